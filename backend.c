@@ -3,6 +3,9 @@
 #include "backend.h"
 #include "ll.h"
 #include "config.h"
+#include "stats.h"
+#include "log.h"
+#include "mem.h"
 
 #define DECLARE_BACKEND_INIT_FUNC(_x) extern int _x##_init()
 #define BACKEND_INIT_FUNC(_x) _x##_init
@@ -47,17 +50,17 @@ void backend_register(backend_ops* be)
 {
    if (num_backends >= BACKEND_COUNT)
    {
-      printf("Can't accept any more backends - sorry, we're full! (MAX_BACKENDS=%lu)\n", BACKEND_COUNT);
+      LOG_ERROR(LOG_BACKEND, "Can't accept any more backends - sorry, we're full! (MAX_BACKENDS=%lu)\n", BACKEND_COUNT);
       return;
    }
 
    if (!be->format)
    {
-      printf("You must implement the format() function\n");
+      LOG_ERROR(LOG_BACKEND, "You must implement the format() function\n");
       return;
    }
 
-	DEBUG_PRINT("registering backend %s\n", be->name());
+	LOG_TRACE(LOG_BACKEND, "registering backend %s\n", be->name());
 
    backend[num_backends++] = be;
 }
@@ -69,6 +72,28 @@ static int cmp_by_name(void* a, const void* b)
 	return strcmp(s->name, name);
 }
 
+static int cmp_by_ptr(void* a, const void* b)
+{
+	return (a != b);
+}
+
+static void free_symbol(backend_symbol* s)
+{
+	if (s->aliases)
+	{
+		backend_symbol* a = (backend_symbol*)ll_pop(s->aliases);
+		while (a)
+		{
+			free_symbol(a);
+			a = (backend_symbol*)ll_pop(s->aliases);
+		}
+		mem_free(MEM_LIST, s->aliases);
+	}
+	mem_free(MEM_TABLES, s->name);
+	mem_free(MEM_TABLES, s->src);
+	mem_free(MEM_TABLES, s);
+}
+
 backend_type backend_lookup_target(const char* name)
 {
 	if (!name)
@@ -77,7 +102,7 @@ backend_type backend_lookup_target(const char* name)
 	// iterate through all known backends, comparing the string. When we find a match, convert the name to the correct type
    for (int i=0; i < num_backends; i++)
    {
-		DEBUG_PRINT("Found backend %s\n", backend[i]->name());
+		LOG_TRACE(LOG_BACKEND, "Found backend %s\n", backend[i]->name());
       if (backend[i]->name && strcmp(backend[i]->name(), name) == 0)
 			return backend[i]->format();
    }
@@ -124,7 +149,7 @@ const char* backend_symbol_type_to_str(backend_symbol_type t)
 
 backend_object* backend_create(void)
 {
-   backend_object* obj = (backend_object*)calloc(1, sizeof(backend_object));
+   backend_object* obj = (backend_object*)mem_calloc(MEM_TABLES, 1, sizeof(backend_object));
    return obj;
 }
 
@@ -141,6 +166,21 @@ backend_object* backend_read(const char* filename)
 }
 
 int backend_write(backend_object* obj)
+{
+   FILE* f = fopen(obj->name, "wb");
+   if (!f)
+   {
+      LOG_ERROR(LOG_BACKEND, "can't open file %s\n", obj->name);
+      return -1;
+   }
+
+   int ret = backend_write_stream(obj, f);
+   if (fclose(f) != 0 && ret == 0)
+      ret = -1;
+   return ret;
+}
+
+int backend_write_stream(backend_object* obj, FILE* f)
 {
    // run through all backends until we find one that matches the output format
    for (int i=0; i < num_backends; i++)
@@ -151,12 +191,12 @@ int backend_write(backend_object* obj)
 			{
 				// someone should have told us sooner - why are we trying to write
 				// to an object type that we don't know how to write?
-				printf("This backend type doesn't have a write function!\n");
+				LOG_ERROR(LOG_BACKEND, "This backend type doesn't have a write function!\n");
             return -2;
 			}
 
-			DEBUG_PRINT("Using backend %i\n", i);
-         return backend[i]->write(obj, obj->name);
+			LOG_TRACE(LOG_BACKEND, "Using backend %i\n", i);
+         return backend[i]->write(obj, f);
       }
    }
 
@@ -165,12 +205,12 @@ int backend_write(backend_object* obj)
 
 void backend_set_filename(backend_object* obj, const char* name)
 {
-	obj->name = strdup(name);
+	obj->name = mem_strdup(MEM_TABLES, name);
 }
 
 void backend_set_type(backend_object* obj, backend_type t)
 {
-	DEBUG_PRINT("setting backend type to %i\n", t);
+	LOG_TRACE(LOG_BACKEND, "setting backend type to %i\n", t);
    obj->type = t;
 }
 
@@ -191,8 +231,7 @@ backend_arch backend_get_arch(backend_object* obj)
 
 void backend_set_entry_point(backend_object* obj, unsigned long addr)
 {
-   if (config.verbose)
-	   fprintf(stderr, "Setting entry point to 0x%lx\n", addr);
+   LOG_INFO(LOG_BACKEND, "Setting entry point to 0x%lx\n", addr);
 	obj->entry = addr;
 }
 
@@ -201,6 +240,16 @@ unsigned long backend_get_entry_point(backend_object* obj)
 	return obj->entry;
 }
 
+void backend_set_base_address(backend_object* obj, unsigned long addr)
+{
+	obj->base = addr;
+}
+
+unsigned long backend_get_base_address(backend_object* obj)
+{
+	return obj->base;
+}
+
 static void dump_symbol_table(backend_object* obj)
 {
    if (!obj || !obj->symbol_table)
@@ -209,7 +258,7 @@ static void dump_symbol_table(backend_object* obj)
    for (const list_node* iter=ll_iter_start(obj->symbol_table); iter != NULL; iter=iter->next)
 	{
 		backend_symbol *bs = (backend_symbol*)iter->val;
-		DEBUG_PRINT("** %s 0x%lx\n", bs->name, bs->val);
+		LOG_TRACE(LOG_BACKEND, "** %s 0x%lx\n", bs->name, bs->val);
 	}
 }
 
@@ -234,17 +283,20 @@ backend_symbol* backend_add_symbol(backend_object* obj, const char* name, unsign
 	if (!name)
 		name = "!";
 
-   backend_symbol* s = (backend_symbol*)malloc(sizeof(backend_symbol));
-   s->name = strdup(name);
+   backend_symbol* s = (backend_symbol*)mem_alloc(MEM_TABLES, sizeof(backend_symbol));
+   s->name = mem_strdup(MEM_TABLES, name);
    s->val = val;
    s->type = type;
 	s->size = size;
    s->flags = flags;
    s->section = sec;
 	s->src = NULL;
+	s->aliases = NULL;
+	s->_index = 0;
+	s->_src = NULL;
 
 	ll_add(obj->symbol_table, s);
-   DEBUG_PRINT("There are %i symbols\n", backend_symbol_count(obj));
+   LOG_TRACE(LOG_BACKEND, "There are %i symbols\n", backend_symbol_count(obj));
    return s;
 }
 
@@ -366,16 +418,13 @@ backend_symbol* backend_merge_symbol(backend_object* obj, backend_symbol *sym)
 				return sym;
 
 			// there may be empty space between the functions, so we can't just add the sizes together
-			DEBUG_PRINT("Merging into %s: oldsize=%lu newsize=%lu\n", prev->name, prev->size, (sym->val + sym->size) - prev->val);
+			LOG_TRACE(LOG_BACKEND, "Merging into %s: oldsize=%lu newsize=%lu\n", prev->name, prev->size, (sym->val + sym->size) - prev->val);
 			prev->size = (sym->val + sym->size) - prev->val;
-			DEBUG_PRINT("Removing %s\n", sym->name);
+			LOG_TRACE(LOG_BACKEND, "Removing %s\n", sym->name);
 			backend_symbol *old = (backend_symbol *)ll_remove(obj->symbol_table, sym->name, cmp_by_name);
 			if (old)
-			{
-				free(old->name);
-				old->name = NULL;
-				free(old);
-			}
+				free_symbol(old);
+			stats_count(STATS_SYMBOLS_MERGED, 1);
 			return prev;
 		}
 		prev = (backend_symbol *)iter->val;
@@ -394,23 +443,62 @@ backend_symbol* backend_split_symbol(backend_object* obj, backend_symbol *sym, c
 		if (iter->val == sym)
 		{
 			unsigned int newsize;
-			backend_symbol* s = (backend_symbol*)malloc(sizeof(backend_symbol));
+			backend_symbol* s = (backend_symbol*)mem_alloc(MEM_TABLES, sizeof(backend_symbol));
 			newsize = val - sym->val;
-			s->name = strdup(name);
+			s->name = mem_strdup(MEM_TABLES, name);
 			s->val = val;
 			s->type = type;
 			s->size = sym->size - newsize;
 			s->flags = flags;
 			s->section = sym->section;
-			s->src = strdup(sym->src);
+			s->src = sym->src ? mem_strdup(MEM_TABLES, sym->src) : NULL;
+			s->aliases = NULL;
+			s->_index = 0;
+			s->_src = NULL;
 			ll_insert(obj->symbol_table, iter, s);
 			sym->size = newsize;
+			stats_count(STATS_SYMBOLS_SPLIT, 1);
 			return s;
 		}
 	}
 	return NULL;
 }
 
+// The alias keeps its own name and flags, but takes the value, size and section of 'sym'. It is no
+// longer in the symbol table, so writers must output the aliases along with 'sym'.
+int backend_add_alias(backend_object* obj, backend_symbol *sym, backend_symbol *alias)
+{
+	if (!obj || !obj->symbol_table || !sym || !alias || sym == alias)
+		return -1;
+
+	if (!ll_remove(obj->symbol_table, alias, cmp_by_ptr))
+		return -2;
+
+	if (!sym->aliases)
+		sym->aliases = ll_init();
+	alias->val = sym->val;
+	alias->size = sym->size;
+	alias->section = sym->section;
+	ll_add(sym->aliases, alias);
+
+	// an alias can't have aliases of its own
+	if (alias->aliases)
+	{
+		backend_symbol* a = (backend_symbol*)ll_pop(alias->aliases);
+		while (a)
+		{
+			a->val = sym->val;
+			a->size = sym->size;
+			a->section = sym->section;
+			ll_add(sym->aliases, a);
+			a = (backend_symbol*)ll_pop(alias->aliases);
+		}
+		mem_free(MEM_LIST, alias->aliases);
+		alias->aliases = NULL;
+	}
+	return 0;
+}
+
 backend_symbol* backend_get_symbol_by_type_first(backend_object* obj, backend_symbol_type type)
 {
    if (!obj || !obj->symbol_table)
@@ -469,56 +557,95 @@ int backend_remove_symbol_by_name(backend_object* obj, const char* name)
 	bs = (backend_symbol*)ll_remove(obj->symbol_table, name, cmp_by_name);
 	if (bs)
 	{
-		free(bs->name);
-		free(bs->src);
-		free(bs);
+		mem_free(MEM_TABLES, bs->name);
+		mem_free(MEM_TABLES, bs->src);
+		mem_free(MEM_TABLES, bs);
 		return 0;
 	}
 
 	return -2;
 }
 
-int backend_sort_symbols(backend_object* obj, backend_cmpfunc cmp)
+struct symbol_filter
 {
-	if (!obj || !obj->symbol_table)
-		return -1;
+	backend_symbol_filter f;
+	void* ctx;
+};
+
+static int remove_symbol_pred(void* item, void* ctx)
+{
+	struct symbol_filter* sf = (struct symbol_filter*)ctx;
+	backend_symbol* s = (backend_symbol*)item;
+	if (!sf->f(s, sf->ctx))
+		return 0;
+	free_symbol(s);
+	return 1;
+}
 
-	// create an empty list to hold the sorted elements
-	linked_list *new_table = ll_init();
+unsigned int backend_remove_symbols_if(backend_object* obj, backend_symbol_filter f, void* ctx)
+{
+	struct symbol_filter sf = { f, ctx };
 
-	// iterate over the original elements
-   for (const list_node* iter=ll_iter_start(obj->symbol_table); iter != NULL; iter=iter->next)
-	{
-		backend_symbol *bs = (backend_symbol*)iter->val;
+   if (!obj || !obj->symbol_table)
+      return 0;
+
+	// the iterators may point at removed symbols
+	obj->iter_symbol = NULL;
+	obj->iter_symbol_t = NULL;
+	return ll_remove_if(obj->symbol_table, remove_symbol_pred, &sf);
+}
+
+// stable merge sort of a chain of list nodes; ties keep their original order
+static list_node* sort_nodes(list_node* head, unsigned int count, backend_cmpfunc cmp)
+{
+	if (count < 2)
+		return head;
+
+	// split the chain in two halves
+	unsigned int half = count / 2;
+	list_node* last = head;
+	for (unsigned int i=1; i < half; i++)
+		last = last->next;
+	list_node* right = last->next;
+	last->next = NULL;
 
-		// find its insertion point in the new list
-		list_node *ii;
-		list_node* i=0; // we will insert after 'i'
+	list_node* a = sort_nodes(head, half, cmp);
+	list_node* b = sort_nodes(right, count - half, cmp);
 
-		for (ii = new_table->head; ii != NULL; i=ii,ii=ii->next)
+	// merge them back, taking from the left half on ties
+	list_node* merged = NULL;
+	list_node** link = &merged;
+	while (a && b)
+	{
+		if (cmp(b->val, a->val) < 0)
 		{
-			backend_symbol *ss = (backend_symbol*)ii->val;
-			if (cmp(bs, ss) < 0)
-			{
-				if (!i)
-					ll_push(new_table, bs);
-				else
-					ll_insert(new_table, i, bs);
-				break;
-			}
+			*link = b;
+			b = b->next;
 		}
-		if (ii == NULL)
-			ll_add(new_table, bs);
+		else
+		{
+			*link = a;
+			a = a->next;
+		}
+		link = &(*link)->next;
 	}
+	*link = a ? a : b;
 
-	// save the old one temporarily
-	linked_list * lltmp = obj->symbol_table;
+	return merged;
+}
 
-	// set the new list in its place
-	obj->symbol_table = new_table;
+int backend_sort_symbols(backend_object* obj, backend_cmpfunc cmp)
+{
+	if (!obj || !obj->symbol_table)
+		return -1;
+
+	linked_list* ll = obj->symbol_table;
+	ll->head = sort_nodes(ll->head, ll->count, cmp);
 
-	// delete the old list
-	ll_destroy(lltmp);
+	// the last node has probably moved
+	ll->tail = ll->head;
+	while (ll->tail && ll->tail->next)
+		ll->tail = ll->tail->next;
 
 	return 0;
 }
@@ -529,9 +656,9 @@ void backend_set_source_file(backend_symbol *s, const char *filename)
 		return;
 
 	if (s->src)
-		free(s->src);
+		mem_free(MEM_TABLES, s->src);
 
-	s->src = strdup(filename);
+	s->src = mem_strdup(MEM_TABLES, filename);
 }
 
 ///////////////////////////////////////////
@@ -539,7 +666,7 @@ unsigned int backend_section_count(backend_object* obj)
 {
    if (!obj->section_table)
    {
-      DEBUG_PRINT("No section table yet\n");
+      LOG_TRACE(LOG_BACKEND, "No section table yet\n");
       return 0;
    }
    return ll_size(obj->section_table);
@@ -553,19 +680,19 @@ backend_section* backend_add_section(backend_object* obj, const char* name, unsi
    if (!obj->section_table)
       obj->section_table = ll_init();
 
-   backend_section* s = (backend_section*)malloc(sizeof(backend_section));
+   backend_section* s = (backend_section*)mem_alloc(MEM_TABLES, sizeof(backend_section));
 	if (!s)
 		return NULL;
 
 	memset(s, 0, sizeof(backend_section));
-   s->name = strdup(name);
+   s->name = mem_strdup(MEM_TABLES, name);
    s->size = size;
    s->address = address;
    s->flags = flags;
 	s->entry_size = entry_size;
    s->data = data;
 	s->alignment = alignment;
-   DEBUG_PRINT("Adding section %s size:%i address:0x%lx entry size: %i flags:0x%x alignment %i\n", s->name, s->size, s->address, s->entry_size, s->flags, s->alignment);
+   LOG_TRACE(LOG_BACKEND, "Adding section %s size:%i address:0x%lx entry size: %i flags:0x%x alignment %i\n", s->name, s->size, s->address, s->entry_size, s->flags, s->alignment);
    ll_add(obj->section_table, s);
    return s;
 }
@@ -699,6 +826,10 @@ backend_section* backend_get_first_section_by_type(backend_object* obj, backend_
 
 backend_section* backend_get_next_section_by_type(backend_object* obj, backend_section_type t)
 {
+	if (!obj->iter_section)
+		return NULL;
+
+	obj->iter_section = obj->iter_section->next;
 	while (obj->iter_section && ((backend_section*)obj->iter_section->val)->type != t)
 		obj->iter_section = obj->iter_section->next;
 
@@ -715,7 +846,7 @@ backend_symbol* backend_get_section_symbol(backend_object* obj, backend_section*
 		// I hate comparing pointers to objects like this, but what are my options?
 		if (bs->section == sec)
 		{
-			DEBUG_PRINT("Found symbol %s for section %s\n", bs->name, sec->name);
+			LOG_TRACE(LOG_BACKEND, "Found symbol %s for section %s\n", bs->name, sec->name);
 			break;
 		}
 		bs = backend_get_symbol_by_type_next(obj, SYMBOL_TYPE_SECTION);
@@ -731,12 +862,10 @@ void backend_destructor(backend_object* obj)
       backend_symbol* s = (backend_symbol*)ll_pop(obj->symbol_table);
       while (s)
       {
-         free(s->name);
-         free(s->src);
-         free(s);
+         free_symbol(s);
          s = (backend_symbol*)ll_pop(obj->symbol_table);
       }
-		free(obj->symbol_table);
+		mem_free(MEM_LIST, obj->symbol_table);
    }
 
 	if (obj->section_table)
@@ -744,12 +873,12 @@ void backend_destructor(backend_object* obj)
       backend_section* sec = (backend_section*)ll_pop(obj->section_table);
 		while (sec)
 		{
-         free(sec->name);
-         free(sec->data);
-			free(sec);
+         mem_free(MEM_TABLES, sec->name);
+         mem_free(obj->_data_mem, sec->data);
+			mem_free(MEM_TABLES, sec);
 			sec = (backend_section*)ll_pop(obj->section_table);
 		}
-		free(obj->section_table);
+		mem_free(MEM_LIST, obj->section_table);
    }
 
    if (obj->relocation_table)
@@ -757,10 +886,10 @@ void backend_destructor(backend_object* obj)
 		backend_reloc* r = (backend_reloc*)ll_pop(obj->relocation_table);
 		while (r)
 		{
-			free(r);
+			mem_free(MEM_TABLES, r);
 			r = (backend_reloc*)ll_pop(obj->relocation_table);
 		}
-		free(obj->relocation_table);
+		mem_free(MEM_LIST, obj->relocation_table);
 	}
 
 	if (obj->import_table)
@@ -773,19 +902,22 @@ void backend_destructor(backend_object* obj)
 				backend_symbol* s = (backend_symbol*)ll_pop(i->symbols);
 				while (s)
 				{
-					free(s->name);
-					free(s);
+					mem_free(MEM_TABLES, s->name);
+					mem_free(MEM_TABLES, s);
 					s = (backend_symbol*)ll_pop(i->symbols);
 				}
-				free(i->symbols);
+				mem_free(MEM_LIST, i->symbols);
 			}
+			mem_free(MEM_TABLES, i->name);
+			mem_free(MEM_TABLES, i);
 			i = (backend_import*)ll_pop(obj->import_table);
 		}
-		free(obj->import_table);
+		mem_free(MEM_LIST, obj->import_table);
 	}
 
    // and finally the object itself
-   free(obj);
+	mem_free(MEM_TABLES, obj->name);
+   mem_free(MEM_TABLES, obj);
 }
 
 ///////////////////////////////////////////
@@ -798,23 +930,56 @@ unsigned int backend_relocation_count(backend_object* obj)
 }
 
 int backend_add_relocation(backend_object* obj, unsigned long offset, backend_reloc_type t, long addend, backend_symbol* bs)
+{
+	return backend_add_section_relocation(obj, NULL, offset, t, addend, bs);
+}
+
+int backend_add_section_relocation(backend_object* obj, backend_section* sec, unsigned long offset, backend_reloc_type t, long addend, backend_symbol* bs)
 {
    if (!obj)
 		return -1;
 
-	DEBUG_PRINT("add relocation for %s @ 0x%lx type=%s\n", bs->name, offset, backend_lookup_reloc_type(t));
+	LOG_TRACE(LOG_BACKEND, "add relocation for %s @ 0x%lx type=%s\n", bs->name, offset, backend_lookup_reloc_type(t));
    if (!obj->relocation_table)
       obj->relocation_table = ll_init();
 
-   backend_reloc* r = (backend_reloc*)malloc(sizeof(backend_reloc));
+   backend_reloc* r = (backend_reloc*)mem_alloc(MEM_TABLES, sizeof(backend_reloc));
 	r->offset = offset;
 	r->addend = addend;
    r->type = t;
 	r->symbol = bs;
+	r->section = sec;
    ll_add(obj->relocation_table, r);
    return 0;
 }
 
+struct reloc_filter
+{
+	backend_reloc_filter f;
+	void* ctx;
+};
+
+static int remove_reloc_pred(void* item, void* ctx)
+{
+	struct reloc_filter* rf = (struct reloc_filter*)ctx;
+	backend_reloc* r = (backend_reloc*)item;
+	if (!rf->f(r, rf->ctx))
+		return 0;
+	mem_free(MEM_TABLES, r);
+	return 1;
+}
+
+unsigned int backend_remove_relocations_if(backend_object* obj, backend_reloc_filter f, void* ctx)
+{
+	struct reloc_filter rf = { f, ctx };
+
+   if (!obj || !obj->relocation_table)
+      return 0;
+
+	obj->iter_reloc = NULL;
+	return ll_remove_if(obj->relocation_table, remove_reloc_pred, &rf);
+}
+
 backend_reloc* backend_find_reloc_by_offset(backend_object* obj, unsigned long offset)
 {
 	if (!obj || !obj->relocation_table)
@@ -872,8 +1037,8 @@ backend_import* backend_add_import_module(backend_object* obj, const char* name)
    if (!obj->import_table)
       obj->import_table = ll_init();
 
-   backend_import* i = (backend_import*)malloc(sizeof(backend_import));
-	i->name = strdup(name);
+   backend_import* i = (backend_import*)mem_alloc(MEM_TABLES, sizeof(backend_import));
+	i->name = mem_strdup(MEM_TABLES, name);
 	i->symbols = NULL;
    ll_add(obj->import_table, i);
    return i;
@@ -902,13 +1067,17 @@ backend_symbol* backend_add_import_function(backend_import* mod, const char* nam
    if (!mod->symbols)
       mod->symbols = ll_init();
 
-   backend_symbol* s = (backend_symbol*)malloc(sizeof(backend_symbol));
-	s->name = strdup(name);
+   backend_symbol* s = (backend_symbol*)mem_alloc(MEM_TABLES, sizeof(backend_symbol));
+	s->name = mem_strdup(MEM_TABLES, name);
 	s->val = addr;
 	s->type = SYMBOL_TYPE_FUNCTION;
 	s->flags = SYMBOL_FLAG_GLOBAL | SYMBOL_FLAG_EXTERNAL;
 	s->size = 0;
 	s->section = NULL;
+	s->src = NULL;
+	s->aliases = NULL;
+	s->_index = 0;
+	s->_src = NULL;
    ll_add(mod->symbols, s);
    return s;
 }
@@ -5,7 +5,9 @@ public functions for talking to backends */
 
 /* To add a new backend, read instructions in backend.c */
 
+#include <stdio.h>
 #include "ll.h"
+#include "mem.h"
 
 #define MAX_STRING_TABLES 100 /* this needs some explanation */
 
@@ -107,6 +109,8 @@ typedef struct backend_section
 	struct backend_section *strtab; // used in some sections that contain entries that require a string table
 ////// private data ///////
 	int _name;					// used to hold the index into the string table when writing
+	int _index;					// used to hold the section index when writing
+	struct backend_section *_link;	// used to pair code & relocation sections when writing
 } backend_section;
 
 typedef struct backend_symbol
@@ -118,6 +122,9 @@ typedef struct backend_symbol
 	unsigned long size;
 	char *src; // source filename (if known)
    backend_section* section;
+	linked_list *aliases; // other names for this symbol (see backend_add_alias)
+	unsigned int _index;		// used to hold the symbol table index when writing
+	struct backend_symbol *_src;	// the input symbol an output symbol was copied from
 } backend_symbol;
 
 typedef struct backend_reloc
@@ -126,6 +133,7 @@ typedef struct backend_reloc
 	long addend;
 	backend_reloc_type type;
 	backend_symbol* symbol;
+	backend_section* section;	// the section being relocated (NULL means .text)
 } backend_reloc;
 
 // an import is a module containing a name, and a list of function symbols that the code
@@ -143,6 +151,7 @@ typedef struct backend_object
 	backend_arch arch; // the target architecture (after all, the code is compiled for a particular ISA)
    backend_type type; // the file format that should be used when writing the file - this may go away, and become a parameter to backend_write() instead
 	unsigned long entry;	// the entry point for linked files
+	unsigned long base;	// the address the image was linked at (PE RVAs are relative to this)
 
    linked_list* section_table;
    linked_list* symbol_table;
@@ -155,6 +164,8 @@ typedef struct backend_object
    const list_node* iter_reloc;
    const list_node* iter_import_table;
    const list_node* iter_import_symbol;
+////// private data ///////
+	enum mem_category _data_mem;	// what the section data is accounted to (see mem.h)
 } backend_object;
 
 // the interface that must be implemented by a particular backend implementation - mainly for serializing to disk (and deserializing from disk)
@@ -163,12 +174,16 @@ typedef struct backend_ops
 	const char* (*name)(void);
    backend_type (*format)(void);
    backend_object* (*read)(const char* filename);
-   int (*write)(backend_object* obj, const char* filename);
+   int (*write)(backend_object* obj, FILE* f);
 } backend_ops;
 
 // backend-specific sorting comparator
 typedef int(*backend_cmpfunc)(void* item_a, void* item_b);
 
+// return nonzero to remove the item (see backend_remove_symbols_if)
+typedef int(*backend_symbol_filter)(backend_symbol* sym, void* ctx);
+typedef int(*backend_reloc_filter)(backend_reloc* r, void* ctx);
+
 // global operations
 int backend_init(void); /* initialize the library for use - don't call any functions before this one */
 void backend_register(backend_ops* be); /* register specific backend implementation so it is known to the library */
@@ -182,6 +197,7 @@ backend_object* backend_create(void); /* the constructor - make an empty backend
 void backend_destructor(backend_object* obj); /* the destructor - clean up and delete everything */
 backend_object* backend_read(const char* filename);
 int backend_write(backend_object* obj);
+int backend_write_stream(backend_object* obj, FILE* f); /* write to an open (seekable) stream instead of the file named in the object */
 void backend_set_filename(backend_object* obj, const char* name);
 void backend_set_type(backend_object* obj, backend_type t);
 backend_type backend_get_type(backend_object* obj);
@@ -189,6 +205,8 @@ void backend_set_arch(backend_object* obj, backend_arch a);
 backend_arch backend_get_arch(backend_object* obj);
 void backend_set_entry_point(backend_object* obj, unsigned long addr);
 unsigned long backend_get_entry_point(backend_object* obj);
+void backend_set_base_address(backend_object* obj, unsigned long addr);
+unsigned long backend_get_base_address(backend_object* obj);
 
 // symbols
 unsigned int backend_symbol_count(backend_object* obj);
@@ -205,7 +223,9 @@ backend_symbol* backend_find_nearest_symbol(backend_object* obj, unsigned long v
 unsigned int backend_get_symbol_index(backend_object* obj, backend_symbol* s); // if the symbol table were to be serialized, what would be the index of this symbol in the table?
 backend_symbol* backend_merge_symbol(backend_object* obj, backend_symbol *sym); // merge a symbol with the previous one
 backend_symbol* backend_split_symbol(backend_object* obj, backend_symbol *sym, const char* name, unsigned long val, backend_symbol_type type, unsigned int flags);
+int backend_add_alias(backend_object* obj, backend_symbol *sym, backend_symbol *alias); // make 'alias' another name for 'sym', and take it out of the symbol table
 int backend_remove_symbol_by_name(backend_object* obj, const char* name);
+unsigned int backend_remove_symbols_if(backend_object* obj, backend_symbol_filter f, void* ctx); /* remove and free all matching symbols in one pass */
 int backend_sort_symbols(backend_object* obj, backend_cmpfunc cmp);
 void backend_set_source_file(backend_symbol *s, const char *source_filename);
 
@@ -231,6 +251,8 @@ backend_symbol* backend_get_section_symbol(backend_object* obj, backend_section*
 // relocations
 unsigned int backend_relocation_count(backend_object* obj);
 int backend_add_relocation(backend_object* obj, unsigned long offset, backend_reloc_type t, long addend, backend_symbol* bs);
+unsigned int backend_remove_relocations_if(backend_object* obj, backend_reloc_filter f, void* ctx); /* remove and free all matching relocations in one pass */
+int backend_add_section_relocation(backend_object* obj, backend_section* sec, unsigned long offset, backend_reloc_type t, long addend, backend_symbol* bs); /* offset is relative to 'sec' */
 backend_reloc* backend_find_reloc_by_offset(backend_object* obj, unsigned long val);
 backend_reloc* backend_get_first_reloc(backend_object* obj);
 backend_reloc* backend_get_next_reloc(backend_object* obj);
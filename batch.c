@@ -0,0 +1,259 @@
+/* Batch mode (--batch)
+Many inputs are delinked by one invocation, on a pool of worker processes. The options are parsed
+and the backends initialized once, and each worker is forked from that state to delink a single
+input in a directory of its own. Processes rather than threads, because the delinker writes its
+output to the current directory, and because an input that crashes the delinker only takes its own
+worker down, which matters when there are thousands of them. At the end there is a report with the
+result and the time of every input. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "ll.h"
+#include "config.h"
+#include "batch.h"
+#include "log.h"
+
+typedef struct batch_job
+{
+	char *input;			// absolute, since the worker runs in the output directory
+	char *dir;				// where the output goes
+	pid_t pid;
+	int status;				// from waitpid
+	int finished;
+	double started;
+	double wall;			// seconds
+} batch_job;
+
+static double get_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned int batch_worker_count(int jobs)
+{
+	long n = jobs;
+	if (n <= 0)
+		n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n <= 0)
+		n = 1;
+	return n;
+}
+
+// Add the inputs listed in a file, one per line ("-" is stdin). Empty lines and lines starting with
+// '#' are skipped.
+int batch_read_manifest(linked_list *inputs, const char *filename)
+{
+	FILE *f = stdin;
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+
+	if (strcmp(filename, "-") != 0)
+	{
+		f = fopen(filename, "r");
+		if (!f)
+		{
+			LOG_ERROR(LOG_MAIN, "Can't open the manifest %s\n", filename);
+			return -1;
+		}
+	}
+
+	while ((len = getline(&line, &size, f)) >= 0)
+	{
+		while (len && (line[len-1] == '\n' || line[len-1] == '\r' || line[len-1] == ' ' || line[len-1] == '\t'))
+			line[--len] = 0;
+		if (!len || line[0] == '#')
+			continue;
+		ll_add(inputs, strdup(line));
+	}
+
+	free(line);
+	if (f != stdin)
+		fclose(f);
+	return 0;
+}
+
+static char *absolute_path(const char *path)
+{
+	char cwd[4096];
+	char *abs;
+
+	if (path[0] == '/' || !getcwd(cwd, sizeof(cwd)))
+		return strdup(path);
+	abs = (char*)malloc(strlen(cwd) + strlen(path) + 2);
+	if (abs)
+		sprintf(abs, "%s/%s", cwd, path);
+	return abs;
+}
+
+// The output directory of an input is named after the file. Inputs with the same name (from
+// different directories) get a number on the end, so they don't overwrite each other.
+static char *make_output_dir(const char *output_dir, const char *input, batch_job *jobs, unsigned int count)
+{
+	const char *base = strrchr(input, '/');
+	char *dir = (char*)malloc(strlen(output_dir) + strlen(input) + 16);
+	unsigned int n = 1;
+
+	if (!dir)
+		return NULL;
+	base = base ? base + 1 : input;
+	sprintf(dir, "%s/%s", output_dir, base);
+	for (unsigned int i=0; i < count; i++)
+	{
+		if (strcmp(jobs[i].dir, dir) == 0)
+		{
+			sprintf(dir, "%s/%s.%u", output_dir, base, ++n);
+			i = -1;		// start again with the new name
+		}
+	}
+	return dir;
+}
+
+static void start_job(struct config *config, batch_job *job, batch_fn fn, void *ctx, unsigned int workers)
+{
+	fflush(stdout);
+	fflush(stderr);
+	job->started = get_time();
+	job->pid = fork();
+	if (job->pid)
+		return;
+
+	// this is the worker - don't let it start threads of its own when the pool is already busy
+	if (workers > 1)
+		config->jobs = 1;
+	int ret = -1;
+	if (mkdir(job->dir, 0777) != 0 && errno != EEXIST)
+		LOG_ERROR(LOG_MAIN, "Can't create the output directory %s\n", job->dir);
+	else if (chdir(job->dir) != 0)
+		LOG_ERROR(LOG_MAIN, "Can't change to the output directory %s\n", job->dir);
+	else
+		ret = fn(job->input, ctx);
+	fflush(stdout);
+	fflush(stderr);
+	_exit(ret < 0 ? -ret : ret);
+}
+
+static const char *describe_status(int status, batch_error_fn describe, char *buff)
+{
+	if (WIFSIGNALED(status))
+	{
+		sprintf(buff, "crashed (%s)", strsignal(WTERMSIG(status)));
+		return buff;
+	}
+	if (!WIFEXITED(status))
+		return "unknown";
+	if (WEXITSTATUS(status) == 0)
+		return "ok";
+	return describe(WEXITSTATUS(status));
+}
+
+// Delink each input in its own directory under 'output_dir', with up to --jobs workers at a time,
+// and print the report. 'config' holds the options of the run, which the workers inherit. Returns
+// the number of inputs that failed.
+int batch_run(struct config *config, linked_list *inputs, const char *output_dir, batch_fn fn, void *ctx, batch_error_fn describe)
+{
+	unsigned int count = ll_size(inputs);
+	unsigned int workers = batch_worker_count(config->jobs);
+	unsigned int next = 0, running = 0, done = 0;
+	unsigned int failed = 0, crashed = 0;
+	double started = get_time();
+	batch_job *jobs;
+	char buff[64];
+
+	if (mkdir(output_dir, 0777) != 0 && errno != EEXIST)
+	{
+		LOG_ERROR(LOG_MAIN, "Can't create the output directory %s\n", output_dir);
+		return count;
+	}
+
+	jobs = (batch_job*)calloc(count + 1, sizeof(batch_job));
+	if (!jobs)
+		return count;
+	for (const list_node* iter=ll_iter_start(inputs); iter != NULL; iter=iter->next, next++)
+	{
+		jobs[next].input = absolute_path((const char*)iter->val);
+		jobs[next].dir = make_output_dir(output_dir, (const char*)iter->val, jobs, next);
+		if (!jobs[next].input || !jobs[next].dir)
+		{
+			LOG_ERROR(LOG_MAIN, "Out of memory\n");
+			count = next;
+			break;
+		}
+	}
+	if (workers > count)
+		workers = count;
+	LOG_INFO(LOG_MAIN, "Delinking %u inputs with %u workers\n", count, workers);
+
+	next = 0;
+	while (done < count)
+	{
+		int status;
+		pid_t pid;
+
+		while (running < workers && next < count)
+		{
+			start_job(config, &jobs[next], fn, ctx, workers);
+			if (jobs[next].pid < 0)
+			{
+				LOG_ERROR(LOG_MAIN, "Can't start a worker for %s\n", jobs[next].input);
+				done++;
+			}
+			else
+				running++;
+			next++;
+		}
+		if (!running)
+			continue;
+
+		pid = waitpid(-1, &status, 0);
+		if (pid < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			LOG_ERROR(LOG_MAIN, "Lost track of the workers\n");
+			break;
+		}
+		for (unsigned int i=0; i < next; i++)
+		{
+			if (jobs[i].pid != pid)
+				continue;
+			jobs[i].status = status;
+			jobs[i].finished = 1;
+			jobs[i].wall = get_time() - jobs[i].started;
+			running--;
+			done++;
+			LOG_INFO(LOG_MAIN, "[%u/%u] %s: %s\n", done, count, jobs[i].input, describe_status(status, describe, buff));
+			break;
+		}
+	}
+
+	printf("%-32s %10s  %s\n", "status", "wall ms", "input -> output directory");
+	for (unsigned int i=0; i < count; i++)
+	{
+		if (!jobs[i].finished)
+			printf("%-32s %10s  %s -> %s\n", "not run", "-", jobs[i].input, jobs[i].dir);
+		else
+			printf("%-32s %10.1f  %s -> %s\n", describe_status(jobs[i].status, describe, buff), jobs[i].wall * 1000,
+				jobs[i].input, jobs[i].dir);
+		if (!jobs[i].finished || WIFSIGNALED(jobs[i].status))
+			crashed++;
+		else if (!WIFEXITED(jobs[i].status) || WEXITSTATUS(jobs[i].status) != 0)
+			failed++;
+		free(jobs[i].input);
+		free(jobs[i].dir);
+	}
+	printf("\n%u inputs in %.1f s with %u worker%s: %u ok, %u failed, %u crashed or not run\n", count,
+		get_time() - started, workers, workers == 1 ? "" : "s", count - failed - crashed, failed, crashed);
+
+	free(jobs);
+	return failed + crashed;
+}
@@ -0,0 +1,18 @@
+#ifndef _BATCH__H
+#define _BATCH__H
+
+#include "ll.h"
+
+// Delinks one input. It is called in a worker process, with the output directory of the input as
+// the current directory, and returns 0 or a negative error code.
+typedef int (*batch_fn)(const char *input, void *ctx);
+
+// Describes a (positive) error code returned by a batch_fn, for the report
+typedef const char *(*batch_error_fn)(int code);
+
+struct config;
+
+int batch_read_manifest(linked_list *inputs, const char *filename);
+int batch_run(struct config *config, linked_list *inputs, const char *output_dir, batch_fn fn, void *ctx, batch_error_fn describe);
+
+#endif // _BATCH__H
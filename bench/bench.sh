@@ -0,0 +1,102 @@
+#!/bin/bash
+# End-to-end benchmark: generate synthetic programs with bench/gen, delink each one with --stats,
+# and report the throughput of every phase - MB/s of .text, relocations per second and objects
+# written per second. Everything runs offline; the ELF inputs are built with the local gcc.
+#
+# usage: bench/bench.sh [path to delinker]
+#
+# Environment:
+#   CC                 compiler used to build the ELF inputs (default gcc)
+#   BENCH_FUNCTIONS    sizes of the generated programs, in functions (default "1000 10000 50000")
+#   BENCH_FORMATS      input formats (default "elf pe")
+#   BENCH_FLAGS        extra delinker options (default -S, so every function is written to its own object)
+#   BENCH_DIR          where to keep the inputs, outputs and JSON statistics (default: a new directory in /tmp)
+
+set -e
+
+BENCH=$(cd "$(dirname "$0")" && pwd)
+DELINKER=$(realpath "${1:-./delinker}")
+GEN=$BENCH/gen
+CC=${CC:-gcc}
+FUNCTIONS=${BENCH_FUNCTIONS:-"1000 10000 50000"}
+FORMATS=${BENCH_FORMATS:-"elf pe"}
+FLAGS=${BENCH_FLAGS--S}
+WORK=${BENCH_DIR:-$(mktemp -d /tmp/delinker-bench.XXXXXX)}
+
+if [[ ! -x $DELINKER || ! -x $GEN ]]; then
+	echo "Build the delinker and $GEN first (make delinker bench/gen)"
+	exit 1
+fi
+mkdir -p "$WORK"
+
+# generate the program in format $1 with $2 functions, as file $3. The data grows with the code.
+function generate()
+{
+	local format=$1
+	local functions=$2
+	local out=$3
+	local args="-f $functions -c 4 -p 1 -i 32 -d 3 -n 8 -D $((functions * 64)) -R $((functions * 16)) -B $((functions * 32))"
+
+	if [[ $format == elf ]]; then
+		$GEN -F elf $args -o "$out.s"
+		$CC -no-pie -o "$out" "$out.s"
+	else
+		$GEN -F pe $args -o "$out"
+	fi
+}
+
+# print the table for one run from its JSON statistics ($1) and the size of .text ($2)
+function report()
+{
+	awk -v text="$2" '
+	function field(line, key)
+	{
+		if (!match(line, "\"" key "\": [0-9.]+"))
+			return 0
+		line = substr(line, RSTART, RLENGTH)
+		sub(/.*: /, "", line)
+		return line + 0
+	}
+	function rate(count, ms)
+	{
+		return (count && ms > 0) ? sprintf("%12.0f", count * 1000 / ms) : sprintf("%12s", "-")
+	}
+	BEGIN { printf("%-12s %10s %12s %12s %12s\n", "phase", "wall ms", ".text MB/s", "relocs/s", "objects/s") }
+	/"name":/ {
+		match($0, /"name": "[a-z]+"/)
+		name = substr($0, RSTART + 9, RLENGTH - 10)
+		ms = field($0, "wall_ms")
+		mbs = (ms > 0) ? sprintf("%12.2f", text / 1048576 * 1000 / ms) : sprintf("%12s", "-")
+		printf("%-12s %10.3f %s %s %s\n", name, ms, mbs, rate(field($0, "relocs_created"), ms), rate(field($0, "files_written"), ms))
+	}' "$1"
+}
+
+status=0
+for format in $FORMATS; do
+	for functions in $FUNCTIONS; do
+		name=$format-$functions
+		input=$WORK/$name.$([[ $format == elf ]] && echo elf || echo exe)
+		generate $format $functions "$input"
+
+		# the PE writer is only for PE inputs - the objects are relinked with the GNU tools
+		target=
+		[[ $format == pe ]] && target="-O elf32"
+
+		text=$(size -A "$input" | awk '$1 == ".text" { print $2 }')
+		rm -rf "$WORK/$name"
+		mkdir "$WORK/$name"
+		echo
+		echo "== $name: $functions functions, .text $text bytes"
+		if ! (cd "$WORK/$name" && "$DELINKER" $FLAGS $target --stats="$WORK/$name.json" "$input" > "$WORK/$name.log" 2>&1) ||
+			[[ ! -s $WORK/$name.json ]]; then
+			echo "delinker failed - see $WORK/$name.log"
+			status=1
+			continue
+		fi
+		report "$WORK/$name.json" "$text"
+	done
+done
+
+echo
+echo "The inputs, outputs and JSON statistics are in $WORK"
+exit $status
@@ -0,0 +1,846 @@
+/* Synthetic workloads for the benchmark (see bench.sh)
+Writes a program with a known number of functions, calls, data references and imports, so the cost
+of each phase of the delinker can be measured on inputs of a known shape and size, and compared from
+one version to the next. The same seed always gives the same program.
+
+x86_64 ELF is written as assembly, to be built with the local gcc. That way the executable has the
+same startup code, PLT and dynamic sections as any other program on the machine. There is no PE
+toolchain on a plain Linux box, so PE32 executables are written directly.
+
+The programs are never run (the arguments of the calls are garbage) - they only have to look like
+real code to the delinker. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#pragma pack(1)
+
+#define OBJECT_SIZE 64			// size of each data object
+#define FUNCTION_ALIGN 16
+#define MAX_FUNCTION_NAME 8	// COFF names longer than this need a string table
+
+#define PE_BASE 0x400000
+#define PE_SECTION_ALIGN 0x1000
+#define PE_FILE_ALIGN 0x200
+#define PE_HEADER_OFFSET 0x40
+
+#define ALIGN(_x, _y) (((_x) + ((_y)-1)) & ~((_y)-1))
+
+enum format
+{
+	FORMAT_ELF,
+	FORMAT_PE,
+};
+
+enum op_kind
+{
+	OP_CALL,			// call another function
+	OP_IMPORT,		// call an imported function through the PLT or IAT
+	OP_DATA,			// load from .data
+	OP_RODATA,		// take the address of a constant
+	OP_BSS,			// take the address of a .bss object as an immediate
+	OP_ADD,			// the rest don't refer to anything
+	OP_XOR,
+	OP_MUL,
+	OP_BRANCH,		// conditional jump to the end of the function
+	OP_FILLER_COUNT = OP_BRANCH - OP_ADD + 1
+};
+
+typedef struct op
+{
+	unsigned char kind;
+	unsigned int target;		// function, import or object index
+} op;
+
+// Functions from the C runtime that exist in both glibc and msvcrt.dll
+static const char *import_names[] =
+{
+	"abs", "atoi", "atol", "calloc", "clock", "exit", "fclose", "fflush", "fgets", "fopen",
+	"fprintf", "fputs", "fread", "free", "fseek", "ftell", "fwrite", "getenv", "isalpha", "isdigit",
+	"isspace", "labs", "malloc", "memchr", "memcmp", "memcpy", "memmove", "memset", "printf", "putchar",
+	"puts", "qsort", "rand", "realloc", "remove", "rename", "setvbuf", "sprintf", "srand", "strcat",
+	"strchr", "strcmp", "strcpy", "strlen", "strncmp", "strncpy", "strrchr", "strstr", "strtol", "time",
+	"tolower", "toupper",
+};
+#define MAX_IMPORTS (sizeof(import_names) / sizeof(import_names[0]))
+
+static struct config
+{
+	enum format format;
+	unsigned int functions;
+	unsigned int calls;				// calls to other functions, per function
+	unsigned int import_calls;		// calls to imported functions, per function
+	unsigned int imports;			// number of distinct imported functions
+	unsigned int data_refs;			// per function
+	unsigned int filler;				// instructions that don't refer to anything, per function
+	unsigned int data_size;
+	unsigned int rodata_size;
+	unsigned int bss_size;
+	unsigned int seed;
+	const char *output;
+} config =
+{
+	.format = FORMAT_ELF,
+	.functions = 1000,
+	.calls = 4,
+	.import_calls = 1,
+	.imports = 32,
+	.data_refs = 3,
+	.filler = 8,
+	.data_size = 64 * 1024,
+	.rodata_size = 16 * 1024,
+	.bss_size = 32 * 1024,
+	.seed = 1,
+};
+
+static unsigned int data_objects;
+static unsigned int rodata_objects;
+static unsigned int bss_objects;
+
+static struct option options[] =
+{
+  {"bss-size", required_argument, 0, 'B'},
+  {"calls", required_argument, 0, 'c'},
+  {"data-refs", required_argument, 0, 'd'},
+  {"data-size", required_argument, 0, 'D'},
+  {"functions", required_argument, 0, 'f'},
+  {"format", required_argument, 0, 'F'},
+  {"imports", required_argument, 0, 'i'},
+  {"filler", required_argument, 0, 'n'},
+  {"output", required_argument, 0, 'o'},
+  {"import-calls", required_argument, 0, 'p'},
+  {"rodata-size", required_argument, 0, 'R'},
+  {"seed", required_argument, 0, 's'},
+  {0, no_argument, 0, 0}
+};
+
+static unsigned int next_random(unsigned int *state)
+{
+	// xorshift32
+	unsigned int x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state = x;
+	return x;
+}
+
+static unsigned int ops_per_function(void)
+{
+	return config.calls + config.import_calls + config.data_refs + config.filler;
+}
+
+// The body of function 'f'. The operations are generated from a seed that depends only on the
+// function number, so they can be generated again (once for the layout, once for the code) instead
+// of being kept in memory for the whole program.
+static void function_ops(unsigned int f, op *ops)
+{
+	unsigned int state = (config.seed ^ (f * 0x9E3779B9)) | 1;
+	unsigned int objects = data_objects + rodata_objects + bss_objects;
+	unsigned int n=0;
+
+	for (unsigned int i=0; i < config.calls; i++, n++)
+	{
+		ops[n].kind = OP_CALL;
+		ops[n].target = next_random(&state) % config.functions;
+	}
+
+	for (unsigned int i=0; i < config.import_calls; i++, n++)
+	{
+		if (!config.imports)
+		{
+			ops[n].kind = OP_ADD;
+			continue;
+		}
+		ops[n].kind = OP_IMPORT;
+		ops[n].target = next_random(&state) % config.imports;
+	}
+
+	for (unsigned int i=0; i < config.data_refs; i++, n++)
+	{
+		unsigned int obj;
+
+		if (!objects)
+		{
+			ops[n].kind = OP_ADD;
+			continue;
+		}
+		obj = next_random(&state) % objects;
+		if (obj < data_objects)
+			ops[n].kind = OP_DATA;
+		else if ((obj -= data_objects) < rodata_objects)
+			ops[n].kind = OP_RODATA;
+		else
+		{
+			obj -= rodata_objects;
+			ops[n].kind = OP_BSS;
+		}
+		ops[n].target = obj;
+	}
+
+	for (unsigned int i=0; i < config.filler; i++, n++)
+	{
+		ops[n].kind = OP_ADD + next_random(&state) % OP_FILLER_COUNT;
+		ops[n].target = next_random(&state);
+	}
+
+	// mix it up, so the references aren't always in the same order
+	for (unsigned int i=n; i > 1; i--)
+	{
+		unsigned int j = next_random(&state) % i;
+		op tmp = ops[i-1];
+		ops[i-1] = ops[j];
+		ops[j] = tmp;
+	}
+}
+
+/////////////////////////////// ELF ///////////////////////////////
+
+static void elf_function(FILE *f, unsigned int index, const op *ops, unsigned int count)
+{
+	fprintf(f, "\t.p2align 4\n\t.globl f%u\n\t.type f%u, @function\nf%u:\n", index, index, index);
+	fprintf(f, "\tpush %%rbp\n\tmov %%rsp, %%rbp\n");
+	for (unsigned int i=0; i < count; i++)
+	{
+		unsigned int t = ops[i].target;
+
+		switch (ops[i].kind)
+		{
+		case OP_CALL:
+			fprintf(f, "\tcall f%u\n", t);
+			break;
+		case OP_IMPORT:
+			fprintf(f, "\tcall %s@PLT\n", import_names[t]);
+			break;
+		case OP_DATA:
+			fprintf(f, "\tmov d%u(%%rip), %%eax\n", t);
+			break;
+		case OP_RODATA:
+			fprintf(f, "\tlea r%u(%%rip), %%rsi\n", t);
+			break;
+		case OP_BSS:
+			fprintf(f, "\tmov $b%u, %%edi\n", t);
+			break;
+		case OP_ADD:
+			fprintf(f, "\tadd $0x%x, %%eax\n", t);
+			break;
+		case OP_XOR:
+			fprintf(f, "\txor %%ecx, %%ecx\n");
+			break;
+		case OP_MUL:
+			fprintf(f, "\timul $%u, %%eax, %%eax\n", t & 0x7F);
+			break;
+		case OP_BRANCH:
+			fprintf(f, "\ttest %%eax, %%eax\n\tje .Lf%u_end\n", index);
+			break;
+		}
+	}
+	fprintf(f, ".Lf%u_end:\n\tpop %%rbp\n\tret\n\t.size f%u, .-f%u\n", index, index, index);
+}
+
+static void elf_objects(FILE *f, const char *section, char prefix, unsigned int count, int pointers)
+{
+	unsigned int state = config.seed | 1;
+
+	if (!count)
+		return;
+
+	fprintf(f, "\t.section %s\n\t.p2align 3\n", section);
+	for (unsigned int i=0; i < count; i++)
+	{
+		fprintf(f, "\t.globl %c%u\n\t.type %c%u, @object\n\t.size %c%u, %u\n%c%u:\n",
+			prefix, i, prefix, i, prefix, i, OBJECT_SIZE, prefix, i);
+
+		// like a table of callbacks - the first word of each object points to a function
+		if (pointers)
+			fprintf(f, "\t.quad f%u\n\t.zero %u\n", next_random(&state) % config.functions, OBJECT_SIZE - 8);
+		else
+			fprintf(f, "\t.zero %u\n", OBJECT_SIZE);
+	}
+}
+
+static int write_elf(FILE *f)
+{
+	op *ops = (op*)malloc(sizeof(op) * ops_per_function());
+	if (!ops)
+		return -1;
+
+	fprintf(f, "\t.text\n\t.globl main\n\t.type main, @function\nmain:\n");
+	fprintf(f, "\tpush %%rbp\n\tmov %%rsp, %%rbp\n\tcall f0\n\txor %%eax, %%eax\n\tpop %%rbp\n\tret\n");
+	fprintf(f, "\t.size main, .-main\n");
+	for (unsigned int i=0; i < config.functions; i++)
+	{
+		function_ops(i, ops);
+		elf_function(f, i, ops, ops_per_function());
+	}
+	free(ops);
+
+	elf_objects(f, ".data", 'd', data_objects, 1);
+	elf_objects(f, ".rodata", 'r', rodata_objects, 0);
+	elf_objects(f, ".bss", 'b', bss_objects, 0);
+	fprintf(f, "\t.section .note.GNU-stack,\"\",@progbits\n");
+	return 0;
+}
+
+/////////////////////////////// PE ///////////////////////////////
+
+// These are the same as the structures in pe.c, from the PE/COFF specification
+typedef struct coff_header
+{
+	unsigned short machine;
+	unsigned short num_sections;
+	unsigned int time_created;
+	unsigned int offset_symtab;
+	unsigned int num_symbols;
+	unsigned short size_optional_hdr;
+	unsigned short flags;
+} coff_header;
+
+typedef struct pe32_header
+{
+	unsigned short state;
+	unsigned char major_linker_ver;
+	unsigned char minor_linker_ver;
+	unsigned int code_size;
+	unsigned int data_size;
+	unsigned int uninit_data_size;
+	unsigned int entry;
+	unsigned int code_base;
+	unsigned int data_base;
+	unsigned int base;
+	unsigned int section_alignment;
+	unsigned int file_alignment;
+	unsigned short os_major;
+	unsigned short os_minor;
+	unsigned short image_major;
+	unsigned short image_minor;
+	unsigned short subsys_major;
+	unsigned short subsys_minor;
+	unsigned int win32ver;
+	unsigned int image_size;
+	unsigned int header_size;
+	unsigned int checksum;
+	unsigned short subsystem;
+	unsigned short dll_chars;
+	unsigned int stack_size;
+	unsigned int stack_commit_size;
+	unsigned int heap_size;
+	unsigned int heap_commit_size;
+	unsigned int loader_flags;
+	unsigned int num_rva;
+	struct
+	{
+		unsigned int offset;
+		unsigned int size;
+	} dirs[16];
+} pe32_header;
+
+typedef struct section_header
+{
+	char name[8];
+	unsigned int size_in_mem;
+	unsigned int address;
+	unsigned int size_on_disk;
+	unsigned int data_offset;
+	unsigned int reloc;
+	unsigned int linenums;
+	unsigned short num_reloc;
+	unsigned short num_lines;
+	unsigned int flags;
+} section_header;
+
+typedef struct coff_symbol
+{
+	char name[8];
+	unsigned int val;
+	short section;
+	unsigned short type;
+	unsigned char symclass;
+	unsigned char auxsymbols;
+} coff_symbol;
+
+typedef struct import_dir_entry
+{
+	unsigned int lu_table;
+	unsigned int timestamp;
+	unsigned int forwarder;
+	unsigned int name;
+	unsigned int addr_table;
+} import_dir_entry;
+
+#define PE_MACHINE_I386 0x14C
+#define PE_FLAGS (0x1 | 0x2 | 0x100)	// relocs stripped, executable, 32-bit
+#define PE_STATE_PE32 0x10B
+#define PE_SUBSYSTEM_CONSOLE 3
+#define PE_DIR_IMPORT 1
+#define PE_DIR_IAT 12
+#define PE_SYMBOL_FUNCTION 0x20
+#define PE_SYMBOL_EXTERNAL 2
+#define PE_SCN_CODE 0x60000020			// code, execute, read
+#define PE_SCN_RODATA 0x40000040		// initialized data, read
+#define PE_SCN_DATA 0xC0000040			// initialized data, read, write
+#define PE_IMPORT_MODULE "msvcrt.dll"
+
+enum pe_sections
+{
+	PE_TEXT,
+	PE_RDATA,
+	PE_DATA,
+	PE_IDATA,
+	PE_SECTION_COUNT
+};
+
+typedef struct pe_section
+{
+	const char *name;
+	unsigned int flags;
+	unsigned int size;
+	unsigned int address;		// RVA
+	unsigned int offset;			// in the file
+	unsigned char *data;
+} pe_section;
+
+static pe_section pe_sections[PE_SECTION_COUNT] =
+{
+	{ ".text", PE_SCN_CODE },
+	{ ".rdata", PE_SCN_RODATA },
+	{ ".data", PE_SCN_DATA },
+	{ ".idata", PE_SCN_DATA },
+};
+
+static unsigned int *pe_function_address;	// RVA of each function
+static unsigned int pe_main_address;
+static unsigned int pe_iat;						// RVA of the import address table
+
+static unsigned int pe_op_size(const op *o)
+{
+	switch (o->kind)
+	{
+	case OP_IMPORT:
+		return 6;
+	case OP_XOR:
+		return 2;
+	case OP_MUL:
+		return 3;
+	case OP_BRANCH:
+		return 8;
+	default:
+		return 5;
+	}
+}
+
+static unsigned int pe_function_size(const op *ops, unsigned int count)
+{
+	unsigned int size = 3 + 2; // prologue & epilogue
+
+	for (unsigned int i=0; i < count; i++)
+		size += pe_op_size(&ops[i]);
+	return size;
+}
+
+static unsigned char *put32(unsigned char *p, unsigned int val)
+{
+	memcpy(p, &val, sizeof(val));
+	return p + sizeof(val);
+}
+
+static unsigned char *pe_op(unsigned char *p, unsigned int address, const op *o, unsigned int end)
+{
+	unsigned int t = o->target;
+
+	switch (o->kind)
+	{
+	case OP_CALL:
+		*p++ = 0xE8;
+		return put32(p, pe_function_address[t] - (address + 5));
+	case OP_IMPORT:
+		*p++ = 0xFF; // call [iat]
+		*p++ = 0x15;
+		return put32(p, PE_BASE + pe_iat + t * 4);
+	case OP_DATA:
+		*p++ = 0xA1; // mov eax, [d]
+		return put32(p, PE_BASE + pe_sections[PE_DATA].address + t * OBJECT_SIZE);
+	case OP_RODATA:
+		*p++ = 0xBE; // mov esi, r
+		return put32(p, PE_BASE + pe_sections[PE_RDATA].address + t * OBJECT_SIZE);
+	case OP_BSS:
+		*p++ = 0xBF; // mov edi, b
+		return put32(p, PE_BASE + pe_sections[PE_DATA].address + (data_objects + t) * OBJECT_SIZE);
+	case OP_ADD:
+		*p++ = 0x05;
+		return put32(p, t);
+	case OP_XOR:
+		*p++ = 0x31;
+		*p++ = 0xC9;
+		return p;
+	case OP_MUL:
+		*p++ = 0x6B;
+		*p++ = 0xC0;
+		*p++ = t & 0x7F;
+		return p;
+	case OP_BRANCH:
+		*p++ = 0x85; // test eax, eax
+		*p++ = 0xC0;
+		*p++ = 0x0F; // je end
+		*p++ = 0x84;
+		return put32(p, end - (address + 8));
+	}
+	return p;
+}
+
+// Build the import directory, which points at a single lookup table. The delinker identifies an
+// import by the address of its lookup table entry, and the code calls through the address table,
+// so the two tables are one and the same (which the loader doesn't mind).
+static int pe_build_imports(pe_section *s)
+{
+	import_dir_entry *d;
+	unsigned int names = sizeof(import_dir_entry) * 2 + (config.imports + 1) * 4;
+	unsigned int size = names;
+	unsigned char *p;
+
+	for (unsigned int i=0; i < config.imports; i++)
+		size += ALIGN(2 + strlen(import_names[i]) + 1, 2);
+	size += sizeof(PE_IMPORT_MODULE);
+
+	if (s->data)
+	{
+		d = (import_dir_entry*)s->data;
+		pe_iat = s->address + sizeof(import_dir_entry) * 2;
+		d->lu_table = pe_iat;
+		d->addr_table = pe_iat;
+		d->name = s->address + size - sizeof(PE_IMPORT_MODULE);
+		strcpy((char*)s->data + size - sizeof(PE_IMPORT_MODULE), PE_IMPORT_MODULE);
+
+		p = s->data + names;
+		for (unsigned int i=0; i < config.imports; i++)
+		{
+			put32(s->data + (pe_iat - s->address) + i * 4, s->address + (p - s->data));
+			strcpy((char*)p + 2, import_names[i]); // the hint is 0
+			p += ALIGN(2 + strlen(import_names[i]) + 1, 2);
+		}
+	}
+	return size;
+}
+
+static int write_pe(FILE *f)
+{
+	op *ops = (op*)malloc(sizeof(op) * ops_per_function());
+	unsigned int address;
+	unsigned int offset;
+	unsigned int num_sections = 0;
+	unsigned int num_symbols = config.functions + 1;
+	unsigned char *p;
+	unsigned char dos_header[PE_HEADER_OFFSET] = { 'M', 'Z' };
+	coff_header ch;
+	pe32_header h;
+	int ret = -1;
+
+	pe_function_address = (unsigned int*)malloc(sizeof(unsigned int) * config.functions);
+	if (!ops || !pe_function_address)
+		goto done;
+
+	// lay out the code first, so the calls can be encoded in one pass
+	address = PE_SECTION_ALIGN;
+	pe_sections[PE_TEXT].address = address;
+	pe_main_address = address;
+	address += ALIGN(12, FUNCTION_ALIGN);
+	for (unsigned int i=0; i < config.functions; i++)
+	{
+		function_ops(i, ops);
+		pe_function_address[i] = address;
+		address += ALIGN(pe_function_size(ops, ops_per_function()), FUNCTION_ALIGN);
+	}
+	pe_sections[PE_TEXT].size = address - pe_sections[PE_TEXT].address;
+
+	// the .bss objects are kept as zeros in .data, since the delinker reads the whole virtual size
+	// of each section from the file
+	pe_sections[PE_RDATA].size = rodata_objects * OBJECT_SIZE;
+	pe_sections[PE_DATA].size = (data_objects + bss_objects) * OBJECT_SIZE;
+	pe_sections[PE_IDATA].size = config.imports ? pe_build_imports(&pe_sections[PE_IDATA]) : 0;
+
+	offset = PE_FILE_ALIGN;
+	for (int i=0; i < PE_SECTION_COUNT; i++)
+	{
+		pe_section *s = &pe_sections[i];
+		if (!s->size)
+			continue;
+
+		if (i != PE_TEXT)
+			s->address = ALIGN(address, PE_SECTION_ALIGN);
+		s->offset = offset;
+		s->data = (unsigned char*)calloc(1, ALIGN(s->size, PE_FILE_ALIGN));
+		if (!s->data)
+			goto done;
+		address = s->address + s->size;
+		offset += ALIGN(s->size, PE_FILE_ALIGN);
+		num_sections++;
+	}
+	if (config.imports)
+		pe_build_imports(&pe_sections[PE_IDATA]);
+
+	// main calls the first function
+	p = pe_sections[PE_TEXT].data;
+	memset(p, 0xCC, pe_function_address[0] - pe_main_address);
+	memcpy(p, "\x55\x89\xE5\xE8", 4);
+	put32(p + 4, pe_function_address[0] - (pe_main_address + 8));
+	memcpy(p + 8, "\x31\xC0\x5D\xC3", 4);
+
+	for (unsigned int i=0; i < config.functions; i++)
+	{
+		unsigned int a = pe_function_address[i];
+		unsigned int end;
+
+		function_ops(i, ops);
+		end = a + pe_function_size(ops, ops_per_function()) - 2;
+		p = pe_sections[PE_TEXT].data + (a - pe_sections[PE_TEXT].address);
+		memset(p, 0xCC, ALIGN(end + 2 - a, FUNCTION_ALIGN));
+		*p++ = 0x55; // push ebp
+		*p++ = 0x89; // mov ebp, esp
+		*p++ = 0xE5;
+		a += 3;
+		for (unsigned int o=0; o < ops_per_function(); o++)
+		{
+			p = pe_op(p, a, &ops[o], end);
+			a += pe_op_size(&ops[o]);
+		}
+		*p++ = 0x5D; // pop ebp
+		*p++ = 0xC3; // ret
+	}
+
+	// the first word of each data object points to a function
+	if (data_objects)
+	{
+		unsigned int state = config.seed | 1;
+		for (unsigned int i=0; i < data_objects; i++)
+			put32(pe_sections[PE_DATA].data + i * OBJECT_SIZE,
+				PE_BASE + pe_function_address[next_random(&state) % config.functions]);
+	}
+
+	// headers
+	put32(dos_header + 0x3C, PE_HEADER_OFFSET);
+	memset(&ch, 0, sizeof(ch));
+	ch.machine = PE_MACHINE_I386;
+	ch.num_sections = num_sections;
+	ch.offset_symtab = offset;
+	ch.num_symbols = num_symbols;
+	ch.size_optional_hdr = sizeof(h);
+	ch.flags = PE_FLAGS;
+
+	memset(&h, 0, sizeof(h));
+	h.state = PE_STATE_PE32;
+	h.major_linker_ver = 2;
+	h.code_size = ALIGN(pe_sections[PE_TEXT].size, PE_FILE_ALIGN);
+	h.data_size = offset - PE_FILE_ALIGN - h.code_size;
+	h.entry = pe_main_address;
+	h.code_base = pe_sections[PE_TEXT].address;
+	h.data_base = ALIGN(pe_sections[PE_TEXT].address + pe_sections[PE_TEXT].size, PE_SECTION_ALIGN);
+	h.base = PE_BASE;
+	h.section_alignment = PE_SECTION_ALIGN;
+	h.file_alignment = PE_FILE_ALIGN;
+	h.os_major = 4;
+	h.subsys_major = 4;
+	h.image_size = ALIGN(address, PE_SECTION_ALIGN);
+	h.header_size = PE_FILE_ALIGN;
+	h.subsystem = PE_SUBSYSTEM_CONSOLE;
+	h.stack_size = h.heap_size = 0x100000;
+	h.stack_commit_size = h.heap_commit_size = 0x1000;
+	h.num_rva = 16;
+	if (config.imports)
+	{
+		h.dirs[PE_DIR_IMPORT].offset = pe_sections[PE_IDATA].address;
+		h.dirs[PE_DIR_IMPORT].size = sizeof(import_dir_entry) * 2;
+		h.dirs[PE_DIR_IAT].offset = pe_iat;
+		h.dirs[PE_DIR_IAT].size = (config.imports + 1) * 4;
+	}
+
+	fwrite(dos_header, sizeof(dos_header), 1, f);
+	fwrite("PE\0\0", 4, 1, f);
+	fwrite(&ch, sizeof(ch), 1, f);
+	fwrite(&h, sizeof(h), 1, f);
+	for (int i=0; i < PE_SECTION_COUNT; i++)
+	{
+		pe_section *s = &pe_sections[i];
+		section_header sh;
+
+		if (!s->size)
+			continue;
+		memset(&sh, 0, sizeof(sh));
+		memcpy(sh.name, s->name, strlen(s->name));
+		sh.size_in_mem = s->size;
+		sh.address = s->address;
+		sh.size_on_disk = ALIGN(s->size, PE_FILE_ALIGN);
+		sh.data_offset = s->offset;
+		sh.flags = s->flags;
+		fwrite(&sh, sizeof(sh), 1, f);
+	}
+
+	for (int i=0; i < PE_SECTION_COUNT; i++)
+	{
+		pe_section *s = &pe_sections[i];
+		if (!s->size)
+			continue;
+		fseek(f, s->offset, SEEK_SET);
+		fwrite(s->data, ALIGN(s->size, PE_FILE_ALIGN), 1, f);
+	}
+
+	// The symbol table holds the functions only, with their virtual address as the value, which is
+	// what the PE reader expects
+	for (unsigned int i=0; i < num_symbols; i++)
+	{
+		coff_symbol sym;
+		char name[16];
+
+		memset(&sym, 0, sizeof(sym));
+		if (i == 0)
+		{
+			strcpy(name, "main");
+			sym.val = PE_BASE + pe_main_address;
+		}
+		else
+		{
+			sprintf(name, "f%u", i-1);
+			sym.val = PE_BASE + pe_function_address[i-1];
+		}
+		memcpy(sym.name, name, strlen(name));
+		sym.section = PE_TEXT + 1;
+		sym.type = PE_SYMBOL_FUNCTION;
+		sym.symclass = PE_SYMBOL_EXTERNAL;
+		fwrite(&sym, sizeof(sym), 1, f);
+	}
+
+	// an empty string table - its size includes the size field itself. The PE reader reads that
+	// many bytes after the size field, so they are there too.
+	fwrite("\x04\0\0\0\0\0\0\0", 8, 1, f);
+	ret = 0;
+
+done:
+	for (int i=0; i < PE_SECTION_COUNT; i++)
+		free(pe_sections[i].data);
+	free(pe_function_address);
+	free(ops);
+	return ret;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Generate a synthetic program for benchmarking the delinker\n\n");
+	fprintf(stderr, "gen [OPTIONS] -o <output file>\n\n");
+	fprintf(stderr, "OPTIONS:\n");
+	fprintf(stderr, "-F, --format\t\telf (x86_64 assembly, to be built with gcc -no-pie) or pe (PE32 executable)\n");
+	fprintf(stderr, "-f, --functions\t\tNumber of functions (default %u)\n", config.functions);
+	fprintf(stderr, "-c, --calls\t\tCalls to other functions, per function (default %u)\n", config.calls);
+	fprintf(stderr, "-p, --import-calls\tCalls to imported functions, per function (default %u)\n", config.import_calls);
+	fprintf(stderr, "-i, --imports\t\tNumber of different imported functions (default %u, max %zu)\n", config.imports, MAX_IMPORTS);
+	fprintf(stderr, "-d, --data-refs\t\tReferences to data objects, per function (default %u)\n", config.data_refs);
+	fprintf(stderr, "-n, --filler\t\tOther instructions, per function (default %u)\n", config.filler);
+	fprintf(stderr, "-D, --data-size\t\tSize of .data in bytes (default %u)\n", config.data_size);
+	fprintf(stderr, "-R, --rodata-size\tSize of .rodata in bytes (default %u)\n", config.rodata_size);
+	fprintf(stderr, "-B, --bss-size\t\tSize of .bss in bytes (default %u)\n", config.bss_size);
+	fprintf(stderr, "-s, --seed\t\tSeed for the random choices (default %u)\n", config.seed);
+}
+
+int main(int argc, char *argv[])
+{
+	FILE *f;
+	int ret;
+	int c;
+
+	while (1)
+	{
+		c = getopt_long(argc, argv, "B:c:d:D:f:F:i:n:o:p:R:s:", options, 0);
+		if (c == -1)
+			break;
+
+		switch (c)
+		{
+		case 'B':
+			config.bss_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			config.calls = strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			config.data_refs = strtoul(optarg, NULL, 0);
+			break;
+		case 'D':
+			config.data_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'f':
+			config.functions = strtoul(optarg, NULL, 0);
+			break;
+		case 'F':
+			if (strcmp(optarg, "elf") == 0)
+				config.format = FORMAT_ELF;
+			else if (strcmp(optarg, "pe") == 0)
+				config.format = FORMAT_PE;
+			else
+			{
+				usage();
+				return -1;
+			}
+			break;
+		case 'i':
+			config.imports = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			config.filler = strtoul(optarg, NULL, 0);
+			break;
+		case 'o':
+			config.output = optarg;
+			break;
+		case 'p':
+			config.import_calls = strtoul(optarg, NULL, 0);
+			break;
+		case 'R':
+			config.rodata_size = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			config.seed = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+			return -1;
+		}
+	}
+
+	if (!config.output || !config.functions)
+	{
+		usage();
+		return -1;
+	}
+	if (config.imports > MAX_IMPORTS)
+	{
+		fprintf(stderr, "Only %zu imports are available\n", MAX_IMPORTS);
+		config.imports = MAX_IMPORTS;
+	}
+	if (config.format == FORMAT_PE && config.functions > 9999999)
+	{
+		fprintf(stderr, "PE function names are limited to %u characters\n", MAX_FUNCTION_NAME);
+		return -1;
+	}
+
+	data_objects = ALIGN(config.data_size, OBJECT_SIZE) / OBJECT_SIZE;
+	rodata_objects = ALIGN(config.rodata_size, OBJECT_SIZE) / OBJECT_SIZE;
+	bss_objects = ALIGN(config.bss_size, OBJECT_SIZE) / OBJECT_SIZE;
+
+	f = fopen(config.output, "wb");
+	if (!f)
+	{
+		fprintf(stderr, "Can't open %s\n", config.output);
+		return -1;
+	}
+	if (config.format == FORMAT_ELF)
+		ret = write_elf(f);
+	else
+		ret = write_pe(f);
+	fclose(f);
+
+	if (ret)
+	{
+		fprintf(stderr, "Out of memory\n");
+		remove(config.output);
+	}
+	return ret;
+}
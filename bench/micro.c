@@ -0,0 +1,551 @@
+/* Microbenchmark for the backend query API and the list container under it
+Each primitive is timed on tables of 1k, 10k, 100k and 1M entries, and the cost of one call is
+printed together with its growth (the exponent of n between the two largest sizes), so the
+asymptotic behaviour is there in numbers. A run can be saved and used as the baseline for the next
+one, which then fails if anything got slower by more than the tolerance.
+
+The tables are built through the API, and some of the builds (and the sort) are quadratic. Their time
+at the next size is predicted from the sizes already done, and anything that would take longer than
+the time limit is skipped instead of running for hours. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <getopt.h>
+#include "backend.h"
+#include "ll.h"
+
+#define MAX_SIZES 8
+#define MAX_ROWS 16
+#define KEY_COUNT 4096				// random lookup keys, reused in a cycle
+#define BATCH 16						// list entries added & removed at a time
+#define SYMBOL_BASE 0x400000
+#define SYMBOL_SIZE 16
+#define IMPORTS_PER_MODULE 1000
+#define MAX_NAME 32
+
+typedef struct row
+{
+	const char *name;
+	double ns[MAX_SIZES];		// per call - 0 when not measured
+} row;
+
+// a table build or sort that gets slower than linearly, and may have to be skipped
+typedef struct guard
+{
+	unsigned int runs;
+	double n[2];
+	double seconds[2];
+} guard;
+
+static unsigned int sizes[MAX_SIZES] = { 1000, 10000, 100000, 1000000 };
+static unsigned int size_count = 4;
+static double min_time = 0.1;		// seconds per measurement
+static double time_limit = 30;	// seconds for a build or a sort
+static double tolerance = 2.0;	// allowed slowdown against the baseline
+static row rows[MAX_ROWS];
+static unsigned int row_count;
+static volatile unsigned long sink;	// keeps the results of the lookups alive
+
+static struct option options[] =
+{
+  {"baseline", required_argument, 0, 'b'},
+  {"min-time", required_argument, 0, 'm'},
+  {"output", required_argument, 0, 'o'},
+  {"tolerance", required_argument, 0, 'r'},
+  {"sizes", required_argument, 0, 's'},
+  {"time-limit", required_argument, 0, 't'},
+  {0, no_argument, 0, 0}
+};
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static row *get_row(const char *name)
+{
+	for (unsigned int i=0; i < row_count; i++)
+		if (strcmp(rows[i].name, name) == 0)
+			return &rows[i];
+	if (row_count == MAX_ROWS)
+		return NULL;
+	rows[row_count].name = name;
+	return &rows[row_count++];
+}
+
+static void record(const char *name, unsigned int size_index, double ns)
+{
+	row *r = get_row(name);
+	if (r)
+		r->ns[size_index] = ns;
+}
+
+// will this build or sort finish within the time limit at size n?
+static int guard_allows(const guard *g, double n)
+{
+	double exponent = 2;
+
+	if (!g->runs || time_limit <= 0)
+		return 1;
+
+	// assume the same growth as between the last two sizes (quadratic until there are two)
+	if (g->runs > 1 && g->seconds[0] > 0)
+	{
+		exponent = log(g->seconds[1] / g->seconds[0]) / log(g->n[1] / g->n[0]);
+		if (exponent < 1)
+			exponent = 1;
+	}
+	return g->seconds[1] * pow(n / g->n[1], exponent) <= time_limit;
+}
+
+static void guard_update(guard *g, double n, double seconds)
+{
+	g->n[0] = g->n[1];
+	g->seconds[0] = g->seconds[1];
+	g->n[1] = n;
+	g->seconds[1] = seconds;
+	g->runs++;
+}
+
+typedef void (lookup_fn)(backend_object *obj, void *key);
+
+// call 'fn' with the keys in turn until it has run for the minimum time, and return ns per call
+static double time_lookups(lookup_fn *fn, backend_object *obj, void **keys)
+{
+	unsigned long calls = 0;
+	unsigned long batch = 1;
+	double start = now();
+	double elapsed;
+
+	do
+	{
+		for (unsigned long i=0; i < batch; i++)
+			fn(obj, keys[(calls + i) % KEY_COUNT]);
+		calls += batch;
+		batch *= 2;
+		elapsed = now() - start;
+	} while (elapsed < min_time);
+
+	return elapsed * 1e9 / calls;
+}
+
+static void lookup_by_val(backend_object *obj, void *key)
+{
+	sink += (unsigned long)backend_find_symbol_by_val(obj, ((backend_symbol*)key)->val);
+}
+
+static void lookup_by_name(backend_object *obj, void *key)
+{
+	sink += (unsigned long)backend_find_symbol_by_name(obj, ((backend_symbol*)key)->name);
+}
+
+static void lookup_by_val_type(backend_object *obj, void *key)
+{
+	sink += (unsigned long)backend_find_symbol_by_val_type(obj, ((backend_symbol*)key)->val, SYMBOL_TYPE_FUNCTION);
+}
+
+static void lookup_symbol_index(backend_object *obj, void *key)
+{
+	sink += backend_get_symbol_index(obj, (backend_symbol*)key);
+}
+
+static void lookup_section(backend_object *obj, void *key)
+{
+	sink += (unsigned long)backend_find_section_by_val(obj, ((backend_section*)key)->address);
+}
+
+static void lookup_import(backend_object *obj, void *key)
+{
+	sink += (unsigned long)backend_find_import_by_address(obj, ((backend_symbol*)key)->val);
+}
+
+static int cmp_by_val(void *a, void *b)
+{
+	backend_symbol *sa = (backend_symbol*)a;
+	backend_symbol *sb = (backend_symbol*)b;
+
+	if (sa->val < sb->val)
+		return -1;
+	return sa->val > sb->val;
+}
+
+static int cmp_by_ptr(void *a, const void *b)
+{
+	return a != b;
+}
+
+// a random permutation of 0..n-1, so the tables aren't built in order
+static unsigned int *shuffled(unsigned int n, unsigned int *state)
+{
+	unsigned int *order = (unsigned int*)malloc(sizeof(unsigned int) * n);
+	if (!order)
+		return NULL;
+
+	for (unsigned int i=0; i < n; i++)
+		order[i] = i;
+	for (unsigned int i=n; i > 1; i--)
+	{
+		unsigned int j = rand_r(state) % i;
+		unsigned int tmp = order[i-1];
+		order[i-1] = order[j];
+		order[j] = tmp;
+	}
+	return order;
+}
+
+static void bench_symbols(unsigned int si, guard *build, guard *sort, unsigned int *state)
+{
+	unsigned int n = sizes[si];
+	backend_object *obj;
+	unsigned int *order;
+	backend_symbol **syms;
+	void *keys[KEY_COUNT];
+	char name[MAX_NAME];
+	double start;
+
+	if (!guard_allows(build, n))
+		return;
+
+	obj = backend_create();
+	order = shuffled(n, state);
+	syms = (backend_symbol**)malloc(sizeof(backend_symbol*) * n);
+	if (!obj || !order || !syms)
+		goto done;
+
+	start = now();
+	for (unsigned int i=0; i < n; i++)
+	{
+		sprintf(name, "sym%07u", order[i]);
+		syms[i] = backend_add_symbol(obj, name, SYMBOL_BASE + order[i] * SYMBOL_SIZE, SYMBOL_TYPE_FUNCTION, SYMBOL_SIZE, 0, NULL);
+	}
+	guard_update(build, n, now() - start);
+	record("backend_add_symbol", si, build->seconds[1] * 1e9 / n);
+
+	// the keys are symbols in random positions
+	for (unsigned int i=0; i < KEY_COUNT; i++)
+		keys[i] = syms[rand_r(state) % n];
+
+	record("backend_find_symbol_by_val", si, time_lookups(lookup_by_val, obj, keys));
+	record("backend_find_symbol_by_name", si, time_lookups(lookup_by_name, obj, keys));
+	record("backend_find_symbol_by_val_type", si, time_lookups(lookup_by_val_type, obj, keys));
+	record("backend_get_symbol_index", si, time_lookups(lookup_symbol_index, obj, keys));
+
+	if (guard_allows(sort, n))
+	{
+		start = now();
+		backend_sort_symbols(obj, cmp_by_val);
+		guard_update(sort, n, now() - start);
+		record("backend_sort_symbols", si, sort->seconds[1] * 1e9);
+	}
+
+done:
+	free(syms);
+	free(order);
+	if (obj)
+		backend_destructor(obj);
+}
+
+static void bench_sections(unsigned int si, guard *build, unsigned int *state)
+{
+	unsigned int n = sizes[si];
+	backend_object *obj;
+	unsigned int *order;
+	void *keys[KEY_COUNT];
+	backend_section **secs;
+	char name[MAX_NAME];
+	double start;
+
+	if (!guard_allows(build, n))
+		return;
+
+	obj = backend_create();
+	order = shuffled(n, state);
+	secs = (backend_section**)malloc(sizeof(backend_section*) * n);
+	if (!obj || !order || !secs)
+		goto done;
+
+	start = now();
+	for (unsigned int i=0; i < n; i++)
+	{
+		sprintf(name, ".text.%u", order[i]);
+		secs[i] = backend_add_section(obj, name, SYMBOL_SIZE, SYMBOL_BASE + order[i] * SYMBOL_SIZE, NULL, 0, 4, SECTION_FLAG_EXECUTE);
+	}
+	guard_update(build, n, now() - start);
+
+	for (unsigned int i=0; i < KEY_COUNT; i++)
+		keys[i] = secs[rand_r(state) % n];
+	record("backend_find_section_by_val", si, time_lookups(lookup_section, obj, keys));
+
+done:
+	free(secs);
+	free(order);
+	if (obj)
+		backend_destructor(obj);
+}
+
+static void bench_imports(unsigned int si, unsigned int *state)
+{
+	unsigned int n = sizes[si];
+	backend_object *obj = backend_create();
+	backend_import *mod = NULL;
+	backend_symbol **syms = (backend_symbol**)malloc(sizeof(backend_symbol*) * n);
+	void *keys[KEY_COUNT];
+	char name[MAX_NAME];
+
+	if (!obj || !syms)
+		goto done;
+
+	// a module for every IMPORTS_PER_MODULE functions, like a program with many libraries
+	for (unsigned int i=0; i < n; i++)
+	{
+		if (i % IMPORTS_PER_MODULE == 0)
+		{
+			sprintf(name, "lib%u.so", i / IMPORTS_PER_MODULE);
+			mod = backend_add_import_module(obj, name);
+		}
+		sprintf(name, "import%u", i);
+		syms[i] = backend_add_import_function(mod, name, SYMBOL_BASE + i * 8);
+	}
+
+	for (unsigned int i=0; i < KEY_COUNT; i++)
+		keys[i] = syms[rand_r(state) % n];
+	record("backend_find_import_by_address", si, time_lookups(lookup_import, obj, keys));
+
+done:
+	free(syms);
+	if (obj)
+		backend_destructor(obj);
+}
+
+// ll_add appends, and ll_remove searches from the head, so both are timed at the tail of a list
+// with n entries
+static void bench_list(unsigned int si)
+{
+	unsigned int n = sizes[si];
+	linked_list *ll = ll_init();
+	unsigned long *items = (unsigned long*)malloc(sizeof(unsigned long) * (n + BATCH));
+	unsigned long calls = 0;
+	double add_time = 0;
+	double remove_time = 0;
+	double start;
+
+	if (!ll || !items)
+		goto done;
+
+	for (unsigned int i=0; i < n; i++)
+		ll_push(ll, &items[i]);
+
+	while (add_time + remove_time < min_time)
+	{
+		start = now();
+		for (unsigned int i=0; i < BATCH; i++)
+			ll_add(ll, &items[n + i]);
+		add_time += now() - start;
+
+		start = now();
+		for (unsigned int i=0; i < BATCH; i++)
+			sink += (unsigned long)ll_remove(ll, &items[n + i], cmp_by_ptr);
+		remove_time += now() - start;
+		calls += BATCH;
+	}
+	record("ll_add", si, add_time * 1e9 / calls);
+	record("ll_remove", si, remove_time * 1e9 / calls);
+
+done:
+	free(items);
+	if (ll)
+		ll_destroy(ll);
+}
+
+static void print_time(double ns)
+{
+	if (ns <= 0)
+		printf(" %10s", "skipped");
+	else if (ns < 1e3)
+		printf(" %7.1f ns", ns);
+	else if (ns < 1e6)
+		printf(" %7.1f us", ns / 1e3);
+	else if (ns < 1e9)
+		printf(" %7.1f ms", ns / 1e6);
+	else
+		printf(" %7.1f s ", ns / 1e9);
+}
+
+static void print_table(void)
+{
+	printf("%-32s", "per call");
+	for (unsigned int s=0; s < size_count; s++)
+		printf(" %10u", sizes[s]);
+	printf("   growth\n");
+
+	for (unsigned int r=0; r < row_count; r++)
+	{
+		int last = -1;
+		int prev = -1;
+
+		printf("%-32s", rows[r].name);
+		for (unsigned int s=0; s < size_count; s++)
+		{
+			print_time(rows[r].ns[s]);
+			if (rows[r].ns[s] > 0)
+			{
+				prev = last;
+				last = s;
+			}
+		}
+
+		// the exponent of n between the two largest sizes that were measured
+		if (prev >= 0)
+			printf("   n^%.2f", log(rows[r].ns[last] / rows[r].ns[prev]) / log((double)sizes[last] / sizes[prev]));
+		printf("\n");
+	}
+}
+
+static int save_results(const char *filename)
+{
+	FILE *f = fopen(filename, "w");
+	if (!f)
+	{
+		fprintf(stderr, "Can't open %s\n", filename);
+		return -1;
+	}
+
+	for (unsigned int r=0; r < row_count; r++)
+		for (unsigned int s=0; s < size_count; s++)
+			if (rows[r].ns[s] > 0)
+				fprintf(f, "%s %u %.1f\n", rows[r].name, sizes[s], rows[r].ns[s]);
+	fclose(f);
+	return 0;
+}
+
+// compare with the results of an earlier run, and return the number of regressions
+static int compare_results(const char *filename)
+{
+	char name[64];
+	unsigned int size;
+	double ns;
+	int regressions = 0;
+	FILE *f = fopen(filename, "r");
+
+	if (!f)
+	{
+		fprintf(stderr, "Can't open %s\n", filename);
+		return -1;
+	}
+
+	while (fscanf(f, "%63s %u %lf", name, &size, &ns) == 3)
+	{
+		for (unsigned int r=0; r < row_count; r++)
+		{
+			if (strcmp(rows[r].name, name) != 0)
+				continue;
+			for (unsigned int s=0; s < size_count; s++)
+			{
+				if (sizes[s] != size || rows[r].ns[s] <= 0 || rows[r].ns[s] <= ns * tolerance)
+					continue;
+				printf("Regression: %s at %u entries went from %.1f ns to %.1f ns (%.1fx)\n",
+					name, size, ns, rows[r].ns[s], rows[r].ns[s] / ns);
+				regressions++;
+			}
+		}
+	}
+	fclose(f);
+	return regressions;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Microbenchmark for the backend lookups and the linked list\n\n");
+	fprintf(stderr, "micro [OPTIONS]\n\n");
+	fprintf(stderr, "OPTIONS:\n");
+	fprintf(stderr, "-s, --sizes\t\tComma-separated table sizes (default 1000,10000,100000,1000000)\n");
+	fprintf(stderr, "-m, --min-time\t\tSeconds to spend on each measurement (default %g)\n", min_time);
+	fprintf(stderr, "-t, --time-limit\tSkip builds & sorts predicted to take longer than this many seconds (default %g, 0 = no limit)\n", time_limit);
+	fprintf(stderr, "-o, --output\t\tSave the results, to use as a baseline\n");
+	fprintf(stderr, "-b, --baseline\t\tFail if anything is slower than in these saved results...\n");
+	fprintf(stderr, "-r, --tolerance\t\t...by more than this factor (default %g)\n", tolerance);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *output = NULL;
+	const char *baseline = NULL;
+	unsigned int state = 1;
+	guard symbol_build = {0};
+	guard symbol_sort = {0};
+	guard section_build = {0};
+	int c;
+
+	while (1)
+	{
+		c = getopt_long(argc, argv, "b:m:o:r:s:t:", options, 0);
+		if (c == -1)
+			break;
+
+		switch (c)
+		{
+		case 'b':
+			baseline = optarg;
+			break;
+		case 'm':
+			min_time = atof(optarg);
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		case 'r':
+			tolerance = atof(optarg);
+			break;
+		case 's':
+			size_count = 0;
+			for (char *s = strtok(optarg, ","); s && size_count < MAX_SIZES; s = strtok(NULL, ","))
+				if ((sizes[size_count] = strtoul(s, NULL, 0)) > 0)
+					size_count++;
+			break;
+		case 't':
+			time_limit = atof(optarg);
+			break;
+		default:
+			usage();
+			return -1;
+		}
+	}
+	if (!size_count)
+	{
+		usage();
+		return -1;
+	}
+
+	// make the rows come out in a sensible order
+	get_row("backend_add_symbol");
+	get_row("backend_find_symbol_by_val");
+	get_row("backend_find_symbol_by_name");
+	get_row("backend_find_symbol_by_val_type");
+	get_row("backend_get_symbol_index");
+	get_row("backend_sort_symbols");
+	get_row("backend_find_section_by_val");
+	get_row("backend_find_import_by_address");
+	get_row("ll_add");
+	get_row("ll_remove");
+
+	for (unsigned int s=0; s < size_count; s++)
+	{
+		fprintf(stderr, "%u entries\n", sizes[s]);
+		bench_symbols(s, &symbol_build, &symbol_sort, &state);
+		bench_sections(s, &section_build, &state);
+		bench_imports(s, &state);
+		bench_list(s);
+	}
+
+	print_table();
+	if (output && save_results(output) != 0)
+		return -1;
+	if (baseline && compare_results(baseline) != 0)
+		return 1;
+	return 0;
+}
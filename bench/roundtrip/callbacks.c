@@ -0,0 +1,30 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+static int add(int a, int b) { return a + b; }
+static int sub(int a, int b) { return a - b; }
+static int mul(int a, int b) { return a * b; }
+
+// function pointers in .data, and a comparator called back from libc
+static int (*ops[])(int, int) = { add, sub, mul };
+static int values[] = { 42, 7, 19, 3, 88, 21, 5 };
+
+static int compare(const void *a, const void *b)
+{
+	return *(const int*)a - *(const int*)b;
+}
+
+int main(void)
+{
+	int total = 1;
+	unsigned int count = sizeof(values) / sizeof(values[0]);
+
+	qsort(values, count, sizeof(values[0]), compare);
+	for (unsigned int i=0; i < count; i++)
+	{
+		total = ops[i % 3](total, values[i]);
+		printf("%i ", values[i]);
+	}
+	printf("\ntotal = %i\n", total);
+	return total & 0x7F;
+}
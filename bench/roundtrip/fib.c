@@ -0,0 +1,16 @@
+#include <stdio.h>
+
+static int fib(int n)
+{
+	if (n < 2)
+		return n;
+	return fib(n - 1) + fib(n - 2);
+}
+
+int main(void)
+{
+	int f = fib(20);
+
+	printf("fib(20) = %i\n", f);
+	return f % 256;
+}
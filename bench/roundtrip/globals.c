@@ -0,0 +1,23 @@
+#include <stdio.h>
+
+static const char *names[] = { "zero", "one", "two", "three", "four" };
+static const int squares[] = { 0, 1, 4, 9, 16 };
+int counter = 10;			// .data
+int hits[5];				// .bss
+
+static void count(int i)
+{
+	hits[i]++;
+	counter += squares[i];
+}
+
+int main(void)
+{
+	for (int i=0; i < 20; i++)
+		count(i % 5);
+
+	for (int i=0; i < 5; i++)
+		printf("%s: %i hits\n", names[i], hits[i]);
+	printf("counter = %i\n", counter);
+	return counter % 100;
+}
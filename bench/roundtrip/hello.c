@@ -0,0 +1,7 @@
+#include <stdio.h>
+
+int main(void)
+{
+	puts("Hello, world");
+	return 0;
+}
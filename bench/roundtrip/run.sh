@@ -0,0 +1,138 @@
+#!/bin/bash
+# Round trip: build the small C programs in this directory with the local gcc, delink each one in
+# every mode, relink the objects, run the result and compare its output and exit code with those
+# of the original program. The time of each step (compile, delink, relink, run) is recorded, so the
+# same run shows both whether the objects still work and what a delink/relink cycle costs.
+#
+# usage: bench/roundtrip/run.sh [path to delinker]
+#
+# Environment:
+#   CC                 compiler used to build the programs, and to drive ld for the relink (default gcc)
+#   ROUNDTRIP_CFLAGS   flags for building the programs (default "-O1 -no-pie -fno-pie")
+#   ROUNDTRIP_MODES    delinker options of each mode, separated by ';'. An empty mode is the default
+#                      (symbols from the symbol table, one object per source file).
+#                      (default "; -S; -C; -D; -F; -g -k main; -i; -R internal; -R descent; -R ehframe; -R prologue; -R internal -S")
+#   ROUNDTRIP_DIR      where to keep the programs, objects, outputs and timings (default: a new directory in /tmp)
+#
+# The programs are delinked with their symbol tables, so -R adds the reconstructed function
+# boundaries to the known symbols, and main is still there to be linked against the C runtime.
+# The entry point (_start) is one of the ignored runtime symbols, so --gc is told to keep main.
+
+ROUNDTRIP=$(cd "$(dirname "$0")" && pwd)
+DELINKER=$(realpath "${1:-./delinker}")
+CC=${CC:-gcc}
+CFLAGS=${ROUNDTRIP_CFLAGS:-"-O1 -no-pie -fno-pie"}
+MODES=${ROUNDTRIP_MODES-"; -S; -C; -D; -F; -g -k main; -i; -R internal; -R descent; -R ehframe; -R prologue; -R internal -S"}
+WORK=${ROUNDTRIP_DIR:-$(mktemp -d /tmp/delinker-roundtrip.XXXXXX)}
+
+# symbols that the C runtime brings in again when the objects are linked (see the README)
+IGNORE="-I_start -I_IO_stdin_used -I__dso_handle -I_init -I_fini -I__TMC_END__ -I__libc_csu_fini -I__libc_csu_init
+	-I_dl_relocate_static_pie -Ideregister_tm_clones -Iregister_tm_clones -I__do_global_dtors_aux -Iframe_dummy"
+
+# every program is run with the same arguments and input
+ARGS="one two"
+TIMEOUT=10
+
+if [[ ! -x $DELINKER ]]; then
+	echo "Build the delinker first (make delinker)"
+	exit 1
+fi
+mkdir -p "$WORK"
+
+# a timestamp in nanoseconds, and the milliseconds since the timestamp $1
+function now()
+{
+	date +%s%N
+}
+function elapsed()
+{
+	echo $(( ($(now) - $1) / 1000000 ))
+}
+
+# run the program $1 in its own directory, and write its output to $2. The exit code is returned.
+function run()
+{
+	(cd "$(dirname "$1")" && echo "input" | timeout $TIMEOUT "./$(basename "$1")" $ARGS > "$2" 2>&1)
+}
+
+# print one line of the table, and keep it in the results file
+function result()
+{
+	printf "%-12s %-20s %-16s %8s %8s %8s %8s\n" "$@"
+	printf "%s\t%s\t%s\t%s\t%s\t%s\t%s\n" "$@" >> "$WORK/results.tsv"
+}
+
+passed=0
+failed=0
+printf "program\tmode\tresult\tcompile_ms\tdelink_ms\trelink_ms\trun_ms\n" > "$WORK/results.tsv"
+printf "%-12s %-20s %-16s %8s %8s %8s %8s\n" program mode result compile delink relink "run (ms)"
+
+for src in "$ROUNDTRIP"/*.c; do
+	prog=$(basename "$src" .c)
+	mkdir -p "$WORK/$prog"
+	orig=$WORK/$prog/$prog
+
+	start=$(now)
+	if ! $CC $CFLAGS -o "$orig" "$src" > "$WORK/$prog/compile.log" 2>&1; then
+		result "$prog" - "compile failed" "$(elapsed $start)" - - -
+		failed=$((failed + 1))
+		continue
+	fi
+	compile_ms=$(elapsed $start)
+	run "$orig" "$WORK/$prog/expected.txt"
+	expected_exit=$?
+
+	IFS=';' read -ra modes <<< "$MODES"
+	for mode in "${modes[@]}"; do
+		mode=$(echo $mode)
+		name=${mode:-default}
+		dir=$WORK/$prog/$(echo "${name// /}" | tr -c 'a-zA-Z0-9\n' '_')
+		rm -rf "$dir"
+		mkdir -p "$dir"
+
+		# the delinker writes the objects to the current directory
+		start=$(now)
+		(cd "$dir" && "$DELINKER" $IGNORE $mode "$orig" > delink.log 2>&1)
+		status=$?
+		delink_ms=$(elapsed $start)
+		if [[ $status != 0 ]]; then
+			result "$prog" "$name" "delink failed" $compile_ms $delink_ms - -
+			failed=$((failed + 1))
+			continue
+		elif ! compgen -G "$dir/*.o" > /dev/null; then
+			result "$prog" "$name" "no objects" $compile_ms $delink_ms - -
+			failed=$((failed + 1))
+			continue
+		fi
+
+		start=$(now)
+		(cd "$dir" && $CC -no-pie -o relinked *.o > relink.log 2>&1)
+		status=$?
+		relink_ms=$(elapsed $start)
+		if [[ $status != 0 ]]; then
+			result "$prog" "$name" "relink failed" $compile_ms $delink_ms $relink_ms -
+			failed=$((failed + 1))
+			continue
+		fi
+
+		start=$(now)
+		run "$dir/relinked" "$dir/output.txt"
+		exit_code=$?
+		run_ms=$(elapsed $start)
+		if [[ $exit_code != $expected_exit ]]; then
+			result "$prog" "$name" "exit $exit_code!=$expected_exit" $compile_ms $delink_ms $relink_ms $run_ms
+			failed=$((failed + 1))
+		elif ! cmp -s "$WORK/$prog/expected.txt" "$dir/output.txt"; then
+			result "$prog" "$name" "output differs" $compile_ms $delink_ms $relink_ms $run_ms
+			failed=$((failed + 1))
+		else
+			result "$prog" "$name" pass $compile_ms $delink_ms $relink_ms $run_ms
+			passed=$((passed + 1))
+		fi
+	done
+done
+
+echo
+echo "$passed passed, $failed failed"
+echo "The programs, objects, logs and timings (results.tsv) are in $WORK"
+[[ $failed == 0 ]]
@@ -0,0 +1,29 @@
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+
+static char buffer[64];
+
+static const char *shout(const char *s)
+{
+	unsigned int i;
+
+	for (i=0; s[i] && i < sizeof(buffer) - 1; i++)
+		buffer[i] = toupper((unsigned char)s[i]);
+	buffer[i] = 0;
+	return buffer;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *words[] = { "delink", "relink", "run" };
+	size_t length = 0;
+
+	for (unsigned int i=0; i < sizeof(words) / sizeof(words[0]); i++)
+	{
+		printf("%s -> %s\n", words[i], shout(words[i]));
+		length += strlen(words[i]);
+	}
+	printf("%i arguments, %zu letters\n", argc, length);
+	return (int)length;
+}
@@ -0,0 +1,33 @@
+#include <stdio.h>
+
+// dense enough for the compiler to use a jump table in .rodata
+static const char *classify(int c)
+{
+	switch (c)
+	{
+	case 0: return "nul";
+	case 1: return "soh";
+	case 2: return "stx";
+	case 3: return "etx";
+	case 4: return "eot";
+	case 5: return "enq";
+	case 6: return "ack";
+	case 7: return "bel";
+	case 8: return "bs";
+	case 9: return "tab";
+	default: return "other";
+	}
+}
+
+int main(void)
+{
+	int sum = 0;
+
+	for (int i=0; i < 12; i++)
+	{
+		const char *s = classify(i);
+		printf("%i: %s\n", i, s);
+		sum += s[0];
+	}
+	return sum % 256;
+}
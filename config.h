@@ -7,10 +7,17 @@
 #define DEBUG_PRINT //
 #endif
 
+// the default name of the entry point function
+#define SYMBOL_NAME_MAIN "main"
+
 enum reconstructor_functions
 {
 	RECONSTRUCTOR_INTERNAL,
-	RECONSTRUCTOR_NUCLEUS
+	RECONSTRUCTOR_NUCLEUS,
+	RECONSTRUCTOR_DESCENT,
+	RECONSTRUCTOR_EHFRAME,
+	RECONSTRUCTOR_PDATA,
+	RECONSTRUCTOR_PROLOGUE
 };
 
 struct config
@@ -22,9 +29,22 @@ struct config
 										// when planning to make modifications before relinking.
 	linked_list *ignore_list;	// List of symbols to ignore
 	char *entry_name;				// name of the entry point function
+	int jobs;						// number of worker threads (0 = one per CPU)
+	char *prologue_file;			// extra function prologue patterns (see prologue.c)
+	int shared_data;				// write each data section once, to its own object
+	int compact;					// pack the code in the output sections instead of keeping the original offsets
+	int function_sections;		// write a single object, with a section for each function
+	int fold_identical;			// write identical functions once, with aliases (see icf.c)
+	int gc;							// remove the functions & data that can't be reached (see reach.c)
+	linked_list *keep_list;		// List of symbols that --gc must not remove
+	int stats;						// time each phase and count what it did (see stats.c)
+	char *stats_file;				// write the statistics as JSON to this file instead of a table to stdout
+	char *trace_file;				// write Chrome trace events to this file (see trace.c)
+	int batch;						// delink each of many inputs in its own directory (see batch.c)
+	char *manifest;				// a file listing the inputs of the batch, one per line
+	char *output_dir;				// where to write the output files (default: the current directory)
+	char *daemon_socket;			// answer requests on this socket, and keep the analysed inputs (see server.c)
+	char *connect_socket;		// send the request to the daemon listening on this socket
 };
 
-// make the config globally accessible
-extern struct config config;
-
 #endif // _CONFIG__H
@@ -0,0 +1,29 @@
+#ifndef _CONTEXT__H
+#define _CONTEXT__H
+
+#include <stddef.h>
+#include "ll.h"
+#include "config.h"
+#include "log.h"
+
+struct prologue_db;
+
+// Everything a run depends on, apart from its input. The program has one (see delinker.c), and
+// each context of the library (see libdelinker.c) is another, so independent runs don't share any
+// state. It is passed down to every stage that reads the options. The log levels are also made the
+// levels of the thread that does the work (see log_use).
+struct delinker_ctx
+{
+	struct config config;
+	unsigned char log_levels[LOG_CATEGORY_COUNT];
+	struct prologue_db *prologues;	// compiled on first use (see prologue.c)
+
+	// where the output objects go - when there is no sink, they are written to files
+	int (*output_sink)(const char *name, const void *data, size_t size, void *arg);
+	void *output_sink_arg;
+
+	char *output_target;				// the library's choice of output format (NULL for the input's)
+	int busy;							// a call of the library is running on this context
+};
+
+#endif // _CONTEXT__H
@@ -7,49 +7,46 @@ backend from scratch. */
 /* The idea of the program is simple - read in a fully linked executable,
 and write out a set of unlinked .o files that can be relinked later.*/
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
 #include <getopt.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "capstone/capstone.h"
 #include "backend.h"
-#include "config.h"
+#include "context.h"
 #include "reloc.h"
-
-#ifdef DEBUG
-#define DEBUG_PRINT printf
-#else
-#define DEBUG_PRINT //
-#endif
-
-extern int nucleus_reconstruct_symbols(backend_object *obj);
+#include "errors.h"
+#include "stats.h"
+#include "log.h"
+#include "mem.h"
+#include "trace.h"
+#include "batch.h"
+#include "server.h"
+
+extern int nucleus_reconstruct_symbols(backend_object *obj, const char *src_name);
+extern int ehframe_reconstruct_symbols(backend_object *obj, backend_section *sec_text, csh cs_dis, cs_insn *cs_ins, const char *src_name);
+extern int pdata_present(backend_object *obj);
+extern int pdata_reconstruct_symbols(backend_object *obj, backend_section *sec_text, csh cs_dis, cs_insn *cs_ins, const char *src_name);
+extern int prologue_reconstruct_symbols(struct delinker_ctx *ctx, backend_object *obj, unsigned int bits, const char *src_name);
+extern void prologue_free(struct delinker_ctx *ctx);
+extern int fold_identical_functions(backend_object *obj);
+extern int remove_unreachable_symbols(struct delinker_ctx *ctx, backend_object *obj);
+extern int descent_reconstruct_symbols(struct delinker_ctx *ctx, backend_object *obj, backend_section *sec_text, cs_mode mode, const char *src_name);
 extern void reloc_x86_16(backend_object* obj, backend_section* sec, csh cs_dis, cs_insn *cs_ins);
 extern void reloc_x86_32(backend_object* obj, backend_section* sec, csh cs_dis, cs_insn *cs_ins);
 extern void reloc_x86_64(backend_object* obj, backend_section* sec, csh cs_dis, cs_insn *cs_ins);
 
 #define DEFAULT_OUTPUT_FILENAME "default.o"
-#define SYMBOL_NAME_MAIN "main"
 #define MAX_FILENAME_LENGTH 31
+#define MAX_ANCHOR_NAME_LENGTH 63
 
-typedef void (reloc_fn)(backend_object* obj, backend_section* sec, csh cs_dis, cs_insn *cs_ins);
+#define SHARED_DATA_FILENAME "shared_data.o"
+#define SHARED_DATA_ANCHOR_PREFIX "__section"
 
-// this must be synchronized with "error_code_str" string table,
-// because these defines are used as a direct index into the table
-enum error_codes
-{
-   ERR_NONE,
-   ERR_BAD_FILE,
-   ERR_BAD_FORMAT,
-   ERR_NO_SYMS,
-   ERR_NO_SYMS_AFTER_RECONSTRUCT,
-   ERR_NO_SECTION,
-   ERR_NO_TEXT_SECTION,
-   ERR_NO_PLT_SECTION,
-	ERR_CANT_CREATE_OO,
-	ERR_CANT_WRITE_OO,
-	ERR_UNSUPPORTED_ARCH,
-	ERR_CANT_DISASSEMBLE,
-   ERR_NO_MEMORY,
-};
+typedef void (reloc_fn)(backend_object* obj, backend_section* sec, csh cs_dis, cs_insn *cs_ins);
 
 typedef char error_msg[32];
 error_msg error_code_str[] =
@@ -67,33 +64,74 @@ error_msg error_code_str[] =
    "Unsupported architecture",
    "Can't disassemble",
    "Out of memory",
+	"The context is already in use",
+	"Stopped by the output sink",
 };
 
+// the message for a (positive) error code
+const char *error_message(int code)
+{
+	if (code < 0 || code >= (int)(sizeof(error_code_str) / sizeof(error_code_str[0])))
+		return "Unknown error";
+	return error_code_str[code];
+}
+
+#ifndef DELINKER_LIBRARY
 static struct option options[] =
 {
+  {"batch", optional_argument, 0, 'b'},
+  {"connect", required_argument, 0, 'c'},
+  {"compact", no_argument, 0, 'C'},
+  {"daemon", required_argument, 0, 'd'},
+  {"shared-data", no_argument, 0, 'D'},
   {"entry-name", required_argument, 0, 'e'},
+  {"function-sections", no_argument, 0, 'F'},
+  {"icf", no_argument, 0, 'i'},
+  {"gc", no_argument, 0, 'g'},
   {"ignore", required_argument, 0, 'I'},
+  {"jobs", required_argument, 0, 'j'},
+  {"keep", required_argument, 0, 'k'},
+  {"log", required_argument, 0, 'l'},
+  {"output-dir", required_argument, 0, 'o'},
   {"output-target", required_argument, 0, 'O'},
+  {"prologues", required_argument, 0, 'P'},
   {"reconstruct-symbols", required_argument, 0, 'R'},
+  {"stats", optional_argument, 0, 's'},
   {"symbol-per-file", no_argument, 0, 'S'},
+  {"trace", required_argument, 0, 't'},
   {"verbose", no_argument, 0, 'v'},
   {0, no_argument, 0, 0}
 };
 
-// The global configuration options
-struct config config;
-
 static void
 usage(void)
 {
    fprintf(stderr, "Delinker performs the opposite action to 'ld'. It accepts a binary executable as input, and\n");
    fprintf(stderr, "creates a set of .o files that can be relinked.\n\n");
-   fprintf(stderr, "delinker [OPTIONS] <input file>\n\n");
+   fprintf(stderr, "delinker [OPTIONS] <input file>\n");
+   fprintf(stderr, "delinker --batch[=MANIFEST] [OPTIONS] [input files...]\n");
+   fprintf(stderr, "delinker --daemon=SOCKET [OPTIONS]\n");
+   fprintf(stderr, "delinker --connect=SOCKET [OPTIONS] <input file>\n\n");
    fprintf(stderr, "OPTIONS:\n");
+   fprintf(stderr, "-b, --batch[=MANIFEST]\t\tDelink many inputs - the arguments, and those listed in MANIFEST ('-' is stdin) - each in its own directory\n");
+   fprintf(stderr, "-c, --connect=SOCKET\t\tHave the daemon listening on SOCKET do the work, and print what it prints\n");
+   fprintf(stderr, "-C, --compact\t\t\tPack the code in each .o file instead of keeping the original section offsets\n");
+   fprintf(stderr, "-d, --daemon=SOCKET\t\tAnswer --connect requests on SOCKET, keeping the analysed inputs in memory between them\n");
+   fprintf(stderr, "-D, --shared-data\t\tWrite the data sections once, to %s, instead of to every .o file\n", SHARED_DATA_FILENAME);
    fprintf(stderr, "-e, --entry-name\tSet the name of the entry point function\n");
+   fprintf(stderr, "-F, --function-sections\tWrite a single %s, with a separate section for each function\n", DEFAULT_OUTPUT_FILENAME);
+   fprintf(stderr, "-g, --gc\t\t\tRemove functions and data that can't be reached from the entry point\n");
+   fprintf(stderr, "-i, --icf\t\t\tWrite identical functions only once, with the others as aliases\n");
+   fprintf(stderr, "-j, --jobs\t\t\tNumber of worker threads (or processes, with --batch) to use (default: one per CPU)\n");
+   fprintf(stderr, "-k, --keep\t\t\tDon't remove this symbol with --gc (may be used more than once)\n");
+   fprintf(stderr, "-l, --log\t\t\tSet the log levels, e.g. 'debug' or 'reloc=trace,elf=debug'. Use -l ? to see the options\n");
+   fprintf(stderr, "-o, --output-dir\t\tWrite the output files to this directory (with --batch, to a directory for each input in it)\n");
    fprintf(stderr, "-R, --reconstruct-symbols\tRebuild the symbol table by various techniques. Use -R ? to see the options\n");
+   fprintf(stderr, "-s, --stats[=FILE]\t\tPrint the time, work done and memory used by each phase, or write it to FILE as JSON ('-' is stdout)\n");
    fprintf(stderr, "-S, --symbol-per-file\t\tCreate a separate .o file for each function\n");
+   fprintf(stderr, "-t, --trace=FILE\t\tRecord the phases, sections and output files as Chrome trace events (for Perfetto)\n");
    fprintf(stderr, "-O, --output-target\t\tSpecify the output file format (see supported backend targets below)\n");
+   fprintf(stderr, "-P, --prologues\t\t\tLoad additional function prologue patterns from a file\n");
    fprintf(stderr, "-v, --verbose\t\t\tPrint lots of information - useful for debugging\n");
    fprintf(stderr, "\nSupported backend targets:\n");
 	const char* t = backend_get_first_target();
@@ -103,6 +141,7 @@ usage(void)
 		t = backend_get_next_target();
 	}
 }
+#endif // DELINKER_LIBRARY
 
 static int extraneous_cmp(void* a, const void* b)
 {
@@ -124,7 +163,7 @@ static int check_function_sequence(backend_object* obj)
 			//printf("func: %s\t\t0x%lx -> 0x%lx (flags=0x%x)\n", sym->name, sym->val, sym->val+sym->size, sym->flags);
 			if (sym->val < curr)
 			{
-				printf("Overlap detected @ 0x%lx (curr: 0x%lx)!\n", sym->val, curr);
+				LOG_WARN(LOG_OUTPUT, "Overlap detected @ 0x%lx (curr: 0x%lx)!\n", sym->val, curr);
 				return -1;
 			}
 			curr = sym->val + sym->size;
@@ -145,12 +184,13 @@ static int reconstruct_symbols_x86_16(csh cs_dis, cs_insn *cs_ins, backend_objec
 	int eof = 0;
 	int padding = 1;
 
-	DEBUG_PRINT("Reconstructing x86_16 symbols\n");
+	LOG_DEBUG(LOG_RECONSTRUCT, "Reconstructing x86_16 symbols\n");
 	pc = sec_text->data;
 	length = sec_text->size;
 	pc_addr = sec_text->address;
 	while(cs_disasm_iter(cs_dis, &pc, &length, &pc_addr, cs_ins))
 	{
+		stats_count(STATS_INSTRUCTIONS, 1);
 		backend_symbol *s;
 		// did we hit the official end of the function?
 		if (cs_ins->id == X86_INS_RET || cs_ins->id == X86_INS_IRET ||
@@ -211,12 +251,13 @@ static int reconstruct_symbols_x86_64(csh cs_dis, cs_insn *cs_ins, backend_objec
 	unsigned long prev_addr = 0;
 	char name[24];
 
-	DEBUG_PRINT("Reconstructing x86_64 symbols\n");
+	LOG_DEBUG(LOG_RECONSTRUCT, "Reconstructing x86_64 symbols\n");
 	pc = sec_text->data;
 	length = sec_text->size;
 	pc_addr = sec_text->address;
 	while(cs_disasm_iter(cs_dis, &pc, &length, &pc_addr, cs_ins))
 	{
+		stats_count(STATS_INSTRUCTIONS, 1);
 		// In x86_64, any ENDBR64 instruction by definition is the target of a branch, and should have a symbol associated with it
 		if (cs_ins->id == X86_INS_ENDBR64)
 		{
@@ -227,7 +268,7 @@ static int reconstruct_symbols_x86_64(csh cs_dis, cs_insn *cs_ins, backend_objec
 				backend_set_source_file(s, src_name);
 			}
 
-			DEBUG_PRINT("Starting symbol @ 0x%lx\n", cs_ins->address);
+			LOG_TRACE(LOG_RECONSTRUCT, "Starting symbol @ 0x%lx\n", cs_ins->address);
 			prev_addr = cs_ins->address;
 		}
 	}
@@ -242,7 +283,7 @@ static int reconstruct_symbols_x86_64(csh cs_dis, cs_insn *cs_ins, backend_objec
 	return 0;
 }
 
-static int reconstruct_symbols(backend_object* obj, int padding)
+static int reconstruct_symbols(struct delinker_ctx *ctx, backend_object* obj, int padding)
 {
 	csh cs_dis;
 	cs_mode cs_mode;
@@ -253,7 +294,7 @@ static int reconstruct_symbols(backend_object* obj, int padding)
 	unsigned long prev_addr;
 	const char fake_src_name[] = "source.c";
 
-	printf("reconstructing symbols from text section\n");
+	LOG_INFO(LOG_RECONSTRUCT, "reconstructing symbols from text section\n");
    /* find the text section */
    backend_section* sec_text = backend_get_section_by_name(obj, ".text");
    if (!sec_text)
@@ -272,7 +313,7 @@ static int reconstruct_symbols(backend_object* obj, int padding)
 	}
 
 	unsigned int start_count = backend_symbol_count(obj);
-	DEBUG_PRINT("Starting with %u symbols\n", start_count);
+	LOG_DEBUG(LOG_RECONSTRUCT, "Starting with %u symbols\n", start_count);
 
 	// decode (disassemble) the executable section, and assume that any instruction following a 'ret'
    // is the beginning of a new function. Create a symbol entry at that address, and add it to the list.
@@ -316,17 +357,40 @@ static int reconstruct_symbols(backend_object* obj, int padding)
 	cs_ins = cs_malloc(cs_dis);
 	if(!cs_ins)
 	{
-		printf("out of memory");
+		LOG_ERROR(LOG_RECONSTRUCT, "out of memory");
 		return -1;
 	}
 
-	if (t == OBJECT_TYPE_ELF64 && arch == CS_ARCH_X86)
+	// the exception tables are not always there - if not, fall back to the linear sweep
+	if (ctx->config.reconstructor == RECONSTRUCTOR_EHFRAME &&
+		ehframe_reconstruct_symbols(obj, sec_text, cs_dis, cs_ins, fake_src_name) == 0)
+	{
+		LOG_INFO(LOG_RECONSTRUCT, "Function boundaries taken from .eh_frame\n");
+	}
+	// the x64 exception directory is exact, so it is preferred over the linear sweep whenever it is there
+	else if ((ctx->config.reconstructor == RECONSTRUCTOR_PDATA || ctx->config.reconstructor == RECONSTRUCTOR_INTERNAL) &&
+		pdata_reconstruct_symbols(obj, sec_text, cs_dis, cs_ins, fake_src_name) == 0)
+	{
+		LOG_INFO(LOG_RECONSTRUCT, "Function boundaries taken from .pdata\n");
+	}
+	else if (ctx->config.reconstructor == RECONSTRUCTOR_NUCLEUS)
+		nucleus_reconstruct_symbols(obj, fake_src_name);
+	else if (ctx->config.reconstructor == RECONSTRUCTOR_DESCENT)
+		descent_reconstruct_symbols(ctx, obj, sec_text, cs_mode, fake_src_name);
+	// In 32-bit code, looking for prologues is much more accurate than splitting after every 'jmp'
+	else if ((ctx->config.reconstructor == RECONSTRUCTOR_PROLOGUE || cs_mode == CS_MODE_32) &&
+		prologue_reconstruct_symbols(ctx, obj, cs_mode == CS_MODE_16 ? 16 : (cs_mode == CS_MODE_32 ? 32 : 64), fake_src_name) > 0)
+	{
+		LOG_INFO(LOG_RECONSTRUCT, "Function boundaries taken from prologues\n");
+	}
+	else if (t == OBJECT_TYPE_ELF64 && arch == CS_ARCH_X86)
 		reconstruct_symbols_x86_64(cs_dis, cs_ins, obj, sec_text, fake_src_name);
 	else if (t == OBJECT_TYPE_MZ && arch == CS_ARCH_X86)
 		reconstruct_symbols_x86_16(cs_dis, cs_ins, obj, sec_text, fake_src_name);
 	else
 	while(cs_disasm_iter(cs_dis, &pc, &n, &pc_addr, cs_ins))
 	{
+		stats_count(STATS_INSTRUCTIONS, 1);
 		backend_symbol *s;
 		// did we hit the official end of the function?
 		if (cs_ins->id == X86_INS_IRET || cs_ins->id == X86_INS_JMP)
@@ -384,23 +448,23 @@ static int reconstruct_symbols(backend_object* obj, int padding)
 	{
 		if (bs->val == entry)
 		{
-			DEBUG_PRINT("found entry point %s @ 0x%lx - renaming to '%s'\n", bs->name, bs->val, config.entry_name);
-			free(bs->name);
-			bs->name = strdup(config.entry_name);
+			LOG_DEBUG(LOG_RECONSTRUCT, "found entry point %s @ 0x%lx - renaming to '%s'\n", bs->name, bs->val, ctx->config.entry_name);
+			mem_free(MEM_TABLES, bs->name);
+			bs->name = mem_strdup(MEM_TABLES, ctx->config.entry_name);
 		}
 		else
 		{
-			printf("Entry point is in the middle of a symbol - splitting\n");
-			backend_split_symbol(obj, bs, config.entry_name, entry, SYMBOL_TYPE_FUNCTION, SYMBOL_FLAG_GLOBAL);
+			LOG_WARN(LOG_RECONSTRUCT, "Entry point is in the middle of a symbol - splitting\n");
+			backend_split_symbol(obj, bs, ctx->config.entry_name, entry, SYMBOL_TYPE_FUNCTION, SYMBOL_FLAG_GLOBAL);
 		}
 	}
 	else
 	{
-		printf("No symbol for entry point @ 0x%lx - the recovery is not very accurate\n", backend_get_entry_point(obj));
-      //backend_add_symbol(obj, config.entry_name, entry, SYMBOL_TYPE_FUNCTION, size, flags, section);
+		LOG_WARN(LOG_RECONSTRUCT, "No symbol for entry point @ 0x%lx - the recovery is not very accurate\n", backend_get_entry_point(obj));
+      //backend_add_symbol(obj, ctx->config.entry_name, entry, SYMBOL_TYPE_FUNCTION, size, flags, section);
 	}
 
-	printf("%u symbols after reconstruction\n", backend_symbol_count(obj) - start_count);
+	LOG_INFO(LOG_RECONSTRUCT, "%u symbols after reconstruction\n", backend_symbol_count(obj) - start_count);
 	cs_free(cs_ins, 1);
 	cs_close(&cs_dis);
 
@@ -417,16 +481,16 @@ static backend_symbol* get_data_section_symbol(backend_object* obj, unsigned lon
 	{
 		if (val >= sec->address && val < sec->address + sec->size)
 		{
-			printf("Address 0x%lx is in section %s\n", val, sec->name);
+			LOG_TRACE(LOG_RELOC, "Address 0x%lx is in section %s\n", val, sec->name);
 
 			// should rely on flags, not section name
 			if (sec->flags & SECTION_FLAG_INIT_DATA)
-				printf("Section %s has init data\n", sec->name);
+				LOG_TRACE(LOG_RELOC, "Section %s has init data\n", sec->name);
 			else if (sec->flags & SECTION_FLAG_UNINIT_DATA)
-				printf("Section %s has uninit data\n", sec->name);
+				LOG_TRACE(LOG_RELOC, "Section %s has uninit data\n", sec->name);
 			else
 			{
-				printf("Section %s is not a data section\n", sec->name);
+				LOG_TRACE(LOG_RELOC, "Section %s is not a data section\n", sec->name);
 				break;
 			}
 			
@@ -435,12 +499,12 @@ static backend_symbol* get_data_section_symbol(backend_object* obj, unsigned lon
 			backend_symbol *sym = backend_find_symbol_by_name(obj, sec->name);
 			if (!sym)
 			{
-				printf("Creating section symbol %s\n", sec->name);
+				LOG_DEBUG(LOG_RELOC, "Creating section symbol %s\n", sec->name);
 				sym = backend_add_symbol(obj, sec->name, 0, SYMBOL_TYPE_SECTION, 0, 0, NULL);
 			}
 			if (!sym)
 			{
-				printf("Error adding sec symbol %s\n", sec->name);
+				LOG_ERROR(LOG_RELOC, "Error adding sec symbol %s\n", sec->name);
 				return NULL;
 			}
 
@@ -459,26 +523,26 @@ int create_reloc(backend_object *obj, backend_reloc_type rt, unsigned int val, i
 	static int data_symbols;
 	int addend = 0;
 
-	DEBUG_PRINT("[0x%x]: looking up symbol[%u] @ 0x%x - ", offset, hint, val);
+	LOG_TRACE(LOG_RELOC, "[0x%x]: looking up symbol[%u] @ 0x%x - ", offset, hint, val);
 
 	// First, find the section that this symbol belongs in
 	sec = backend_find_section_by_val(obj, val);
 	if (!sec)
 	{
-		printf("  Address 0x%x doesn't have a containing section\n", val);
+		LOG_TRACE(LOG_RELOC, "  Address 0x%x doesn't have a containing section\n", val);
 		return -2;
 	}
 
 	// Warning, not error. MZ files are basically linked at 0x0000
 	if (sec->address == 0)
 	{
-		printf("Warning:  section %s has a zero address\n", sec->name);
+		LOG_DEBUG(LOG_RELOC, "Warning:  section %s has a zero address\n", sec->name);
 		//return -3;
 	}
 
 	if (!(sec->flags & SECTION_FLAG_INIT_DATA | SECTION_FLAG_UNINIT_DATA | SECTION_FLAG_EXECUTE))
 	{
-		printf("  section %s is not a program section\n", sec->name);
+		LOG_TRACE(LOG_RELOC, "  section %s is not a program section\n", sec->name);
 		return -4;
 	}
 
@@ -494,7 +558,7 @@ int create_reloc(backend_object *obj, backend_reloc_type rt, unsigned int val, i
 	{
 		if (bs->type != SYMBOL_TYPE_FUNCTION && bs->type != SYMBOL_TYPE_OBJECT)
 		{
-			printf("  symbol %s is not a function or data object\n", bs->name);
+			LOG_TRACE(LOG_RELOC, "  symbol %s is not a function or data object\n", bs->name);
 			return -5;
 		}
 
@@ -510,7 +574,7 @@ int create_reloc(backend_object *obj, backend_reloc_type rt, unsigned int val, i
 			//DEBUG_PRINT("  Found function symbol %s\n", bs->name);
 			if (bs->val != val)
 			{
-				DEBUG_PRINT("  Function symbol %s not precise\n", bs->name);
+				LOG_TRACE(LOG_RELOC, "  Function symbol %s not precise\n", bs->name);
 
 				if (hint == RELOC_HINT_CALL)
 				{
@@ -523,17 +587,17 @@ int create_reloc(backend_object *obj, backend_reloc_type rt, unsigned int val, i
 					sprintf(name, "fn%06X", val);
 					bs = backend_split_symbol(obj, bs, name, val, SYMBOL_TYPE_FUNCTION, SYMBOL_FLAG_GLOBAL);
 					if (!bs)
-						printf("   Error splitting symbol\n");
+						LOG_ERROR(LOG_RELOC, "   Error splitting symbol\n");
 					addend = -4;
 				}
 				else if (hint == RELOC_HINT_JUMP)
 				{
-					DEBUG_PRINT("  Jump to 0x%x\n", val);
+					LOG_TRACE(LOG_RELOC, "  Jump to 0x%x\n", val);
 					addend = (val - bs->val) - 4;
 				}
 				else if (sec->flags & SECTION_FLAG_INIT_DATA | SECTION_FLAG_UNINIT_DATA)
 				{
-					DEBUG_PRINT("Relocation to data section - assuming data symbol\n");
+					LOG_TRACE(LOG_RELOC, "Relocation to data section - assuming data symbol\n");
 					bs = NULL;
 				}
 			}
@@ -548,17 +612,17 @@ int create_reloc(backend_object *obj, backend_reloc_type rt, unsigned int val, i
 
 	if (!bs)
 	{
-		DEBUG_PRINT("  No known symbol for 0x%x but it is in section %s %u\n", val, sec->name, sec->type);
+		LOG_TRACE(LOG_RELOC, "  No known symbol for 0x%x but it is in section %s %u\n", val, sec->name, sec->type);
 
 		// symbol must be in a program section (GOT, PLT, data, code or BSS)
 		if (sec->type == SECTION_TYPE_NOBITS)
 		{
 			if (strcmp(sec->name, ".bss") != 0)
-				printf("Warning: NOBITS section has name other than .bss - this is unusual\n");
+				LOG_DEBUG(LOG_RELOC, "Warning: NOBITS section has name other than .bss - this is unusual\n");
 		}
 		else if (sec->type != SECTION_TYPE_PROG)
 		{
-			printf("Symbol is not in a program section - no good\n");
+			LOG_TRACE(LOG_RELOC, "Symbol is not in a program section - no good\n");
 			return -6;
 		}
 
@@ -569,20 +633,20 @@ int create_reloc(backend_object *obj, backend_reloc_type rt, unsigned int val, i
 			bs = backend_find_import_by_address(obj, val);
 			if (bs)
 			{
-				printf("  Found import symbol %s (flags=%u)\n", bs->name, bs->flags);
+				LOG_TRACE(LOG_RELOC, "  Found import symbol %s (flags=%u)\n", bs->name, bs->flags);
 				bs = backend_find_symbol_by_name(obj, bs->name);
 				if (!bs)
 				{
 					return -11;
 				}
 
-				printf("   Creating (PLT) relocation to %s @ 0x%x\n", bs->name, offset);
+				LOG_TRACE(LOG_RELOC, "   Creating (PLT) relocation to %s @ 0x%x\n", bs->name, offset);
 				rt = RELOC_TYPE_PLT;
 				addend = -4;
 			}
 			else if (strcmp(sec->name, ".plt.got") == 0)
 			{
-				printf("Not sure what to do with .plt.got symbols. They are dynamic but don't have an import??\n");
+				LOG_DEBUG(LOG_RELOC, "Not sure what to do with .plt.got symbols. They are dynamic but don't have an import??\n");
 				return -7;
 			}
 /*
@@ -604,22 +668,22 @@ int create_reloc(backend_object *obj, backend_reloc_type rt, unsigned int val, i
 				if (rt == RELOC_TYPE_PC_RELATIVE)
 				{
 					addend = val - sec->address;
-					printf("  Creating PC_REL to %s +0x%x\n", bs->name, addend);
+					LOG_TRACE(LOG_RELOC, "  Creating PC_REL to %s +0x%x\n", bs->name, addend);
 				}
 				else if (rt == RELOC_TYPE_OFFSET)
 				{
 					addend = val - sec->address;
-					printf("  Creating REL_OFFSET to %s+%i @offset 0x%x\n", bs->name, addend, offset);
+					LOG_TRACE(LOG_RELOC, "  Creating REL_OFFSET to %s+%i @offset 0x%x\n", bs->name, addend, offset);
 				}
 				else
 				{
-					printf("Unknown relocation type: %i\n", rt);
+					LOG_ERROR(LOG_RELOC, "Unknown relocation type: %i\n", rt);
 					return -1;
 				}
 			}
 			else
 			{
-				printf("Missing section symbol for %s\n", sec->name);
+				LOG_ERROR(LOG_RELOC, "Missing section symbol for %s\n", sec->name);
 				return -1;
 			}
 		}
@@ -627,7 +691,7 @@ int create_reloc(backend_object *obj, backend_reloc_type rt, unsigned int val, i
 		{
 			// This might be a debug instruction, or just a 'mov' instruction that
 			// shouldn't have a relocation at all.
-			printf("Ignoring instruction - no reloc\n");
+			LOG_TRACE(LOG_RELOC, "Ignoring instruction - no reloc\n");
 			return -1;
 		}
 	}
@@ -653,8 +717,7 @@ static int build_relocations(backend_object* obj)
 	cs_x86_op *cs_op;
 	reloc_fn *rfn;
 
-   if (config.verbose)
-	   fprintf(stderr, "Building relocations\n");
+   LOG_INFO(LOG_RELOC, "Building relocations\n");
 
 	// make sure we are using the right decoder
 	backend_type t = backend_get_type(obj);
@@ -686,12 +749,12 @@ static int build_relocations(backend_object* obj)
 		if (!(curr_sec->flags & SECTION_FLAG_EXECUTE) ||
 			curr_sec->entry_size > 0)
 		{
-			DEBUG_PRINT("Skipping section %s flags 0x%x entry size=%u\n", curr_sec->name, curr_sec->flags, curr_sec->entry_size);
+			LOG_DEBUG(LOG_RELOC, "Skipping section %s flags 0x%x entry size=%u\n", curr_sec->name, curr_sec->flags, curr_sec->entry_size);
 			curr_sec = backend_get_next_section(obj);
 			continue;
 		}
 
-		printf("Building relocations for section %s\n", curr_sec->name);
+		LOG_INFO(LOG_RELOC, "Building relocations for section %s\n", curr_sec->name);
 
 		// The architecture selection is inside the while loop because it
 		// should read the arch type from the section rather than the object.
@@ -733,7 +796,9 @@ static int build_relocations(backend_object* obj)
 		if(!cs_ins)
 			return -ERR_NO_MEMORY;
 
+		trace_begin("relocations", curr_sec->name);
 		rfn(obj, curr_sec, cs_dis, cs_ins);
+		trace_end();
 
 		cs_free(cs_ins, 1);
 		cs_close(&cs_dis);
@@ -742,65 +807,313 @@ static int build_relocations(backend_object* obj)
 		curr_sec = backend_get_next_section(obj);
 	}
 
-  	if (config.verbose)
-		fprintf(stderr, "Done building relocations\n");
+  	LOG_INFO(LOG_RELOC, "Done building relocations\n");
 
 	return 0;
 }
 
-/* check to see if we need this relocation in the output file 
-   It depends on if it is covered by a symbol in the src file
-	that also exists in the dest file */
-static inline int need_reloc(backend_reloc *r, backend_object *src, backend_object *dest)
+// The relocations of the input file, grouped by the function or data object that contains them.
+// It is built once, so each output object only has to look at the relocations of its own symbols.
+typedef struct reloc_owner
+{
+	const backend_symbol *owner;	// the symbol in the input file that contains the relocation
+	backend_reloc *reloc;
+	unsigned int order;				// position in the relocation table, to keep the original order
+} reloc_owner;
+
+typedef struct reloc_index
+{
+	reloc_owner *relocs;		// sorted by owner, then by order
+	unsigned int count;
+} reloc_index;
+
+// An output symbol, keyed by the input symbol it was copied from (see backend_symbol._src)
+typedef struct symbol_pair
+{
+	const backend_symbol *src;
+	backend_symbol *dest;
+} symbol_pair;
+
+// The symbols of an output object that weren't copied from the input (section symbols and
+// externals), by name. Copied symbols are only ever found through their source symbol, since
+// two source files may well have a static function of the same name.
+typedef struct symbol_names
+{
+	backend_symbol **table;		// open addressing, NULL is empty
+	unsigned int count;
+	unsigned int capacity;		// always a power of 2
+} symbol_names;
+
+static int symbol_addr_cmp(const void *a, const void *b)
+{
+	const backend_symbol *sa = *(const backend_symbol**)a;
+	const backend_symbol *sb = *(const backend_symbol**)b;
+	if (sa->val != sb->val)
+		return (sa->val > sb->val) - (sa->val < sb->val);
+	return (sa->size < sb->size) - (sa->size > sb->size);
+}
+
+static int reloc_owner_cmp(const void *a, const void *b)
+{
+	const reloc_owner *ra = (const reloc_owner*)a;
+	const reloc_owner *rb = (const reloc_owner*)b;
+	if (ra->owner != rb->owner)
+		return (ra->owner > rb->owner) - (ra->owner < rb->owner);
+	return (ra->order > rb->order) - (ra->order < rb->order);
+}
+
+static int reloc_order_cmp(const void *a, const void *b)
 {
-	backend_symbol* besym;
-	backend_symbol* sym;
-	unsigned long address = r->offset;
+	const reloc_owner *ra = *(const reloc_owner**)a;
+	const reloc_owner *rb = *(const reloc_owner**)b;
+	return (ra->order > rb->order) - (ra->order < rb->order);
+}
+
+static int symbol_pair_cmp(const void *a, const void *b)
+{
+	const symbol_pair *pa = (const symbol_pair*)a;
+	const symbol_pair *pb = (const symbol_pair*)b;
+	return (pa->src > pb->src) - (pa->src < pb->src);
+}
 
-	switch (r->type)
+// the function or data object that contains 'addr', from a list sorted by address
+static const backend_symbol* find_owner(backend_symbol **syms, unsigned int count, unsigned long addr)
+{
+	unsigned int lo = 0, hi = count;
+	while (lo < hi)
 	{
-	case RELOC_TYPE_OFFSET:
-		address = r->addend;
-		break;
+		unsigned int mid = lo + (hi - lo) / 2;
+		if (syms[mid]->val <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == 0)
+		return NULL;
 
-	case RELOC_TYPE_PC_RELATIVE:
-		address == r->offset;
-		break;
+	const backend_symbol *sym = syms[lo - 1];
+	if (addr < sym->val + sym->size || addr == sym->val)
+		return sym;
+	return NULL;
+}
 
-	case RELOC_TYPE_PLT:
-		address == r->offset;
-		break;
+// Find the symbol that contains each relocation. A relocation is only needed in an output file
+// if the symbol that contains it (not the one it points at) was copied to that file.
+static int build_reloc_index(backend_object *src, reloc_index *idx)
+{
+	backend_symbol **syms;
+	backend_symbol *sym;
+	unsigned int count = 0;
+	unsigned int order = 0;
 
-	default:
-		printf("Unhandled relocation type\n");
-		return -1; // I guess we don't need it
+	idx->count = 0;
+	idx->relocs = (reloc_owner*)malloc(backend_relocation_count(src) * sizeof(reloc_owner) + 1);
+	syms = (backend_symbol**)malloc(backend_symbol_count(src) * sizeof(backend_symbol*) + 1);
+	if (!idx->relocs || !syms)
+	{
+		free(idx->relocs);
+		idx->relocs = NULL;
+		free(syms);
+		return -ERR_NO_MEMORY;
 	}
 
-	//printf(">>Reloc addend: 0x%lx offset: 0x%lx\n", r->addend, r->offset);
-	//printf("Looking for a symbol that covers address 0x%lx\n", address);
-	besym = backend_find_symbol_by_val(src, r->offset);
-	if (besym)
+	for (sym = backend_get_first_symbol(src); sym; sym = backend_get_next_symbol(src))
 	{
-		//printf("  Address 0x%lx is covered by symbol %s: 0x%lx to 0x%lx\n", address,
-		//	besym->name, besym->val, besym->val + besym->size);
+		if ((sym->type == SYMBOL_TYPE_FUNCTION || sym->type == SYMBOL_TYPE_OBJECT) && sym->section)
+			syms[count++] = sym;
+	}
+	qsort(syms, count, sizeof(backend_symbol*), symbol_addr_cmp);
 
-		sym = backend_find_symbol_by_name(dest, besym->name);
-		if (!sym)
+	for (backend_reloc* r = backend_get_first_reloc(src); r; r = backend_get_next_reloc(src), order++)
+	{
+		if (r->type != RELOC_TYPE_OFFSET && r->type != RELOC_TYPE_PC_RELATIVE && r->type != RELOC_TYPE_PLT)
 		{
-			//printf("  Symbol '%s' doesn't exist in output file - skipping reloc\n", besym->name);
-			return -1;
+			LOG_ERROR(LOG_OUTPUT, "Unhandled relocation type\n");
+			continue;
+		}
+
+		const backend_symbol *owner = find_owner(syms, count, r->offset);
+		if (!owner)
+		{
+			LOG_DEBUG(LOG_OUTPUT, "can't find src symbol to match value 0x%lx\n", r->offset);
+			continue;
 		}
+
+		idx->relocs[idx->count].owner = owner;
+		idx->relocs[idx->count].reloc = r;
+		idx->relocs[idx->count].order = order;
+		idx->count++;
 	}
-	else
+	qsort(idx->relocs, idx->count, sizeof(reloc_owner), reloc_owner_cmp);
+
+	free(syms);
+	return 0;
+}
+
+static unsigned int hash_name(const char *name)
+{
+	unsigned int h = 2166136261U;
+	while (*name)
+		h = (h ^ (unsigned char)*name++) * 16777619U;
+	return h;
+}
+
+// The first symbol with a name is the one that is found, as backend_find_symbol_by_name would
+static int symbol_names_add(symbol_names *names, backend_symbol *sym)
+{
+	unsigned int mask;
+	unsigned int i;
+
+	if (!sym->name)
+		return 0;
+
+	if (names->count * 2 >= names->capacity)
 	{
-		//printf("Strange - this relocation doesn't seem to be covered by any symbol in the src file\n");
-		return -1;
+		unsigned int capacity = names->capacity ? names->capacity * 2 : 64;
+		backend_symbol **table = (backend_symbol**)calloc(capacity, sizeof(backend_symbol*));
+		if (!table)
+			return -ERR_NO_MEMORY;
+		for (i=0; i < names->capacity; i++)
+		{
+			if (!names->table[i])
+				continue;
+			unsigned int j = hash_name(names->table[i]->name) & (capacity - 1);
+			while (table[j])
+				j = (j + 1) & (capacity - 1);
+			table[j] = names->table[i];
+		}
+		free(names->table);
+		names->table = table;
+		names->capacity = capacity;
 	}
 
-	//printf("Using reloc addend: 0x%lx offset: 0x%lx\n", r->addend, r->offset);
+	mask = names->capacity - 1;
+	for (i = hash_name(sym->name) & mask; names->table[i]; i = (i + 1) & mask)
+	{
+		if (strcmp(names->table[i]->name, sym->name) == 0)
+			return 0;
+	}
+	names->table[i] = sym;
+	names->count++;
 	return 0;
 }
 
+static backend_symbol* symbol_names_find(const symbol_names *names, const char *name)
+{
+	unsigned int mask;
+
+	if (!names->capacity)
+		return NULL;
+
+	mask = names->capacity - 1;
+	for (unsigned int i = hash_name(name) & mask; names->table[i]; i = (i + 1) & mask)
+	{
+		if (strcmp(names->table[i]->name, name) == 0)
+			return names->table[i];
+	}
+	return NULL;
+}
+
+// add a symbol to an output object, where the other relocations can find it by name
+static backend_symbol* add_named_symbol(symbol_names *names, backend_object *dest, const char *name,
+	unsigned long val, backend_symbol_type type, unsigned long size, unsigned int flags, backend_section *sec)
+{
+	backend_symbol *sym = backend_add_symbol(dest, name, val, type, size, flags, sec);
+	if (sym)
+		symbol_names_add(names, sym);
+	return sym;
+}
+
+// Functions that were folded (see icf.c) are written as extra names for the one that was kept
+static void write_aliases(backend_object *oo, const backend_symbol *sym, unsigned long val, backend_section *sec)
+{
+	if (!sym->aliases)
+		return;
+
+	for (const list_node* iter=ll_iter_start(sym->aliases); iter != NULL; iter=iter->next)
+	{
+		backend_symbol *alias = (backend_symbol*)iter->val;
+		backend_symbol *out = backend_add_symbol(oo, alias->name, val, alias->type, alias->size, alias->flags, sec);
+		if (!out)
+			LOG_ERROR(LOG_OUTPUT, "Error adding alias %s for %s\n", alias->name, sym->name);
+		else
+			out->_src = alias;
+	}
+}
+
+static inline int is_data_section(const backend_section *sec)
+{
+	return (sec && (sec->flags & (SECTION_FLAG_INIT_DATA | SECTION_FLAG_UNINIT_DATA)));
+}
+
+// In shared data mode, each data section gets a global symbol at its start in the data object,
+// so references to the section can be resolved from other objects.
+static void make_section_anchor_name(const char *sec_name, char *anchor)
+{
+	snprintf(anchor, MAX_ANCHOR_NAME_LENGTH+1, "%s%s", SHARED_DATA_ANCHOR_PREFIX, sec_name);
+}
+
+// Get the (external) symbol that a relocation to data must use in shared data mode. Only global
+// data objects are referenced by name - local ones keep their names to themselves (two source files
+// may well have a 'static int count'), so they are referenced through the section's anchor symbol,
+// like anything else in a data section. The addend of a section symbol is already relative to the
+// start of the section, but the addend of an object must be moved by the object's offset.
+static backend_symbol* get_shared_data_symbol(symbol_names *names, backend_object *dest, backend_symbol *target, long *addend)
+{
+	char anchor[MAX_ANCHOR_NAME_LENGTH+1];
+	const char *name = target->name;
+	backend_symbol *sym;
+
+	if (target->type != SYMBOL_TYPE_OBJECT || !(target->flags & SYMBOL_FLAG_GLOBAL))
+	{
+		if (target->type == SYMBOL_TYPE_OBJECT)
+			*addend += target->val - target->section->address;
+		make_section_anchor_name(target->section->name, anchor);
+		name = anchor;
+	}
+
+	sym = symbol_names_find(names, name);
+	if (!sym)
+	{
+		LOG_DEBUG(LOG_OUTPUT, "Adding external data symbol %s\n", name);
+		sym = add_named_symbol(names, dest, name, 0, SYMBOL_TYPE_NONE, 0,
+			SYMBOL_FLAG_GLOBAL | SYMBOL_FLAG_EXTERNAL, NULL);
+		if (!sym)
+			LOG_ERROR(LOG_OUTPUT, "Error adding external symbol %s to output file %s\n", name, dest->name);
+	}
+	return sym;
+}
+
+// index of the first relocation contained by 'owner'
+static unsigned int first_owned(const reloc_index *idx, const backend_symbol *owner)
+{
+	unsigned int lo = 0, hi = idx->count;
+	while (lo < hi)
+	{
+		unsigned int mid = lo + (hi - lo) / 2;
+		if (idx->relocs[mid].owner < owner)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+// the output copy of an input symbol, if it is in this output object
+static symbol_pair* find_copy(symbol_pair *copies, unsigned int count, const backend_symbol *src)
+{
+	unsigned int lo = 0, hi = count;
+	while (lo < hi)
+	{
+		unsigned int mid = lo + (hi - lo) / 2;
+		if (copies[mid].src < src)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return (lo < count && copies[lo].src == src) ? &copies[lo] : NULL;
+}
+
 // We set up relocations in the source file when it is read in, since that is when we have all of the
 // relevant information available. Once the symbols & code are divided into separate object files, it
 // is much harder to reconcile jumps between various files since the base addresses are all reset to
@@ -808,112 +1121,186 @@ static inline int need_reloc(backend_reloc *r, backend_object *src, backend_obje
 // information that was set up in the input file.
 // Those relocations are relative to the beginning of the section that they belonged to in the original
 // file, so those offsets should be updated if any functions move around in the output file.
-static int copy_relocations(backend_object* src, backend_object* dest)
+static int copy_relocations(struct delinker_ctx *ctx, const reloc_index *idx, backend_object* dest)
 {
 	backend_symbol *dest_target; // symbol in output file that copied relocation points to
 	backend_symbol *target; // symbol that the relocation points to
-	backend_section* sec;
-	int first_function_offset = -1;
+	backend_symbol *sym;
+	long addend;
+	symbol_names names = {0};
+	symbol_pair *copies;
+	const reloc_owner **relocs = NULL;
+	unsigned int copy_count = 0;
+	unsigned int reloc_count = 0;
+	int ret = 0;
  
-	printf("=== Copying relocations for %s\n", dest->name);
-	//printf("Source file has %u relocs\n", backend_relocation_count(src));
+	LOG_DEBUG(LOG_OUTPUT, "=== Copying relocations for %s\n", dest->name);
 
-	// why am I doing this here?
-/*
-	if (check_function_sequence(dest) != 0)
+	// match the symbols of the output object to the ones they were copied from
+	copies = (symbol_pair*)malloc(backend_symbol_count(dest) * sizeof(symbol_pair) + 1);
+	if (!copies)
+		return -ERR_NO_MEMORY;
+	for (sym = backend_get_first_symbol(dest); sym; sym = backend_get_next_symbol(dest))
 	{
-		printf("Non-linearity detected in function sequence\n");
-		return -1;
+		if (sym->_src)
+		{
+			copies[copy_count].src = sym->_src;
+			copies[copy_count].dest = sym;
+			copy_count++;
+		}
+		else if (symbol_names_add(&names, sym) < 0)
+		{
+			ret = -ERR_NO_MEMORY;
+			goto out;
+		}
 	}
-*/
+	qsort(copies, copy_count, sizeof(symbol_pair), symbol_pair_cmp);
+
+	// Only the relocations contained by a symbol in the output file are needed. The first pass
+	// counts them, the second collects them.
+	for (int pass=0; pass < 2; pass++)
+	{
+		for (unsigned int i=0; i < copy_count; i++)
+		{
+			if (i && copies[i].src == copies[i-1].src)
+				continue;
+			for (unsigned int k = first_owned(idx, copies[i].src); k < idx->count && idx->relocs[k].owner == copies[i].src; k++)
+			{
+				if (relocs)
+					relocs[reloc_count] = &idx->relocs[k];
+				reloc_count++;
+			}
+		}
+		if (pass)
+			break;
+		relocs = (const reloc_owner**)malloc(reloc_count * sizeof(reloc_owner*) + 1);
+		if (!relocs)
+		{
+			ret = -ERR_NO_MEMORY;
+			goto out;
+		}
+		reloc_count = 0;
+	}
+	qsort(relocs, reloc_count, sizeof(reloc_owner*), reloc_order_cmp);
 
 	// copy the relocations to the output object, and match the symbols to the output symbol table
-	backend_reloc* r = backend_get_first_reloc(src);
-	while (r)
+	for (unsigned int i=0; i < reloc_count; i++)
 	{
+		backend_reloc *r = relocs[i]->reloc;
+		const backend_symbol *owner = relocs[i]->owner;
+		symbol_pair *copy;
+
 		target = r->symbol;
-		//printf("Checking reloc @offset=%lx to symbol %s (flags=%u)\n", r->offset, target->name, target->flags);
 
-		// If this relocation isn't covered by a symbol in the output file, we don't need it
-		// First, find which symbol the relocation is contained by (not points at) in the source
-		// file. Then see if that symbol made it into this output file.
-		if (need_reloc(r, src, dest) == 0)
+		// All (real) symbols belonging to this file should have already been copied, so if a
+		// symbol is missing, it must be external and must be added.
+		LOG_TRACE(LOG_OUTPUT, "Copying reloc @offset=%lx to symbol %s\n", r->offset, target->name);
+		addend = r->addend;
+		if (ctx->config.shared_data && is_data_section(target->section))
+			dest_target = get_shared_data_symbol(&names, dest, target, &addend);
+		else
+		{
+			copy = find_copy(copies, copy_count, target);
+			dest_target = copy ? copy->dest : symbol_names_find(&names, target->name);
+		}
+		if (!dest_target)
 		{
-			// Check to see if the output object already contains a symbol with this name.
-			// All (real) symbols belonging to this file should have already been copied,
-			// so if a symbol is missing, it must be external and must be added.
-			printf("Copying reloc @offset=%lx to symbol %s\n", r->offset, target->name);
-			dest_target = backend_find_symbol_by_name(dest, target->name);
-			if (!dest_target)
+			if (target->type == SYMBOL_TYPE_FUNCTION)
+			{
+				LOG_DEBUG(LOG_OUTPUT, "Adding external symbol %s\n", target->name);
+				dest_target = add_named_symbol(&names, dest, target->name, 0, SYMBOL_TYPE_NONE, 0,
+					SYMBOL_FLAG_GLOBAL | SYMBOL_FLAG_EXTERNAL, NULL);
+				if (!dest_target)
+				{
+					LOG_ERROR(LOG_OUTPUT, "Error adding external symbol %s to output file %s\n", target->name, dest->name);
+					break;
+				}
+			}
+			else if (target->section)
 			{
 				backend_section *dest_sec = backend_get_section_by_name(dest, target->section->name);
 				if (!dest_sec)
 				{
 					// Add the missing section and section symbol
-					printf("Adding section %s (flags=0x%x)\n", target->section->name, target->section->flags);
+					LOG_DEBUG(LOG_OUTPUT, "Adding section %s (flags=0x%x)\n", target->section->name, target->section->flags);
 					dest_sec = backend_add_section(dest, target->section->name, 0, target->section->address,
 						NULL, 0, target->section->alignment, target->section->flags);
 				}
 
-				if (target->type == SYMBOL_TYPE_FUNCTION)
-				{
-					printf("Adding external symbol %s\n", target->name);
-					dest_target = backend_add_symbol(dest, target->name, 0, SYMBOL_TYPE_NONE, 0,
-						SYMBOL_FLAG_GLOBAL | SYMBOL_FLAG_EXTERNAL, NULL);
-					if (!dest_target)
-					{
-						printf("Error adding external symbol %s to output file %s\n", target->name, dest->name);
-						break;
-					}
-				}
-				else
+				// Generally, section symbols don't have a name. But there doesn't seem to be
+				// any reason why not, and it makes it easier to debug
+				dest_target = add_named_symbol(&names, dest, target->section->name, target->val, SYMBOL_TYPE_SECTION, target->size, 0, dest_sec);
+				if (!dest_target)
 				{
-					// Generally, section symbols don't have a name. But there doesn't seem to be
-					// any reason why not, and it makes it easier to debug
-					dest_target = backend_add_symbol(dest, target->section->name, target->val, SYMBOL_TYPE_SECTION, target->size, 0, dest_sec);
-					if (!dest_target)
-						printf("Error adding section symbol %s\n", dest_target->name);
+					LOG_ERROR(LOG_OUTPUT, "Error adding section symbol %s\n", target->section->name);
+					continue;
 				}
 			}
-
-			backend_symbol *besym = backend_find_symbol_by_val(src, r->offset);
-			if (besym)
-			{
-				// calculate the relocation offset from start of section
-				unsigned int offset = r->offset - besym->section->address;
-
-				//printf("Adding relocation to symbol %s (offset=0x%x type=%i)\n", dest_target->name, offset, dest_target->type);
-				backend_add_relocation(dest, offset, r->type, r->addend, dest_target);
-			}
 			else
 			{
-				printf("can't find src symbol to match value 0x%lx\n", r->offset);
+				LOG_ERROR(LOG_OUTPUT, "Relocation to %s has no section\n", target->name);
+				continue;
 			}
 		}
-		else
-		{
-			//printf("Ignoring reloc @offset=%lx to symbol %s (flags=%u)\n", r->offset, target->name, target->flags);
-		}
 
-		r = backend_get_next_reloc(src);
+		// the symbol may have moved within its section (see write_symbol), or be in a
+		// section of its own (see add_function_section)
+		copy = find_copy(copies, copy_count, owner);
+		if (copy->dest->section)
+			backend_add_section_relocation(dest, copy->dest->section, copy->dest->val + (r->offset - owner->val), r->type, addend, dest_target);
+		else
+			backend_add_section_relocation(dest, NULL, r->offset - owner->section->address, r->type, addend, dest_target);
 	}
 
-	DEBUG_PRINT("Output file has %u relocations\n", backend_relocation_count(dest));
-/*
-#ifdef DEBUG
-	backend_reloc* tr = backend_get_first_reloc(dest);
-	while (tr)
+	LOG_DEBUG(LOG_OUTPUT, "Output file has %u relocations\n", backend_relocation_count(dest));
+
+out:
+	free(relocs);
+	free(copies);
+	free(names.table);
+	return ret;
+}
+
+// The final layout of one output section, worked out before anything is copied so the buffer
+// can be allocated once (see plan_output_object)
+typedef struct section_plan
+{
+	backend_section *src;		// section in the input file
+	unsigned long extent;		// end of the last symbol in the output section
+	unsigned long size;			// final size, including the data appended by copy_data
+} section_plan;
+
+static section_plan* find_section_plan(linked_list *plan, const backend_section *src)
+{
+	if (!plan)
+		return NULL;
+
+	for (const list_node* iter=ll_iter_start(plan); iter != NULL; iter=iter->next)
 	{
-		printf("** Symbol %s (val 0x%lx) Offset: 0x%lx\n", tr->symbol->name, tr->symbol->val, tr->offset);
-		tr = backend_get_next_reloc(dest);
+		section_plan *sp = (section_plan*)iter->val;
+		if (sp->src == src)
+			return sp;
 	}
-#endif // DEBUG
-*/
+	return NULL;
+}
 
-	return 0;
+// In compact mode, code is packed to the start of the output section instead of sitting at its
+// original offset. The original alignment is kept by preserving the offset modulo the section
+// alignment. Data keeps its layout, since data relocations are relative to the section.
+static unsigned long compact_offset(unsigned long used, unsigned long offset, unsigned int alignment)
+{
+	unsigned long out_offset;
+
+	if (alignment <= 1)
+		return used;
+
+	out_offset = used - (used % alignment) + (offset % alignment);
+	if (out_offset < used)
+		out_offset += alignment;
+	return out_offset;
 }
 
-static int copy_data(backend_object* src, backend_object* dest)
+static int copy_data(backend_object* src, backend_object* dest, linked_list *plan)
 {
 	// without serious code analysis I can't know how much data to copy. It's because data symbols
 	// don't have a size. So for now, I will just copy everything we have to every output object. This
@@ -935,10 +1322,17 @@ static int copy_data(backend_object* src, backend_object* dest)
 			}
 
 			unsigned int old_size = outsec->size;
-			outsec->data = (unsigned char*)realloc(outsec->data, old_size + insec->size);
+			section_plan *sp = find_section_plan(plan, insec);
+
+			// the buffer may already be big enough if this object was planned
+			if (!sp || sp->size < old_size + insec->size)
+				outsec->data = (unsigned char*)mem_realloc(MEM_OUTPUT, outsec->data, old_size + insec->size);
 			outsec->size += insec->size;
 			if (!(insec->flags & SECTION_FLAG_UNINIT_DATA))
+			{
 				memcpy(outsec->data + old_size, insec->data, insec->size);
+				stats_count(STATS_BYTES_COPIED, insec->size);
+			}
 		}
 next:
 		insec = backend_get_next_section(src);
@@ -948,7 +1342,9 @@ next:
 }
 
 // copy an object (symbol + data) to a backend object
-static int write_symbol(backend_object *oo, backend_object *obj, struct backend_symbol *sym, backend_type output_target)
+// If out_offset is negative, the position in the output section is worked out here. Otherwise it
+// comes from plan_output_object, which has already created the section at its final size.
+static int write_symbol(struct delinker_ctx *ctx, backend_object *oo, backend_object *obj, struct backend_symbol *sym, backend_type output_target, long out_offset)
 {
 	backend_section *sec_out;
 	unsigned char *data=0;
@@ -964,7 +1360,7 @@ static int write_symbol(backend_object *oo, backend_object *obj, struct backend_
 
 	if (!sym->section)
 	{
-		printf("WARNING: Symbol %s is missing a source section!\n", sym->name);
+		LOG_WARN(LOG_OUTPUT, "WARNING: Symbol %s is missing a source section!\n", sym->name);
 		return -ERR_NO_SECTION;
 	}
 
@@ -983,31 +1379,40 @@ static int write_symbol(backend_object *oo, backend_object *obj, struct backend_
 
 	// make room in the output object
 	sec_out = backend_get_section_by_name(oo, sym->section->name);
+
+	if (out_offset < 0)
+	{
+		out_offset = offset;
+		if (ctx->config.compact && (sym->section->flags & SECTION_FLAG_EXECUTE))
+			out_offset = compact_offset(sec_out ? sec_out->size : 0, offset, alignment);
+	}
+
 	if (!sec_out)
 	{
 		// if the object is not empty, copy it
 		if (sym->size)
 		{
 			// copy the code/data to the output object
-			size = sym->size + offset;
+			size = sym->size + out_offset;
 			//printf("   allocating %i bytes\n", size);
-			data = (unsigned char*)malloc(size);
+			data = (unsigned char*)mem_alloc(MEM_OUTPUT, size);
 			if ((sym->section->flags & SECTION_FLAG_UNINIT_DATA) == 0)
 			{
 				//printf("  copying %lu bytes from offset 0x%lx\n", sym->size, offset);
-				//printf("  dest=%p src=%p size=%lu\n", data+offset, sym->section->data+offset, sym->size);
-				memcpy(data+offset, sym->section->data+offset, sym->size);
+				//printf("  dest=%p src=%p size=%lu\n", data+out_offset, sym->section->data+offset, sym->size);
+				memcpy(data+out_offset, sym->section->data+offset, sym->size);
+				stats_count(STATS_BYTES_COPIED, sym->size);
 			}
 		}
 
-		printf("Adding section %s (flags=0x%x) for symbol %s\n", sym->section->name, sym->section->flags, sym->name);
+		LOG_DEBUG(LOG_OUTPUT, "Adding section %s (flags=0x%x) for symbol %s\n", sym->section->name, sym->section->flags, sym->name);
 		sec_out = backend_add_section(oo, sym->section->name, size, 0, data,
 			0, sym->section->alignment, sym->section->flags);
 
 		// Generally, section symbols don't have a name. But there doesn't seem to be
 		// any reason why not, and it makes it easier to debug
 		if (!backend_add_symbol(oo, sec_out->name, 0, SYMBOL_TYPE_SECTION, 0, 0, sec_out))
-			printf("Error adding section symbol %s\n", sec_out->name);
+			LOG_ERROR(LOG_OUTPUT, "Error adding section symbol %s\n", sec_out->name);
 	}
 	else
 	{
@@ -1015,44 +1420,51 @@ static int write_symbol(backend_object *oo, backend_object *obj, struct backend_
 		if (sym->size)
 		{
 			//printf("Going to write %lu bytes at offset 0x%lx\n", sym->size, offset);
-			if (offset + sym->size > sec_out->size)
+			if (out_offset + sym->size > sec_out->size)
 			{
-				//printf("Buffer is too small (%u need %lu)\n", sec_out->size, offset + sym->size);
+				//printf("Buffer is too small (%u need %lu)\n", sec_out->size, out_offset + sym->size);
 
 				//printf("Output section %s found - extending from %u to %lu\n",
 				//	sec_out->name, sec_out->size, sec_out->size + sym->size);
-				data = (unsigned char*)realloc(sec_out->data, offset + sym->size);
+				data = (unsigned char*)mem_realloc(MEM_OUTPUT, sec_out->data, out_offset + sym->size);
 				if (data)
 				{
+					// don't leave garbage in the alignment padding
+					if (out_offset > sec_out->size)
+						memset(data + sec_out->size, 0, out_offset - sec_out->size);
 					sec_out->data = data;
-					sec_out->size = offset + sym->size;
+					sec_out->size = out_offset + sym->size;
 				}
 				else
 				{
-					printf("Error realloc\n");
+					LOG_ERROR(LOG_OUTPUT, "Error realloc\n");
 				}
 			}
 			if ((sym->section->flags & SECTION_FLAG_UNINIT_DATA) == 0)
 			{
 				//printf("  copying %lu bytes from offset 0x%lx\n", sym->size, offset);
-				//printf("  dest=%p src=%p size=%lu\n", sec_out->data+offset, sym->section->data+offset, sym->size);
-				memcpy(sec_out->data+offset, sym->section->data+offset, sym->size);
+				//printf("  dest=%p src=%p size=%lu\n", sec_out->data+out_offset, sym->section->data+offset, sym->size);
+				memcpy(sec_out->data+out_offset, sym->section->data+offset, sym->size);
+				stats_count(STATS_BYTES_COPIED, sym->size);
 			}
 		}
 	}
 
 	// add the function symbol
-	//DEBUG_PRINT("Adding symbol %s @ 0x%lx (type=%i size=%lu) to %s\n", sym->name, sec_out->address+offset, sym->type, sym->size, oo->name);
-	sym = backend_add_symbol(oo, sym->name, sec_out->address+offset, sym->type, sym->size, sym->flags, sec_out);
-	if (!sym)
-		printf("Error adding symbol\n"); 
+	//DEBUG_PRINT("Adding symbol %s @ 0x%lx (type=%i size=%lu) to %s\n", sym->name, sec_out->address+out_offset, sym->type, sym->size, oo->name);
+	write_aliases(oo, sym, sec_out->address+out_offset, sec_out);
+	backend_symbol *out = backend_add_symbol(oo, sym->name, sec_out->address+out_offset, sym->type, sym->size, sym->flags, sec_out);
+	if (!out)
+		LOG_ERROR(LOG_OUTPUT, "Error adding symbol\n"); 
+	else
+		out->_src = sym;
 
 	return 0;
 }
 
-static int ignore_symbol(backend_symbol *sym)
+static int ignore_symbol(struct delinker_ctx *ctx, backend_symbol *sym)
 {
-   for (const list_node* iter=ll_iter_start(config.ignore_list); iter != NULL; iter=iter->next)
+   for (const list_node* iter=ll_iter_start(ctx->config.ignore_list); iter != NULL; iter=iter->next)
    {
 		char *tmp_name = (char*)iter->val;
 		if (strcmp(sym->name, tmp_name) == 0)
@@ -1061,147 +1473,583 @@ static int ignore_symbol(backend_symbol *sym)
 	return 0;
 }
 
-static int close_output_object(backend_object *oo)
+// An output object in memory, on its way to the sink. The writers seek back and forth (to fill
+// in the headers once the sections have been placed), which open_memstream doesn't allow, so the
+// stream is a cookie stream over a buffer that grows as it is written.
+typedef struct output_buffer
 {
-	int ret = 0;
-	if (config.verbose)
-		fprintf(stderr, "Writing file %s\n", oo->name);
-	if (backend_write(oo))
-		ret = -ERR_CANT_WRITE_OO;
-	backend_destructor(oo);
-	return ret;
-}
+	unsigned char *data;
+	size_t size;			// the furthest that has been written
+	size_t capacity;
+	size_t pos;
+} output_buffer;
 
-static void finalize_objects(linked_list *oo_list, backend_object *src)
+static ssize_t output_buffer_write(void *cookie, const char *buff, size_t len)
 {
-	// iterate through each object from the list
-   for (const list_node* iter=ll_iter_start(oo_list); iter != NULL; iter=iter->next)
-   {
-		backend_object *oo = (backend_object*)iter->val;
-		copy_relocations(src, oo);
+	output_buffer *b = (output_buffer*)cookie;
 
-		// sometimes, data symbols don't have a size. In that case, we must copy all data
-		printf("Copy data\n");
-		copy_data(src, oo);
+	if (b->pos + len > b->capacity)
+	{
+		size_t capacity = b->capacity ? b->capacity : 4096;
+		while (capacity < b->pos + len)
+			capacity *= 2;
+		unsigned char *data = (unsigned char*)mem_realloc(MEM_OUTPUT, b->data, capacity);
+		if (!data)
+			return -1;
+		b->data = data;
+		b->capacity = capacity;
 	}
+
+	// a seek past the end leaves a gap, which reads as zeros like it would in a file
+	if (b->pos > b->size)
+		memset(b->data + b->size, 0, b->pos - b->size);
+	memcpy(b->data + b->pos, buff, len);
+	b->pos += len;
+	if (b->pos > b->size)
+		b->size = b->pos;
+	return len;
 }
 
-static void write_output_objects(linked_list *oo_list)
+static int output_buffer_seek(void *cookie, off64_t *offset, int whence)
 {
-	backend_object *oo;
+	output_buffer *b = (output_buffer*)cookie;
+	off64_t pos = *offset;
+
+	if (whence == SEEK_CUR)
+		pos += b->pos;
+	else if (whence == SEEK_END)
+		pos += b->size;
+	if (pos < 0)
+		return -1;
+	b->pos = pos;
+	*offset = pos;
+	return 0;
+}
 
-	// pop each object from the list, write it to a file
-	for (; oo = (backend_object*)ll_pop(oo_list); oo != NULL)
+// Returns -ERR_SINK_STOPPED when the sink doesn't want any more objects
+static int sink_output_object(struct delinker_ctx *ctx, backend_object *oo)
+{
+	cookie_io_functions_t io = { NULL, output_buffer_write, output_buffer_seek, NULL };
+	output_buffer b = { 0 };
+	int ret;
+	FILE *f;
+
+	f = fopencookie(&b, "w", io);
+	if (!f)
+		return -ERR_CANT_CREATE_OO;
+	ret = backend_write_stream(oo, f);
+	if (fclose(f) != 0 || ret != 0)
+		ret = -ERR_CANT_WRITE_OO;
+	else if (ctx->output_sink(oo->name, b.data, b.size, ctx->output_sink_arg) != 0)
 	{
-		if (close_output_object(oo) != 0)
-			printf("Error writing %s\n", oo->name);
+		LOG_INFO(LOG_OUTPUT, "The output sink stopped at %s\n", oo->name);
+		ret = -ERR_SINK_STOPPED;
 	}
+	mem_free(MEM_OUTPUT, b.data);
+	return ret;
 }
 
-static backend_object* get_output_object(linked_list *oo_list, const char* sym_name, backend_type output_target)
+static int close_output_object(struct delinker_ctx *ctx, backend_object *oo)
 {
-	backend_object *oo;
-   char output_filename[MAX_FILENAME_LENGTH+1];
+	int ret = 0;
+	LOG_INFO(LOG_OUTPUT, "Writing file %s\n", oo->name);
+	stats_phase_begin(STATS_PHASE_WRITE);
+	trace_begin("write", oo->name);
+	if (ctx->output_sink)
+		ret = sink_output_object(ctx, oo);
+	else if (backend_write(oo))
+		ret = -ERR_CANT_WRITE_OO;
+	if (ret == 0)
+		stats_count(STATS_FILES_WRITTEN, 1);
+	else if (ret != -ERR_SINK_STOPPED)
+		LOG_ERROR(LOG_OUTPUT, "Error writing %s\n", oo->name);
+	trace_end();
+	stats_phase_end();
+	backend_destructor(oo);
+	return ret;
+}
 
-	// make the output name
-	memset(output_filename, 0, MAX_FILENAME_LENGTH+1);
-	strncpy(output_filename, sym_name, MAX_FILENAME_LENGTH-2); // leave 2 chars for ".o"
-	char *lastdot = strrchr(output_filename, '.');
-	if (lastdot)
-		*lastdot = 0;
-	strcat(output_filename, ".o");
+// Copy every data section in full to an output object, along with the data symbols. In shared mode,
+// each section also gets a global anchor symbol, through which the other objects refer to anything
+// in the section that isn't a global object (see get_shared_data_symbol).
+static int add_data_sections(struct delinker_ctx *ctx, backend_object* src, backend_object* oo, int shared)
+{
+	char anchor[MAX_ANCHOR_NAME_LENGTH+1];
+	backend_section *insec, *outsec;
+	backend_symbol *sym;
+	unsigned char *data;
 
-	// first, check to see if there is already a backend object with this name
-	for (const list_node* iter = ll_iter_start(oo_list); iter != NULL; iter=iter->next)
+	for (insec = backend_get_first_section(src); insec; insec = backend_get_next_section(src))
 	{
-		oo = (backend_object*)iter->val;
-		if (strcmp(oo->name, output_filename) == 0)
-			break;
+		if (!is_data_section(insec) || !insec->size)
+			continue;
+
+		// the writers expect a buffer even for uninitialized data
+		if (insec->flags & SECTION_FLAG_UNINIT_DATA)
+			data = (unsigned char*)mem_calloc(MEM_OUTPUT, 1, insec->size);
+		else
+			data = (unsigned char*)mem_alloc(MEM_OUTPUT, insec->size);
+		if (!data)
+			return -ERR_NO_MEMORY;
+		if (!(insec->flags & SECTION_FLAG_UNINIT_DATA))
+		{
+			memcpy(data, insec->data, insec->size);
+			stats_count(STATS_BYTES_COPIED, insec->size);
+		}
 
-		oo = NULL;
+		outsec = backend_add_section(oo, insec->name, insec->size, 0, data, 0, insec->alignment, insec->flags);
+		if (!outsec)
+		{
+			mem_free(MEM_OUTPUT, data);
+			return -ERR_NO_MEMORY;
+		}
+		backend_section_set_type(outsec, insec->type);
+		if (!backend_add_symbol(oo, outsec->name, 0, SYMBOL_TYPE_SECTION, 0, 0, outsec))
+			LOG_ERROR(LOG_OUTPUT, "Error adding section symbol %s\n", outsec->name);
+
+		if (!shared)
+			continue;
+		make_section_anchor_name(insec->name, anchor);
+		if (!backend_add_symbol(oo, anchor, 0, SYMBOL_TYPE_OBJECT, insec->size, SYMBOL_FLAG_GLOBAL, outsec))
+			LOG_ERROR(LOG_OUTPUT, "Error adding anchor symbol %s\n", anchor);
 	}
 
-	if (!oo)
+	for (sym = backend_get_first_symbol(src); sym; sym = backend_get_next_symbol(src))
 	{
-		// set up new output file
-		oo = backend_create();
+		if (sym->type != SYMBOL_TYPE_OBJECT || !is_data_section(sym->section) || ignore_symbol(ctx, sym))
+			continue;
 
-		if (oo)
-		{
-			if (config.verbose)
-				fprintf(stderr, "=== Opening file %s\n", output_filename);
-			printf("=== Opening file %s\n", output_filename);
-			backend_set_type(oo, output_target);
-			backend_set_filename(oo, output_filename);
-			ll_push(oo_list, oo);
-		}
+		outsec = backend_get_section_by_name(oo, sym->section->name);
+		if (!outsec)
+			continue;
+		backend_symbol *out = backend_add_symbol(oo, sym->name, sym->val - sym->section->address, SYMBOL_TYPE_OBJECT,
+			sym->size, sym->flags, outsec);
+		if (!out)
+			LOG_ERROR(LOG_OUTPUT, "Error adding data symbol %s\n", sym->name);
+		else
+			out->_src = sym;
 	}
 
-	return oo;
+	return 0;
 }
 
-static int
-unlink_file(const char* input_filename, backend_type output_target)
+// Write every data section (once) to a dedicated object. The other output objects refer to the
+// data through relocations instead of carrying their own copy of it.
+static int write_shared_data_object(struct delinker_ctx *ctx, backend_object* src, backend_type output_target)
 {
-	backend_object* obj; 
-   backend_object* oo = NULL;
-	backend_symbol *sym;
+	backend_object *oo;
+	int ret;
 
-	// print ignore list
-	if (config.ignore_list->count)
-		printf("Ignore list:\n");
-   for (const list_node* iter=ll_iter_start(config.ignore_list); iter != NULL; iter=iter->next)
-   {
-		char *sym = (char*)iter->val;
-		printf(" > %s\n", sym);
+	oo = backend_create();
+	if (!oo)
+		return -ERR_NO_MEMORY;
+	backend_set_type(oo, output_target);
+	backend_set_filename(oo, SHARED_DATA_FILENAME);
+	oo->_data_mem = MEM_OUTPUT;
+
+	ret = add_data_sections(ctx, src, oo, 1);
+	if (ret < 0)
+	{
+		backend_destructor(oo);
+		return ret;
 	}
 
-	// read the input file into a generic backend structure
-   if (config.verbose)
-      fprintf(stderr, "Reading input file %s\n", input_filename);
-   obj = backend_read(input_filename);
-	if (!obj)
-		return -ERR_BAD_FORMAT;
+	return close_output_object(ctx, oo);
+}
 
-	// check for symbols, and rebuild if necessary
-	if (backend_symbol_count(obj) == 0 && backend_import_symbol_count(obj) == 0 && config.reconstruct_symbols == 0)
-		return -ERR_NO_SYMS;
-	else if (config.reconstruct_symbols)
-	{
-		if (config.reconstructor == RECONSTRUCTOR_NUCLEUS)
+// Put a function in a section of its own (.text.<name>), like -ffunction-sections does
+static int add_function_section(backend_object *oo, backend_symbol *sym)
+{
+	backend_section *sec_out;
+	unsigned char *data = NULL;
+	unsigned long offset = sym->val - sym->section->address;
+	unsigned int alignment = sym->section->alignment ? sym->section->alignment : 1;
+	char *name;
+
+	// keep the alignment that the function had in the original section
+	while (alignment > 1 && (offset & (alignment - 1)))
+		alignment >>= 1;
+
+	if (sym->size)
+	{
+		data = (unsigned char*)mem_alloc(MEM_OUTPUT, sym->size);
+		if (!data)
+			return -ERR_NO_MEMORY;
+		if (!(sym->section->flags & SECTION_FLAG_UNINIT_DATA))
 		{
-			if (config.verbose)
-				fprintf(stderr, "Reconstructing symbols with 'nucleus' function detector\n");
-			nucleus_reconstruct_symbols(obj);
+			memcpy(data, sym->section->data + offset, sym->size);
+			stats_count(STATS_BYTES_COPIED, sym->size);
+		}
+	}
+
+	name = (char*)malloc(strlen(sym->name) + 7);
+	if (!name)
+	{
+		mem_free(MEM_OUTPUT, data);
+		return -ERR_NO_MEMORY;
+	}
+	sprintf(name, ".text.%s", sym->name);
+	sec_out = backend_add_section(oo, name, sym->size, 0, data, 0, alignment, sym->section->flags);
+	free(name);
+	if (!sec_out)
+	{
+		mem_free(MEM_OUTPUT, data);
+		return -ERR_NO_MEMORY;
+	}
+	backend_section_set_type(sec_out, SECTION_TYPE_PROG);
+
+	if (!backend_add_symbol(oo, sec_out->name, 0, SYMBOL_TYPE_SECTION, 0, 0, sec_out))
+		LOG_ERROR(LOG_OUTPUT, "Error adding section symbol %s\n", sec_out->name);
+	backend_symbol *out = backend_add_symbol(oo, sym->name, 0, sym->type, sym->size, sym->flags, sec_out);
+	if (!out)
+		LOG_ERROR(LOG_OUTPUT, "Error adding symbol %s\n", sym->name);
+	else
+		out->_src = sym;
+	write_aliases(oo, sym, 0, sec_out);
+
+	return 0;
+}
+
+// Write a single object with a section for each function. The linker can still discard or replace
+// individual functions (--gc-sections, --icf), without the overhead of one file per function.
+static int write_function_sections(struct delinker_ctx *ctx, backend_object* obj, const reloc_index *relocs, backend_type output_target)
+{
+	backend_object *oo;
+	backend_symbol *sym;
+	int ret = 0;
+
+	if (output_target != OBJECT_TYPE_ELF64)
+	{
+		LOG_ERROR(LOG_OUTPUT, "Function sections are only supported for ELF64 output\n");
+		return -ERR_CANT_CREATE_OO;
+	}
+
+	oo = backend_create();
+	if (!oo)
+		return -ERR_NO_MEMORY;
+	backend_set_type(oo, output_target);
+	backend_set_filename(oo, DEFAULT_OUTPUT_FILENAME);
+	oo->_data_mem = MEM_OUTPUT;
+
+	// the data sections are copied whole, so the data relocations stay relative to their sections
+	if (!ctx->config.shared_data)
+		ret = add_data_sections(ctx, obj, oo, 0);
+
+	for (sym = backend_get_first_symbol(obj); sym && ret == 0; sym = backend_get_next_symbol(obj))
+	{
+		if (sym->type != SYMBOL_TYPE_FUNCTION || !sym->section || ignore_symbol(ctx, sym))
+			continue;
+
+		// don't bother outputting any external (empty) functions
+		if (strstr(sym->name, "@@"))
+			continue;
+
+		ret = add_function_section(oo, sym);
+	}
+	if (ret < 0)
+	{
+		backend_destructor(oo);
+		return ret;
+	}
+
+	copy_relocations(ctx, relocs, oo);
+	return close_output_object(ctx, oo);
+}
+
+static void finalize_object(struct delinker_ctx *ctx, backend_object *oo, backend_object *src, const reloc_index *relocs, linked_list *plan)
+{
+	trace_begin("finalize", oo->name);
+	copy_relocations(ctx, relocs, oo);
+
+	// the data is already in its own object (otherwise, since data symbols don't always
+	// have a size, all of the data must be copied)
+	if (!ctx->config.shared_data)
+	{
+		LOG_DEBUG(LOG_OUTPUT, "Copy data\n");
+		copy_data(src, oo, plan);
+	}
+	trace_end();
+}
+
+// make the output name from a source file name (or symbol name)
+static void make_output_filename(const char* name, char *output_filename)
+{
+	memset(output_filename, 0, MAX_FILENAME_LENGTH+1);
+	strncpy(output_filename, name, MAX_FILENAME_LENGTH-2); // leave 2 chars for ".o"
+	char *lastdot = strrchr(output_filename, '.');
+	if (lastdot)
+		*lastdot = 0;
+	strcat(output_filename, ".o");
+}
+
+// Each output object is written as soon as its last symbol has been added, so there is never more
+// than one open at a time, and nothing to look up.
+static backend_object* open_output_object(const char* sym_name, backend_type output_target)
+{
+	backend_object *oo;
+   char output_filename[MAX_FILENAME_LENGTH+1];
+
+	make_output_filename(sym_name, output_filename);
+
+	// set up new output file
+	oo = backend_create();
+	if (oo)
+	{
+		LOG_INFO(LOG_OUTPUT, "=== Opening file %s\n", output_filename);
+		backend_set_type(oo, output_target);
+		backend_set_filename(oo, output_filename);
+		oo->_data_mem = MEM_OUTPUT;
+	}
+
+	return oo;
+}
+
+// a symbol waiting to be written to an output object
+typedef struct output_entry
+{
+	backend_symbol *sym;
+	unsigned int index;		// position in the symbol table, to keep the original order
+	unsigned long out_offset;	// position in the output section (see plan_output_object)
+	char filename[MAX_FILENAME_LENGTH+1];
+} output_entry;
+
+static int output_entry_cmp(const void *a, const void *b)
+{
+	const output_entry *ea = (const output_entry*)a;
+	const output_entry *eb = (const output_entry*)b;
+	int ret = strcmp(ea->filename, eb->filename);
+	if (ret)
+		return ret;
+	return (ea->index > eb->index) - (ea->index < eb->index);
+}
+
+// Work out where each symbol of one output object goes, and how big each of its sections will be
+// once copy_data has appended its part. The sections are then created at their final size, so
+// write_symbol and copy_data fill them in place instead of growing the buffers symbol by symbol.
+static int plan_output_object(struct delinker_ctx *ctx, backend_object *oo, output_entry *entries, unsigned int count, linked_list *plan)
+{
+	section_plan *sp;
+
+	for (unsigned int i=0; i < count; i++)
+	{
+		backend_symbol *sym = entries[i].sym;
+		unsigned long offset;
+
+		if (!sym->section)
+			continue;
+
+		sp = find_section_plan(plan, sym->section);
+		if (!sp)
+		{
+			sp = (section_plan*)calloc(1, sizeof(section_plan));
+			if (!sp)
+				return -ERR_NO_MEMORY;
+			sp->src = sym->section;
+			ll_add(plan, sp);
+		}
+
+		offset = sym->val - sym->section->address;
+		entries[i].out_offset = offset;
+		if (ctx->config.compact && (sym->section->flags & SECTION_FLAG_EXECUTE))
+			entries[i].out_offset = compact_offset(sp->extent, offset, sym->section->alignment);
+
+		// empty symbols don't take up any room (see write_symbol)
+		if (sym->size && entries[i].out_offset + sym->size > sp->extent)
+			sp->extent = entries[i].out_offset + sym->size;
+	}
+
+	for (const list_node* iter=ll_iter_start(plan); iter != NULL; iter=iter->next)
+	{
+		backend_section *sec_out;
+		unsigned char *data = NULL;
+
+		sp = (section_plan*)iter->val;
+		sp->size = sp->extent;
+		if (!ctx->config.shared_data && is_data_section(sp->src))
+			sp->size += sp->src->size;
+
+		// zeroed, so the alignment padding doesn't contain garbage
+		if (sp->size)
+		{
+			data = (unsigned char*)mem_calloc(MEM_OUTPUT, 1, sp->size);
+			if (!data)
+				return -ERR_NO_MEMORY;
+		}
+
+		sec_out = backend_add_section(oo, sp->src->name, sp->extent, 0, data, 0, sp->src->alignment, sp->src->flags);
+		if (!sec_out)
+		{
+			mem_free(MEM_OUTPUT, data);
+			return -ERR_NO_MEMORY;
+		}
+		if (!backend_add_symbol(oo, sec_out->name, 0, SYMBOL_TYPE_SECTION, 0, 0, sec_out))
+			LOG_ERROR(LOG_OUTPUT, "Error adding section symbol %s\n", sec_out->name);
+	}
+
+	return 0;
+}
+
+// Write the symbols to one .o file per source file. The symbols of a source file are not necessarily
+// next to each other in the symbol table, so they are grouped by output file first. Then each object
+// can be finalized and written as soon as its last symbol has been added, and only one output
+// object (with its copy of the data) is held in memory at a time.
+static int write_objects_by_source(struct delinker_ctx *ctx, backend_object *obj, const reloc_index *relocs, backend_type output_target)
+{
+	output_entry *entries;
+	unsigned int count = 0;
+	backend_symbol *sym;
+	int ret = 0;
+
+	entries = (output_entry*)malloc(backend_symbol_count(obj) * sizeof(output_entry) + 1);
+	if (!entries)
+		return -ERR_NO_MEMORY;
+
+	for (sym = backend_get_first_symbol(obj); sym; sym = backend_get_next_symbol(obj))
+	{
+		//DEBUG_PRINT("Processing %s type=%s size=%lu\n", sym->name, backend_symbol_type_to_str(sym->type), sym->size);
+		if (ignore_symbol(ctx, sym) || !sym->src)
+		{
+			LOG_DEBUG(LOG_OUTPUT, "Ignoring %s\n", sym->name);
+			continue;
+		}
+
+		// data symbols are defined by the shared data object
+		if (ctx->config.shared_data && sym->type == SYMBOL_TYPE_OBJECT && is_data_section(sym->section))
+			continue;
+
+		if (sym->type == SYMBOL_TYPE_FUNCTION || sym->type == SYMBOL_TYPE_OBJECT)
+		{
+			entries[count].sym = sym;
+			entries[count].index = count;
+			make_output_filename(sym->src, entries[count].filename);
+			count++;
+		}
+	}
+	qsort(entries, count, sizeof(output_entry), output_entry_cmp);
+
+	for (unsigned int first=0, last; first < count; first = last)
+	{
+		backend_object *oo;
+		linked_list *plan;
+		section_plan *sp;
+
+		// the symbols for this file
+		for (last = first + 1; last < count && strcmp(entries[first].filename, entries[last].filename) == 0; last++);
+
+		oo = open_output_object(entries[first].sym->src, output_target);
+		if (!oo)
+		{
+			LOG_ERROR(LOG_OUTPUT, "Error getting output object\n");
+			continue;
+		}
+
+		plan = ll_init();
+		if (!plan || plan_output_object(ctx, oo, entries + first, last - first, plan) < 0)
+		{
+			LOG_ERROR(LOG_OUTPUT, "Error planning the sections of %s\n", oo->name);
+			backend_destructor(oo);
+			ret = -ERR_NO_MEMORY;
 		}
 		else
 		{
-      	if (config.verbose)
-				fprintf(stderr, "Reconstructing symbols with internal function detector\n");
-			reconstruct_symbols(obj, 1);
+			for (unsigned int i=first; i < last; i++)
+			{
+				sym = entries[i].sym;
+				LOG_DEBUG(LOG_OUTPUT, "Writing symbol %s to %s\n", sym->name, sym->src);
+				if (write_symbol(ctx, oo, obj, sym, output_target, (long)entries[i].out_offset) < 0)
+					LOG_ERROR(LOG_OUTPUT, "Error adding function symbol for %s\n", sym->name);
+			}
+
+			// that was the last symbol for this file - write it out and free the memory
+			finalize_object(ctx, oo, obj, relocs, plan);
+			if (close_output_object(ctx, oo) == -ERR_SINK_STOPPED)
+				ret = -ERR_SINK_STOPPED;
+		}
+
+		if (plan)
+		{
+			while ((sp = (section_plan*)ll_pop(plan)) != NULL)
+				free(sp);
+			ll_destroy(plan);
 		}
+		if (ret < 0)
+			break;
+	}
+	free(entries);
+
+	return ret;
+}
+
+static void print_ignore_list(struct delinker_ctx *ctx)
+{
+	if (ctx->config.ignore_list->count)
+		LOG_INFO(LOG_MAIN, "Ignore list:\n");
+   for (const list_node* iter=ll_iter_start(ctx->config.ignore_list); iter != NULL; iter=iter->next)
+   {
+		char *sym = (char*)iter->val;
+		LOG_INFO(LOG_MAIN, " > %s\n", sym);
+	}
+}
+
+// Find the functions: take them from the symbol table, or reconstruct them (see --reconstruct-symbols)
+int
+analyse_symbols(struct delinker_ctx *ctx, backend_object* obj)
+{
+	int reconstruct = ctx->config.reconstruct_symbols;
+
+	// A stripped PE32+ file usually still has the exception directory, which tells us where all
+	// the functions are. In that case we don't need to be asked to reconstruct the symbols.
+	if (!reconstruct && pdata_present(obj) &&
+		!backend_get_symbol_by_type_first(obj, SYMBOL_TYPE_FUNCTION))
+	{
+		LOG_INFO(LOG_MAIN, "No function symbols, but there is an exception directory - using it to reconstruct symbols\n");
+		reconstruct = 1;
+	}
+
+	// check for symbols, and rebuild if necessary
+	if (backend_symbol_count(obj) == 0 && backend_import_symbol_count(obj) == 0 && reconstruct == 0)
+		return -ERR_NO_SYMS;
+	else if (reconstruct)
+	{
+		if (ctx->config.reconstructor == RECONSTRUCTOR_NUCLEUS)
+			LOG_INFO(LOG_RECONSTRUCT, "Reconstructing symbols with 'nucleus' function detector\n");
+		else
+			LOG_INFO(LOG_RECONSTRUCT, "Reconstructing symbols with internal function detector\n");
+		// the detectors only find functions - the common parts (file & section symbols, naming the
+		// entry point) are taken care of by reconstruct_symbols
+		stats_phase_begin(STATS_PHASE_RECONSTRUCT);
+		reconstruct_symbols(ctx, obj, 1);
+		stats_phase_end();
 		if (backend_symbol_count(obj) == 0)
 			return -ERR_NO_SYMS_AFTER_RECONSTRUCT;
 	}
 
-	if (config.verbose)
-		printf("reconstruct complete\n");
+	LOG_INFO(LOG_MAIN, "reconstruct complete\n");
+	return 0;
+}
+
+// Build the relocations, then trim the symbols that nothing refers to
+int
+analyse_relocations(struct delinker_ctx *ctx, backend_object* obj)
+{
+	backend_symbol *sym;
 
 	// convert any absolute addresses into symbols (loads of data, calls of functions, etc.)
 	// make sure any relative jumps are still accurate
+	stats_phase_begin(STATS_PHASE_RELOCATIONS);
 	int ret = build_relocations(obj);
+	stats_phase_end();
 	if (ret < 0)
 	{
-		printf("Can't build relocations: %s (%i)\n", error_code_str[-ret], ret);
+		LOG_ERROR(LOG_MAIN, "Can't build relocations: %s (%i)\n", error_code_str[-ret], ret);
       return ret;
 	}
-	if (config.verbose)
-		printf("building relocs complete\n");
+	LOG_INFO(LOG_MAIN, "building relocs complete\n");
 
-	if (config.verbose)
-		printf("trimming extraneous symbols\n");
+	LOG_INFO(LOG_MAIN, "trimming extraneous symbols\n");
 	// trim the extraneous symbols that were probably auto-generated
 	// start with a full list of functions, and remove anything that has a reloc pointing to it
+	stats_phase_begin(STATS_PHASE_TRIM);
 	linked_list *extraneous = ll_init();
    for (sym = backend_get_first_symbol(obj); sym; sym = backend_get_next_symbol(obj))
 		ll_add(extraneous, sym);
@@ -1213,8 +2061,7 @@ unlink_file(const char* input_filename, backend_type output_target)
 		//printf("Remaining functions: %u\n", ll_size(extraneous));
 	}
 
-	if (config.verbose)
-		printf("trimmed %u symbols\n", ll_size(extraneous));
+	LOG_INFO(LOG_MAIN, "trimmed %u symbols\n", ll_size(extraneous));
 
 	// anything that is left does not have a reloc pointing to it, and can be removed
 	sym = (backend_symbol *)ll_pop(extraneous);
@@ -1226,20 +2073,82 @@ unlink_file(const char* input_filename, backend_type output_target)
 	}
 	ll_destroy(extraneous);
 	extraneous = NULL;
+	stats_phase_end();
+
+	return 0;
+}
+
+// The output stage: the optimizations, then copying the symbols to the output objects and writing
+// them. Only the ignore list and the output options matter from here on.
+int
+write_output(struct delinker_ctx *ctx, backend_object* obj, backend_type output_target)
+{
+   backend_object* oo = NULL;
+	backend_symbol *sym;
+	reloc_index relocs;
+	int ret = 0;
+
+	print_ignore_list(ctx);
+
+	// drop everything that can't be reached from the entry point
+	if (ctx->config.gc)
+	{
+		LOG_INFO(LOG_MAIN, "removing unreachable symbols\n");
+		stats_phase_begin(STATS_PHASE_GC);
+		if (remove_unreachable_symbols(ctx, obj) < 0)
+			LOG_ERROR(LOG_OPT, "Error removing unreachable symbols\n");
+		stats_phase_end();
+	}
+
+	// write each set of identical functions only once
+	if (ctx->config.fold_identical)
+	{
+		LOG_INFO(LOG_MAIN, "folding identical functions\n");
+		stats_phase_begin(STATS_PHASE_ICF);
+		if (fold_identical_functions(obj) < 0)
+			LOG_ERROR(LOG_OPT, "Error folding identical functions\n");
+		stats_phase_end();
+	}
 
    // if the output target is not specified, use the input target
 	if (output_target == OBJECT_TYPE_NONE)
 	{
 		output_target = backend_get_type(obj);
-		printf("Warning: setting output type to match input: %i\n", output_target);
+		LOG_WARN(LOG_MAIN, "Warning: setting output type to match input: %i\n", output_target);
+	}
+
+	// everything from here on is copying symbols to the output objects, and writing them
+	stats_phase_begin(STATS_PHASE_COPY);
+
+	// Output the data sections to their own .o file
+	if (ctx->config.shared_data)
+	{
+		ret = write_shared_data_object(ctx, obj, output_target);
+		if (ret < 0)
+		{
+			LOG_ERROR(LOG_MAIN, "Can't write the shared data object: %s (%i)\n", error_code_str[-ret], ret);
+			stats_phase_end();
+			return ret;
+		}
 	}
 
+	// every output object needs the relocations of the symbols it holds
+	ret = build_reloc_index(obj, &relocs);
+	if (ret < 0)
+	{
+		stats_phase_end();
+		return ret;
+	}
+
+	// Output all functions to a single .o file, each in its own section
+	if (ctx->config.function_sections)
+		ret = write_function_sections(ctx, obj, &relocs, output_target);
+
 	// Output symbols to .o files
-	linked_list *oo_list = ll_init();
-   sym = backend_get_first_symbol(obj);
-	if (config.symbol_per_file)
+	else if (ctx->config.symbol_per_file)
    {
-		while (sym)
+		sym = backend_get_first_symbol(obj);
+		while (sym && ret == 0)
 		{
 			switch (sym->type)
 			{
@@ -1253,21 +2162,25 @@ unlink_file(const char* input_filename, backend_type output_target)
 				// don't bother outputting any external (empty) functions
 				if (strstr(sym->name, "@@"))
 				{
-					printf("Skipping external function %s\n", sym->name);
+					LOG_DEBUG(LOG_OUTPUT, "Skipping external function %s\n", sym->name);
 					break;
 				}
 
-				oo = get_output_object(oo_list, sym->name, output_target);
+				oo = open_output_object(sym->name, output_target);
 				if (!oo)
-					printf("Error getting output object\n");
+				{
+					LOG_ERROR(LOG_OUTPUT, "Error getting output object\n");
+					break;
+				}
 
-				if (write_symbol(oo, obj, sym, output_target) < 0)
-					printf("Error adding function symbol for %s\n", sym->name);
+				if (write_symbol(ctx, oo, obj, sym, output_target, -1) < 0)
+					LOG_ERROR(LOG_OUTPUT, "Error adding function symbol for %s\n", sym->name);
 
-				copy_relocations(obj, oo);
+				copy_relocations(ctx, &relocs, oo);
 
 				// close output file
-				close_output_object(oo);
+				if (close_output_object(ctx, oo) == -ERR_SINK_STOPPED)
+					ret = -ERR_SINK_STOPPED;
 				break;
 			}
 			sym = backend_get_next_symbol(obj);
@@ -1275,106 +2188,235 @@ unlink_file(const char* input_filename, backend_type output_target)
 	}
 	else
 	{
-		DEBUG_PRINT("Outputting to original .o files\n");
-		while (sym)
-		{
-			//DEBUG_PRINT("Processing %s type=%s size=%lu\n", sym->name, backend_symbol_type_to_str(sym->type), sym->size);
-			if (ignore_symbol(sym) || !sym->src)
-			{
-				DEBUG_PRINT("Ignoring %s\n", sym->name);
-				goto skip_ext;
-			}
+		LOG_DEBUG(LOG_OUTPUT, "Outputting to original .o files\n");
+		ret = write_objects_by_source(ctx, obj, &relocs, output_target);
+	}
+	free(relocs.relocs);
+	stats_phase_end();
 
-			if (sym->type == SYMBOL_TYPE_FUNCTION || sym->type == SYMBOL_TYPE_OBJECT)
-			{
-				//DEBUG_PRINT("Getting output object for symbol %s\n", sym->name);
-				if (!sym->src)
-				{
-					printf("Skipping external function %s\n", sym->name);
-					goto skip_ext;
-				}
+	return ret;
+}
 
-				printf("Writing symbol %s to %s\n", sym->name, sym->src);
-				oo = get_output_object(oo_list, sym->src, output_target);
+#ifndef DELINKER_LIBRARY
+// The context of the program: the options it was started with (see parse_options)
+static struct delinker_ctx program;
 
-				if (write_symbol(oo, obj, sym, output_target) < 0)
-					printf("Error adding function symbol for %s\n", sym->name);
-			}
-skip_ext:
-			sym = backend_get_next_symbol(obj);
-		}
+// Everything that only depends on the input and the choice of function detector: read it, find
+// the functions, build the relocations and trim the symbols nothing refers to. The daemon keeps
+// the result (see server.c). On success, the object is returned in 'objp'.
+static int
+analyse_file(struct delinker_ctx *ctx, const char* input_filename, backend_object **objp)
+{
+	backend_object* obj; 
+	int ret;
 
-		finalize_objects(oo_list, obj);
+	// read the input file into a generic backend structure
+   LOG_INFO(LOG_MAIN, "Reading input file %s\n", input_filename);
+	stats_phase_begin(STATS_PHASE_READ);
+   obj = backend_read(input_filename);
+	stats_phase_end();
+	if (!obj)
+		return -ERR_BAD_FORMAT;
 
-		// write out all objects to files
-		write_output_objects(oo_list);
+	ret = analyse_symbols(ctx, obj);
+	if (ret == 0)
+		ret = analyse_relocations(ctx, obj);
+	if (ret < 0)
+	{
+		backend_destructor(obj);
+		return ret;
 	}
-	ll_destroy(oo_list);
-	oo_list = NULL;
 
+	*objp = obj;
 	return 0;
 }
 
-int
-main (int argc, char *argv[])
+static int
+unlink_file(struct delinker_ctx *ctx, const char* input_filename, backend_type output_target)
 {
-   int status = 0;
-   char *input_filename = NULL;
-   char *output_target = NULL;
-
-	config.ignore_list = ll_init(); // list of symbols to ignore
+	backend_object* obj;
 
-	// we have to initialize the backends early so we can print out the names in usage()
-   backend_init();
+	int ret = analyse_file(ctx, input_filename, &obj);
+	if (ret < 0)
+		return ret;
+	return write_output(ctx, obj, output_target);
+}
 
-   if (argc < 2)
+// Say what went wrong with an input
+static void report_error(int ret, const char* input_filename)
+{
+   switch (ret)
    {
-      usage();
-      return -1;
+   case -ERR_BAD_FILE:
+      LOG_ERROR(LOG_MAIN, "Can't open input file %s\n", input_filename);
+      break;
+   case -ERR_BAD_FORMAT:
+      LOG_ERROR(LOG_MAIN, "Unhandled input file format\n");
+      break;
+   case -ERR_NO_SYMS:
+      LOG_ERROR(LOG_MAIN, "No symbols found - try again with --reconstruct-symbols\n");
+      break;
+   case -ERR_NO_SYMS_AFTER_RECONSTRUCT:
+      LOG_ERROR(LOG_MAIN, "No symbols found even after attempting to recreate them - maybe the code section is empty?\n");
+      break;
+   case -ERR_NO_TEXT_SECTION:
+      LOG_ERROR(LOG_MAIN, "Can't find .text section!\n");
+      break;
    }
+}
+
+// Delink one input into the current directory, and say what went wrong if it didn't work
+static int delink_file(struct delinker_ctx *ctx, const char* input_filename, backend_type output_target)
+{
+   int ret = unlink_file(ctx, input_filename, output_target);
+	report_error(ret, input_filename);
+
+	stats_report(ctx->config.stats_file);
+	return ret;
+}
 
+// Each input of a batch is delinked by a worker process of its own (see batch.c), so the
+// statistics and the trace are for that input, and are written to its output directory.
+static int batch_worker(const char *input_filename, void *arg)
+{
+	struct delinker_ctx *ctx = &program;
+	if (ctx->config.trace_file && trace_open(ctx->config.trace_file) != 0)
+		return -ERR_CANT_CREATE_OO;
+
+	int ret = delink_file(ctx, input_filename, *(backend_type*)arg);
+	trace_close();
+	return ret;
+}
+
+// Parse the options into the configuration of a context. The daemon parses the arguments of each of
+// its requests too, so getopt is started over every time.
+static int parse_options(struct delinker_ctx *ctx, int argc, char *argv[], char **output_target)
+{
+   optind = 0;
    int c;
    while (1)
    {
-      c = getopt_long (argc, argv, "e:I:O:R:Sv", options, 0);
+      c = getopt_long (argc, argv, "b::c:Cd:De:FgiI:j:k:l:o:O:P:R:s::St:v", options, 0);
       if (c == -1)
       break;
 
       switch (c)
       {
+		case 'b':
+			ctx->config.batch = 1;
+			if (optarg)
+				ctx->config.manifest = strdup(optarg);
+			break;
+
+		case 'c':
+			ctx->config.connect_socket = strdup(optarg);
+			break;
+
+		case 'C':
+			ctx->config.compact = 1;
+			break;
+
+		case 'd':
+			ctx->config.daemon_socket = strdup(optarg);
+			break;
+
+		case 'D':
+			ctx->config.shared_data = 1;
+			break;
+
 		case 'e':
-			config.entry_name = strdup(optarg);
+			ctx->config.entry_name = strdup(optarg);
+			break;
+
+		case 'F':
+			ctx->config.function_sections = 1;
+			break;
+
+		case 'g':
+			ctx->config.gc = 1;
+			break;
+
+		case 'i':
+			ctx->config.fold_identical = 1;
 			break;
 
 		case 'I':
-			ll_push(config.ignore_list, strdup(optarg));
+			ll_push(ctx->config.ignore_list, strdup(optarg));
+			break;
+
+		case 'j':
+			ctx->config.jobs = atoi(optarg);
+			break;
+
+		case 'k':
+			ll_push(ctx->config.keep_list, strdup(optarg));
+			break;
+
+		case 'l':
+			if (log_configure(ctx->log_levels, optarg) != 0)
+			{
+				log_usage();
+				return -1;
+			}
+			break;
+
+		case 'o':
+			ctx->config.output_dir = strdup(optarg);
 			break;
 
       case 'O':
-         output_target = optarg;
+         *output_target = optarg;
          break;
 
+		case 'P':
+			ctx->config.prologue_file = strdup(optarg);
+			break;
+
       case 'R':
-         config.reconstruct_symbols = 1;
+         ctx->config.reconstruct_symbols = 1;
 			if (strcmp(optarg, "nucleus") == 0)
-				config.reconstructor = RECONSTRUCTOR_NUCLEUS;
+				ctx->config.reconstructor = RECONSTRUCTOR_NUCLEUS;
 			else if (strcmp(optarg, "internal") == 0)
-				config.reconstructor = RECONSTRUCTOR_INTERNAL;
+				ctx->config.reconstructor = RECONSTRUCTOR_INTERNAL;
+			else if (strcmp(optarg, "descent") == 0)
+				ctx->config.reconstructor = RECONSTRUCTOR_DESCENT;
+			else if (strcmp(optarg, "ehframe") == 0)
+				ctx->config.reconstructor = RECONSTRUCTOR_EHFRAME;
+			else if (strcmp(optarg, "pdata") == 0)
+				ctx->config.reconstructor = RECONSTRUCTOR_PDATA;
+			else if (strcmp(optarg, "prologue") == 0)
+				ctx->config.reconstructor = RECONSTRUCTOR_PROLOGUE;
 			else
 			{
 				printf("Symbol Reconstruction Algorithms:\nUse one of the following strings after the -R to choose a specific algorithm\n");
 				printf("nucleus: Nucleus algorithm\n");
 				printf("internal: Internal algorithm\n");
+				printf("descent: Recursive descent from the entry point and known functions\n");
+				printf("ehframe: Function boundaries from the exception tables (.eh_frame)\n");
+				printf("pdata: Function boundaries from the x64 exception directory (.pdata)\n");
+				printf("prologue: Function starts from known compiler prologues (see --prologues)\n");
+				printf("(internal uses .pdata automatically when it is present, and prologues for 32-bit code)\n");
 				return -1;
 			}
          break;
 
+		case 's':
+			ctx->config.stats = 1;
+			if (optarg)
+				ctx->config.stats_file = strdup(optarg);
+			break;
+
 		case 'S':
-			config.symbol_per_file = true;
+			ctx->config.symbol_per_file = true;
+			break;
+
+		case 't':
+			ctx->config.trace_file = strdup(optarg);
 			break;
 
       case 'v':
-         config.verbose = 1;
+         ctx->config.verbose = 1;
+			log_raise_level(ctx->log_levels, LOG_LEVEL_INFO);
          break;
 
       default:
@@ -1383,41 +2425,281 @@ main (int argc, char *argv[])
       }
    }
 
-   if (argc <= optind)
+   return 0;
+}
+
+// A request of the daemon that has got as far as the output stage
+typedef struct daemon_job
+{
+	struct delinker_ctx *ctx;
+	backend_object *obj;
+	backend_type output_target;
+} daemon_job;
+
+// the exit code of a normal run with bad options (-1)
+#define DAEMON_BAD_OPTIONS 255
+
+// The output stage of a request runs in a process of its own (see server.c), so it may change
+// the cached object, and the statistics are for this request only. The trace was opened by the
+// daemon, and is shared with it.
+static int daemon_output(void *arg)
+{
+	daemon_job *job = (daemon_job*)arg;
+	int ret;
+
+	ret = write_output(job->ctx, job->obj, job->output_target);
+	stats_report(job->ctx->config.stats_file);
+	trace_flush();
+	return ret;
+}
+
+// Handle one request of the daemon, in the working directory of the client. The request's options
+// are parsed on top of the daemon's own, and the input is only analysed if it isn't in the cache.
+// Returns the exit code for the client: 0, or a (positive) error code.
+static int daemon_request(struct delinker_ctx *ctx, server_request *req, const struct config *defaults)
+{
+	char *output_target = NULL;
+	const char *input_filename;
+	char *path = NULL;
+	backend_object *obj;
+	daemon_job job;
+	uint64_t hash;
+	char key[512];
+	int ret;
+
+	if (chdir(req->cwd) != 0)
+	{
+		LOG_ERROR(LOG_MAIN, "Can't change to the directory %s\n", req->cwd);
+		return ERR_BAD_FILE;
+	}
+	if (parse_options(ctx, req->argc, req->argv, &output_target) != 0)
+		return DAEMON_BAD_OPTIONS;
+	stats_reset(ctx->config.stats);
+	if (ctx->config.batch || ctx->config.daemon_socket != defaults->daemon_socket)
+	{
+		LOG_ERROR(LOG_MAIN, "The daemon doesn't take --batch or --daemon requests\n");
+		return DAEMON_BAD_OPTIONS;
+	}
+	// the patterns are only loaded once (see prologue.c)
+	if (ctx->config.prologue_file != defaults->prologue_file &&
+		(!defaults->prologue_file || strcmp(ctx->config.prologue_file, defaults->prologue_file) != 0))
+	{
+		LOG_ERROR(LOG_MAIN, "The prologue patterns can only be given when the daemon is started\n");
+		return DAEMON_BAD_OPTIONS;
+	}
+	if (req->argc <= optind)
+	{
+		printf("Missing input file name\n");
+		return DAEMON_BAD_OPTIONS;
+	}
+	input_filename = req->argv[optind];
+
+	if (server_hash_file(input_filename, &hash) != 0)
+	{
+		report_error(-ERR_BAD_FILE, input_filename);
+		return ERR_BAD_FILE;
+	}
+
+	// like a normal run, move to the output directory before anything is traced
+	if (ctx->config.output_dir)
+	{
+		path = realpath(input_filename, NULL);
+		if (path)
+			input_filename = path;
+		if ((mkdir(ctx->config.output_dir, 0777) != 0 && errno != EEXIST) || chdir(ctx->config.output_dir) != 0)
+		{
+			LOG_ERROR(LOG_MAIN, "Can't use the output directory %s\n", ctx->config.output_dir);
+			free(path);
+			return ERR_CANT_CREATE_OO;
+		}
+	}
+	if (ctx->config.trace_file && trace_open(ctx->config.trace_file) != 0)
+	{
+		free(path);
+		return ERR_CANT_CREATE_OO;
+	}
+
+	// these are the options that analyse_file depends on
+	snprintf(key, sizeof(key), "%i %i %s", ctx->config.reconstruct_symbols, ctx->config.reconstructor, ctx->config.entry_name);
+	obj = server_cache_find(hash, key);
+	if (obj)
+		LOG_INFO(LOG_MAIN, "Reusing the analysis of %s\n", input_filename);
+	else
+	{
+		ret = analyse_file(ctx, input_filename, &obj);
+		if (ret < 0)
+		{
+			report_error(ret, input_filename);
+			stats_report(ctx->config.stats_file);
+			trace_close();
+			free(path);
+			return -ret;
+		}
+		server_cache_add(hash, key, obj);
+	}
+
+	job.ctx = ctx;
+	job.obj = obj;
+	job.output_target = backend_lookup_target(output_target);
+	trace_flush();
+	ret = server_run(daemon_output, &job);
+	trace_close();
+	free(path);
+	return ret;
+}
+
+static linked_list *copy_list(linked_list *list)
+{
+	linked_list *copy = ll_init();
+   for (const list_node* iter=ll_iter_start(list); iter != NULL; iter=iter->next)
+		ll_add(copy, strdup((char*)iter->val));
+	return copy;
+}
+
+static void free_list(linked_list *list)
+{
+	char *s;
+	while ((s = (char*)ll_pop(list)) != NULL)
+		free(s);
+	ll_destroy(list);
+}
+
+static void free_option(char *value, const char *default_value)
+{
+	if (value != default_value)
+		free(value);
+}
+
+// Answer requests on the socket until the daemon is told to stop (see server.c). Each request
+// starts with the configuration and log levels the daemon was started with.
+static int serve(struct delinker_ctx *ctx, const char *socket_name)
+{
+	struct config defaults = ctx->config;
+	unsigned char default_levels[LOG_CATEGORY_COUNT];
+	server_request req;
+
+	memcpy(default_levels, ctx->log_levels, LOG_CATEGORY_COUNT);
+	if (server_open(socket_name) != 0)
+		return -1;
+
+	while (server_accept(&req) == 0)
+	{
+		ctx->config.ignore_list = copy_list(defaults.ignore_list);
+		ctx->config.keep_list = copy_list(defaults.keep_list);
+		server_reply(&req, daemon_request(ctx, &req, &defaults));
+
+		free_list(ctx->config.ignore_list);
+		free_list(ctx->config.keep_list);
+		free_option(ctx->config.entry_name, defaults.entry_name);
+		free_option(ctx->config.prologue_file, defaults.prologue_file);
+		free_option(ctx->config.stats_file, defaults.stats_file);
+		free_option(ctx->config.trace_file, defaults.trace_file);
+		free_option(ctx->config.manifest, defaults.manifest);
+		free_option(ctx->config.output_dir, defaults.output_dir);
+		free_option(ctx->config.connect_socket, defaults.connect_socket);
+		free_option(ctx->config.daemon_socket, defaults.daemon_socket);
+		ctx->config = defaults;
+		memcpy(ctx->log_levels, default_levels, LOG_CATEGORY_COUNT);
+	}
+
+	server_close();
+	return 0;
+}
+
+int
+main (int argc, char *argv[])
+{
+   int status = 0;
+   char *input_filename = NULL;
+   char *output_target = NULL;
+
+	program.config.ignore_list = ll_init(); // list of symbols to ignore
+	program.config.keep_list = ll_init(); // list of symbols to keep
+	log_default_levels(program.log_levels);
+	log_use(program.log_levels);
+
+	// we have to initialize the backends early so we can print out the names in usage()
+   backend_init();
+
+   if (argc < 2)
    {
-      printf("Missing input file name\n");
       usage();
       return -1;
    }
-	if (!config.entry_name)
-		config.entry_name = strdup(SYMBOL_NAME_MAIN);
 
-   input_filename = argv[optind];
+   if (parse_options(&program, argc, argv, &output_target) != 0)
+      return -1;
+	stats_reset(program.config.stats);
 
-   int ret = unlink_file(input_filename, backend_lookup_target(output_target));
-   switch (ret)
+	// the daemon does the work, and prints whatever the request would have printed
+	if (program.config.connect_socket)
+		return server_connect(program.config.connect_socket, argc, argv);
+
+   if (argc <= optind && !program.config.batch && !program.config.daemon_socket)
    {
-   case -ERR_BAD_FILE:
-      printf("Can't open input file %s\n", input_filename);
-      break;
-   case -ERR_BAD_FORMAT:
-      printf("Unhandled input file format\n");
-      break;
-   case -ERR_NO_SYMS:
-      printf("No symbols found - try again with --reconstruct-symbols\n");
-      break;
-   case -ERR_NO_SYMS_AFTER_RECONSTRUCT:
-      printf("No symbols found even after attempting to recreate them - maybe the code section is empty?\n");
-      break;
-   case -ERR_NO_TEXT_SECTION:
-      printf("Can't find .text section!\n");
-      break;
+      printf("Missing input file name\n");
+      usage();
+      return -1;
    }
+	if (!program.config.entry_name)
+		program.config.entry_name = strdup(SYMBOL_NAME_MAIN);
+	backend_type target = backend_lookup_target(output_target);
+
+	if (program.config.daemon_socket)
+	{
+		if (serve(&program, program.config.daemon_socket) != 0)
+			status = -1;
+	}
+	else if (program.config.batch)
+	{
+		linked_list *inputs = ll_init();
+		for (int i=optind; i < argc; i++)
+			ll_add(inputs, strdup(argv[i]));
+
+		if (program.config.manifest && batch_read_manifest(inputs, program.config.manifest) != 0)
+			status = -1;
+		else if (!ll_size(inputs))
+		{
+			printf("No input files\n");
+			status = -1;
+		}
+		else if (batch_run(&program.config, inputs, program.config.output_dir ? program.config.output_dir : ".", batch_worker, &target, error_message) != 0)
+			status = 1;
+
+		char *name;
+		while ((name = (char*)ll_pop(inputs)) != NULL)
+			free(name);
+		ll_destroy(inputs);
+	}
+	else
+	{
+		input_filename = argv[optind];
+		if (program.config.output_dir)
+		{
+			// the input is opened after we have moved to the output directory
+			char *path = realpath(input_filename, NULL);
+			if (path)
+				input_filename = path;
+			if ((mkdir(program.config.output_dir, 0777) != 0 && errno != EEXIST) || chdir(program.config.output_dir) != 0)
+			{
+				LOG_ERROR(LOG_MAIN, "Can't use the output directory %s\n", program.config.output_dir);
+				return -1;
+			}
+		}
+
+		if (program.config.trace_file && trace_open(program.config.trace_file) != 0)
+			return -1;
+		if (delink_file(&program, input_filename, target) != 0)
+			status = 1;
+		trace_close();
+	}
 
 	// clean up ignore list
-   for (const list_node* iter=ll_iter_start(config.ignore_list); iter != NULL; iter=iter->next)
+   for (const list_node* iter=ll_iter_start(program.config.ignore_list); iter != NULL; iter=iter->next)
 		free((char*)iter->val);
-	ll_destroy(config.ignore_list);
+	ll_destroy(program.config.ignore_list);
+	prologue_free(&program);
 
    return status;
 }
+#endif // DELINKER_LIBRARY
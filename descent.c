@@ -0,0 +1,648 @@
+/* Recursive descent function detector.
+Instead of sweeping linearly through the code section and guessing where functions end, follow
+the control flow from addresses that are known to be functions (the entry point, symbols we
+already have, and the targets of direct calls). Every call target found along the way is another
+function start, so the work is naturally split into independent units that can be processed in
+parallel. Each worker thread has its own queue of function start addresses, and steals from the
+other queues when its own runs dry.
+Which worker finds a call target first depends on timing, so the traces don't stop at the starts
+found by the other workers - only at the ones that were known beforehand. The extent of each
+function is worked out from its blocks once all workers are done, so the result is the same from
+one run to the next. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "capstone/capstone.h"
+#include "backend.h"
+#include "context.h"
+#include "stats.h"
+#include "log.h"
+#include "trace.h"
+#include "detect.h"
+
+#define DESCENT_MAX_THREADS 64
+
+// per-byte state flags in the code section
+#define STATE_START     (1<<0)	// a function starts here
+#define STATE_KNOWN     (1<<1)	// there is already a symbol for this function
+#define STATE_SEED      (1<<2)	// known before the workers start (a symbol or the entry point)
+
+// a run of instructions traced in a function, [start, end) as offsets in the code section
+typedef struct descent_block
+{
+	unsigned long start;
+	unsigned long end;
+} descent_block;
+
+// one entry of the set of instructions visited in the current function
+typedef struct descent_seen
+{
+	unsigned long offset;
+	unsigned int generation;
+} descent_seen;
+
+// a discovered function, [start, end) as offsets in the code section
+typedef struct descent_func
+{
+	unsigned long start;
+	unsigned long end;			// only known after all workers are done
+	unsigned int worker;			// whose 'blocks' hold the blocks of the function
+	unsigned int first_block;
+	unsigned int block_count;
+} descent_func;
+
+typedef struct descent_queue
+{
+	pthread_mutex_t lock;
+	unsigned long *items;
+	unsigned int head;			// oldest item - stolen by other workers
+	unsigned int tail;			// newest item - popped by the owner
+	unsigned int capacity;
+} descent_queue;
+
+typedef struct descent_worker
+{
+	struct descent_ctx *ctx;
+	unsigned int id;
+	pthread_t thread;
+	int started;				// the thread was created, and must be joined
+	descent_queue queue;
+	descent_seen *seen;			// hash set of the instructions visited in the current function
+	unsigned int seen_count;
+	unsigned int seen_capacity;
+	unsigned int generation;	// entries of older generations are empty
+	descent_func *funcs;			// functions found by this worker
+	unsigned int func_count;
+	unsigned int func_capacity;
+	descent_block *blocks;		// the blocks of all of its functions
+	unsigned int block_count;
+	unsigned int block_capacity;
+	unsigned long decoded;		// instructions decoded (see --stats)
+} descent_worker;
+
+typedef struct descent_ctx
+{
+	backend_section *sec;
+	cs_mode mode;
+	unsigned char *state;		// STATE_ flags for each byte of the section
+	unsigned long pending;		// function starts queued or in progress
+	unsigned long queued;		// function starts waiting in the queues
+	unsigned int idle;			// workers waiting for work
+	pthread_mutex_t idle_lock;
+	pthread_cond_t idle_cond;	// signalled when work is queued, or when there is none left
+	unsigned int worker_count;
+	unsigned char *log_levels;	// of the run, for the worker threads
+	descent_worker workers[DESCENT_MAX_THREADS];
+} descent_ctx;
+
+static int queue_push(descent_queue *q, unsigned long offset)
+{
+	pthread_mutex_lock(&q->lock);
+	if (q->tail == q->capacity)
+	{
+		// compact before growing
+		if (q->head)
+		{
+			memmove(q->items, q->items + q->head, (q->tail - q->head) * sizeof(unsigned long));
+			q->tail -= q->head;
+			q->head = 0;
+		}
+		if (q->tail == q->capacity)
+		{
+			unsigned int capacity = q->capacity ? q->capacity * 2 : 256;
+			unsigned long *items = realloc(q->items, capacity * sizeof(unsigned long));
+			if (!items)
+			{
+				pthread_mutex_unlock(&q->lock);
+				return -1;
+			}
+			q->items = items;
+			q->capacity = capacity;
+		}
+	}
+	q->items[q->tail++] = offset;
+	pthread_mutex_unlock(&q->lock);
+	return 0;
+}
+
+// the owner takes the newest item, which keeps the related functions together
+static int queue_pop(descent_queue *q, unsigned long *offset)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&q->lock);
+	if (q->head != q->tail)
+	{
+		*offset = q->items[--q->tail];
+		ret = 1;
+	}
+	pthread_mutex_unlock(&q->lock);
+	return ret;
+}
+
+// thieves take the oldest item, so they don't compete with the owner for the same end of the queue
+static int queue_steal(descent_queue *q, unsigned long *offset)
+{
+	int ret = 0;
+
+	if (pthread_mutex_trylock(&q->lock))
+		return 0;
+	if (q->head != q->tail)
+	{
+		*offset = q->items[q->head++];
+		ret = 1;
+	}
+	pthread_mutex_unlock(&q->lock);
+	return ret;
+}
+
+// Mark an offset as a function start, and queue it if nobody has done so before
+static void add_function(descent_worker *w, unsigned long offset, unsigned char flags)
+{
+	descent_ctx *ctx = w->ctx;
+	unsigned char old = __atomic_fetch_or(&ctx->state[offset], STATE_START | flags, __ATOMIC_ACQ_REL);
+	if (old & STATE_START)
+		return;
+
+	__atomic_add_fetch(&ctx->pending, 1, __ATOMIC_SEQ_CST);
+	if (queue_push(&w->queue, offset))
+	{
+		LOG_ERROR(LOG_RECONSTRUCT, "Out of memory queueing function @ 0x%lx\n", ctx->sec->address + offset);
+		__atomic_sub_fetch(&ctx->pending, 1, __ATOMIC_SEQ_CST);
+		return;
+	}
+
+	// an idle worker checks 'queued' after counting itself in 'idle', so one of us sees the other
+	__atomic_add_fetch(&ctx->queued, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ctx->idle, __ATOMIC_SEQ_CST))
+	{
+		pthread_mutex_lock(&ctx->idle_lock);
+		pthread_cond_signal(&ctx->idle_cond);
+		pthread_mutex_unlock(&ctx->idle_lock);
+	}
+}
+
+// Wait until there is work in one of the queues. Returns 0 when all functions have been traced.
+static int wait_for_work(descent_ctx *ctx)
+{
+	int ret;
+
+	pthread_mutex_lock(&ctx->idle_lock);
+	__atomic_add_fetch(&ctx->idle, 1, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&ctx->pending, __ATOMIC_SEQ_CST) && !__atomic_load_n(&ctx->queued, __ATOMIC_SEQ_CST))
+		pthread_cond_wait(&ctx->idle_cond, &ctx->idle_lock);
+	__atomic_sub_fetch(&ctx->idle, 1, __ATOMIC_SEQ_CST);
+	ret = __atomic_load_n(&ctx->pending, __ATOMIC_SEQ_CST) != 0;
+	pthread_mutex_unlock(&ctx->idle_lock);
+	return ret;
+}
+
+// Mark an instruction as visited in the current function. Returns 1 if it already was.
+static int seen_insert(descent_worker *w, unsigned long offset)
+{
+	unsigned int mask;
+	unsigned int i;
+
+	if (w->seen_count * 2 >= w->seen_capacity)
+	{
+		unsigned int capacity = w->seen_capacity ? w->seen_capacity * 2 : 1024;
+		descent_seen *seen = calloc(capacity, sizeof(descent_seen));
+		if (!seen)
+			return 1;	// stop tracing rather than loop forever
+		for (i=0; i < w->seen_capacity; i++)
+		{
+			if (w->seen[i].generation != w->generation)
+				continue;
+			unsigned int j = (w->seen[i].offset * 2654435761U) & (capacity - 1);
+			while (seen[j].generation == w->generation)
+				j = (j + 1) & (capacity - 1);
+			seen[j] = w->seen[i];
+		}
+		free(w->seen);
+		w->seen = seen;
+		w->seen_capacity = capacity;
+	}
+
+	mask = w->seen_capacity - 1;
+	for (i = (offset * 2654435761U) & mask; w->seen[i].generation == w->generation; i = (i + 1) & mask)
+	{
+		if (w->seen[i].offset == offset)
+			return 1;
+	}
+	w->seen[i].offset = offset;
+	w->seen[i].generation = w->generation;
+	w->seen_count++;
+	return 0;
+}
+
+static int record_block(descent_worker *w, unsigned long start, unsigned long end)
+{
+	if (w->block_count == w->block_capacity)
+	{
+		unsigned int capacity = w->block_capacity ? w->block_capacity * 2 : 1024;
+		descent_block *blocks = realloc(w->blocks, capacity * sizeof(descent_block));
+		if (!blocks)
+			return -1;
+		w->blocks = blocks;
+		w->block_capacity = capacity;
+	}
+	w->blocks[w->block_count].start = start;
+	w->blocks[w->block_count].end = end;
+	w->block_count++;
+	return 0;
+}
+
+static int record_function(descent_worker *w, unsigned long start, unsigned int first_block)
+{
+	if (w->func_count == w->func_capacity)
+	{
+		unsigned int capacity = w->func_capacity ? w->func_capacity * 2 : 256;
+		descent_func *funcs = realloc(w->funcs, capacity * sizeof(descent_func));
+		if (!funcs)
+			return -1;
+		w->funcs = funcs;
+		w->func_capacity = capacity;
+	}
+	w->funcs[w->func_count].start = start;
+	w->funcs[w->func_count].end = start;
+	w->funcs[w->func_count].worker = w->id;
+	w->funcs[w->func_count].first_block = first_block;
+	w->funcs[w->func_count].block_count = w->block_count - first_block;
+	w->func_count++;
+	return 0;
+}
+
+// Decode the target of a direct branch (call, jmp, jcc, loop). The displacement is always the
+// last part of the instruction, so its size can be found without knowing the prefixes.
+// Returns 1 for a conditional branch, 2 for an unconditional jump, 3 for a call and 0 if the
+// instruction is not a direct branch.
+static int branch_target(const cs_insn *cs_ins, cs_mode mode, unsigned long *target)
+{
+	const unsigned char *b = cs_ins->bytes;
+	unsigned int i = 0;
+	unsigned int op_end;
+	int kind;
+	long rel;
+
+	// skip prefixes (operand size, address size, segment, bnd/rep)
+	while (i < cs_ins->size && (b[i] == 0x66 || b[i] == 0x67 || b[i] == 0xf2 || b[i] == 0xf3 ||
+		b[i] == 0x2e || b[i] == 0x3e || b[i] == 0x26 || b[i] == 0x36 || b[i] == 0x64 || b[i] == 0x65))
+		i++;
+	if (i >= cs_ins->size)
+		return 0;
+
+	if (b[i] == 0xe8)
+		kind = 3;
+	else if (b[i] == 0xe9 || b[i] == 0xeb)
+		kind = 2;
+	else if ((b[i] >= 0x70 && b[i] <= 0x7f) || (b[i] >= 0xe0 && b[i] <= 0xe3))
+		kind = 1;
+	else if (b[i] == 0x0f && i + 1 < cs_ins->size && b[i+1] >= 0x80 && b[i+1] <= 0x8f)
+	{
+		kind = 1;
+		i++;
+	}
+	else
+		return 0;
+	op_end = i + 1;
+
+	switch (cs_ins->size - op_end)
+	{
+	case 1:
+		rel = *(signed char*)(b + op_end);
+		break;
+	case 2:
+		rel = *(short*)(b + op_end);
+		break;
+	case 4:
+		rel = *(int*)(b + op_end);
+		break;
+	default:
+		return 0;
+	}
+
+	*target = cs_ins->address + cs_ins->size + rel;
+
+	// near branches wrap around within the 64K segment
+	if (mode == CS_MODE_16)
+		*target = (cs_ins->address & ~0xFFFFUL) | (*target & 0xFFFF);
+
+	return kind;
+}
+
+static inline int is_terminator(unsigned int id)
+{
+	switch (id)
+	{
+	case X86_INS_RET:
+	case X86_INS_RETF:
+	case X86_INS_IRET:
+	case X86_INS_IRETD:
+	case X86_INS_IRETQ:
+	case X86_INS_HLT:
+	case X86_INS_UD2:
+	case X86_INS_JMP:
+	case X86_INS_LJMP:
+		return 1;
+	}
+	return 0;
+}
+
+// Follow the control flow of a single function, starting at 'start'. Any block that is reachable
+// without passing through a call belongs to the function. Direct call targets are queued as new
+// functions. Jumps to the starts that were known beforehand, or to addresses before the start are
+// treated as tail calls. The blocks are recorded, and cut back to the function once all starts
+// are known (see descent_reconstruct_symbols).
+static void trace_function(descent_worker *w, csh cs_dis, cs_insn *cs_ins, unsigned long start)
+{
+	descent_ctx *ctx = w->ctx;
+	backend_section *sec = ctx->sec;
+	unsigned long *blocks = NULL;
+	unsigned int block_count = 0;
+	unsigned int block_capacity = 0;
+	unsigned long block = start;
+
+	// each function gets a new generation so the 'seen' set doesn't have to be cleared
+	w->seen_count = 0;
+	if (++w->generation == 0)
+	{
+		memset(w->seen, 0, w->seen_capacity * sizeof(descent_seen));
+		w->generation = 1;
+	}
+
+	while (1)
+	{
+		const uint8_t *pc = sec->data + block;
+		size_t n = sec->size - block;
+		uint64_t pc_addr = sec->address + block;
+		unsigned long end = block;
+
+		while (!seen_insert(w, pc - sec->data) && cs_disasm_iter(cs_dis, &pc, &n, &pc_addr, cs_ins))
+		{
+			unsigned long target;
+			unsigned long offset = cs_ins->address - sec->address;
+			int kind;
+
+			w->decoded++;
+			end = offset + cs_ins->size;
+
+			kind = branch_target(cs_ins, ctx->mode, &target);
+			if (kind && target >= sec->address && target < sec->address + sec->size)
+			{
+				unsigned long t = target - sec->address;
+				if (kind == 3)
+					add_function(w, t, 0);
+				else if (t > start && !(__atomic_load_n(&ctx->state[t], __ATOMIC_ACQUIRE) & STATE_SEED))
+				{
+					// a branch inside the function - remember the block
+					if (block_count == block_capacity)
+					{
+						block_capacity = block_capacity ? block_capacity * 2 : 64;
+						unsigned long *b = realloc(blocks, block_capacity * sizeof(unsigned long));
+						if (!b)
+							break;
+						blocks = b;
+					}
+					blocks[block_count++] = t;
+				}
+			}
+
+			if (is_terminator(cs_ins->id))
+				break;
+			if (pc >= sec->data + sec->size)
+				break;
+		}
+
+		if (end > block && record_block(w, block, end))
+			LOG_ERROR(LOG_RECONSTRUCT, "Out of memory recording block @ 0x%lx\n", sec->address + block);
+
+		if (!block_count)
+			break;
+		block = blocks[--block_count];
+	}
+
+	free(blocks);
+}
+
+static void* descent_worker_main(void *arg)
+{
+	descent_worker *w = (descent_worker*)arg;
+	descent_ctx *ctx = w->ctx;
+	csh cs_dis;
+	cs_insn *cs_ins;
+	unsigned long start;
+	char name[24];
+
+	unsigned char *levels = log_use(ctx->log_levels);
+	if (cs_open(CS_ARCH_X86, ctx->mode, &cs_dis) != CS_ERR_OK)
+	{
+		log_use(levels);
+		return NULL;
+	}
+	cs_ins = cs_malloc(cs_dis);
+	sprintf(name, "worker %u", w->id);
+	trace_begin("descent", name);
+
+	while (1)
+	{
+		int found = queue_pop(&w->queue, &start);
+		for (unsigned int i=1; !found && i < ctx->worker_count; i++)
+			found = queue_steal(&ctx->workers[(w->id + i) % ctx->worker_count].queue, &start);
+		if (!found)
+		{
+			if (!wait_for_work(ctx))
+				break;
+			continue;
+		}
+		__atomic_sub_fetch(&ctx->queued, 1, __ATOMIC_SEQ_CST);
+
+		unsigned int first_block = w->block_count;
+		trace_function(w, cs_dis, cs_ins, start);
+		if (record_function(w, start, first_block))
+			LOG_ERROR(LOG_RECONSTRUCT, "Out of memory recording function @ 0x%lx\n", ctx->sec->address + start);
+
+		// the last one out wakes up the others, so they can finish
+		if (__atomic_sub_fetch(&ctx->pending, 1, __ATOMIC_SEQ_CST) == 0)
+		{
+			pthread_mutex_lock(&ctx->idle_lock);
+			pthread_cond_broadcast(&ctx->idle_cond);
+			pthread_mutex_unlock(&ctx->idle_lock);
+		}
+	}
+
+	trace_end();
+	cs_free(cs_ins, 1);
+	cs_close(&cs_dis);
+	log_use(levels);
+	return NULL;
+}
+
+static int descent_func_cmp(const void *a, const void *b)
+{
+	const descent_func *fa = (const descent_func*)a;
+	const descent_func *fb = (const descent_func*)b;
+	if (fa->start < fb->start)
+		return -1;
+	return (fa->start > fb->start);
+}
+
+static unsigned int descent_thread_count(int jobs)
+{
+	long n = jobs;
+	if (n <= 0)
+		n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n <= 0)
+		n = 1;
+	if (n > DESCENT_MAX_THREADS)
+		n = DESCENT_MAX_THREADS;
+	return n;
+}
+
+// Find all functions in the code section that are reachable from the entry point, existing function
+// symbols or direct calls. Function symbols are added for each one that doesn't have a symbol yet.
+int descent_reconstruct_symbols(struct delinker_ctx *run, backend_object *obj, backend_section *sec_text, cs_mode mode, const char *src_name)
+{
+	descent_ctx *ctx;
+	descent_func *funcs;
+	unsigned int func_count = 0;
+	unsigned int added = 0;
+	unsigned long covered = 0;
+	unsigned long entry;
+	int ret = 0;
+
+	ctx = calloc(1, sizeof(descent_ctx));
+	if (!ctx)
+		return -1;
+	ctx->sec = sec_text;
+	ctx->mode = mode;
+	ctx->worker_count = descent_thread_count(run->config.jobs);
+	ctx->log_levels = run->log_levels;
+	ctx->state = calloc(sec_text->size, 1);
+	if (!ctx->state)
+	{
+		free(ctx);
+		return -1;
+	}
+	pthread_mutex_init(&ctx->idle_lock, NULL);
+	pthread_cond_init(&ctx->idle_cond, NULL);
+
+	for (unsigned int i=0; i < ctx->worker_count; i++)
+	{
+		descent_worker *w = &ctx->workers[i];
+		w->ctx = ctx;
+		w->id = i;
+		pthread_mutex_init(&w->queue.lock, NULL);
+	}
+
+	// Seed the queues with the functions we already know about. They are spread across the
+	// workers so all threads have something to start with.
+	descent_worker *seeder = &ctx->workers[0];
+	entry = backend_get_entry_point(obj);
+	if (entry >= sec_text->address && entry < sec_text->address + sec_text->size)
+		add_function(seeder, entry - sec_text->address, STATE_SEED);
+
+	backend_symbol *sym = backend_get_symbol_by_type_first(obj, SYMBOL_TYPE_FUNCTION);
+	while (sym)
+	{
+		if (sym->section == sec_text && sym->val >= sec_text->address && sym->val < sec_text->address + sec_text->size)
+		{
+			seeder = &ctx->workers[(seeder->id + 1) % ctx->worker_count];
+			add_function(seeder, sym->val - sec_text->address, STATE_SEED | STATE_KNOWN);
+		}
+		sym = backend_get_symbol_by_type_next(obj, SYMBOL_TYPE_FUNCTION);
+	}
+
+	if (!ctx->pending)
+	{
+		LOG_WARN(LOG_RECONSTRUCT, "No starting point for recursive descent\n");
+		goto done;
+	}
+
+	LOG_INFO(LOG_RECONSTRUCT, "Tracing %lu known functions with %u threads\n", ctx->pending, ctx->worker_count);
+
+	// Workers steal from every queue, so the ones that start will drain the queues of any that don't
+	unsigned int started = 0;
+	for (unsigned int i=0; i < ctx->worker_count; i++)
+	{
+		int err = pthread_create(&ctx->workers[i].thread, NULL, descent_worker_main, &ctx->workers[i]);
+		if (err)
+		{
+			LOG_WARN(LOG_RECONSTRUCT, "Can't start descent worker %u: %s\n", i, strerror(err));
+			continue;
+		}
+		ctx->workers[i].started = 1;
+		started++;
+	}
+	if (!started)
+		descent_worker_main(&ctx->workers[0]);
+	for (unsigned int i=0; i < ctx->worker_count; i++)
+		if (ctx->workers[i].started)
+			pthread_join(ctx->workers[i].thread, NULL);
+
+	// gather the results from all workers, and put them in address order
+	for (unsigned int i=0; i < ctx->worker_count; i++)
+	{
+		func_count += ctx->workers[i].func_count;
+		stats_count(STATS_INSTRUCTIONS, ctx->workers[i].decoded);
+	}
+	funcs = malloc(func_count * sizeof(descent_func) + 1);
+	if (!funcs)
+	{
+		ret = -1;
+		goto done;
+	}
+	func_count = 0;
+	for (unsigned int i=0; i < ctx->worker_count; i++)
+	{
+		memcpy(funcs + func_count, ctx->workers[i].funcs, ctx->workers[i].func_count * sizeof(descent_func));
+		func_count += ctx->workers[i].func_count;
+	}
+	qsort(funcs, func_count, sizeof(descent_func), descent_func_cmp);
+
+	for (unsigned int i=0; i < func_count; i++)
+	{
+		descent_func *f = &funcs[i];
+		descent_block *blocks = ctx->workers[f->worker].blocks + f->first_block;
+		unsigned long limit = (i + 1 < func_count) ? funcs[i+1].start : sec_text->size;
+
+		// Functions can share code (e.g. a common tail), but symbols must not overlap. Blocks that
+		// begin in another function were reached by a tail call, and don't count.
+		for (unsigned int j=0; j < f->block_count; j++)
+		{
+			if (blocks[j].start < f->start || blocks[j].start >= limit)
+				continue;
+			if (blocks[j].end > f->end)
+				f->end = blocks[j].end < limit ? blocks[j].end : limit;
+		}
+		covered += f->end - f->start;
+
+		if (ctx->state[f->start] & STATE_KNOWN)
+			continue;
+
+		add_function_symbol(obj, sec_text, sec_text->address + f->start, sec_text->address + f->end, src_name);
+		added++;
+	}
+	free(funcs);
+
+	LOG_INFO(LOG_RECONSTRUCT, "Recursive descent found %u functions (%u new), covering 0x%lx of 0x%x bytes\n",
+		func_count, added, covered, sec_text->size);
+
+done:
+	for (unsigned int i=0; i < ctx->worker_count; i++)
+	{
+		descent_worker *w = &ctx->workers[i];
+		free(w->seen);
+		free(w->funcs);
+		free(w->blocks);
+		free(w->queue.items);
+		pthread_mutex_destroy(&w->queue.lock);
+	}
+	pthread_cond_destroy(&ctx->idle_cond);
+	pthread_mutex_destroy(&ctx->idle_lock);
+	free(ctx->state);
+	free(ctx);
+	return ret;
+}
@@ -0,0 +1,59 @@
+/* Helpers shared by the function detectors */
+
+#include <stdio.h>
+#include "capstone/capstone.h"
+#include "backend.h"
+#include "stats.h"
+#include "detect.h"
+
+// Add a function symbol for [start, end), named after its address
+backend_symbol* add_function_symbol(backend_object *obj, backend_section *sec, unsigned long start, unsigned long end, const char *src_name)
+{
+	char name[24];
+
+	sprintf(name, "fn%06lX", start);
+	backend_symbol *s = backend_add_symbol(obj, name, start, SYMBOL_TYPE_FUNCTION, end - start, SYMBOL_FLAG_GLOBAL, sec);
+	backend_set_source_file(s, src_name);
+	return s;
+}
+
+// Disassemble an area that isn't covered by any FDE (or any other table of functions). Padding
+// (nop, int3) between functions is skipped, and a new function is started after every 'ret' or 'jmp'.
+unsigned int fill_function_gap(backend_object *obj, backend_section *sec, csh cs_dis, cs_insn *cs_ins,
+	unsigned long start, unsigned long end, const char *src_name)
+{
+	const uint8_t *pc = sec->data + (start - sec->address);
+	size_t n = end - start;
+	uint64_t pc_addr = start;
+	unsigned long fn_start = 0;
+	unsigned int found = 0;
+	int in_function = 0;
+
+	while (cs_disasm_iter(cs_dis, &pc, &n, &pc_addr, cs_ins))
+	{
+		stats_count(STATS_INSTRUCTIONS, 1);
+		if (!in_function)
+		{
+			if (cs_ins->id == X86_INS_NOP || cs_ins->id == X86_INS_INT3)
+				continue;
+			fn_start = cs_ins->address;
+			in_function = 1;
+		}
+
+		if (cs_ins->id == X86_INS_RET || cs_ins->id == X86_INS_JMP)
+		{
+			add_function_symbol(obj, sec, fn_start, cs_ins->address + cs_ins->size, src_name);
+			in_function = 0;
+			found++;
+		}
+	}
+
+	// anything that can't be decoded belongs to the last function
+	if (in_function)
+	{
+		add_function_symbol(obj, sec, fn_start, end, src_name);
+		found++;
+	}
+
+	return found;
+}
@@ -0,0 +1,13 @@
+#ifndef _DETECT__H
+#define _DETECT__H
+
+/* Helpers shared by the function detectors (ehframe.c, pdata.c, descent.c, prologue.c).
+backend.h must be included first. */
+
+#include "capstone/capstone.h"
+
+backend_symbol* add_function_symbol(backend_object *obj, backend_section *sec, unsigned long start, unsigned long end, const char *src_name);
+unsigned int fill_function_gap(backend_object *obj, backend_section *sec, csh cs_dis, cs_insn *cs_ins,
+	unsigned long start, unsigned long end, const char *src_name);
+
+#endif // _DETECT__H
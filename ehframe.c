@@ -0,0 +1,466 @@
+/* Function detection from the exception handling tables.
+Almost every function in a modern ELF executable has a Frame Description Entry (FDE) in .eh_frame,
+which gives the start address and length of the function, so the unwinder can find its way
+through the stack. On top of that, .eh_frame_hdr holds a table of all FDEs sorted by address (for
+binary search at runtime), so we don't even have to walk .eh_frame to find them. Only the areas
+of the code section that are not described by any FDE (usually hand-written assembly) need to be
+disassembled. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "capstone/capstone.h"
+#include "backend.h"
+#include "config.h"
+#include "stats.h"
+#include "log.h"
+#include "detect.h"
+
+// DWARF pointer encodings (see the LSB 'Exception Frames' chapter)
+#define DW_EH_PE_absptr		0x00
+#define DW_EH_PE_uleb128	0x01
+#define DW_EH_PE_udata2		0x02
+#define DW_EH_PE_udata4		0x03
+#define DW_EH_PE_udata8		0x04
+#define DW_EH_PE_sleb128	0x09
+#define DW_EH_PE_sdata2		0x0A
+#define DW_EH_PE_sdata4		0x0B
+#define DW_EH_PE_sdata8		0x0C
+#define DW_EH_PE_pcrel		0x10
+#define DW_EH_PE_datarel	0x30
+#define DW_EH_PE_omit		0xFF
+
+#define EH_FRAME_HDR_VERSION 1
+
+// a function described by an FDE
+typedef struct eh_func
+{
+	unsigned long start;
+	unsigned long end;
+} eh_func;
+
+static unsigned long read_uleb128(const unsigned char **p, const unsigned char *end)
+{
+	unsigned long val = 0;
+	unsigned int shift = 0;
+
+	while (*p < end)
+	{
+		unsigned char b = *(*p)++;
+		val |= (unsigned long)(b & 0x7F) << shift;
+		shift += 7;
+		if (!(b & 0x80))
+			break;
+	}
+	return val;
+}
+
+static long read_sleb128(const unsigned char **p, const unsigned char *end)
+{
+	long val = 0;
+	unsigned int shift = 0;
+	unsigned char b = 0;
+
+	while (*p < end)
+	{
+		b = *(*p)++;
+		val |= (long)(b & 0x7F) << shift;
+		shift += 7;
+		if (!(b & 0x80))
+			break;
+	}
+	if (shift < 64 && (b & 0x40))
+		val |= -(1L << shift);
+	return val;
+}
+
+// Read a pointer with the given encoding. 'sec' is the section that holds the pointer, which is
+// needed to resolve PC-relative values. 'datarel' is the base for data-relative values.
+static int read_encoded(const unsigned char **p, const unsigned char *end, unsigned char enc,
+	backend_section *sec, unsigned long datarel, unsigned int ptr_size, unsigned long *val)
+{
+	unsigned long field = sec->address + (*p - sec->data);
+	unsigned long v;
+
+	if (enc == DW_EH_PE_omit)
+		return -1;
+
+	switch (enc & 0x0F)
+	{
+	case DW_EH_PE_absptr:
+		if (*p + ptr_size > end)
+			return -1;
+		v = (ptr_size == 8) ? *(unsigned long*)*p : *(unsigned int*)*p;
+		*p += ptr_size;
+		break;
+	case DW_EH_PE_uleb128:
+		v = read_uleb128(p, end);
+		break;
+	case DW_EH_PE_sleb128:
+		v = read_sleb128(p, end);
+		break;
+	case DW_EH_PE_udata2:
+		if (*p + 2 > end)
+			return -1;
+		v = *(unsigned short*)*p;
+		*p += 2;
+		break;
+	case DW_EH_PE_sdata2:
+		if (*p + 2 > end)
+			return -1;
+		v = *(short*)*p;
+		*p += 2;
+		break;
+	case DW_EH_PE_udata4:
+		if (*p + 4 > end)
+			return -1;
+		v = *(unsigned int*)*p;
+		*p += 4;
+		break;
+	case DW_EH_PE_sdata4:
+		if (*p + 4 > end)
+			return -1;
+		v = *(int*)*p;
+		*p += 4;
+		break;
+	case DW_EH_PE_udata8:
+	case DW_EH_PE_sdata8:
+		if (*p + 8 > end)
+			return -1;
+		v = *(unsigned long*)*p;
+		*p += 8;
+		break;
+	default:
+		LOG_WARN(LOG_RECONSTRUCT, "Unsupported pointer encoding 0x%x\n", enc);
+		return -1;
+	}
+
+	switch (enc & 0x70)
+	{
+	case 0:
+		break;
+	case DW_EH_PE_pcrel:
+		v += field;
+		break;
+	case DW_EH_PE_datarel:
+		v += datarel;
+		break;
+	default:
+		LOG_WARN(LOG_RECONSTRUCT, "Unsupported pointer application 0x%x\n", enc & 0x70);
+		return -1;
+	}
+
+	*val = v;
+	return 0;
+}
+
+// Find the encoding of the FDE pointers from the augmentation data of a CIE
+static int cie_fde_encoding(backend_section *eh, unsigned long cie_offset, unsigned int ptr_size)
+{
+	const unsigned char *end = eh->data + eh->size;
+	const unsigned char *p = eh->data + cie_offset;
+	unsigned long length;
+	unsigned char version;
+	const char *aug;
+
+	if (p + 4 > end)
+		return -1;
+	length = *(unsigned int*)p;
+	p += 4;
+	if (length == 0xFFFFFFFF)
+	{
+		if (p + 8 > end)
+			return -1;
+		length = *(unsigned long*)p;
+		p += 8;
+	}
+	if (p + length > end)
+		return -1;
+	end = p + length;
+
+	// the CIE id is always 0 in .eh_frame
+	if (p + 5 > end || *(unsigned int*)p != 0)
+		return -1;
+	p += 4;
+
+	version = *p++;
+	aug = (const char*)p;
+	p += strnlen(aug, end - p) + 1;
+	if (strstr(aug, "eh"))
+		p += ptr_size;
+	read_uleb128(&p, end);	// code alignment
+	read_sleb128(&p, end);	// data alignment
+	if (version == 1)
+		p++;						// return address register
+	else
+		read_uleb128(&p, end);
+
+	if (aug[0] != 'z')
+		return DW_EH_PE_absptr;
+
+	read_uleb128(&p, end);	// augmentation data length
+	for (const char *a = aug + 1; *a && p < end; a++)
+	{
+		unsigned long personality;
+
+		switch (*a)
+		{
+		case 'R':
+			return *p;
+		case 'P':
+		{
+			unsigned char penc = *p++;
+			if (read_encoded(&p, end, penc & 0x7F, eh, 0, ptr_size, &personality))
+				return -1;
+			break;
+		}
+		case 'L':
+			p++;
+			break;
+		case 'S':
+		case 'B':
+			break;
+		default:
+			return -1;
+		}
+	}
+
+	return DW_EH_PE_absptr;
+}
+
+// Decode the FDE at the given offset in .eh_frame. Returns 1 if it describes a function, 0 for
+// CIEs and terminators and -1 if the entry is broken. 'next' is set to the following entry.
+static int decode_fde(backend_section *eh, unsigned long offset, unsigned int ptr_size, eh_func *f, unsigned long *next)
+{
+	const unsigned char *end = eh->data + eh->size;
+	const unsigned char *p = eh->data + offset;
+	const unsigned char *id_field;
+	unsigned long length;
+	unsigned int cie_ptr;
+	unsigned long range;
+	int enc;
+
+	if (p + 4 > end)
+		return -1;
+	length = *(unsigned int*)p;
+	p += 4;
+	if (length == 0)
+	{
+		*next = p - eh->data;
+		return 0;
+	}
+	if (length == 0xFFFFFFFF)
+	{
+		if (p + 8 > end)
+			return -1;
+		length = *(unsigned long*)p;
+		p += 8;
+	}
+	if (length < 4 || p + length > end)
+		return -1;
+	*next = (p - eh->data) + length;
+	end = p + length;
+
+	// the CIE pointer is relative to the field itself - a value of 0 means this is a CIE
+	id_field = p;
+	cie_ptr = *(unsigned int*)p;
+	p += 4;
+	if (cie_ptr == 0)
+		return 0;
+	if (cie_ptr > id_field - eh->data)
+		return -1;
+
+	enc = cie_fde_encoding(eh, (id_field - eh->data) - cie_ptr, ptr_size);
+	if (enc < 0)
+		return -1;
+
+	if (read_encoded(&p, end, enc, eh, 0, ptr_size, &f->start))
+		return -1;
+
+	// the range has the same size as the start address, but is never relative to anything
+	if (read_encoded(&p, end, enc & 0x0F, eh, 0, ptr_size, &range))
+		return -1;
+	f->end = f->start + range;
+
+	return 1;
+}
+
+static int add_eh_func(eh_func **funcs, unsigned int *count, unsigned int *capacity, const eh_func *f)
+{
+	if (*count == *capacity)
+	{
+		unsigned int c = *capacity ? *capacity * 2 : 256;
+		eh_func *n = realloc(*funcs, c * sizeof(eh_func));
+		if (!n)
+			return -1;
+		*funcs = n;
+		*capacity = c;
+	}
+	(*funcs)[(*count)++] = *f;
+	return 0;
+}
+
+static int eh_func_cmp(const void *a, const void *b)
+{
+	const eh_func *fa = (const eh_func*)a;
+	const eh_func *fb = (const eh_func*)b;
+	if (fa->start < fb->start)
+		return -1;
+	return (fa->start > fb->start);
+}
+
+// Use the binary search table in .eh_frame_hdr to find all FDEs
+static int read_eh_frame_hdr(backend_section *hdr, backend_section *eh, unsigned int ptr_size,
+	eh_func **funcs, unsigned int *count, unsigned int *capacity)
+{
+	const unsigned char *p = hdr->data;
+	const unsigned char *end = hdr->data + hdr->size;
+	unsigned char eh_frame_ptr_enc, fde_count_enc, table_enc;
+	unsigned long eh_frame_ptr, fde_count;
+
+	if (hdr->size < 4 || p[0] != EH_FRAME_HDR_VERSION)
+		return -1;
+	eh_frame_ptr_enc = p[1];
+	fde_count_enc = p[2];
+	table_enc = p[3];
+	p += 4;
+
+	if (read_encoded(&p, end, eh_frame_ptr_enc, hdr, hdr->address, ptr_size, &eh_frame_ptr))
+		return -1;
+	if (eh_frame_ptr != eh->address)
+		LOG_WARN(LOG_RECONSTRUCT, "Warning: .eh_frame_hdr points to 0x%lx, but .eh_frame is at 0x%lx\n", eh_frame_ptr, eh->address);
+
+	// the table is optional
+	if (fde_count_enc == DW_EH_PE_omit || table_enc == DW_EH_PE_omit)
+		return -1;
+	if (read_encoded(&p, end, fde_count_enc, hdr, hdr->address, ptr_size, &fde_count))
+		return -1;
+
+	LOG_TRACE(LOG_RECONSTRUCT, ".eh_frame_hdr has %lu entries\n", fde_count);
+	for (unsigned long i=0; i < fde_count; i++)
+	{
+		unsigned long initial_loc, fde_addr, next;
+		eh_func f;
+
+		if (read_encoded(&p, end, table_enc, hdr, hdr->address, ptr_size, &initial_loc) ||
+			read_encoded(&p, end, table_enc, hdr, hdr->address, ptr_size, &fde_addr))
+			return -1;
+
+		if (fde_addr < eh->address || fde_addr >= eh->address + eh->size)
+		{
+			LOG_WARN(LOG_RECONSTRUCT, "FDE for 0x%lx @ 0x%lx is outside of .eh_frame\n", initial_loc, fde_addr);
+			continue;
+		}
+		if (decode_fde(eh, fde_addr - eh->address, ptr_size, &f, &next) != 1)
+		{
+			LOG_WARN(LOG_RECONSTRUCT, "Bad FDE for 0x%lx @ 0x%lx\n", initial_loc, fde_addr);
+			continue;
+		}
+		if (f.start != initial_loc)
+			LOG_WARN(LOG_RECONSTRUCT, "Warning: FDE @ 0x%lx starts at 0x%lx, but the table says 0x%lx\n", fde_addr, f.start, initial_loc);
+
+		if (add_eh_func(funcs, count, capacity, &f))
+			return -1;
+	}
+
+	return 0;
+}
+
+// Without a search table, walk all entries in .eh_frame
+static int read_eh_frame(backend_section *eh, unsigned int ptr_size, eh_func **funcs, unsigned int *count, unsigned int *capacity)
+{
+	unsigned long offset = 0;
+
+	while (offset < eh->size)
+	{
+		unsigned long next;
+		eh_func f;
+		int ret = decode_fde(eh, offset, ptr_size, &f, &next);
+		if (ret < 0)
+			return -1;
+		if (ret == 1 && add_eh_func(funcs, count, capacity, &f))
+			return -1;
+		offset = next;
+	}
+
+	return 0;
+}
+
+// Create function symbols for all functions described in .eh_frame, and disassemble the gaps in
+// between. Returns -1 if there are no usable exception tables, so the caller can use a different
+// method.
+int ehframe_reconstruct_symbols(backend_object *obj, backend_section *sec_text, csh cs_dis, cs_insn *cs_ins, const char *src_name)
+{
+	backend_section *hdr = backend_get_section_by_name(obj, ".eh_frame_hdr");
+	backend_section *eh = backend_get_section_by_name(obj, ".eh_frame");
+	unsigned int ptr_size = (backend_get_type(obj) == OBJECT_TYPE_ELF64) ? 8 : 4;
+	eh_func *funcs = NULL;
+	unsigned int count = 0;
+	unsigned int capacity = 0;
+	unsigned int added = 0;
+	unsigned int gap_funcs = 0;
+	unsigned long text_end = sec_text->address + sec_text->size;
+	unsigned long cursor = sec_text->address;
+	int check_existing;
+
+	if (!eh || !eh->data)
+	{
+		LOG_INFO(LOG_RECONSTRUCT, "No .eh_frame section\n");
+		return -1;
+	}
+
+	if (!hdr || !hdr->data || read_eh_frame_hdr(hdr, eh, ptr_size, &funcs, &count, &capacity))
+	{
+		LOG_TRACE(LOG_RECONSTRUCT, "No usable .eh_frame_hdr - walking .eh_frame\n");
+		count = 0;
+		if (read_eh_frame(eh, ptr_size, &funcs, &count, &capacity))
+		{
+			LOG_WARN(LOG_RECONSTRUCT, "Can't parse .eh_frame\n");
+			free(funcs);
+			return -1;
+		}
+		// the entries in .eh_frame are not necessarily in order
+		qsort(funcs, count, sizeof(eh_func), eh_func_cmp);
+	}
+
+	if (!count)
+	{
+		free(funcs);
+		return -1;
+	}
+
+	// only look for duplicates if there were function symbols to start with
+	check_existing = (backend_get_symbol_by_type_first(obj, SYMBOL_TYPE_FUNCTION) != NULL);
+
+	for (unsigned int i=0; i < count; i++)
+	{
+		eh_func *f = &funcs[i];
+
+		if (f->start < sec_text->address || f->start >= text_end || f->end <= f->start)
+			continue;
+		if (f->end > text_end)
+			f->end = text_end;
+
+		if (f->start > cursor)
+			gap_funcs += fill_function_gap(obj, sec_text, cs_dis, cs_ins, cursor, f->start, src_name);
+
+		// symbols must not overlap
+		if (f->start < cursor)
+			continue;
+		if (i + 1 < count && f->end > funcs[i+1].start && funcs[i+1].start > f->start)
+			f->end = funcs[i+1].start;
+		cursor = f->end;
+
+		if (check_existing && backend_find_symbol_by_val_type(obj, f->start, SYMBOL_TYPE_FUNCTION))
+			continue;
+		add_function_symbol(obj, sec_text, f->start, f->end, src_name);
+		added++;
+	}
+	if (cursor < text_end)
+		gap_funcs += fill_function_gap(obj, sec_text, cs_dis, cs_ins, cursor, text_end, src_name);
+
+	LOG_INFO(LOG_RECONSTRUCT, "%u functions from .eh_frame, %u more from disassembling the gaps\n", added, gap_funcs);
+	free(funcs);
+
+	return 0;
+}
@@ -11,15 +11,11 @@
 #include "capstone/capstone.h"
 #include "backend.h"
 #include "config.h"
+#include "log.h"
+#include "mem.h"
 
 #pragma pack(1)
 
-#ifdef DEBUG
-#define DEBUG_PRINT printf
-#else
-#define DEBUG_PRINT //
-#endif
-
 #define ALIGN(_x, _y) ((_x + (_y-1)) & ~(_y-1))
 #define ELF_MAGIC "\x7F\x45\x4c\x46"
 #define MAGIC_SIZE 4
@@ -495,69 +491,67 @@ static const char* elf_lookup_section_type(unsigned short type)
    __lookup(type, section_type_lookup);
 }
 
-#ifdef DEBUG
 void dump_elf_header(const char* buf)
 {
    elf64_header *e64 = (elf64_header*)buf;
 
    if (e64->size == 1)
    {
-      fprintf(stderr, "32-bit ELF header\n");
+      LOG_DEBUG(LOG_ELF, "32-bit ELF header\n");
    }
    else if (e64->size == 2)
    {
-      fprintf(stderr, "64-bit ELF header\n");
+      LOG_DEBUG(LOG_ELF, "64-bit ELF header\n");
       if (e64->endian == 1)
-         fprintf(stderr, "Little endian\n");
+         LOG_DEBUG(LOG_ELF, "Little endian\n");
       else if (e64->endian == 2)
-         fprintf(stderr, "Big endian\n");
+         LOG_DEBUG(LOG_ELF, "Big endian\n");
       else
-         fprintf(stderr, "Unknown endian %i\n", e64->endian);
-      fprintf(stderr, "Version: %i\n", e64->version);
+         LOG_DEBUG(LOG_ELF, "Unknown endian %i\n", e64->endian);
+      LOG_DEBUG(LOG_ELF, "Version: %i\n", e64->version);
    }
    else
    {
-      fprintf(stderr, "%i is not a known ELF size\n", e64->size);
+      LOG_DEBUG(LOG_ELF, "%i is not a known ELF size\n", e64->size);
    }
 
-   fprintf(stderr, "OS: %s\n", elf_lookup_os((elf_os)e64->os));
-   fprintf(stderr, "Type: %s\n", elf_lookup_type((elf_type)e64->type));
-   fprintf(stderr, "Machine: %s (%i)\n", elf_lookup_machine(e64->machine), e64->machine);
-   fprintf(stderr, "Entry point: 0x%lx\n", e64->entry);
-   fprintf(stderr, "Number of program headers: %i\n", e64->ph_num);
+   LOG_DEBUG(LOG_ELF, "OS: %s\n", elf_lookup_os((elf_os)e64->os));
+   LOG_DEBUG(LOG_ELF, "Type: %s\n", elf_lookup_type((elf_type)e64->type));
+   LOG_DEBUG(LOG_ELF, "Machine: %s (%i)\n", elf_lookup_machine(e64->machine), e64->machine);
+   LOG_DEBUG(LOG_ELF, "Entry point: 0x%lx\n", e64->entry);
+   LOG_DEBUG(LOG_ELF, "Number of program headers: %i\n", e64->ph_num);
 }
 
 void dump_elf64_section(elf64_section* s, const char* strtab)
 {
-   printf("Name: %s\n", strtab + s->name);
-   printf("Type: %s\n", elf_lookup_section_type(s->type));
-   printf("Flags: 0x%lx\n", s->flags);
-   printf("Load address: 0x%lx\n", s->addr);
-   printf("File Offset: 0x%lx\n", s->offset);
-   printf("Size: 0x%lx\n", s->size);
-   printf("Alignment: %i (%lu)\n", 2 << s->addralign, s->addralign);
-   printf("Entry size: %lu\n\n", s->entsize);
+   LOG_DEBUG(LOG_ELF, "Name: %s\n", strtab + s->name);
+   LOG_DEBUG(LOG_ELF, "Type: %s\n", elf_lookup_section_type(s->type));
+   LOG_DEBUG(LOG_ELF, "Flags: 0x%lx\n", s->flags);
+   LOG_DEBUG(LOG_ELF, "Load address: 0x%lx\n", s->addr);
+   LOG_DEBUG(LOG_ELF, "File Offset: 0x%lx\n", s->offset);
+   LOG_DEBUG(LOG_ELF, "Size: 0x%lx\n", s->size);
+   LOG_DEBUG(LOG_ELF, "Alignment: %i (%lu)\n", 2 << s->addralign, s->addralign);
+   LOG_DEBUG(LOG_ELF, "Entry size: %lu\n\n", s->entsize);
 }
 
 void dump_elf64_symbol(elf64_symbol *s, const unsigned char *strtab)
 {
-	printf("Name: %s\n", strtab + s->name);
-	printf("Info: %u\n", s->info);
-	printf("Other: %u\n", s->other);
-	printf("Section index: %i\n", s->section_index);
-	printf("Value: 0x%lx\n", s->value);
-	printf("Size: 0x%lx\n", s->value);
+	LOG_DEBUG(LOG_ELF, "Name: %s\n", strtab + s->name);
+	LOG_DEBUG(LOG_ELF, "Info: %u\n", s->info);
+	LOG_DEBUG(LOG_ELF, "Other: %u\n", s->other);
+	LOG_DEBUG(LOG_ELF, "Section index: %i\n", s->section_index);
+	LOG_DEBUG(LOG_ELF, "Value: 0x%lx\n", s->value);
+	LOG_DEBUG(LOG_ELF, "Size: 0x%lx\n", s->value);
 }
 
 void dump_rela(elf64_rela *rela)
 {
-	printf("Addr: 0x%lx\n", rela->addr);
-	printf("Info: 0x%lx\n", rela->info);
-	printf("  Type: 0x%x\n", ELF64_R_TYPE(rela->info));
-	printf("  Sym: 0x%x\n", ELF64_R_SYM(rela->info));
-	printf("Addend: 0x%lx\n", rela->addend);
+	LOG_DEBUG(LOG_ELF, "Addr: 0x%lx\n", rela->addr);
+	LOG_DEBUG(LOG_ELF, "Info: 0x%lx\n", rela->info);
+	LOG_DEBUG(LOG_ELF, "  Type: 0x%x\n", ELF64_R_TYPE(rela->info));
+	LOG_DEBUG(LOG_ELF, "  Sym: 0x%x\n", ELF64_R_SYM(rela->info));
+	LOG_DEBUG(LOG_ELF, "Addend: 0x%lx\n", rela->addend);
 }
-#endif // DEBUG
 
 const char* elf32_name(void)
 {
@@ -686,6 +680,75 @@ int elf_reloc_addend(elf_x86_64_reloc_type t)
    return 0;
 }
 
+// The linkers only emit a handful of PLT stub layouts. Each template describes one of them:
+// the bytes that must match (wherever the mask is set), and where to find the RIP-relative
+// displacement of the jump into the GOT. Templates without a displacement are stubs that
+// don't belong to an import (the lazy binding resolver, or the 'push' half of an IBT PLT).
+typedef struct plt_template
+{
+	const char *name;
+	unsigned int size;		// number of bytes to compare
+	unsigned char bytes[8];
+	unsigned char mask[8];
+	unsigned int disp;		// offset of the GOT displacement (0 = not an import stub)
+	unsigned int next;		// offset of the instruction following the jump
+} plt_template;
+
+static const plt_template plt_templates_x86_64[] =
+{
+	// ff 25 xx xx xx xx     jmp *GOT(%rip)
+	// 68 xx xx xx xx        push $index
+	{ "lazy", 7, { 0xff, 0x25, 0, 0, 0, 0, 0x68 }, { 0xff, 0xff, 0, 0, 0, 0, 0xff }, 2, 6 },
+
+	// ff 25 xx xx xx xx     jmp *GOT(%rip)
+	// 66 90                 xchg %ax,%ax
+	{ "plt.got", 8, { 0xff, 0x25, 0, 0, 0, 0, 0x66, 0x90 }, { 0xff, 0xff, 0, 0, 0, 0, 0xff, 0xff }, 2, 6 },
+
+	// ff 35 xx xx xx xx     push GOT+8(%rip)
+	{ "resolver", 2, { 0xff, 0x35 }, { 0xff, 0xff }, 0, 0 },
+
+	// f3 0f 1e fa           endbr64
+	// f2 ff 25 xx xx xx xx  bnd jmp *GOT(%rip)
+	{ "ibt bnd", 7, { 0xf3, 0x0f, 0x1e, 0xfa, 0xf2, 0xff, 0x25 }, { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff }, 7, 11 },
+
+	// f3 0f 1e fa           endbr64
+	// ff 25 xx xx xx xx     jmp *GOT(%rip)
+	{ "ibt", 6, { 0xf3, 0x0f, 0x1e, 0xfa, 0xff, 0x25 }, { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff }, 6, 10 },
+
+	// f3 0f 1e fa           endbr64
+	// 68 xx xx xx xx        push $index
+	{ "ibt lazy", 5, { 0xf3, 0x0f, 0x1e, 0xfa, 0x68 }, { 0xff, 0xff, 0xff, 0xff, 0xff }, 0, 0 },
+};
+
+// Match a PLT entry against the known layouts. Returns 1 if the entry was recognized, in which
+// case 'target' holds the address of the GOT slot the entry jumps through (or 0 if it doesn't
+// jump through the GOT).
+static int match_plt_entry_x86_64(const unsigned char *entry, unsigned long size, unsigned long addr, unsigned long *target)
+{
+	for (int t=0; t < sizeof(plt_templates_x86_64)/sizeof(plt_template); t++)
+	{
+		const plt_template *tmpl = &plt_templates_x86_64[t];
+		int i;
+
+		if (tmpl->size > size)
+			continue;
+
+		for (i=0; i < tmpl->size; i++)
+			if ((entry[i] & tmpl->mask[i]) != tmpl->bytes[i])
+				break;
+		if (i < tmpl->size)
+			continue;
+
+		LOG_TRACE(LOG_ELF, "PLT entry @ 0x%lx is a '%s' stub\n", addr, tmpl->name);
+		*target = 0;
+		if (tmpl->disp)
+			*target = addr + tmpl->next + *(int*)(entry + tmpl->disp);
+		return 1;
+	}
+
+	return 0;
+}
+
 // this should be moved to the backend - it has nothing to do with elf
 static unsigned long decode_plt_entry_x86_64(csh cs_dis, cs_insn *cs_ins, const unsigned char *pc, uint64_t pc_addr, unsigned long entry_size)
 {
@@ -801,6 +864,15 @@ static int elfcmp(void* item_a, void* item_b)
 	return 0;
 }
 
+/* Once the symbols are in ELF order, remember each one's index in the symbol table so the
+   relocations don't have to search for it. Index 0 is the null symbol the writers add. */
+static void elf_number_symbols(backend_object* obj)
+{
+	unsigned int index = 1;
+	for (backend_symbol* s = backend_get_first_symbol(obj); s; s = backend_get_next_symbol(obj))
+		s->_index = index++;
+}
+
 static backend_object* elf32_read_file(FILE* f, elf32_header* h)
 {
 	char sym_name[SYMBOL_MAX_LENGTH+1];
@@ -824,7 +896,7 @@ static backend_object* elf32_read_file(FILE* f, elf32_header* h)
 	char* section_strtab = NULL;
 	char *src_file = NULL;
 
-	printf("elf32_read_file\n");
+	LOG_DEBUG(LOG_ELF, "elf32_read_file\n");
 	backend_object* obj = backend_create();
 	if (!obj)
 		return 0;
@@ -843,23 +915,19 @@ static backend_object* elf32_read_file(FILE* f, elf32_header* h)
 	default:
 		be_arch = OBJECT_ARCH_UNKNOWN;
 	}
-	if (config.verbose)
-		fprintf(stderr, "Arch %i\n", be_arch);
+	LOG_INFO(LOG_ELF, "Arch %i\n", be_arch);
 	backend_set_arch(obj, be_arch);
 
-	if (config.verbose)
-	{
-		fprintf(stderr, "Number of section headers: %i\n", h->sh_num);
-		fprintf(stderr, "Size of section headers: %i\n", h->shent_size);
-		fprintf(stderr, "String table index: %i\n", h->sh_str_index);
-	}
+	LOG_DEBUG(LOG_ELF, "Number of section headers: %i\n", h->sh_num);
+	LOG_DEBUG(LOG_ELF, "Size of section headers: %i\n", h->shent_size);
+	LOG_DEBUG(LOG_ELF, "String table index: %i\n", h->sh_str_index);
 
 	backend_set_entry_point(obj, h->entry);
 
 	// validate the size of the section entry struct
 	if (h->shent_size != sizeof(elf32_section))
 	{
-		printf("Size mismatch in section: read %i expected %lu\n",
+		LOG_WARN(LOG_ELF, "Size mismatch in section: read %i expected %lu\n",
 			h->shent_size, sizeof(elf32_section));
 	}
 
@@ -867,7 +935,7 @@ static backend_object* elf32_read_file(FILE* f, elf32_header* h)
 	fseek(f, h->sh_off + h->shent_size * h->sh_str_index, SEEK_SET);
 	if (fread(&in_sec, h->shent_size, 1, f) != 1)
 	{
-		fprintf(stderr, "Error loading string table\n");
+		LOG_ERROR(LOG_ELF, "Error loading string table\n");
 		goto error;
 	}
 
@@ -893,13 +961,13 @@ static backend_object* elf32_read_file(FILE* f, elf32_header* h)
 			// load the section data unless it is marked as unloadable
 			if (in_sec.type != SHT_NOBITS)
 			{
-				data = (unsigned char*)malloc(in_sec.size);
+				data = (unsigned char*)mem_alloc(MEM_SECTION_DATA, in_sec.size);
 
 				fseek(f, in_sec.offset, SEEK_SET);
 				if (fread(data, in_sec.size, 1, f) != 1)
 				{
-					fprintf(stderr, "Error loading section %s data\n", name);
-					free(data);
+					LOG_ERROR(LOG_ELF, "Error loading section %s data\n", name);
+					mem_free(MEM_SECTION_DATA, data);
 					goto error_strtab;
 				}
 			}
@@ -937,7 +1005,7 @@ static backend_object* elf32_read_file(FILE* f, elf32_header* h)
 	{
 		sec_strtab = backend_get_section_by_type(obj, SECTION_TYPE_STRTAB);
 		if (!sec_strtab)
-			printf("Warning: can't find string table section!\n");
+			LOG_WARN(LOG_ELF, "Warning: can't find string table section!\n");
 		//goto done;
 	}
 
@@ -947,7 +1015,7 @@ static backend_object* elf32_read_file(FILE* f, elf32_header* h)
 	{
 		sec_symtab = backend_get_section_by_type(obj, SECTION_TYPE_SYMTAB);
 		if (!sec_symtab)
-			printf("Warning: can't find symbol table section!\n");
+			LOG_WARN(LOG_ELF, "Warning: can't find symbol table section!\n");
 		goto dynsym;
 	}
 
@@ -970,13 +1038,13 @@ static backend_object* elf32_read_file(FILE* f, elf32_header* h)
 			// The first symbol in an ELF file must have no name and no type
 			//printf("Skipping symbol with no type\n");
 			if (!backend_add_symbol(obj, name, 0, elf_to_backend_sym_type(sym->info), 0, 0, sec_symtab))
-				printf("Failed adding untyped symbol\n");
+				LOG_ERROR(LOG_ELF, "Failed adding untyped symbol\n");
 			continue;
 
 		case ELF_ST_SECTION:
 			sec = backend_get_section_by_index(obj, sym->section_index);
 			if (!backend_add_symbol(obj, sec->name, 0, elf_to_backend_sym_type(sym->info), 0, 0, sec) || !sec)
-				printf("Failed adding section symbol\n");
+				LOG_ERROR(LOG_ELF, "Failed adding section symbol\n");
 			//printf("Adding section symbol %s (%i)\n", sec->name, sym->section_index);
 			continue;
 
@@ -1035,35 +1103,35 @@ dynsym:
 	sec_dynsym = backend_get_section_by_name(obj, ".dynsym");
 	if (!sec_dynsym)
 	{
-		printf("Can't find dynamic symbol section (.dynsym)\n");
+		LOG_INFO(LOG_ELF, "Can't find dynamic symbol section (.dynsym)\n");
 		goto done;
 	}
 
 	sec_dynstr = backend_get_section_by_name(obj, ".dynstr");
 	if (!sec_dynstr)
 	{
-		printf("Can't find .dynstr\n");
+		LOG_WARN(LOG_ELF, "Can't find .dynstr\n");
 		goto done;
 	}
 
 	sec_versym = backend_get_section_by_name(obj, ".gnu.version");
 	if (!sec_versym)
 	{
-		printf("Can't find .gnu.version\n");
+		LOG_WARN(LOG_ELF, "Can't find .gnu.version\n");
 		goto done;
 	}
 
 	sec_versymr = backend_get_section_by_name(obj, ".gnu.version_r");
 	if (!sec_versymr)
 	{
-		printf("Can't find .gnu.version_r\n");
+		LOG_WARN(LOG_ELF, "Can't find .gnu.version_r\n");
 		goto done;
 	}
 
 	sec_text = backend_get_section_by_name(obj, ".text");
 	if (!sec_text)
 	{
-		printf("Can't find code section!\n");
+		LOG_WARN(LOG_ELF, "Can't find code section!\n");
 		goto done;
 	}
 
@@ -1073,7 +1141,7 @@ dynsym:
 	sec_rela = backend_get_section_by_type(obj, SECTION_TYPE_REL);
 	if (!sec_rela)
 	{
-		printf("Can't find PLT reloc section!\n");
+		LOG_WARN(LOG_ELF, "Can't find PLT reloc section!\n");
 		goto done;
 	}
 
@@ -1098,13 +1166,13 @@ dynsym:
 		strncpy(sym_name, (char*)sec_dynstr->data + dsym->name, SYMBOL_MAX_LENGTH);
 		if (strlen((char*)sec_dynstr->data + dsym->name) > SYMBOL_MAX_LENGTH)
 		{
-			printf("warning: symbol name %s will be truncated!\n", sym_name);
+			LOG_WARN(LOG_ELF, "warning: symbol name %s will be truncated!\n", sym_name);
 			sym_name[SYMBOL_MAX_LENGTH] = 0;
 		}
 		//printf("Found symbol name %s at offset 0x%lx\n", sym_name, rela->addr);
 
 		if (!backend_add_symbol(obj, sym_name, rela->addr, SYMBOL_TYPE_FUNCTION, 0, SYMBOL_FLAG_GLOBAL | SYMBOL_FLAG_EXTERNAL, sec_text))
-			printf("Error adding %s\n", sym_name);
+			LOG_ERROR(LOG_ELF, "Error adding %s\n", sym_name);
 
 		char* module_name = (char*)sec_dynstr->data + verent->name;
 		if (module_name)
@@ -1121,17 +1189,17 @@ dynsym:
 					unsigned long plt_addr = *(unsigned long*)(sec->data + (rela->addr - sec->address));
 					unsigned long sym_addr = plt_addr - 6; // why 6?
 					if (!backend_add_import_function(mod, sym_name, sym_addr))
-						printf("Error adding import function %s\n", sym_name);
+						LOG_ERROR(LOG_ELF, "Error adding import function %s\n", sym_name);
 				}
 				else
 				{
-					printf("Error finding section for address 0x%x\n", rela->addr);
+					LOG_ERROR(LOG_ELF, "Error finding section for address 0x%x\n", rela->addr);
 				}
 			}
 		}
 		else
 		{
-			printf("  No import module\n");
+			LOG_DEBUG(LOG_ELF, "  No import module\n");
 		}
 
 		rela++;
@@ -1139,13 +1207,15 @@ dynsym:
 
 done:
 	free(section_strtab);
+	free(src_file);
 
-	printf("ELF32 loading done (%i symbols, %i relocs)\n", backend_symbol_count(obj), backend_relocation_count(obj));
-	printf("-----------------------------------------\n");
+	LOG_INFO(LOG_ELF, "ELF32 loading done (%i symbols, %i relocs)\n", backend_symbol_count(obj), backend_relocation_count(obj));
+	LOG_INFO(LOG_ELF, "-----------------------------------------\n");
 	return obj;
 
 error_strtab:
 	free(section_strtab);
+	free(src_file);
 error:
 	backend_destructor(obj);
 	return NULL;
@@ -1167,10 +1237,10 @@ void elf64_add_import_from_rela(backend_object *obj, elf64_rela* rela, backend_s
 	strncpy(sym_name, (char*)sec_strtab->data + dsym->name, SYMBOL_MAX_LENGTH);
 	if (strlen((char*)sec_symtab->data + dsym->name) > SYMBOL_MAX_LENGTH)
 	{
-		printf("Warning: symbol name %s will be truncated!\n", sym_name);
+		LOG_WARN(LOG_ELF, "Warning: symbol name %s will be truncated!\n", sym_name);
 		sym_name[SYMBOL_MAX_LENGTH] = 0;
 	}
-	DEBUG_PRINT("Found dynamic symbol name %s at offset 0x%lx info: 0x%lx\n", sym_name, rela->addr, rela->info);
+	LOG_TRACE(LOG_ELF, "Found dynamic symbol name %s at offset 0x%lx info: 0x%lx\n", sym_name, rela->addr, rela->info);
 
 	char* module_name = (char*)sec_strtab->data + verent->name;
 	if (module_name)
@@ -1182,14 +1252,14 @@ void elf64_add_import_from_rela(backend_object *obj, elf64_rela* rela, backend_s
 		if (mod)
 		{
 			if (!backend_add_import_function(mod, sym_name, rela->addr))
-				printf("Error adding import function %s@%s\n", sym_name, module_name);
+				LOG_ERROR(LOG_ELF, "Error adding import function %s@%s\n", sym_name, module_name);
 		}
 		else
-			printf("  Error adding import module %s\n", module_name);
+			LOG_ERROR(LOG_ELF, "  Error adding import module %s\n", module_name);
 	}
 	else
 	{
-		printf("  No import module\n");
+		LOG_DEBUG(LOG_ELF, "  No import module\n");
 	}
 }
 
@@ -1238,23 +1308,19 @@ static backend_object* elf64_read_file(FILE* f, elf64_header* h)
    default:
       be_arch = OBJECT_ARCH_UNKNOWN;
    }
-   if (config.verbose)
-		fprintf(stderr, "Arch %i\n", be_arch);
+   LOG_INFO(LOG_ELF, "Arch %i\n", be_arch);
    backend_set_arch(obj, be_arch);
 
-   if (config.verbose)
-   {
-      fprintf(stderr, "Number of section headers: %i\n", h->sh_num);
-      fprintf(stderr, "Size of section headers: %i\n", h->shent_size);
-      fprintf(stderr, "String table index: %i\n", h->sh_str_index);
-   }
+   LOG_DEBUG(LOG_ELF, "Number of section headers: %i\n", h->sh_num);
+   LOG_DEBUG(LOG_ELF, "Size of section headers: %i\n", h->shent_size);
+   LOG_DEBUG(LOG_ELF, "String table index: %i\n", h->sh_str_index);
 
 	backend_set_entry_point(obj, h->entry);
 
 	// validate the size of the section entry struct
 	if (h->shent_size != sizeof(elf64_section))
 	{
-		printf("Size mismatch in section: read %i expected %lu\n",
+		LOG_WARN(LOG_ELF, "Size mismatch in section: read %i expected %lu\n",
 			h->shent_size, sizeof(elf64_section));
 	}
 
@@ -1262,7 +1328,7 @@ static backend_object* elf64_read_file(FILE* f, elf64_header* h)
    fseek(f, h->sh_off + h->shent_size * h->sh_str_index, SEEK_SET);
    if (fread(&in_sec, h->shent_size, 1, f) != 1)
 	{
-		fprintf(stderr, "Error loading string table\n");
+		LOG_ERROR(LOG_ELF, "Error loading string table\n");
 		goto error;
 	}
 
@@ -1287,20 +1353,20 @@ static backend_object* elf64_read_file(FILE* f, elf64_header* h)
 		// make sure this section hasn't already been seen
 		if (backend_get_section_by_name(obj, name))
 		{
-			printf("Warning: duplicate section \"%s\" - skipping\n", name);
+			LOG_WARN(LOG_ELF, "Warning: duplicate section \"%s\" - skipping\n", name);
 			continue;
 		}
 
 		// load the section data unless it is marked as unloadable
 		if (in_sec.type != SHT_NOBITS)
 		{
-			data = (unsigned char*)malloc(in_sec.size);
+			data = (unsigned char*)mem_alloc(MEM_SECTION_DATA, in_sec.size);
 
 			fseek(f, in_sec.offset, SEEK_SET);
 			if (fread(data, in_sec.size, 1, f) != 1)
 			{
-				fprintf(stderr, "Error loading section %s data\n", name);
-				free(data);
+				LOG_ERROR(LOG_ELF, "Error loading section %s data\n", name);
+				mem_free(MEM_SECTION_DATA, data);
 				goto error_strtab;
 			}
 		}
@@ -1331,14 +1397,14 @@ static backend_object* elf64_read_file(FILE* f, elf64_header* h)
 		if (in_sec.type == SHT_SYMTAB || in_sec.type == SHT_DYNSYM || in_sec.type == SHT_DYNAMIC)
 		{
 			// link points to the string table needed for symbols in this section
-			DEBUG_PRINT("Section %s needs string table in %u\n", name, in_sec.link);
+			LOG_TRACE(LOG_ELF, "Section %s needs string table in %u\n", name, in_sec.link);
 			strtab_index = in_sec.link;
 		}
 
 		backend_section *s = backend_add_section(obj, name, in_sec.size, in_sec.addr, data, in_sec.entsize, in_sec.addralign, flags);
 		if (!s)
 		{
-			printf("Error adding section %s\n", name);
+			LOG_ERROR(LOG_ELF, "Error adding section %s\n", name);
 			goto error_strtab;
 		}
 		backend_section_set_type(s, elf_to_backend_section_type((section_type)in_sec.type));
@@ -1359,7 +1425,7 @@ static backend_object* elf64_read_file(FILE* f, elf64_header* h)
 			if ((uint64_t)sec->strtab < MAX_STRING_TABLES)
 			{
 				sec_strtab = backend_get_section_by_index(obj, (uint64_t)sec->strtab);
-				DEBUG_PRINT("Setting strtab for section %s to %s\n", sec->name, sec_strtab->name);
+				LOG_TRACE(LOG_ELF, "Setting strtab for section %s to %s\n", sec->name, sec_strtab->name);
 				backend_section_set_strtab(sec, sec_strtab);
 			}
 		}
@@ -1369,7 +1435,7 @@ static backend_object* elf64_read_file(FILE* f, elf64_header* h)
    sec_symtab = backend_get_section_by_name(obj, ".symtab");
    if (!sec_symtab)
    {
-      printf("Warning: can't find symbol table section!\n");
+      LOG_WARN(LOG_ELF, "Warning: can't find symbol table section!\n");
       goto dynsym;
    }
 
@@ -1386,7 +1452,7 @@ static backend_object* elf64_read_file(FILE* f, elf64_header* h)
 		// get the string table and look up the symbol name
 		sec_strtab = sec_symtab->strtab;
 		name = (char*)sec_strtab->data + sym->name;
-		DEBUG_PRINT("Symbol: %s @ 0x%lx\n", name, sym->value);
+		LOG_TRACE(LOG_ELF, "Symbol: %s @ 0x%lx\n", name, sym->value);
 
 		switch (ELF_SYM_TYPE(sym->info))
 		{
@@ -1394,13 +1460,13 @@ static backend_object* elf64_read_file(FILE* f, elf64_header* h)
 			// The first symbol in an ELF file must have no name and no type
 			//printf("Skipping symbol with no type\n");
 			if (!backend_add_symbol(obj, name, 0, elf_to_backend_sym_type(sym->info), 0, 0, sec_symtab))
-				printf("Failed adding untyped symbol\n");
+				LOG_ERROR(LOG_ELF, "Failed adding untyped symbol\n");
 			continue;
 
 		case ELF_ST_SECTION:
 			sec = backend_get_section_by_index(obj, sym->section_index);
 			if (!backend_add_symbol(obj, sec->name, 0, elf_to_backend_sym_type(sym->info), 0, 0, sec) || !sec)
-				printf("Failed adding section symbol\n");
+				LOG_ERROR(LOG_ELF, "Failed adding section symbol\n");
 			//printf("Adding section symbol %s (%i)\n", sec->name, sym->section_index);
 			continue;
 
@@ -1457,7 +1523,7 @@ dynsym:
    sec_dynamic = backend_get_section_by_name(obj, ".dynamic");
    if (!sec_dynamic)
    {
-      printf("Can't find dynamic section!\n");
+      LOG_INFO(LOG_ELF, "Can't find dynamic section!\n");
       goto done;
    }
 
@@ -1471,20 +1537,20 @@ dynsym:
 			sec_dynstr = backend_get_section_by_address(obj, dyn_entry->d_ptr);
 			if (!sec_dynstr)
 			{
-				printf("Can't find .dynstr\n");
+				LOG_WARN(LOG_ELF, "Can't find .dynstr\n");
 				goto done;
 			}
-			printf("Dynamic string table @ 0x%lx (%s)\n", dyn_entry->d_ptr, sec_dynstr->name);
+			LOG_DEBUG(LOG_ELF, "Dynamic string table @ 0x%lx (%s)\n", dyn_entry->d_ptr, sec_dynstr->name);
 			break;
 
 		case DT_SYMTAB:
 			sec_dynsym = backend_get_section_by_address(obj, dyn_entry->d_ptr);
 			if (!sec_dynsym)
 			{
-				printf("Can't find .dynsym\n");
+				LOG_WARN(LOG_ELF, "Can't find .dynsym\n");
 				goto done;
 			}
-			printf("Dynamic symbol table @ 0x%lx (%s)\n", dyn_entry->d_ptr, sec_dynsym->name);
+			LOG_DEBUG(LOG_ELF, "Dynamic symbol table @ 0x%lx (%s)\n", dyn_entry->d_ptr, sec_dynsym->name);
 			break;
 		}
 		dyn_entry++;
@@ -1493,14 +1559,14 @@ dynsym:
    sec_versymr = backend_get_section_by_name(obj, ".gnu.version_r");
    if (!sec_versymr)
    {
-      printf("Can't find .gnu.version_r\n");
+      LOG_WARN(LOG_ELF, "Can't find .gnu.version_r\n");
       goto done;
    }
 
    sec_text = backend_get_section_by_name(obj, ".text");
    if (!sec_text)
    {
-      printf("Can't find code section!\n");
+      LOG_WARN(LOG_ELF, "Can't find code section!\n");
       goto done;
    }
 
@@ -1515,18 +1581,18 @@ dynsym:
 		switch(dyn_entry->d_tag)
 		{
 		case DT_NEEDED:
-			printf("Need library: %s\n", sec_dynstr->data + dyn_entry->d_val);
+			LOG_INFO(LOG_ELF, "Need library: %s\n", sec_dynstr->data + dyn_entry->d_val);
 			break;
 
 		case DT_PLTRELSZ:
-			printf("Size of PLT reloc table: %lu\n", dyn_entry->d_val);
+			LOG_DEBUG(LOG_ELF, "Size of PLT reloc table: %lu\n", dyn_entry->d_val);
 			break;
 
 		case DT_PLTGOT:
 			sec_got = backend_get_section_by_address(obj, dyn_entry->d_ptr);
 			if (!sec_got)
 				goto done;
-			printf("PLT GOT is in: (%s) %u entries\n",
+			LOG_DEBUG(LOG_ELF, "PLT GOT is in: (%s) %u entries\n",
 				sec_got->name, sec_got->size/sec_got->entry_size);
 			break;
 
@@ -1534,7 +1600,7 @@ dynsym:
 			sec_reladyn = backend_get_section_by_address(obj, dyn_entry->d_ptr);
 			if (!sec_reladyn)
 				goto done;
-			printf("Where's the RELA table: 0x%lx (%s)\n", dyn_entry->d_ptr,
+			LOG_DEBUG(LOG_ELF, "Where's the RELA table: 0x%lx (%s)\n", dyn_entry->d_ptr,
 				sec_reladyn->name);
 			break;
 
@@ -1547,14 +1613,14 @@ dynsym:
 			break;
 
 		case DT_PLTREL:
-			DEBUG_PRINT("Uses %s table\n", dyn_entry->d_val==DT_REL?"REL":"RELA");
+			LOG_TRACE(LOG_ELF, "Uses %s table\n", dyn_entry->d_val==DT_REL?"REL":"RELA");
 			break;
 
 		case DT_JMPREL:
 			sec_relaplt = backend_get_section_by_address(obj, dyn_entry->d_ptr);
 			if (!sec_relaplt)
 				goto done;
-			printf("PLT relocations @ 0x%lx (%s)\n", dyn_entry->d_ptr, sec_relaplt->name);
+			LOG_DEBUG(LOG_ELF, "PLT relocations @ 0x%lx (%s)\n", dyn_entry->d_ptr, sec_relaplt->name);
 			break;
 
 		case DT_VERDEF:
@@ -1583,7 +1649,7 @@ dynsym:
 			break;
 
 		default:
-			printf("Unknown Dynamic tag: %lu\n", dyn_entry->d_tag);
+			LOG_DEBUG(LOG_ELF, "Unknown Dynamic tag: %lu\n", dyn_entry->d_tag);
 		}
 		dyn_entry++;
 	}
@@ -1594,7 +1660,7 @@ dynsym:
 	// Make sure our understanding of the RELA format is correct
 	if (sizeof(elf64_rela) != sec_relaplt->entry_size)
 	{
-		printf("Warning: rela struct size (0x%lx) doesn't match reported size (0x%x)!\n",
+		LOG_WARN(LOG_ELF, "Warning: rela struct size (0x%lx) doesn't match reported size (0x%x)!\n",
 			sizeof(elf64_rela), sec_relaplt->entry_size);
 	}
 
@@ -1605,17 +1671,17 @@ dynsym:
    }
 
 	// look at .rela.dyn for any missing symbols
-	printf("Looking at rela.dyn\n");
+	LOG_DEBUG(LOG_ELF, "Looking at rela.dyn\n");
 	for (rela = (elf64_rela*)sec_reladyn->data; rela < (elf64_rela*)(sec_reladyn->data + sec_reladyn->size); rela++)
    {
 		if (ELF64_R_TYPE(rela->info) != R_AMD64_RELATIVE)
 		{
 			elf64_add_import_from_rela(obj, rela, sec_dynsym, sec_dynstr, sec_versymr);
-			printf("Found reladyn for 0x%lx (%u)\n", rela->addr, ELF64_R_TYPE(rela->info));
+			LOG_TRACE(LOG_ELF, "Found reladyn for 0x%lx (%u)\n", rela->addr, ELF64_R_TYPE(rela->info));
 		}
 	}
 
-	DEBUG_PRINT("Adding missing functions from PLT sections\n");
+	LOG_DEBUG(LOG_ELF, "Adding missing functions from PLT sections\n");
 	// Add a normal function symbol for every PLT entry that points to an import symbol
 	sec = backend_get_first_section(obj);
 	while (sec)
@@ -1631,7 +1697,7 @@ dynsym:
 
 			// iterate over all entries in the PLT
 			csh cs_dis;
-			cs_insn *cs_ins;
+			cs_insn *cs_ins = NULL;
 			cs_x86_op *cs_op;
 			const uint8_t *pc;
 			uint64_t offset;
@@ -1639,10 +1705,6 @@ dynsym:
 			size_t n;
 			unsigned int entry_size = sec->entry_size;
 
-			if (cs_open(CS_ARCH_X86, CS_MODE_64, &cs_dis) != CS_ERR_OK)
-				goto done;
-			cs_ins = cs_malloc(cs_dis);
-
 			// There are a few kinds of entries in the PLT. The 'main' PLT is not interesting for us;
 			// call instructions use the 'other' PLTs. Since we can't (yet) differentiate, at the top
 			// level, we must parse all PLT sections. In x86_64, all entries start with an ENDBR64
@@ -1652,43 +1714,63 @@ dynsym:
 			// have a jmp instruction into the GOT. We want to create a symbol at this PLT entry because
 			// call instructions point to these entries. But to get the symbol name, we must use the
 			// GOT entry that the PLT entry is pointing at.
+			// Almost all entries follow one of the fixed layouts in plt_templates_x86_64, so the
+			// disassembler is only started for the ones that don't.
 			for (unsigned char *plt_entry = sec->data; plt_entry < (sec->data + sec->size); plt_entry += entry_size)
 			{
-				// decode the entry
+				unsigned long target;
+				unsigned long remaining = sec->data + sec->size - plt_entry;
+
 				pc_addr = sec->address + (plt_entry - sec->data);
-				pc = plt_entry;
-				unsigned long target = decode_plt_entry_x86_64(cs_dis, cs_ins, pc, pc_addr, entry_size);
+				if (!match_plt_entry_x86_64(plt_entry, entry_size < remaining ? entry_size : remaining, pc_addr, &target))
+				{
+					// unknown layout - decode the entry
+					if (!cs_ins)
+					{
+						if (cs_open(CS_ARCH_X86, CS_MODE_64, &cs_dis) != CS_ERR_OK)
+							goto done;
+						cs_ins = cs_malloc(cs_dis);
+					}
+					pc = plt_entry;
+					target = decode_plt_entry_x86_64(cs_dis, cs_ins, pc, pc_addr, entry_size);
+				}
 				if (target)
 				{
 					backend_symbol* import = backend_find_import_by_address(obj, target);
 					if (import)
 					{
-						DEBUG_PRINT("Adding symbol %s @ 0x%lx\n", import->name, pc_addr);
+						LOG_TRACE(LOG_ELF, "Adding symbol %s @ 0x%lx\n", import->name, pc_addr);
 						backend_symbol *pltsym = backend_add_symbol(obj, import->name, pc_addr,
 							SYMBOL_TYPE_FUNCTION, 0, 0, sec_text);
 						if (!pltsym)
-							printf("Error adding symbol\n");
+							LOG_ERROR(LOG_ELF, "Error adding symbol\n");
 					}
 					else
 					{
-						printf("Can't find an import symbol for address 0x%lx\n", target);
+						LOG_DEBUG(LOG_ELF, "Can't find an import symbol for address 0x%lx\n", target);
 					}
 				}
 			}
-			cs_close(&cs_dis);
+			if (cs_ins)
+			{
+				cs_free(cs_ins, 1);
+				cs_close(&cs_dis);
+			}
 		}
 		sec = backend_get_next_section(obj);
 	}
 
 done:
    free(section_strtab);
+	free(src_file);
 
-   printf("ELF64 loading done (%i symbols, %i relocs)\n", backend_symbol_count(obj), backend_relocation_count(obj));
-   printf("-----------------------------------------\n");
+   LOG_INFO(LOG_ELF, "ELF64 loading done (%i symbols, %i relocs)\n", backend_symbol_count(obj), backend_relocation_count(obj));
+   LOG_INFO(LOG_ELF, "-----------------------------------------\n");
    return obj;
 
 error_strtab:
 	free(section_strtab);
+	free(src_file);
 error:
 	backend_destructor(obj);
 	return NULL;
@@ -1704,7 +1786,7 @@ static backend_object* elf_read_file(const char* filename)
    FILE* f = fopen(filename, "rb");
    if (!f)
    {
-      printf("can't open file\n");
+      LOG_DEBUG(LOG_ELF, "can't open file\n");
       goto done;
    }
 
@@ -1717,14 +1799,12 @@ static backend_object* elf_read_file(const char* filename)
 	if ((fread(buff, sizeof(elf64_header), 1, f) != 1) ||
 		(memcmp(buff, ELF_MAGIC, MAGIC_SIZE) != 0))
 	{
-		if (config.verbose)
-			printf("Error reading elf64 header\n");
+		LOG_INFO(LOG_ELF, "Error reading elf64 header\n");
       goto done;
 	}
    
-#ifdef DEBUG
-	dump_elf_header(buff);
-#endif
+	if (LOG_ENABLED(LOG_ELF, LOG_LEVEL_DEBUG))
+		dump_elf_header(buff);
    
    h = (elf64_header*)buff;
 
@@ -1734,7 +1814,7 @@ static backend_object* elf_read_file(const char* filename)
    else if (h->size == 2)
       obj = elf64_read_file(f, (elf64_header*)buff);
    else
-      printf("Unknown ELF size: %i (not 32-bit, not 64-bit)\n", h->size);
+      LOG_ERROR(LOG_ELF, "Unknown ELF size: %i (not 32-bit, not 64-bit)\n", h->size);
 
 done:
    free(buff);
@@ -1742,7 +1822,7 @@ done:
    return obj;
 }
 
-static int elf32_write_file(backend_object* obj, const char* filename)
+static int elf32_write_file(backend_object* obj, FILE* f)
 {
    backend_section *bs;
    elf32_header fh;
@@ -1752,13 +1832,6 @@ static int elf32_write_file(backend_object* obj, const char* filename)
 
    //printf("elf32_write_file\n");
 
-   FILE* f = fopen(filename, "wb");
-   if (!f)
-   {
-      printf("can't open file\n");
-      return -1;
-   }
-
    // before anything, ensure the backend object isn't missing anything, and is ready to be written
    
    // if there are any relocations, we must have a .rela.text section
@@ -1788,6 +1861,7 @@ static int elf32_write_file(backend_object* obj, const char* filename)
 		// they both depend on the ordering. Obviously, no more symbols should be added
 		// after calling this function.
 		backend_sort_symbols(obj, elfcmp);
+		elf_number_symbols(obj);
    }
 
    // write file header
@@ -1813,7 +1887,7 @@ static int elf32_write_file(backend_object* obj, const char* filename)
    int fpos_data = fh.sh_off + fh.shent_size*fh.sh_num;
 
    // build the section header string table with the names we need
-   char* shstrtab = (char*)malloc(shstrtab_size); // just need enough space for a few strings
+   char* shstrtab = (char*)mem_alloc(MEM_STRTAB, shstrtab_size); // just need enough space for a few strings
    char* shstrtab_entry = shstrtab+1;
    shstrtab[0] = 0; // the initial entry is always 0
    bs = backend_get_first_section(obj);
@@ -1827,15 +1901,15 @@ static int elf32_write_file(backend_object* obj, const char* filename)
       {
 			unsigned int offset = shstrtab_entry - shstrtab;
 			shstrtab_size += 4096;
-			printf("Exceeded section header string table size - extending to %u\n", shstrtab_size);
-			shstrtab = (char*)realloc(shstrtab, shstrtab_size);
+			LOG_DEBUG(LOG_ELF, "Exceeded section header string table size - extending to %u\n", shstrtab_size);
+			shstrtab = (char*)mem_realloc(MEM_STRTAB, shstrtab, shstrtab_size);
 			shstrtab_entry = shstrtab + offset;
       }
       bs = backend_get_next_section(obj);
    }
 
    // build the symbol string table as well
-   char* strtab = (char*)malloc(strtab_size);
+   char* strtab = (char*)mem_alloc(MEM_STRTAB, strtab_size);
    char* strtab_entry = strtab+1;
    strtab[0] = 0; // the initial entry is always 0
 
@@ -1860,7 +1934,7 @@ static int elf32_write_file(backend_object* obj, const char* filename)
       if (strcmp(".text", bs->name) == 0)
       {
          // write the .text section & header
-         printf("Writing .text section\n");
+         LOG_DEBUG(LOG_ELF, "Writing .text section\n");
          sh.type = SHT_PROGBITS;
          sh.flags = (1<<SHF_ALLOC) | (1<<SHF_EXECINSTR);
          sh.addr = bs->address;
@@ -1879,15 +1953,15 @@ static int elf32_write_file(backend_object* obj, const char* filename)
       else if (strcmp(".rela.text", bs->name) == 0)
       {
          // write the .rela section header
-         printf("Writing .rela.text section\n");
+         LOG_DEBUG(LOG_ELF, "Writing .rela.text section\n");
          sh.type = SHT_RELA;
          sh.flags = (1<<SHF_INFO);
          sh.link = backend_get_section_index_by_name(obj, ".symtab"); // which symbol table to use
          if (sh.link == -1)
-            printf("Error getting .symtab index\n");
+            LOG_ERROR(LOG_ELF, "Error getting .symtab index\n");
          sh.info = backend_get_section_index_by_name(obj, ".text"); // which code is relevant
          if (sh.info == -1)
-            printf("Error getting .text index\n");
+            LOG_ERROR(LOG_ELF, "Error getting .text index\n");
          sh.entsize = sizeof(elf32_rela);
          sh.size = backend_relocation_count(obj) * sizeof(elf32_rela);
          sh.addralign = 8;
@@ -1901,8 +1975,7 @@ static int elf32_write_file(backend_object* obj, const char* filename)
             {
 					elf32_rela rela;
 					unsigned int reloc_type = backend_to_elf32_reloc_type(r->type);
-					// elf has 1 null symbol at the beginning that is not accounted for when getting the index
-					unsigned int index = backend_get_symbol_index(obj, r->symbol)+1;
+					unsigned int index = r->symbol ? r->symbol->_index : 0;
 
 					rela.addr = r->offset;
 					rela.info = ELF32_R_INFO(index, reloc_type);
@@ -1919,7 +1992,7 @@ static int elf32_write_file(backend_object* obj, const char* filename)
       else if (strcmp(".data", bs->name) == 0)
       {
          // write the .data section header
-         DEBUG_PRINT("Writing .data section\n");
+         LOG_DEBUG(LOG_ELF, "Writing .data section\n");
          sh.type = SHT_PROGBITS;
          sh.flags = (1<<SHF_ALLOC) | (1<<SHF_WRITE);
          sh.addr = bs->address;
@@ -1938,7 +2011,7 @@ static int elf32_write_file(backend_object* obj, const char* filename)
       else if (strcmp(".bss", bs->name) == 0)
       {
          // write the .bss section header
-         printf("Writing .bss section\n");
+         LOG_DEBUG(LOG_ELF, "Writing .bss section\n");
          sh.type = SHT_NOBITS;
          sh.flags = (1<<SHF_ALLOC) | (1<<SHF_WRITE);
          sh.addr = bs->address;
@@ -1957,7 +2030,7 @@ static int elf32_write_file(backend_object* obj, const char* filename)
       else if (strcmp(".rodata", bs->name) == 0)
       {
          // write the .rodata section header
-         printf("Writing .rodata section\n");
+         LOG_DEBUG(LOG_ELF, "Writing .rodata section\n");
          sh.type = SHT_PROGBITS;
          sh.flags = (1<<SHF_ALLOC);
          sh.addr = bs->address;
@@ -1978,11 +2051,11 @@ static int elf32_write_file(backend_object* obj, const char* filename)
          backend_symbol* sym;
          int text_index = backend_get_section_index_by_name(obj, ".text");
          // write the .symtab section header
-         printf("Writing .symtab section\n");
+         LOG_DEBUG(LOG_ELF, "Writing .symtab section\n");
          sh.type = SHT_SYMTAB;
          sh.link = backend_get_section_index_by_name(obj, ".strtab"); // which string table to use
          if (sh.link == -1)
-            printf("Error getting .symtab index\n");
+            LOG_ERROR(LOG_ELF, "Error getting .symtab index\n");
 
          //printf("symtab index=%i\n", sh.link);
          sh.entsize = sizeof(elf32_symbol);
@@ -2037,8 +2110,8 @@ static int elf32_write_file(backend_object* obj, const char* filename)
                   {
                      unsigned int offset = strtab_entry - strtab;
                      strtab_size += 4096;
-                     printf("Exceeded string table size - extending to %u\n", strtab_size);
-                     strtab = (char*)realloc(strtab, strtab_size);
+                     LOG_DEBUG(LOG_ELF, "Exceeded string table size - extending to %u\n", strtab_size);
+                     strtab = (char*)mem_realloc(MEM_STRTAB, strtab, strtab_size);
                      strtab_entry = strtab + offset;
                   }
                   strcpy(strtab_entry, sym->name);
@@ -2095,13 +2168,108 @@ static int elf32_write_file(backend_object* obj, const char* filename)
    }
 
 done:
-   free(shstrtab);
-   free(strtab);
-   fclose(f);
+   mem_free(MEM_STRTAB, shstrtab);
+   mem_free(MEM_STRTAB, strtab);
    return 0;
 }
 
-static int elf64_write_file(backend_object* obj, const char* filename)
+// Only .text and per-function .text.<name> sections are written as code
+static int elf_is_code_section_name(const char *name)
+{
+	return (strncmp(name, ".text", 5) == 0 && (name[5] == 0 || name[5] == '.'));
+}
+
+// Relocations are written to the relocation section of the code section they apply to. Anything
+// else is assumed to be in .text.
+static backend_section* elf_reloc_code_section(backend_reloc *r, backend_section *text)
+{
+	if (r->section && elf_is_code_section_name(r->section->name))
+		return r->section;
+	return text;
+}
+
+// 'existing' says whether the object already has relocation sections that could be reused; the
+// objects built by the delinker don't, which saves a search through every section per code section
+static backend_section* elf_add_rela_section(backend_object *obj, backend_section *code, int existing)
+{
+	char *name = (char*)malloc(strlen(code->name) + 6);
+	if (!name)
+		return NULL;
+
+	sprintf(name, ".rela%s", code->name);
+	backend_section *rela = existing ? backend_get_section_by_name(obj, name) : NULL;
+	if (!rela)
+		rela = backend_add_section(obj, name, 0, 0, 0, 0, 0, 0);
+	free(name);
+
+	if (rela)
+	{
+		code->_link = rela;
+		rela->_link = code;
+	}
+	return rela;
+}
+
+// Convert the relocations to ELF format, in the relocation section of the code they belong to.
+// This has to be done after the symbols are sorted, since the relocations refer to them by index.
+static void elf64_build_rela_sections(backend_object *obj)
+{
+	backend_section *text = backend_get_section_by_name(obj, ".text");
+	backend_section *rela_text = backend_get_section_by_name(obj, ".rela.text");
+	backend_section *bs;
+	backend_reloc *r;
+
+	// count the relocations for each section
+	for (bs = backend_get_first_section(obj); bs; bs = backend_get_next_section(obj))
+	{
+		if (strncmp(".rela", bs->name, 5) == 0 && (bs->_link || bs == rela_text))
+		{
+			mem_free(obj->_data_mem, bs->data);
+			bs->data = NULL;
+			bs->size = 0;
+		}
+	}
+	for (r = backend_get_first_reloc(obj); r; r = backend_get_next_reloc(obj))
+	{
+		backend_section *code = elf_reloc_code_section(r, text);
+		bs = code ? code->_link : rela_text;
+		if (bs)
+			bs->size += sizeof(elf64_rela);
+	}
+
+	// allocate the buffers, then fill them in (the size is used as the write position)
+	for (bs = backend_get_first_section(obj); bs; bs = backend_get_next_section(obj))
+	{
+		if (strncmp(".rela", bs->name, 5) == 0 && bs->size && (bs->_link || bs == rela_text))
+		{
+			bs->data = (unsigned char*)mem_alloc(obj->_data_mem, bs->size);
+			if (!bs->data)
+				LOG_ERROR(LOG_ELF, "Error allocating %u bytes for %s\n", bs->size, bs->name);
+			bs->size = 0;
+		}
+	}
+	for (r = backend_get_first_reloc(obj); r; r = backend_get_next_reloc(obj))
+	{
+		backend_section *code = elf_reloc_code_section(r, text);
+		elf64_rela rela;
+
+		bs = code ? code->_link : rela_text;
+		if (!bs || !bs->data)
+			continue;
+
+		unsigned int reloc_type = backend_to_elf64_reloc_type(r->type);
+		unsigned int index = r->symbol ? r->symbol->_index : 0;
+		rela.addr = r->offset;
+		rela.info = ELF64_R_INFO(index, reloc_type);
+		rela.addend = r->addend;
+		//DEBUG_PRINT("writing reloc for 0x%lx symbol: %s (%u) addend: 0x%lx type=%u\n",
+		//	rela.addr, r->symbol->name, index, rela.addend, reloc_type);
+		memcpy(bs->data + bs->size, &rela, sizeof(elf64_rela));
+		bs->size += sizeof(elf64_rela);
+	}
+}
+
+static int elf64_write_file(backend_object* obj, FILE* f)
 {
    backend_section *bs;
    elf64_header fh;
@@ -2111,19 +2279,28 @@ static int elf64_write_file(backend_object* obj, const char* filename)
 
    //printf("elf64_write_file\n");
 
-   FILE* f = fopen(filename, "wb");
-   if (!f)
-   {
-      printf("can't open file\n");
-      return -1;
-   }
-
    // before anything, ensure the backend object isn't missing anything, and is ready to be written
    
-   // if there are any relocations, we must have a .rela.text section
+   // if there are any relocations, we must have a relocation section for each code section they apply to
    if (backend_relocation_count(obj) > 0)
    {
-      if (!backend_get_section_by_name(obj, ".rela.text"))
+      backend_section *text = backend_get_section_by_name(obj, ".text");
+      int orphans = 0;
+      int existing = 0;
+      for (bs = backend_get_first_section(obj); bs; bs = backend_get_next_section(obj))
+      {
+         if (strncmp(".rela", bs->name, 5) == 0)
+            existing = 1;
+      }
+      for (backend_reloc* r = backend_get_first_reloc(obj); r; r = backend_get_next_reloc(obj))
+      {
+         backend_section *code = elf_reloc_code_section(r, text);
+         if (!code)
+            orphans = 1;
+         else if (!code->_link)
+            elf_add_rela_section(obj, code, existing);
+      }
+      if (orphans && !backend_get_section_by_name(obj, ".rela.text"))
          bs = backend_add_section(obj, ".rela.text", 0, 0, 0, 0, 0, 0);
    }
 
@@ -2147,8 +2324,17 @@ static int elf64_write_file(backend_object* obj, const char* filename)
 		// they both depend on the ordering. Obviously, no more symbols should be added
 		// after calling this function.
 		backend_sort_symbols(obj, elfcmp);
+		elf_number_symbols(obj);
    }
 
+   // the section indices are needed for every symbol and relocation section, so don't look them up by name
+   int index = 1;
+   for (bs = backend_get_first_section(obj); bs; bs = backend_get_next_section(obj))
+      bs->_index = index++;
+
+   // now that the symbols are in order, the relocation sections can be filled in
+   elf64_build_rela_sections(obj);
+
    // write file header
    memset(&fh, 0, sizeof(elf64_header));
    memcpy(fh.magic, ELF_MAGIC, MAGIC_SIZE);
@@ -2172,29 +2358,30 @@ static int elf64_write_file(backend_object* obj, const char* filename)
    int fpos_data = fh.sh_off + fh.shent_size*fh.sh_num;
 
    // build the section header string table with the names we need
-   char* shstrtab = (char*)malloc(shstrtab_size); // just need enough space for a few strings
+   char* shstrtab = (char*)mem_alloc(MEM_STRTAB, shstrtab_size); // just need enough space for a few strings
    char* shstrtab_entry = shstrtab+1;
    shstrtab[0] = 0; // the initial entry is always 0
    bs = backend_get_first_section(obj);
    while (bs)
    {
-      bs->_name = shstrtab_entry - shstrtab;
-      // enter the name in the string table
-      strcpy(shstrtab_entry, bs->name);
-      shstrtab_entry += strlen(shstrtab_entry) + 1;
-      if (shstrtab_entry - shstrtab > shstrtab_size)
+      // make sure the name fits - with per-function sections, there can be a lot of them
+      if (shstrtab_entry - shstrtab + strlen(bs->name) + 1 > shstrtab_size)
       {
 			unsigned int offset = shstrtab_entry - shstrtab;
-			shstrtab_size += 4096;
-			printf("Exceeded section header string table size - extending to %u\n", shstrtab_size);
-			shstrtab = (char*)realloc(shstrtab, shstrtab_size);
+			shstrtab_size += 4096 + strlen(bs->name);
+			LOG_DEBUG(LOG_ELF, "Exceeded section header string table size - extending to %u\n", shstrtab_size);
+			shstrtab = (char*)mem_realloc(MEM_STRTAB, shstrtab, shstrtab_size);
 			shstrtab_entry = shstrtab + offset;
       }
+      bs->_name = shstrtab_entry - shstrtab;
+      // enter the name in the string table
+      strcpy(shstrtab_entry, bs->name);
+      shstrtab_entry += strlen(shstrtab_entry) + 1;
       bs = backend_get_next_section(obj);
    }
 
    // build the symbol string table as well
-   char* strtab = (char*)malloc(strtab_size);
+   char* strtab = (char*)mem_alloc(MEM_STRTAB, strtab_size);
    char* strtab_entry = strtab+1;
    strtab[0] = 0; // the initial entry is always 0
 
@@ -2216,10 +2403,10 @@ static int elf64_write_file(backend_object* obj, const char* filename)
       sh.entsize = 0;
       sh.name = bs->_name;
 
-      if (strcmp(".text", bs->name) == 0)
+      if (elf_is_code_section_name(bs->name))
       {
-         // write the .text section & header
-         printf("Writing .text section\n");
+         // write the .text (or .text.<name>) section & header
+         LOG_DEBUG(LOG_ELF, "Writing %s section\n", bs->name);
          sh.type = SHT_PROGBITS;
          sh.flags = (1<<SHF_ALLOC) | (1<<SHF_EXECINSTR);
          sh.addr = bs->address;
@@ -2235,40 +2422,27 @@ static int elf64_write_file(backend_object* obj, const char* filename)
             fpos_data += sh.size;
          }
       }
-      else if (strcmp(".rela.text", bs->name) == 0)
+      else if (strncmp(".rela", bs->name, 5) == 0 && (bs->_link || strcmp(".rela.text", bs->name) == 0))
       {
-         // write the .rela section header
-         printf("Writing .rela.text section\n");
+         // write the relocation section header - the contents were built by elf64_build_rela_sections
+         LOG_DEBUG(LOG_ELF, "Writing %s section\n", bs->name);
          sh.type = SHT_RELA;
          sh.flags = (1<<SHF_INFO);
          sh.link = backend_get_section_index_by_name(obj, ".symtab"); // which symbol table to use
          if (sh.link == -1)
-            printf("Error getting .symtab index\n");
-         sh.info = backend_get_section_index_by_name(obj, ".text"); // which code is relevant
+            LOG_ERROR(LOG_ELF, "Error getting .symtab index\n");
+         sh.info = bs->_link ? bs->_link->_index : -1; // which code is relevant
          if (sh.info == -1)
-            printf("Error getting .text index\n");
+            LOG_ERROR(LOG_ELF, "Error getting .text index\n");
          sh.entsize = sizeof(elf64_rela);
-         sh.size = backend_relocation_count(obj) * sizeof(elf64_rela);
+         sh.size = bs->size;
          sh.addralign = 8;
          if (sh.size)
          {
             sh.offset = ALIGN(fpos_data, sh.addralign);
             fpos_cur = ftell(f);
             fseek(f, sh.offset, SEEK_SET);
-            backend_reloc* r = backend_get_first_reloc(obj);
-            while (r)
-            {
-					elf64_rela rela;
-					unsigned int reloc_type = backend_to_elf64_reloc_type(r->type);
-					unsigned int index = backend_get_symbol_index(obj, r->symbol)+1;
-					rela.addr = r->offset;
-					rela.info = ELF64_R_INFO(index, reloc_type);
-					rela.addend = r->addend;
-					//DEBUG_PRINT("writing reloc for 0x%lx symbol: %s (%u) addend: 0x%lx type=%u\n",
-					//	rela.addr, r->symbol->name, index, rela.addend, reloc_type);
-					fwrite(&rela, sizeof(elf64_rela), 1, f);
-					r = backend_get_next_reloc(obj);
-            }
+            fwrite(bs->data, sh.size, 1, f);
             fpos_data = ftell(f);
             fseek(f, fpos_cur, SEEK_SET);
          }
@@ -2276,7 +2450,7 @@ static int elf64_write_file(backend_object* obj, const char* filename)
       else if (strcmp(".data", bs->name) == 0)
       {
          // write the .data section header
-         DEBUG_PRINT("Writing .data section\n");
+         LOG_DEBUG(LOG_ELF, "Writing .data section\n");
          sh.type = SHT_PROGBITS;
          sh.flags = (1<<SHF_ALLOC) | (1<<SHF_WRITE);
          sh.addr = bs->address;
@@ -2295,7 +2469,7 @@ static int elf64_write_file(backend_object* obj, const char* filename)
       else if (strcmp(".bss", bs->name) == 0)
       {
          // write the .bss section header
-         DEBUG_PRINT("Writing .bss section\n");
+         LOG_DEBUG(LOG_ELF, "Writing .bss section\n");
          sh.type = SHT_NOBITS;
          sh.flags = (1<<SHF_ALLOC) | (1<<SHF_WRITE);
          sh.addr = bs->address;
@@ -2314,7 +2488,7 @@ static int elf64_write_file(backend_object* obj, const char* filename)
       else if (strcmp(".rodata", bs->name) == 0)
       {
          // write the .rodata section header
-         DEBUG_PRINT("Writing .rodata section\n");
+         LOG_DEBUG(LOG_ELF, "Writing .rodata section\n");
          sh.type = SHT_PROGBITS;
          sh.flags = (1<<SHF_ALLOC);
          sh.addr = bs->address;
@@ -2333,13 +2507,12 @@ static int elf64_write_file(backend_object* obj, const char* filename)
       else if (strcmp(".symtab", bs->name) == 0)
       {
          backend_symbol* sym;
-         int text_index = backend_get_section_index_by_name(obj, ".text");
          // write the .symtab section header
-         DEBUG_PRINT("Writing .symtab section\n");
+         LOG_DEBUG(LOG_ELF, "Writing .symtab section\n");
          sh.type = SHT_SYMTAB;
          sh.link = backend_get_section_index_by_name(obj, ".strtab"); // which string table to use
          if (sh.link == -1)
-            printf("Error getting .symtab index\n");
+            LOG_ERROR(LOG_ELF, "Error getting .symtab index\n");
          // sh.info contains the index of the first non-local symbol
 
          //printf("symtab index=%i\n", sh.link);
@@ -2377,7 +2550,9 @@ static int elf64_write_file(backend_object* obj, const char* filename)
 					if (sym->section && !(sym->flags & SYMBOL_FLAG_EXTERNAL))
 					{
 						//printf("Getting index for section %s for symbol %s\n", sym->section->name, sym->name);
-						s.section_index = backend_get_section_index_by_name(obj, sym->section->name);
+						s.section_index = sym->section->_index;
+						if (!s.section_index)
+							s.section_index = backend_get_section_index_by_name(obj, sym->section->name);
 					}
                if (sym->type == SYMBOL_TYPE_FILE)
                   s.section_index = ELF_SECTION_ABS;
@@ -2390,12 +2565,12 @@ static int elf64_write_file(backend_object* obj, const char* filename)
 					// set the name to point to the string table
                if (sym->name)
                {
-                  if (strtab_entry - strtab + strlen(sym->name) > strtab_size)
+                  if (strtab_entry - strtab + strlen(sym->name) + 1 > strtab_size)
                   {
                      unsigned int offset = strtab_entry - strtab;
-                     strtab_size += 4096;
+                     strtab_size += 4096 + strlen(sym->name);
                      //printf("Exceeded string table size - extending to %u\n", strtab_size);
-                     strtab = (char*)realloc(strtab, strtab_size);
+                     strtab = (char*)mem_realloc(MEM_STRTAB, strtab, strtab_size);
                      strtab_entry = strtab + offset;
                   }
                   strcpy(strtab_entry, sym->name);
@@ -2457,9 +2632,8 @@ static int elf64_write_file(backend_object* obj, const char* filename)
    }
 
 done:
-   free(shstrtab);
-   free(strtab);
-   fclose(f);
+   mem_free(MEM_STRTAB, shstrtab);
+   mem_free(MEM_STRTAB, strtab);
    return 0;
 }
 
@@ -0,0 +1,27 @@
+#ifndef _ERRORS__H
+#define _ERRORS__H
+
+// this must be synchronized with "error_code_str" string table in delinker.c,
+// because these defines are used as a direct index into the table
+enum error_codes
+{
+   ERR_NONE,
+   ERR_BAD_FILE,
+   ERR_BAD_FORMAT,
+   ERR_NO_SYMS,
+   ERR_NO_SYMS_AFTER_RECONSTRUCT,
+   ERR_NO_SECTION,
+   ERR_NO_TEXT_SECTION,
+   ERR_NO_PLT_SECTION,
+	ERR_CANT_CREATE_OO,
+	ERR_CANT_WRITE_OO,
+	ERR_UNSUPPORTED_ARCH,
+	ERR_CANT_DISASSEMBLE,
+   ERR_NO_MEMORY,
+	ERR_REENTERED,
+	ERR_SINK_STOPPED,
+};
+
+const char *error_message(int code);
+
+#endif // _ERRORS__H
@@ -0,0 +1,344 @@
+/* Identical code folding.
+Template instantiations, thunks and small wrappers often compile to exactly the same code. Once
+build_relocations has cleared the relocated operands, such functions are byte-for-byte identical
+and their relocations point to the same places. Each set of duplicates is folded into the first
+one: the others become aliases (extra names for the same code), so the code is only written once.
+Functions are hashed first, so only functions with the same hash have to be compared in full.
+Like the linker's --icf=safe, a function whose address is taken is never folded away, since the
+program may compare function pointers. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "backend.h"
+#include "config.h"
+#include "log.h"
+
+#define FNV_OFFSET_BASIS	14695981039346656037UL
+#define FNV_PRIME				1099511628211UL
+
+typedef struct icf_function
+{
+	backend_symbol *sym;
+	unsigned long hash;
+	unsigned int index;			// position in the symbol table - the first duplicate is kept
+	unsigned int first_reloc;	// relocations inside the function (in the sorted array)
+	unsigned int reloc_count;
+	int address_taken;			// referenced by anything but a call or jump
+} icf_function;
+
+static unsigned long hash_bytes(unsigned long h, const void *data, unsigned long size)
+{
+	const unsigned char *p = (const unsigned char*)data;
+	for (unsigned long i=0; i < size; i++)
+		h = (h ^ p[i]) * FNV_PRIME;
+	return h;
+}
+
+static int reloc_offset_cmp(const void *a, const void *b)
+{
+	const backend_reloc *ra = *(const backend_reloc**)a;
+	const backend_reloc *rb = *(const backend_reloc**)b;
+	return (ra->offset > rb->offset) - (ra->offset < rb->offset);
+}
+
+static int function_cmp(const void *a, const void *b)
+{
+	const icf_function *fa = (const icf_function*)a;
+	const icf_function *fb = (const icf_function*)b;
+
+	if (fa->hash != fb->hash)
+		return (fa->hash > fb->hash) - (fa->hash < fb->hash);
+	if (fa->sym->size != fb->sym->size)
+		return (fa->sym->size > fb->sym->size) - (fa->sym->size < fb->sym->size);
+	return (fa->index > fb->index) - (fa->index < fb->index);
+}
+
+// index of the first relocation at or after 'addr'
+static unsigned int lower_bound(backend_reloc **relocs, unsigned int count, unsigned long addr)
+{
+	unsigned int lo = 0, hi = count;
+	while (lo < hi)
+	{
+		unsigned int mid = lo + (hi - lo) / 2;
+		if (relocs[mid]->offset < addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static int function_addr_cmp(const void *a, const void *b)
+{
+	const icf_function *fa = *(const icf_function**)a;
+	const icf_function *fb = *(const icf_function**)b;
+	return (fa->sym->val > fb->sym->val) - (fa->sym->val < fb->sym->val);
+}
+
+static int name_cmp(const void *a, const void *b)
+{
+	return strcmp(*(const char**)a, *(const char**)b);
+}
+
+// mark the functions that start at 'addr' (from a list sorted by address)
+static void mark_address_taken(icf_function **byaddr, unsigned int count, unsigned long addr)
+{
+	unsigned int lo = 0, hi = count;
+	while (lo < hi)
+	{
+		unsigned int mid = lo + (hi - lo) / 2;
+		if (byaddr[mid]->sym->val < addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for (; lo < count && byaddr[lo]->sym->val == addr; lo++)
+		byaddr[lo]->address_taken = 1;
+}
+
+// Calls and jumps (including tail calls) don't need the address of the function to be unique. They
+// are told apart from a 'lea' or 'mov' by the opcode in front of the operand.
+static int is_branch(backend_object *obj, const backend_reloc *r)
+{
+	const backend_section *sec;
+	const unsigned char *op;
+
+	if (r->type == RELOC_TYPE_PLT)
+		return 1;
+	if (r->type != RELOC_TYPE_PC_RELATIVE)
+		return 0;
+
+	sec = r->section ? r->section : backend_find_section_by_val(obj, r->offset);
+	if (!sec || !sec->data || r->offset < sec->address + 2 || r->offset > sec->address + sec->size)
+		return 0;
+
+	op = sec->data + (r->offset - sec->address);
+	if (op[-1] == 0xE8 || op[-1] == 0xE9)
+		return 1;
+	return (op[-2] == 0x0F && (op[-1] & 0xF0) == 0x80);
+}
+
+// The address of a function is taken if code refers to it other than by calling it or jumping to
+// it, or if it is stored in data (see mark_data_pointers in reach.c)
+static int find_address_taken(backend_object *obj, icf_function *fns, unsigned int count)
+{
+	icf_function **byaddr;
+	unsigned int word;
+
+	byaddr = (icf_function**)malloc(count * sizeof(icf_function*) + 1);
+	if (!byaddr)
+		return -1;
+	for (unsigned int i=0; i < count; i++)
+		byaddr[i] = &fns[i];
+	qsort(byaddr, count, sizeof(icf_function*), function_addr_cmp);
+
+	for (backend_reloc *r = backend_get_first_reloc(obj); r; r = backend_get_next_reloc(obj))
+	{
+		if (r->symbol && r->symbol->type == SYMBOL_TYPE_FUNCTION && !is_branch(obj, r))
+			mark_address_taken(byaddr, count, r->symbol->val);
+	}
+
+	switch (backend_get_type(obj))
+	{
+	case OBJECT_TYPE_ELF64:
+	case OBJECT_TYPE_PE32PLUS:
+		word = 8;
+		break;
+	case OBJECT_TYPE_MZ:
+		word = 2;
+		break;
+	default:
+		word = 4;
+	}
+
+	for (backend_section *sec = backend_get_first_section(obj); sec; sec = backend_get_next_section(obj))
+	{
+		if (!(sec->flags & SECTION_FLAG_INIT_DATA) || (sec->flags & SECTION_FLAG_EXECUTE) || !sec->data)
+			continue;
+
+		for (unsigned long pos = 0; pos + word <= sec->size; pos += word)
+		{
+			unsigned long val = 0;
+			memcpy(&val, sec->data + pos, word);
+			if (val)
+				mark_address_taken(byaddr, count, val);
+		}
+	}
+
+	free(byaddr);
+	return 0;
+}
+
+// A local function can only be made global if no other symbol has its name, or it would be
+// confused with (or clash with) the other one when the objects are linked
+static int name_is_unique(const char **names, unsigned int count, const char *name)
+{
+	unsigned int lo = 0, hi = count;
+	while (lo < hi)
+	{
+		unsigned int mid = lo + (hi - lo) / 2;
+		if (strcmp(names[mid], name) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return (lo + 1 >= count || strcmp(names[lo + 1], name) != 0);
+}
+
+// A call from a function to itself must match a call from the duplicate to itself
+static inline const backend_symbol* reloc_target(const backend_reloc *r, const backend_symbol *self)
+{
+	return (r->symbol == self) ? NULL : r->symbol;
+}
+
+static unsigned long hash_function(const icf_function *fn, backend_reloc **relocs)
+{
+	const backend_symbol *sym = fn->sym;
+	unsigned long h = FNV_OFFSET_BASIS;
+
+	h = hash_bytes(h, sym->section->data + (sym->val - sym->section->address), sym->size);
+	for (unsigned int i=0; i < fn->reloc_count; i++)
+	{
+		const backend_reloc *r = relocs[fn->first_reloc + i];
+		unsigned long offset = r->offset - sym->val;
+		const backend_symbol *target = reloc_target(r, sym);
+
+		h = hash_bytes(h, &offset, sizeof(offset));
+		h = hash_bytes(h, &r->type, sizeof(r->type));
+		h = hash_bytes(h, &r->addend, sizeof(r->addend));
+		h = hash_bytes(h, &target, sizeof(target));
+	}
+	return h;
+}
+
+static int same_function(const icf_function *a, const icf_function *b, backend_reloc **relocs)
+{
+	const backend_symbol *sa = a->sym;
+	const backend_symbol *sb = b->sym;
+
+	if (sa->size != sb->size || a->reloc_count != b->reloc_count)
+		return 0;
+
+	if (memcmp(sa->section->data + (sa->val - sa->section->address),
+		sb->section->data + (sb->val - sb->section->address), sa->size) != 0)
+		return 0;
+
+	for (unsigned int i=0; i < a->reloc_count; i++)
+	{
+		const backend_reloc *ra = relocs[a->first_reloc + i];
+		const backend_reloc *rb = relocs[b->first_reloc + i];
+
+		if (ra->offset - sa->val != rb->offset - sb->val || ra->type != rb->type ||
+			ra->addend != rb->addend || reloc_target(ra, sa) != reloc_target(rb, sb))
+			return 0;
+	}
+	return 1;
+}
+
+// Returns the number of functions that were folded, or a negative error code
+int fold_identical_functions(backend_object *obj)
+{
+	backend_reloc **relocs;
+	backend_reloc *r;
+	icf_function *fns;
+	backend_symbol *sym;
+	const char **names;
+	unsigned int reloc_count = 0;
+	unsigned int name_count = 0;
+	unsigned int count = 0;
+	unsigned int index = 0;
+	unsigned int folded = 0;
+	unsigned long saved = 0;
+
+	relocs = (backend_reloc**)malloc(backend_relocation_count(obj) * sizeof(backend_reloc*) + 1);
+	fns = (icf_function*)malloc(backend_symbol_count(obj) * sizeof(icf_function) + 1);
+	names = (const char**)malloc(backend_symbol_count(obj) * sizeof(const char*) + 1);
+	if (!relocs || !fns || !names)
+	{
+		free(relocs);
+		free(fns);
+		free(names);
+		return -1;
+	}
+
+	for (r = backend_get_first_reloc(obj); r; r = backend_get_next_reloc(obj))
+		relocs[reloc_count++] = r;
+	qsort(relocs, reloc_count, sizeof(backend_reloc*), reloc_offset_cmp);
+
+	for (sym = backend_get_first_symbol(obj); sym; sym = backend_get_next_symbol(obj), index++)
+	{
+		if (sym->name && sym->type != SYMBOL_TYPE_SECTION && sym->type != SYMBOL_TYPE_FILE)
+			names[name_count++] = sym->name;
+
+		if (sym->type != SYMBOL_TYPE_FUNCTION || !sym->size || (sym->flags & SYMBOL_FLAG_EXTERNAL))
+			continue;
+		if (!sym->section || !sym->section->data || !(sym->section->flags & SECTION_FLAG_EXECUTE))
+			continue;
+		if (sym->val < sym->section->address || sym->val + sym->size > sym->section->address + sym->section->size)
+			continue;
+
+		fns[count].sym = sym;
+		fns[count].index = index;
+		fns[count].first_reloc = lower_bound(relocs, reloc_count, sym->val);
+		fns[count].reloc_count = lower_bound(relocs, reloc_count, sym->val + sym->size) - fns[count].first_reloc;
+		fns[count].hash = hash_function(&fns[count], relocs);
+		fns[count].address_taken = 0;
+		count++;
+	}
+	qsort(names, name_count, sizeof(const char*), name_cmp);
+
+	if (find_address_taken(obj, fns, count) < 0)
+	{
+		free(relocs);
+		free(fns);
+		free(names);
+		return -1;
+	}
+	qsort(fns, count, sizeof(icf_function), function_cmp);
+
+	// within a run of equal hashes, each function is compared to the functions that were kept
+	for (unsigned int first=0, last; first < count; first = last)
+	{
+		for (last = first + 1; last < count && fns[last].hash == fns[first].hash &&
+			fns[last].sym->size == fns[first].sym->size; last++);
+
+		for (unsigned int i=first+1; i < last; i++)
+		{
+			// it must keep an address of its own
+			if (fns[i].address_taken)
+				continue;
+
+			// the alias is written to the same object as the function it is folded into, so it
+			// must be visible to the objects that used to contain it
+			if (!(fns[i].sym->flags & SYMBOL_FLAG_GLOBAL) && !name_is_unique(names, name_count, fns[i].sym->name))
+				continue;
+
+			for (unsigned int k=first; k < i; k++)
+			{
+				// already folded into another one
+				if (!fns[k].sym)
+					continue;
+
+				if (same_function(&fns[k], &fns[i], relocs))
+				{
+					LOG_TRACE(LOG_OPT, "Folding %s into %s\n", fns[i].sym->name, fns[k].sym->name);
+					saved += fns[i].sym->size;
+
+					fns[i].sym->flags |= SYMBOL_FLAG_GLOBAL;
+					if (backend_add_alias(obj, fns[k].sym, fns[i].sym) == 0)
+						folded++;
+					fns[i].sym = NULL;
+					break;
+				}
+			}
+		}
+	}
+
+	LOG_INFO(LOG_OPT, "Folded %u identical functions (%lu bytes)\n", folded, saved);
+
+	free(relocs);
+	free(fns);
+	free(names);
+	return folded;
+}
@@ -0,0 +1,363 @@
+/* libdelinker - the delinker as a library (see libdelinker.h)
+Each context carries everything a run depends on (see context.h), and is passed down to every stage,
+so independent contexts can be used on different threads at once. The log levels of a context are
+made those of the calling thread while a call runs, and the statistics & memory counters are kept per
+thread. A context is marked busy while a call runs on it, so a call from a sink on the context that
+is being emitted fails with ERR_REENTERED - calls on other contexts are fine. The library is built
+from the same sources as the program, with DELINKER_LIBRARY defined to leave out main() and the
+command line. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "backend.h"
+#include "context.h"
+#include "errors.h"
+#include "log.h"
+#include "libdelinker.h"
+
+extern int analyse_symbols(struct delinker_ctx *ctx, backend_object* obj);
+extern int analyse_relocations(struct delinker_ctx *ctx, backend_object* obj);
+extern int write_output(struct delinker_ctx *ctx, backend_object* obj, backend_type output_target);
+extern void prologue_free(struct delinker_ctx *ctx);
+
+// how far an object has got
+enum delinker_stage
+{
+	STAGE_LOADED,
+	STAGE_RECONSTRUCTED,
+	STAGE_RELOCATED,
+};
+
+struct delinker_object
+{
+	backend_object *obj;
+	enum delinker_stage stage;
+};
+
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+static void init(void)
+{
+	backend_init();
+}
+
+// Mark the context busy, and log with its levels until leave(). 'prev' gets the levels of the
+// caller (which are those of another context, when this is called from a sink).
+static int enter(delinker_ctx *ctx, unsigned char **prev)
+{
+	if (__atomic_exchange_n(&ctx->busy, 1, __ATOMIC_ACQUIRE))
+		return -ERR_REENTERED;
+	*prev = log_use(ctx->log_levels);
+	return 0;
+}
+
+static void leave(delinker_ctx *ctx, unsigned char *prev)
+{
+	log_use(prev);
+	__atomic_store_n(&ctx->busy, 0, __ATOMIC_RELEASE);
+}
+
+// The calls that only change a context can't be made while it is running one
+static int idle(delinker_ctx *ctx)
+{
+	return __atomic_load_n(&ctx->busy, __ATOMIC_ACQUIRE) ? -ERR_REENTERED : 0;
+}
+
+delinker_ctx* delinker_create(void)
+{
+	delinker_ctx *ctx;
+
+	pthread_once(&init_once, init);
+	ctx = (delinker_ctx*)calloc(1, sizeof(delinker_ctx));
+	if (!ctx)
+		return NULL;
+	ctx->config.ignore_list = ll_init();
+	ctx->config.keep_list = ll_init();
+	ctx->config.entry_name = strdup(SYMBOL_NAME_MAIN);
+	log_default_levels(ctx->log_levels);
+	if (!ctx->config.ignore_list || !ctx->config.keep_list || !ctx->config.entry_name)
+	{
+		delinker_destroy(ctx);
+		return NULL;
+	}
+	return ctx;
+}
+
+static void free_list(linked_list *list)
+{
+	char *s;
+
+	if (!list)
+		return;
+	while ((s = (char*)ll_pop(list)) != NULL)
+		free(s);
+	ll_destroy(list);
+}
+
+void delinker_destroy(delinker_ctx *ctx)
+{
+	if (!ctx)
+		return;
+	free_list(ctx->config.ignore_list);
+	free_list(ctx->config.keep_list);
+	prologue_free(ctx);
+	free(ctx->config.entry_name);
+	free(ctx->output_target);
+	free(ctx);
+}
+
+int delinker_set_flag(delinker_ctx *ctx, enum delinker_flag flag, int on)
+{
+	if (idle(ctx) < 0)
+		return -ERR_REENTERED;
+	switch (flag)
+	{
+	case DELINKER_SYMBOL_PER_FILE:
+		ctx->config.symbol_per_file = on;
+		break;
+	case DELINKER_FUNCTION_SECTIONS:
+		ctx->config.function_sections = on;
+		break;
+	case DELINKER_SHARED_DATA:
+		ctx->config.shared_data = on;
+		break;
+	case DELINKER_COMPACT:
+		ctx->config.compact = on;
+		break;
+	case DELINKER_FOLD_IDENTICAL:
+		ctx->config.fold_identical = on;
+		break;
+	case DELINKER_GC:
+		ctx->config.gc = on;
+		break;
+	default:
+		return -1;
+	}
+	return 0;
+}
+
+// The names of --reconstruct-symbols. NULL takes the functions from the symbol table.
+int delinker_set_reconstructor(delinker_ctx *ctx, const char *name)
+{
+	static const struct { const char *name; int reconstructor; } names[] =
+	{
+		{ "nucleus", RECONSTRUCTOR_NUCLEUS },
+		{ "internal", RECONSTRUCTOR_INTERNAL },
+		{ "descent", RECONSTRUCTOR_DESCENT },
+		{ "ehframe", RECONSTRUCTOR_EHFRAME },
+		{ "pdata", RECONSTRUCTOR_PDATA },
+		{ "prologue", RECONSTRUCTOR_PROLOGUE },
+	};
+
+	if (idle(ctx) < 0)
+		return -ERR_REENTERED;
+	if (!name)
+	{
+		ctx->config.reconstruct_symbols = 0;
+		return 0;
+	}
+	for (unsigned int i=0; i < sizeof(names) / sizeof(names[0]); i++)
+	{
+		if (strcmp(name, names[i].name) == 0)
+		{
+			ctx->config.reconstruct_symbols = 1;
+			ctx->config.reconstructor = names[i].reconstructor;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+int delinker_set_entry_name(delinker_ctx *ctx, const char *name)
+{
+	char *s;
+
+	if (idle(ctx) < 0)
+		return -ERR_REENTERED;
+	s = strdup(name);
+	if (!s)
+		return -1;
+	free(ctx->config.entry_name);
+	ctx->config.entry_name = s;
+	return 0;
+}
+
+// One of the backend targets (see delinker --help). NULL writes the format of the input.
+int delinker_set_output_target(delinker_ctx *ctx, const char *target)
+{
+	char *s = NULL;
+
+	if (idle(ctx) < 0)
+		return -ERR_REENTERED;
+	if (target)
+	{
+		if (backend_lookup_target(target) == OBJECT_TYPE_NONE)
+			return -1;
+		s = strdup(target);
+		if (!s)
+			return -1;
+	}
+	free(ctx->output_target);
+	ctx->output_target = s;
+	return 0;
+}
+
+// The worker threads of the function detectors (0 = one per CPU)
+int delinker_set_jobs(delinker_ctx *ctx, int jobs)
+{
+	if (idle(ctx) < 0)
+		return -ERR_REENTERED;
+	ctx->config.jobs = jobs;
+	return 0;
+}
+
+// The same as --log, e.g. "error" or "reloc=trace,elf=debug"
+int delinker_set_log(delinker_ctx *ctx, const char *spec)
+{
+	if (idle(ctx) < 0)
+		return -ERR_REENTERED;
+	return log_configure(ctx->log_levels, spec);
+}
+
+int delinker_ignore(delinker_ctx *ctx, const char *symbol)
+{
+	char *s;
+
+	if (idle(ctx) < 0)
+		return -ERR_REENTERED;
+	s = strdup(symbol);
+	if (!s)
+		return -1;
+	ll_push(ctx->config.ignore_list, s);
+	return 0;
+}
+
+// Don't remove this symbol with DELINKER_GC
+int delinker_keep(delinker_ctx *ctx, const char *symbol)
+{
+	char *s;
+
+	if (idle(ctx) < 0)
+		return -ERR_REENTERED;
+	s = strdup(symbol);
+	if (!s)
+		return -1;
+	ll_push(ctx->config.keep_list, s);
+	return 0;
+}
+
+int delinker_load(delinker_ctx *ctx, const char *filename, delinker_object **objp)
+{
+	delinker_object *o;
+	unsigned char *prev;
+	int ret = enter(ctx, &prev);
+
+	if (ret < 0)
+		return ret;
+	o = (delinker_object*)calloc(1, sizeof(delinker_object));
+	if (!o)
+	{
+		leave(ctx, prev);
+		return -ERR_NO_MEMORY;
+	}
+	LOG_INFO(LOG_MAIN, "Reading input file %s\n", filename);
+	o->obj = backend_read(filename);
+	leave(ctx, prev);
+	if (!o->obj)
+	{
+		free(o);
+		return -ERR_BAD_FORMAT;
+	}
+	o->stage = STAGE_LOADED;
+	*objp = o;
+	return 0;
+}
+
+static int reconstruct(delinker_ctx *ctx, delinker_object *o)
+{
+	int ret = 0;
+
+	if (o->stage < STAGE_RECONSTRUCTED)
+	{
+		ret = analyse_symbols(ctx, o->obj);
+		if (ret == 0)
+			o->stage = STAGE_RECONSTRUCTED;
+	}
+	return ret;
+}
+
+static int build_relocations(delinker_ctx *ctx, delinker_object *o)
+{
+	int ret = reconstruct(ctx, o);
+
+	if (ret == 0 && o->stage < STAGE_RELOCATED)
+	{
+		ret = analyse_relocations(ctx, o->obj);
+		if (ret == 0)
+			o->stage = STAGE_RELOCATED;
+	}
+	return ret;
+}
+
+// Find the functions - from the symbol table, or with the function detector of the context
+int delinker_reconstruct(delinker_ctx *ctx, delinker_object *obj)
+{
+	unsigned char *prev;
+	int ret = enter(ctx, &prev);
+
+	if (ret < 0)
+		return ret;
+	ret = reconstruct(ctx, obj);
+	leave(ctx, prev);
+	return ret;
+}
+
+// Build the relocations, and trim the symbols nothing refers to
+int delinker_build_relocations(delinker_ctx *ctx, delinker_object *obj)
+{
+	unsigned char *prev;
+	int ret = enter(ctx, &prev);
+
+	if (ret < 0)
+		return ret;
+	ret = build_relocations(ctx, obj);
+	leave(ctx, prev);
+	return ret;
+}
+
+// Write the output objects, to the sink or (when it is NULL) to files in the current directory.
+// DELINKER_GC and DELINKER_FOLD_IDENTICAL remove symbols from the object, so to emit an object
+// more than once, emit it without them first.
+int delinker_emit(delinker_ctx *ctx, delinker_object *obj, delinker_sink sink, void *arg)
+{
+	unsigned char *prev;
+	int ret = enter(ctx, &prev);
+
+	if (ret < 0)
+		return ret;
+	ret = build_relocations(ctx, obj);
+	if (ret == 0)
+	{
+		ctx->output_sink = sink;
+		ctx->output_sink_arg = arg;
+		ret = write_output(ctx, obj->obj, backend_lookup_target(ctx->output_target));
+		ctx->output_sink = NULL;
+		ctx->output_sink_arg = NULL;
+	}
+	leave(ctx, prev);
+	return ret;
+}
+
+void delinker_free(delinker_object *obj)
+{
+	if (!obj)
+		return;
+	backend_destructor(obj->obj);
+	free(obj);
+}
+
+const char* delinker_error(int ret)
+{
+	return error_message(ret < 0 ? -ret : ret);
+}
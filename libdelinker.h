@@ -0,0 +1,69 @@
+#ifndef _LIBDELINKER__H
+#define _LIBDELINKER__H
+
+/* libdelinker - the delinker as a library (see libdelinker.c)
+
+The options of a run are kept in a context, instead of on the command line. An input is loaded,
+its functions are found (reconstructed, if the context says so), its relocations are built, and
+then the output objects are emitted - to files in the current directory, or to a sink that gets
+the name and contents of each one. The steps that haven't been done yet are done by the later
+ones, so loading and emitting is enough for a normal run.
+
+Contexts are independent of each other, and may be used on different threads at the same time. A
+context, and the objects loaded with it, must only be used by one thread at a time.
+
+Functions that can fail return 0 or a negative error code, which delinker_error describes. */
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DELINKER_API __attribute__((visibility("default")))
+
+typedef struct delinker_ctx delinker_ctx;
+typedef struct delinker_object delinker_object;
+
+// the options that are switched on or off (all off by default)
+enum delinker_flag
+{
+	DELINKER_SYMBOL_PER_FILE,		// an object for each function (--symbol-per-file)
+	DELINKER_FUNCTION_SECTIONS,	// a single object, with a section for each function (--function-sections)
+	DELINKER_SHARED_DATA,			// the data sections in an object of their own (--shared-data)
+	DELINKER_COMPACT,					// pack the code instead of keeping the original offsets (--compact)
+	DELINKER_FOLD_IDENTICAL,		// write identical functions once (--icf)
+	DELINKER_GC,						// drop what can't be reached from the entry point (--gc)
+};
+
+// Receives each output object. 'data' is only valid during the call. Return nonzero to stop: no
+// more objects are written, and delinker_emit fails.
+// A sink may use other contexts, and their objects, but not the context or object that is being
+// emitted: the calls on that context fail with an error.
+typedef int (*delinker_sink)(const char *name, const void *data, size_t size, void *arg);
+
+DELINKER_API delinker_ctx* delinker_create(void);
+DELINKER_API void delinker_destroy(delinker_ctx *ctx);
+
+// These return -1 for a name they don't know (or an error code while the context is busy)
+DELINKER_API int delinker_set_flag(delinker_ctx *ctx, enum delinker_flag flag, int on);
+DELINKER_API int delinker_set_reconstructor(delinker_ctx *ctx, const char *name);
+DELINKER_API int delinker_set_entry_name(delinker_ctx *ctx, const char *name);
+DELINKER_API int delinker_set_output_target(delinker_ctx *ctx, const char *target);
+DELINKER_API int delinker_set_jobs(delinker_ctx *ctx, int jobs);
+DELINKER_API int delinker_set_log(delinker_ctx *ctx, const char *spec);
+DELINKER_API int delinker_ignore(delinker_ctx *ctx, const char *symbol);
+DELINKER_API int delinker_keep(delinker_ctx *ctx, const char *symbol);
+
+DELINKER_API int delinker_load(delinker_ctx *ctx, const char *filename, delinker_object **objp);
+DELINKER_API int delinker_reconstruct(delinker_ctx *ctx, delinker_object *obj);
+DELINKER_API int delinker_build_relocations(delinker_ctx *ctx, delinker_object *obj);
+DELINKER_API int delinker_emit(delinker_ctx *ctx, delinker_object *obj, delinker_sink sink, void *arg);
+DELINKER_API void delinker_free(delinker_object *obj);
+DELINKER_API const char* delinker_error(int ret);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _LIBDELINKER__H
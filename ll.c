@@ -1,12 +1,14 @@
 #include "ll.h"
+#include "mem.h"
 
 linked_list* ll_init(void)
 {
-   linked_list* ll = (linked_list*)malloc(sizeof(struct linked_list));
+   linked_list* ll = (linked_list*)mem_alloc(MEM_LIST, sizeof(struct linked_list));
    if (ll)
    {
       ll->count = 0;
       ll->head = NULL;
+      ll->tail = NULL;
    }
    return ll;
 }
@@ -14,7 +16,7 @@ linked_list* ll_init(void)
 void ll_destroy(linked_list *ll)
 {
 	while(ll_pop(ll));
-	free(ll);
+	mem_free(MEM_LIST, ll);
 }
 
 unsigned int ll_size(const linked_list* ll)
@@ -25,7 +27,7 @@ unsigned int ll_size(const linked_list* ll)
 void ll_add(linked_list* ll, void* val)
 {
    // create the new node
-   list_node* n = (list_node*)malloc(sizeof(list_node));
+   list_node* n = (list_node*)mem_alloc(MEM_LIST, sizeof(list_node));
    n->val = val;
    n->next = NULL;
 
@@ -33,12 +35,8 @@ void ll_add(linked_list* ll, void* val)
    if (!(ll->head))
       ll->head = n;
    else
-   {
-      list_node* tmp = ll->head;
-      while (tmp->next)
-         tmp = tmp->next;
-      tmp->next = n;
-   }
+      ll->tail->next = n;
+   ll->tail = n;
    ll->count++;
 }
 
@@ -54,9 +52,11 @@ void* ll_remove(linked_list* ll, const void* data, ll_cmpfunc cmp)
 	if (cmp(tmp->val, data) == 0)
 	{
 		ll->head = ll->head->next;
+		if (!ll->head)
+			ll->tail = NULL;
 		ll->count--;
 		val = tmp->val;
-		free(tmp);
+		mem_free(MEM_LIST, tmp);
 		return val;
 	}
 
@@ -67,9 +67,11 @@ void* ll_remove(linked_list* ll, const void* data, ll_cmpfunc cmp)
 		if (cmp(del->val, data) == 0)
 		{
 			tmp->next = del->next;
+			if (ll->tail == del)
+				ll->tail = tmp;
 			ll->count--;
 			val = del->val;
-			free(del);
+			mem_free(MEM_LIST, del);
 			return val;
 		}
 		tmp = tmp->next;
@@ -78,6 +80,35 @@ void* ll_remove(linked_list* ll, const void* data, ll_cmpfunc cmp)
 	return NULL;
 }
 
+unsigned int ll_remove_if(linked_list* ll, ll_predfunc pred, void* ctx)
+{
+	unsigned int removed = 0;
+
+	if (!ll)
+		return 0;
+
+	list_node** link = &ll->head;
+	ll->tail = NULL;
+	while (*link)
+	{
+		list_node* tmp = *link;
+		if (pred(tmp->val, ctx))
+		{
+			*link = tmp->next;
+			mem_free(MEM_LIST, tmp);
+			ll->count--;
+			removed++;
+		}
+		else
+		{
+			ll->tail = tmp;
+			link = &tmp->next;
+		}
+	}
+
+	return removed;
+}
+
 void* ll_pop(linked_list* ll)
 {
 	if (!ll || !ll->head)
@@ -85,9 +116,11 @@ void* ll_pop(linked_list* ll)
 
 	list_node* tmp = ll->head;
 	ll->head = ll->head->next;
+	if (!ll->head)
+		ll->tail = NULL;
 	ll->count--;
 	void *val = tmp->val;
-	free(tmp);
+	mem_free(MEM_LIST, tmp);
 
 	return val;
 }
@@ -103,10 +136,12 @@ void ll_insert(linked_list* ll, list_node* here, void* val)
 		return;
 
    // create the new node
-   list_node* n = (list_node*)malloc(sizeof(list_node));
+   list_node* n = (list_node*)mem_alloc(MEM_LIST, sizeof(list_node));
    n->val = val;
    n->next = here->next;
 	here->next = n;
+	if (ll->tail == here)
+		ll->tail = n;
    ll->count++;
 }
 
@@ -116,12 +151,15 @@ void ll_push(linked_list* ll, void* val)
 		return;
 
    // create the new node
-   list_node* n = (list_node*)malloc(sizeof(list_node));
+   list_node* n = (list_node*)mem_alloc(MEM_LIST, sizeof(list_node));
    n->val = val;
 	if (ll->head)
    	n->next = ll->head;
 	else
+	{
 		n->next = NULL;
+		ll->tail = n;
+	}
 	ll->head = n;
    ll->count++;
 }
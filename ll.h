@@ -13,15 +13,18 @@ typedef struct linked_list
 {
    unsigned int count;
    list_node* head;
+   list_node* tail; // so items can be added to the end without walking the list
 } linked_list;
 
 typedef int(*ll_cmpfunc)(void* list_item, const void* your_item);
+typedef int(*ll_predfunc)(void* list_item, void* ctx);
 
 linked_list* ll_init(void);
 void ll_destroy(linked_list *ll);
 unsigned int ll_size(const linked_list* ll);
 void ll_add(linked_list* ll, void* val); // adds an item to the tail of the list
 void* ll_remove(linked_list* ll, const void* data, ll_cmpfunc cmp); // find an item with a user-defined comparator, and remove it from the list
+unsigned int ll_remove_if(linked_list* ll, ll_predfunc pred, void* ctx); // remove every item the predicate returns nonzero for (in one pass) - the predicate may free those items
 void* ll_pop(linked_list* ll); // pops the item at the head of the list and returns it
 void ll_push(linked_list* ll, void* val);
 const list_node* ll_iter_start(const linked_list* ll);
@@ -0,0 +1,133 @@
+/* Logging (see log.h)
+The levels are set per category with --log, e.g. --log=reloc=trace,elf=debug. A level on its own
+applies to every category. The default is to print errors and warnings only, and --verbose raises
+everything to 'info'. */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include "log.h"
+
+static const char *category_names[LOG_CATEGORY_COUNT] =
+{
+	"main",
+	"reconstruct",
+	"reloc",
+	"output",
+	"opt",
+	"backend",
+	"elf",
+	"pe",
+	"mz",
+};
+
+static const char *level_names[LOG_LEVEL_COUNT] =
+{
+	"none",
+	"error",
+	"warning",
+	"info",
+	"debug",
+	"trace",
+};
+
+static unsigned char default_levels[LOG_CATEGORY_COUNT] =
+{
+	[0 ... LOG_CATEGORY_COUNT-1] = LOG_LEVEL_WARNING
+};
+
+// Each run has its own levels (see context.h), and a thread logs with the levels of the run it is
+// working for. A thread that hasn't been told which run that is gets the defaults.
+__thread unsigned char *log_levels = default_levels;
+
+// Log with 'levels' on this thread (NULL for the defaults). Returns the levels that were used
+// before, to be given back when the work is done.
+unsigned char *log_use(unsigned char *levels)
+{
+	unsigned char *prev = log_levels;
+
+	log_levels = levels ? levels : default_levels;
+	return prev;
+}
+
+void log_default_levels(unsigned char *levels)
+{
+	memcpy(levels, default_levels, LOG_CATEGORY_COUNT);
+}
+
+void log_write(const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+}
+
+// Make sure every category prints at least 'level' messages
+void log_raise_level(unsigned char *levels, enum log_level level)
+{
+	for (int i=0; i < LOG_CATEGORY_COUNT; i++)
+		if (levels[i] < level)
+			levels[i] = level;
+}
+
+static int lookup(const char *name, unsigned int len, const char **names, int count)
+{
+	for (int i=0; i < count; i++)
+		if (strlen(names[i]) == len && strncmp(name, names[i], len) == 0)
+			return i;
+	return -1;
+}
+
+// Parse a list of [category=]level, separated by commas
+int log_configure(unsigned char *levels, const char *spec)
+{
+	while (*spec)
+	{
+		const char *end = strchr(spec, ',');
+		const char *eq;
+		int cat = -1;
+		int level;
+
+		if (!end)
+			end = spec + strlen(spec);
+		eq = memchr(spec, '=', end - spec);
+		if (eq)
+		{
+			cat = lookup(spec, eq - spec, category_names, LOG_CATEGORY_COUNT);
+			if (cat < 0)
+			{
+				fprintf(stderr, "Unknown log category '%.*s'\n", (int)(eq - spec), spec);
+				return -1;
+			}
+			spec = eq + 1;
+		}
+
+		level = lookup(spec, end - spec, level_names, LOG_LEVEL_COUNT);
+		if (level < 0)
+		{
+			fprintf(stderr, "Unknown log level '%.*s'\n", (int)(end - spec), spec);
+			return -1;
+		}
+
+		if (cat < 0)
+			memset(levels, level, LOG_CATEGORY_COUNT);
+		else
+			levels[cat] = level;
+
+		spec = *end ? end + 1 : end;
+	}
+	return 0;
+}
+
+void log_usage(void)
+{
+	fprintf(stderr, "Log levels:");
+	for (int i=0; i < LOG_LEVEL_COUNT; i++)
+		fprintf(stderr, " %s", level_names[i]);
+	fprintf(stderr, "\nLog categories:");
+	for (int i=0; i < LOG_CATEGORY_COUNT; i++)
+		fprintf(stderr, " %s", category_names[i]);
+	fprintf(stderr, "\n");
+}
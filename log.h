@@ -0,0 +1,54 @@
+#ifndef _LOG__H
+#define _LOG__H
+
+// Each message has a level, and belongs to a category. A message is only formatted and printed if
+// its category is set to that level or higher, so a disabled message costs one compare & branch -
+// the arguments aren't even evaluated. That is what allows messages on the per-instruction and
+// per-relocation paths.
+
+enum log_level
+{
+	LOG_LEVEL_NONE,
+	LOG_LEVEL_ERROR,
+	LOG_LEVEL_WARNING,
+	LOG_LEVEL_INFO,		// progress - once per file or phase (see --verbose)
+	LOG_LEVEL_DEBUG,		// once per section or symbol
+	LOG_LEVEL_TRACE,		// once per instruction or relocation
+	LOG_LEVEL_COUNT
+};
+
+// this must be synchronized with the "category_names" table in log.c
+enum log_category
+{
+	LOG_MAIN,				// the command line, and anything that doesn't fit elsewhere
+	LOG_RECONSTRUCT,		// the function detectors
+	LOG_RELOC,				// building the relocations from the code
+	LOG_OUTPUT,				// copying the symbols, relocations & data to the output objects
+	LOG_OPT,					// the optimizations (--gc, --icf)
+	LOG_BACKEND,			// the generic backend
+	LOG_ELF,
+	LOG_PE,
+	LOG_MZ,
+	LOG_CATEGORY_COUNT
+};
+
+// the levels of the run that this thread is working for (see log_use)
+extern __thread unsigned char *log_levels;
+
+#define LOG_ENABLED(cat, level) __builtin_expect(log_levels[cat] >= (level), 0)
+
+#define LOG(cat, level, ...) do { if (LOG_ENABLED(cat, level)) log_write(__VA_ARGS__); } while (0)
+#define LOG_ERROR(cat, ...) LOG(cat, LOG_LEVEL_ERROR, __VA_ARGS__)
+#define LOG_WARN(cat, ...) LOG(cat, LOG_LEVEL_WARNING, __VA_ARGS__)
+#define LOG_INFO(cat, ...) LOG(cat, LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_DEBUG(cat, ...) LOG(cat, LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define LOG_TRACE(cat, ...) LOG(cat, LOG_LEVEL_TRACE, __VA_ARGS__)
+
+void log_write(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+unsigned char *log_use(unsigned char *levels);
+void log_default_levels(unsigned char *levels);
+void log_raise_level(unsigned char *levels, enum log_level level);
+int log_configure(unsigned char *levels, const char *spec);
+void log_usage(void);
+
+#endif // _LOG__H
@@ -57,6 +57,7 @@ v0.8  Vesselin Bontchev, bontchev@fbihh.informatik.uni-hamburg.de, Aug 92
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include "log.h"
 
 #define	VERSION "0.9G2"
 
@@ -78,8 +79,9 @@ int reloc91 (FILE *f, FILE *ofile, long fpos);
 void initbits (bitstream *,FILE *);
 int getbit (bitstream *);
 
-static WORD ihead[0x10], ohead[0x10], inf[8];
-static long loadsize;
+// per thread, so that inputs can be unpacked on several threads at once (see libdelinker.c)
+static __thread WORD ihead[0x10], ohead[0x10], inf[8];
+static __thread long loadsize;
 char tmpfname[256] = "$tmpfil$.exe";
 char backup_ext[16] = ".olz";
 char ipath[FILENAME_MAX],
@@ -210,13 +212,13 @@ int mkreltbl (FILE *ifile, FILE *ofile, int ver)
 			break;
 	case 91:	i=reloc91 (ifile,ofile,fpos);
 			break;
-	default:	printf ("bad version 0.%d\n", ver);
+	default:	LOG_ERROR(LOG_MZ, "bad version 0.%d\n", ver);
 			i=FAILURE; break;
       }
 
     if (i!=SUCCESS)
       {
-	printf ("Error at relocation table\n");
+	LOG_ERROR(LOG_MZ, "Error at relocation table\n");
 	return (FAILURE);
       }
 
@@ -326,14 +328,15 @@ int unpack (FILE *ifile, FILE *ofile)
     int span;
     long fpos;
     bitstream bits;
-    static BYTE data[0x4500], *p=data;
+    static __thread BYTE data[0x4500];
+    BYTE *p=data;
 
     fpos = ((long)ihead[0x0b]-(long)inf[4]+(long)ihead[4])<<4;
     fseek (ifile, fpos, SEEK_SET);
     fpos = (long)ohead[4]<<4;
     fseek (ofile, fpos, SEEK_SET);
     initbits (&bits, ifile);
-    printf ("progress: ");
+    LOG_DEBUG(LOG_MZ, "progress: ");
 
     for(;;)
       {
@@ -347,7 +350,7 @@ int unpack (FILE *ifile, FILE *ofile)
 	    fwrite (data,sizeof data[0],0x2000,ofile);
 	    p -= 0x2000;
 	    memcpy (data,data+0x2000,p-data);
-	    putchar ('.');
+	    LOG_DEBUG(LOG_MZ, ".");
 	  }
 
 	if (getbit(&bits))
@@ -393,7 +396,7 @@ int unpack (FILE *ifile, FILE *ofile)
 	fwrite (data, sizeof data[0], p-data, ofile);
     loadsize = ftell(ofile)-fpos;
 
-    printf (".\n");
+    LOG_DEBUG(LOG_MZ, ".\n");
     return (SUCCESS);
   }
 
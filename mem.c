@@ -0,0 +1,93 @@
+/* Memory accounting (see mem.h)
+Each allocation is added to its category and to the total, and each free is taken away again. The
+high-water marks can be reset with mem_mark(), which is how --stats finds the peak of each phase. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include "mem.h"
+
+static const char *category_names[MEM_CATEGORY_COUNT] =
+{
+	"section_data",
+	"tables",
+	"lists",
+	"output",
+	"strtab",
+	"total",
+};
+
+__thread size_t mem_current[MEM_CATEGORY_COUNT];
+__thread size_t mem_peak[MEM_CATEGORY_COUNT];
+
+static void mem_add(enum mem_category cat, size_t n)
+{
+	mem_current[cat] += n;
+	if (mem_current[cat] > mem_peak[cat])
+		mem_peak[cat] = mem_current[cat];
+	mem_current[MEM_TOTAL] += n;
+	if (mem_current[MEM_TOTAL] > mem_peak[MEM_TOTAL])
+		mem_peak[MEM_TOTAL] = mem_current[MEM_TOTAL];
+}
+
+// memory that another thread allocated isn't counted by this one
+static void mem_sub(enum mem_category cat, size_t n)
+{
+	mem_current[cat] -= n < mem_current[cat] ? n : mem_current[cat];
+	mem_current[MEM_TOTAL] -= n < mem_current[MEM_TOTAL] ? n : mem_current[MEM_TOTAL];
+}
+
+void *mem_alloc(enum mem_category cat, size_t size)
+{
+	void *p = malloc(size);
+	if (p)
+		mem_add(cat, malloc_usable_size(p));
+	return p;
+}
+
+void *mem_calloc(enum mem_category cat, size_t count, size_t size)
+{
+	void *p = calloc(count, size);
+	if (p)
+		mem_add(cat, malloc_usable_size(p));
+	return p;
+}
+
+// like realloc, the old block is still valid (and still accounted) if this fails
+void *mem_realloc(enum mem_category cat, void *ptr, size_t size)
+{
+	size_t old = malloc_usable_size(ptr);
+	void *p = realloc(ptr, size);
+	if (!p)
+		return NULL;
+	mem_sub(cat, old);
+	mem_add(cat, malloc_usable_size(p));
+	return p;
+}
+
+char *mem_strdup(enum mem_category cat, const char *s)
+{
+	char *p = strdup(s);
+	if (p)
+		mem_add(cat, malloc_usable_size(p));
+	return p;
+}
+
+void mem_free(enum mem_category cat, void *ptr)
+{
+	if (!ptr)
+		return;
+	mem_sub(cat, malloc_usable_size(ptr));
+	free(ptr);
+}
+
+// start a new high-water mark from the current usage
+void mem_mark(void)
+{
+	memcpy(mem_peak, mem_current, sizeof(mem_peak));
+}
+
+const char *mem_category_name(enum mem_category cat)
+{
+	return category_names[cat];
+}
@@ -0,0 +1,37 @@
+#ifndef _MEM__H
+#define _MEM__H
+
+#include <stddef.h>
+
+// The heap is accounted by what the memory is used for, so a large input that runs out of memory
+// can be blamed on the right thing. The sizes are those that malloc really gives out (including
+// its rounding up), so an allocation doesn't need a header to remember its size - but it must be
+// freed or reallocated with the same category that it was allocated with.
+// The counters are kept per thread, so runs on different threads (see libdelinker.c) don't share
+// them. Only the thread that runs a phase allocates from these categories.
+
+// this must be synchronized with the "category_names" table in mem.c
+enum mem_category
+{
+	MEM_SECTION_DATA,		// section contents copied from the input file by the readers
+	MEM_TABLES,				// symbols, sections, relocations & imports of the backend objects
+	MEM_LIST,				// linked lists and their nodes
+	MEM_OUTPUT,				// data of the output objects (write_symbol, copy_data, relocation sections)
+	MEM_STRTAB,				// string tables built by the writers
+	MEM_TOTAL,				// all of the above - not a category to allocate from
+	MEM_CATEGORY_COUNT
+};
+
+// bytes in use, and the most that has been in use since the last mem_mark()
+extern __thread size_t mem_current[MEM_CATEGORY_COUNT];
+extern __thread size_t mem_peak[MEM_CATEGORY_COUNT];
+
+void *mem_alloc(enum mem_category cat, size_t size);
+void *mem_calloc(enum mem_category cat, size_t count, size_t size);
+void *mem_realloc(enum mem_category cat, void *ptr, size_t size);
+char *mem_strdup(enum mem_category cat, const char *s);
+void mem_free(enum mem_category cat, void *ptr);
+void mem_mark(void);
+const char *mem_category_name(enum mem_category cat);
+
+#endif // _MEM__H
@@ -9,15 +9,11 @@ http://files.shikadi.net/malv/files/unlzexe.c - for LZ90 + LZ91 decompression
 #include <stdlib.h>
 #include "backend.h"
 #include "config.h"
+#include "log.h"
+#include "mem.h"
 
 #pragma pack(1)
 
-#ifdef DEBUG
-#define DEBUG_PRINT printf
-#else
-#define DEBUG_PRINT //
-#endif
-
 #define MZ_MAGIC "\x4d\x5a"
 #define MZ_MAGIC_SIZE 2
 #define PARAGRAPH_SIZE 16
@@ -60,21 +56,21 @@ struct EXE_RELOC {
 
 void dump_mz_header(const mz_header *h)
 {
-	fprintf(stderr, "Magic: %X\n", h->magic);
-	fprintf(stderr, "Bytes in last block: %i\n", h->bytes_in_last_block);
-	fprintf(stderr, "Blocks in file: %i\n", h->blocks_in_file);
-	fprintf(stderr, "# relocations: %i\n", h->num_relocs);
-	fprintf(stderr, "# paragraphs in header: %i\n", h->header_paragraphs);
-	fprintf(stderr, "min extra paragraphs: %i\n", h->min_extra_paragraphs);
-	fprintf(stderr, "max extra paragraphs: %i\n", h->max_extra_paragraphs);
-	fprintf(stderr, "Stack segment (SS): 0x%04x\n", h->ss);
-	fprintf(stderr, "Stack pointer (SP): 0x%04x\n", h->sp);
-	fprintf(stderr, "Instruction pointer (IP): 0x%04x\n", h->ip);
-	fprintf(stderr, "Code segment (CS): %x\n", h->cs);
-	fprintf(stderr, "Relocation table offset: 0x%x\n", h->reloc_table_offset);
-	fprintf(stderr, "# overlays: %i\n", h->overlay_number);
-	fprintf(stderr, "Checksum: 0x%x\n", h->checksum);
-	fprintf(stderr, "Compression: %c%c%c%c\n", h->compression[0], h->compression[1], h->compression[2], h->compression[3]);
+	LOG_DEBUG(LOG_MZ, "Magic: %X\n", h->magic);
+	LOG_DEBUG(LOG_MZ, "Bytes in last block: %i\n", h->bytes_in_last_block);
+	LOG_DEBUG(LOG_MZ, "Blocks in file: %i\n", h->blocks_in_file);
+	LOG_DEBUG(LOG_MZ, "# relocations: %i\n", h->num_relocs);
+	LOG_DEBUG(LOG_MZ, "# paragraphs in header: %i\n", h->header_paragraphs);
+	LOG_DEBUG(LOG_MZ, "min extra paragraphs: %i\n", h->min_extra_paragraphs);
+	LOG_DEBUG(LOG_MZ, "max extra paragraphs: %i\n", h->max_extra_paragraphs);
+	LOG_DEBUG(LOG_MZ, "Stack segment (SS): 0x%04x\n", h->ss);
+	LOG_DEBUG(LOG_MZ, "Stack pointer (SP): 0x%04x\n", h->sp);
+	LOG_DEBUG(LOG_MZ, "Instruction pointer (IP): 0x%04x\n", h->ip);
+	LOG_DEBUG(LOG_MZ, "Code segment (CS): %x\n", h->cs);
+	LOG_DEBUG(LOG_MZ, "Relocation table offset: 0x%x\n", h->reloc_table_offset);
+	LOG_DEBUG(LOG_MZ, "# overlays: %i\n", h->overlay_number);
+	LOG_DEBUG(LOG_MZ, "Checksum: 0x%x\n", h->checksum);
+	LOG_DEBUG(LOG_MZ, "Compression: %c%c%c%c\n", h->compression[0], h->compression[1], h->compression[2], h->compression[3]);
 }
 
 static backend_object* mz_read_file(const char* filename)
@@ -82,6 +78,7 @@ static backend_object* mz_read_file(const char* filename)
    int fsize;
 	int exe_size;
 	unsigned char *data;
+	unsigned char *text;
 	int sec_size;
    backend_arch be_arch;
 	backend_section *s;
@@ -92,7 +89,7 @@ static backend_object* mz_read_file(const char* filename)
    FILE* f = fopen(filename, "rb");
    if (!f)
    {
-      printf("can't open file\n");
+      LOG_DEBUG(LOG_MZ, "can't open file\n");
       goto done;
    }
 
@@ -102,25 +99,39 @@ static backend_object* mz_read_file(const char* filename)
    fseek(f, 0, SEEK_SET);
 
 	// read the file header
-	printf("Reading header\n");
+	LOG_DEBUG(LOG_MZ, "Reading header\n");
 	if (fread(buff, 1, sizeof(mz_header), f) != sizeof(mz_header))
 	{
-		printf("Error reading mz header\n");
+		LOG_DEBUG(LOG_MZ, "Error reading mz header\n");
       goto done;
 	}
 
 	if (memcmp(buff, MZ_MAGIC, MZ_MAGIC_SIZE) != 0)
 	{
-		printf("Error in MZ magic 0x%x\n", *(unsigned short *)buff);
+		LOG_DEBUG(LOG_MZ, "Error in MZ magic 0x%x\n", *(unsigned short *)buff);
       goto done;
 	}
 
 	h = (mz_header *)buff;
 
+	// Windows executables start with an MZ stub too. The offset of the PE header is at 0x3C - if
+	// there is one, leave the file for the PE backend.
+	unsigned int pe_offset;
+	char pe_magic[4];
+	if (fseek(f, 0x3C, SEEK_SET) == 0 && fread(&pe_offset, sizeof(pe_offset), 1, f) == 1 &&
+		pe_offset + sizeof(pe_magic) <= fsize && fseek(f, pe_offset, SEEK_SET) == 0 &&
+		fread(pe_magic, sizeof(pe_magic), 1, f) == 1 && memcmp(pe_magic, "PE\0\0", 4) == 0)
+	{
+		LOG_TRACE(LOG_MZ, "Found PE header @ 0x%x - not a DOS executable\n", pe_offset);
+		fclose(f);
+		goto done;
+	}
+	fseek(f, sizeof(mz_header), SEEK_SET);
+
 	// validate the file size with the stored EXE size
 	exe_size = (h->blocks_in_file - 1) * 512 + h->bytes_in_last_block;
 	if (exe_size != fsize)
-		printf("Warning: got EXE size %u (expected %u)\n", exe_size, fsize);
+		LOG_WARN(LOG_MZ, "Warning: got EXE size %u (expected %u)\n", exe_size, fsize);
 	
    obj = backend_create();
    if (!obj)
@@ -129,8 +140,7 @@ static backend_object* mz_read_file(const char* filename)
    backend_set_type(obj, OBJECT_TYPE_MZ);
    be_arch = OBJECT_ARCH_X86;
 
-   if (config.verbose)
-		fprintf(stderr, "Arch %i\n", be_arch);
+   LOG_INFO(LOG_MZ, "Arch %i\n", be_arch);
    backend_set_arch(obj, be_arch);
 
 	// decompress if compressed
@@ -138,67 +148,69 @@ static backend_object* mz_read_file(const char* filename)
 	if (rdhead(f,&ver)==0)
 	{
 		FILE *ofile;
-		char opath[FILENAME_MAX];
 
-		printf ("compressed by LZEXE v0.%d\n", ver);
+		LOG_INFO(LOG_MZ, "compressed by LZEXE v0.%d\n", ver);
 
-		// open output file
-		snprintf(opath, FILENAME_MAX, "/tmp/asdf.exe");
-		if (!(ofile=fopen(opath,"w+b")))
+		// unpack to an anonymous file, so inputs that are read at the same time don't collide
+		if (!(ofile=tmpfile()))
 		{
-			printf("can't open output file %s\n", opath);
+			LOG_ERROR(LOG_MZ, "can't open a temporary file to unpack to\n");
 			goto done;
 		}
 
 		if (mkreltbl (f,ofile,ver)!=0)
 		{
-			printf("Can't make rel table\n");
+			LOG_ERROR(LOG_MZ, "Can't make rel table\n");
 			fclose (ofile);
-			remove (opath);
 			goto done;
       }
 
 		if(unpack (f,ofile)!=0)
 		{
-			printf("Can't unpack\n");
+			LOG_ERROR(LOG_MZ, "Can't unpack\n");
 			fclose (ofile);
-			remove (opath);
 			goto done;
       }
     	wrhead (ofile);
-    	fclose (ofile);
     	fclose (f);
-		f = fopen(opath, "rb");
+		f = ofile;
    	fseek(f, 0, SEEK_SET);
 
 		// read the file header
-		printf("Reading header\n");
+		LOG_DEBUG(LOG_MZ, "Reading header\n");
 		if (fread(buff, 1, sizeof(mz_header), f) != sizeof(mz_header))
 		{
-			if (config.verbose)
-				printf("Error reading mz header\n");
+			LOG_INFO(LOG_MZ, "Error reading mz header\n");
 	      goto done;
 		}
 	}
 	dump_mz_header(h);
 
 	sec_size =  fsize - PARAGRAPH_SIZE * h->header_paragraphs;
-	data = (unsigned char*)malloc(sec_size);
+	data = (unsigned char*)mem_alloc(MEM_SECTION_DATA, sec_size);
 	fseek(f, PARAGRAPH_SIZE * h->header_paragraphs, SEEK_SET);
 	if (fread(data, 1, sec_size, f) != sec_size)
 	{
-		fprintf(stderr, "Error loading exe section\n");
-		free(data);
+		LOG_ERROR(LOG_MZ, "Error loading exe section\n");
+		mem_free(MEM_SECTION_DATA, data);
 		goto done;
 	}
 
 	backend_set_entry_point(obj, (h->cs * PARAGRAPH_SIZE) + h->ip);
 
 	// we only have one input 'section' - mixed code & data, but we want to separate them
-	// start with a duplicate, and cut the unnecessary pieces later
+	// start with a duplicate, and cut the unnecessary pieces later. Each section gets its own copy
+	// of the data, so the object can be destroyed.
+	text = (unsigned char*)mem_alloc(MEM_SECTION_DATA, sec_size);
+	if (!text)
+	{
+		mem_free(MEM_SECTION_DATA, data);
+		goto done;
+	}
+	memcpy(text, data, sec_size);
 	s = backend_add_section(obj, ".data", sec_size, 0, data, 0, 1, SECTION_FLAG_INIT_DATA);
 	backend_section_set_type(s, SECTION_TYPE_PROG);
-	s = backend_add_section(obj, ".text", sec_size, 0, data, 0, 1, SECTION_FLAG_EXECUTE);
+	s = backend_add_section(obj, ".text", sec_size, 0, text, 0, 1, SECTION_FLAG_EXECUTE);
 	backend_section_set_type(s, SECTION_TYPE_PROG);
 
 done:
@@ -0,0 +1,113 @@
+/* Function detection from the x64 exception directory.
+Every function in a PE32+ image that allocates stack space or calls another function must have
+a RUNTIME_FUNCTION entry in the exception directory (usually the .pdata section), giving the exact
+start and end address of the function. The table is sorted by address, so the symbols can be
+created in a single pass. Leaf functions don't need an entry, so the gaps between the entries are
+disassembled. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "capstone/capstone.h"
+#include "backend.h"
+#include "config.h"
+#include "log.h"
+#include "detect.h"
+
+#define UNW_FLAG_CHAININFO 0x4
+
+// all addresses are relative to the image base
+typedef struct runtime_function
+{
+	unsigned int begin;
+	unsigned int end;
+	unsigned int unwind_info;
+} runtime_function;
+
+// Chained entries describe a part of a function that was moved out of line (e.g. a cold path). If
+// it immediately follows the primary entry, it is just a continuation of the same function.
+static int is_chained(backend_object *obj, unsigned long base, const runtime_function *rf)
+{
+	unsigned long addr = base + (rf->unwind_info & ~1U);
+	backend_section *sec = backend_find_section_by_val(obj, addr);
+	if (!sec || !sec->data)
+		return 0;
+
+	// the flags are in the upper 5 bits of the first byte
+	return !!((sec->data[addr - sec->address] >> 3) & UNW_FLAG_CHAININFO);
+}
+
+// Returns 1 if the object has a usable exception directory
+int pdata_present(backend_object *obj)
+{
+	backend_section *sec = backend_get_section_by_name(obj, ".pdata");
+	return (backend_get_type(obj) == OBJECT_TYPE_PE32PLUS && sec && sec->data && sec->size >= sizeof(runtime_function));
+}
+
+// Create a function symbol for each entry in the exception directory, and disassemble the gaps.
+// Returns -1 if there is no exception directory, so the caller can use a different method.
+int pdata_reconstruct_symbols(backend_object *obj, backend_section *sec_text, csh cs_dis, cs_insn *cs_ins, const char *src_name)
+{
+	backend_section *pdata;
+	const runtime_function *rf, *rf_end;
+	unsigned long base = backend_get_base_address(obj);
+	unsigned long text_end = sec_text->address + sec_text->size;
+	unsigned long cursor = sec_text->address;
+	unsigned long start = 0, end = 0;
+	unsigned int added = 0;
+	unsigned int gap_funcs = 0;
+
+	if (!pdata_present(obj))
+		return -1;
+	pdata = backend_get_section_by_name(obj, ".pdata");
+
+	rf = (const runtime_function*)pdata->data;
+	rf_end = rf + pdata->size / sizeof(runtime_function);
+	for (; rf < rf_end; rf++)
+	{
+		unsigned long b = base + rf->begin;
+		unsigned long e = base + rf->end;
+
+		// the section is padded with zeros
+		if (!rf->begin && !rf->end)
+			break;
+		if (b < sec_text->address || e > text_end || e <= b)
+			continue;
+
+		if (start && b == end && is_chained(obj, base, rf))
+		{
+			end = e;
+			continue;
+		}
+
+		// finish the previous function
+		if (start)
+		{
+			add_function_symbol(obj, sec_text, start, end, src_name);
+			added++;
+			cursor = end;
+		}
+
+		if (b < cursor)
+		{
+			LOG_WARN(LOG_RECONSTRUCT, "Runtime function @ 0x%lx overlaps the previous one - ignoring\n", b);
+			start = 0;
+			continue;
+		}
+		if (b > cursor)
+			gap_funcs += fill_function_gap(obj, sec_text, cs_dis, cs_ins, cursor, b, src_name);
+
+		start = b;
+		end = e;
+	}
+	if (start)
+	{
+		add_function_symbol(obj, sec_text, start, end, src_name);
+		added++;
+		cursor = end;
+	}
+	if (cursor < text_end)
+		gap_funcs += fill_function_gap(obj, sec_text, cs_dis, cs_ins, cursor, text_end, src_name);
+
+	LOG_INFO(LOG_RECONSTRUCT, "%u functions from .pdata, %u more from disassembling the gaps\n", added, gap_funcs);
+	return 0;
+}
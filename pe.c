@@ -11,6 +11,8 @@ optional header
 #include <time.h>
 #include "backend.h"
 #include "config.h"
+#include "log.h"
+#include "mem.h"
 
 #pragma pack(1)
 
@@ -90,6 +92,7 @@ optional header
 
 #define IMPORT_BY_ORDINAL 0x80000000
 #define IMPORT_HINT_ENTRY_MASK (~IMPORT_BY_ORDINAL)
+#define IMPORT_BY_ORDINAL_64 0x8000000000000000UL
 
 enum section_flags
 {
@@ -182,6 +185,41 @@ typedef struct pe32_windows_header
    unsigned int num_rva;
 } pe32_windows_header;
 
+// In PE32+ the optional header and the windows-specific header are read together, starting from
+// the state (magic number), which keeps the 64-bit fields naturally aligned
+typedef struct pe32plus_header
+{
+   unsigned short state; // STATE_ID_PE32PLUS
+   unsigned char major_linker_ver;
+   unsigned char minor_linker_ver;
+   unsigned int code_size;
+   unsigned int data_size;
+   unsigned int uninit_data_size;
+   unsigned int entry;
+   unsigned int code_base;
+   unsigned long base;
+   unsigned int section_alignment;
+   unsigned int file_alignment;
+   unsigned short os_major;
+   unsigned short os_minor;
+   unsigned short image_major;
+   unsigned short image_minor;
+   unsigned short subsys_major;
+   unsigned short subsys_minor;
+   unsigned int win32ver;
+   unsigned int image_size;
+   unsigned int header_size;
+   unsigned int checksum;
+   unsigned short subsystem; // see IMAGE_SUBSYSTEM_
+   unsigned short dll_chars;
+   unsigned long stack_size;
+   unsigned long stack_commit_size;
+   unsigned long heap_size;
+   unsigned long heap_commit_size;
+   unsigned int loader_flags;
+   unsigned int num_rva;
+} pe32plus_header;
+
 typedef struct section_header
 {
    char name[8];
@@ -372,11 +410,11 @@ static unsigned int read_import_dir(import_dir_entry *d, FILE *f, unsigned int b
    char *name; // name of the imported function
    unsigned int lu;
 
-   printf("Address table @ 0x%x\n", d->addr_table);
+   LOG_TRACE(LOG_PE, "Address table @ 0x%x\n", d->addr_table);
    fseek(f, d->addr_table, SEEK_SET);
    fread(&lu, sizeof(unsigned int), 1, f);
    unsigned long val = (unsigned long)sec->address + (d->addr_table - base);
-   printf("Val: 0x%lx\n", val);
+   LOG_TRACE(LOG_PE, "Val: 0x%lx\n", val);
    while (lu)
    {
       // if the MSB is set, import by ordinal. Otherwise, import by name
@@ -384,15 +422,14 @@ static unsigned int read_import_dir(import_dir_entry *d, FILE *f, unsigned int b
       {
          char tmp_name[16];
          sprintf(tmp_name, "0x%x", lu & 0xFFFF);
-         printf("%s: import by ordinal: %s\n", mod->name, tmp_name);
+         LOG_TRACE(LOG_PE, "%s: import by ordinal: %s\n", mod->name, tmp_name);
       }
       else
       {
-         printf("import by name lu=0x%x base=0x%x\n", lu, base);
+         LOG_TRACE(LOG_PE, "import by name lu=0x%x base=0x%x\n", lu, base);
          name = (char*)sec->data + ((lu & IMPORT_HINT_ENTRY_MASK) - base) + 2;
 
-         if (config.verbose)
-            fprintf(stderr, "Adding function: %s\n", name);
+         LOG_INFO(LOG_PE, "Adding function: %s\n", name);
          backend_add_import_function(mod, name, val);
       }
       backend_add_symbol(obj, name, 0, SYMBOL_TYPE_NONE, 0, SYMBOL_FLAG_GLOBAL | SYMBOL_FLAG_EXTERNAL, sec_text);
@@ -413,62 +450,62 @@ const char* lookup_machine(unsigned short machine)
 
 void dump_coff(coff_header* h)
 {
-   printf("\nCOFF Header\n");
-   printf("machine: %s\n", lookup_machine(h->machine));
-   printf("num sections: %u\n", h->num_sections);
+   LOG_DEBUG(LOG_PE, "\nCOFF Header\n");
+   LOG_DEBUG(LOG_PE, "machine: %s\n", lookup_machine(h->machine));
+   LOG_DEBUG(LOG_PE, "num sections: %u\n", h->num_sections);
    time_t creat = h->time_created;
-   printf("created: %s", ctime(&creat));
-   printf("symtab offset: %u\n", h->offset_symtab);
-   printf("num symbols: %u\n", h->num_symbols);
-   printf("exe header size: %u\n", h->size_optional_hdr);
-   printf("flags: 0x%X\n", h->flags);
+   LOG_DEBUG(LOG_PE, "created: %s", ctime(&creat));
+   LOG_DEBUG(LOG_PE, "symtab offset: %u\n", h->offset_symtab);
+   LOG_DEBUG(LOG_PE, "num symbols: %u\n", h->num_symbols);
+   LOG_DEBUG(LOG_PE, "exe header size: %u\n", h->size_optional_hdr);
+   LOG_DEBUG(LOG_PE, "flags: 0x%X\n", h->flags);
    for (int i=0; i < sizeof(h->flags)*8; i++)
       if (h->flags & 1<<i)
-         printf("   - %s\n", flags_lookup[i]);
+         LOG_DEBUG(LOG_PE, "   - %s\n", flags_lookup[i]);
 }
 
 void dump_optional(optional_header* h, unsigned short state)
 {
-   printf("state: ");
+   LOG_DEBUG(LOG_PE, "state: ");
    switch(state)
    {
    case STATE_ID_NORMAL:
-      printf("PE32\n");
+      LOG_DEBUG(LOG_PE, "PE32\n");
       break;
    case STATE_ID_ROM:
-      printf("PE ROM\n");
+      LOG_DEBUG(LOG_PE, "PE ROM\n");
       break;
    case STATE_ID_PE32PLUS:
-      printf("PE32+\n");   
+      LOG_DEBUG(LOG_PE, "PE32+\n");   
       break;
    default:
-      printf("Unknown\n");
+      LOG_DEBUG(LOG_PE, "Unknown\n");
    }
-   printf("link ver: %i.%i\n", h->major_linker_ver, h->minor_linker_ver);
-   printf("code size: %i\n", h->code_size);
-   printf("data size: %i\n", h->data_size);
-   printf("uninit data size: %i\n", h->uninit_data_size);
-   printf("entry: 0x%x\n", h->entry);
-   printf("code base: 0x%x\n", h->code_base);
+   LOG_DEBUG(LOG_PE, "link ver: %i.%i\n", h->major_linker_ver, h->minor_linker_ver);
+   LOG_DEBUG(LOG_PE, "code size: %i\n", h->code_size);
+   LOG_DEBUG(LOG_PE, "data size: %i\n", h->data_size);
+   LOG_DEBUG(LOG_PE, "uninit data size: %i\n", h->uninit_data_size);
+   LOG_DEBUG(LOG_PE, "entry: 0x%x\n", h->entry);
+   LOG_DEBUG(LOG_PE, "code base: 0x%x\n", h->code_base);
    if (state == STATE_ID_NORMAL)
-      printf("date base: 0x%x\n", h->data_base);
+      LOG_DEBUG(LOG_PE, "date base: 0x%x\n", h->data_base);
 }
 
 void dump_pe32_windows(pe32_windows_header* h)
 {
-   printf("\nPE 32 Windows header\n");
-   printf("Base: 0x%x\n", h->base);
-   printf("Section alignment: %u\n", h->section_alignment);
+   LOG_DEBUG(LOG_PE, "\nPE 32 Windows header\n");
+   LOG_DEBUG(LOG_PE, "Base: 0x%x\n", h->base);
+   LOG_DEBUG(LOG_PE, "Section alignment: %u\n", h->section_alignment);
    unsigned int file_alignment;
-   printf("OS version: %u.%u\n", h->os_major, h->os_minor);
-   printf("Image version: %u.%u\n", h->image_major, h->image_minor);
-   printf("Subsystem version: %u.%u\n", h->subsys_major, h->subsys_minor);
+   LOG_DEBUG(LOG_PE, "OS version: %u.%u\n", h->os_major, h->os_minor);
+   LOG_DEBUG(LOG_PE, "Image version: %u.%u\n", h->image_major, h->image_minor);
+   LOG_DEBUG(LOG_PE, "Subsystem version: %u.%u\n", h->subsys_major, h->subsys_minor);
    //unsigned int image_size;
    //unsigned int header_size;
    //unsigned int checksum;
    if (h->subsystem >= IMAGE_SUBSYSTEM_MAX)
       h->subsystem = 0;
-   printf("Subsystem: %s\n", subsystem_lookup[h->subsystem]); // see IMAGE_SUBSYSTEM_
+   LOG_DEBUG(LOG_PE, "Subsystem: %s\n", subsystem_lookup[h->subsystem]); // see IMAGE_SUBSYSTEM_
    //unsigned short dll_chars;
    //unsigned int stack_size;
    //unsigned int stack_commit_size;
@@ -480,36 +517,36 @@ void dump_pe32_windows(pe32_windows_header* h)
 
 void dump_data_dirs(data_dirs* h)
 {
-   printf("\nData Directories\n");
-   printf("Export: 0x%x (%u)\n", h->exports.offset, h->exports.size);
-   printf("Import: 0x%x (%u)\n", h->imports.offset, h->imports.size);
-   printf("Resource: 0x%x (%u)\n", h->resource.offset, h->resource.size);
-   printf("Exception: 0x%x (%u)\n", h->exception.offset, h->exception.size);
-   printf("Certificate: 0x%x (%u)\n", h->certificate.offset, h->certificate.size);
-   printf("Relocation: 0x%x (%u)\n", h->relocation.offset, h->relocation.size);
-   printf("Debug: 0x%x (%u)\n", h->debug.offset, h->debug.size);
-   printf("Arch: 0x%x (%u)\n", h->arch.offset, h->arch.size);
-   printf("Ptr: 0x%x (%u)\n", h->ptr.offset, h->ptr.size);
-   printf("TLS: 0x%x (%u)\n", h->tls.offset, h->tls.size);
-   printf("Load Config: 0x%x (%u)\n", h->load.offset, h->load.size);
-   printf("Bound Import: 0x%x (%u)\n", h->bound.offset, h->bound.size);
-   printf("Import Address: 0x%x (%u)\n", h->iat.offset, h->iat.size);
-   printf("Delay Import: 0x%x (%u)\n", h->delay.offset, h->delay.size);
-   printf("CLR Runtime: 0x%x (%u)\n", h->clr.offset, h->clr.size);
+   LOG_DEBUG(LOG_PE, "\nData Directories\n");
+   LOG_DEBUG(LOG_PE, "Export: 0x%x (%u)\n", h->exports.offset, h->exports.size);
+   LOG_DEBUG(LOG_PE, "Import: 0x%x (%u)\n", h->imports.offset, h->imports.size);
+   LOG_DEBUG(LOG_PE, "Resource: 0x%x (%u)\n", h->resource.offset, h->resource.size);
+   LOG_DEBUG(LOG_PE, "Exception: 0x%x (%u)\n", h->exception.offset, h->exception.size);
+   LOG_DEBUG(LOG_PE, "Certificate: 0x%x (%u)\n", h->certificate.offset, h->certificate.size);
+   LOG_DEBUG(LOG_PE, "Relocation: 0x%x (%u)\n", h->relocation.offset, h->relocation.size);
+   LOG_DEBUG(LOG_PE, "Debug: 0x%x (%u)\n", h->debug.offset, h->debug.size);
+   LOG_DEBUG(LOG_PE, "Arch: 0x%x (%u)\n", h->arch.offset, h->arch.size);
+   LOG_DEBUG(LOG_PE, "Ptr: 0x%x (%u)\n", h->ptr.offset, h->ptr.size);
+   LOG_DEBUG(LOG_PE, "TLS: 0x%x (%u)\n", h->tls.offset, h->tls.size);
+   LOG_DEBUG(LOG_PE, "Load Config: 0x%x (%u)\n", h->load.offset, h->load.size);
+   LOG_DEBUG(LOG_PE, "Bound Import: 0x%x (%u)\n", h->bound.offset, h->bound.size);
+   LOG_DEBUG(LOG_PE, "Import Address: 0x%x (%u)\n", h->iat.offset, h->iat.size);
+   LOG_DEBUG(LOG_PE, "Delay Import: 0x%x (%u)\n", h->delay.offset, h->delay.size);
+   LOG_DEBUG(LOG_PE, "CLR Runtime: 0x%x (%u)\n", h->clr.offset, h->clr.size);
 }
 
 void dump_import_dirent(import_dir_entry *d)
 {
-   printf("lu_table=0x%x\n", d->lu_table);
-   //printf("timestamp=0x%x\n", d->timestamp);
-   //printf("forwarder=0x%x\n", d->forwarder);
-   printf("DLL name=0x%x\n", d->name);
-   printf("first thunk=0x%x\n\n", d->addr_table);
+   LOG_DEBUG(LOG_PE, "lu_table=0x%x\n", d->lu_table);
+   //LOG_DEBUG(LOG_PE, "timestamp=0x%x\n", d->timestamp);
+   //LOG_DEBUG(LOG_PE, "forwarder=0x%x\n", d->forwarder);
+   LOG_DEBUG(LOG_PE, "DLL name=0x%x\n", d->name);
+   LOG_DEBUG(LOG_PE, "first thunk=0x%x\n\n", d->addr_table);
 }
 
 static char* coff_symbol_name(symbol* s, char* stringtab)
 {
-   static char nametmp[10];
+   static __thread char nametmp[10];
    char* name;
    if (s->name.ptr.zeros == 0)
       name = stringtab + s->name.ptr.index;
@@ -539,7 +576,7 @@ void dump_symtab(symbol* symtab, unsigned int count, char* stringtab)
             char nametmp[19];
             // COFF symbols of type file should have the name ".file"
             if (strcmp(name, ".file"))
-               printf("Got a symbol of type file without name .file! (named %s)\n", name);
+               LOG_WARN(LOG_PE, "Got a symbol of type file without name .file! (named %s)\n", name);
             // now get its real name
             memcpy(nametmp, (char*)(&symtab[i]), 18);
             nametmp[18] = 0;
@@ -549,28 +586,28 @@ void dump_symtab(symbol* symtab, unsigned int count, char* stringtab)
          //AUX tagndx 0 ttlsiz 0x0 lnnos 0 next 0
          aux--;
       }
-      printf("[%3u](sec %2i)(fl 0x00)(ty %3x)(scl %3i) (nx %i) 0x%08x %s\n", i, s->section, s->type, s->symclass, s->auxsymbols, s->val, name);
+      LOG_DEBUG(LOG_PE, "[%3u](sec %2i)(fl 0x00)(ty %3x)(scl %3i) (nx %i) 0x%08x %s\n", i, s->section, s->type, s->symclass, s->auxsymbols, s->val, name);
    }
 }
 
 static void dump_sections(section_header* secs, unsigned int nsec)
 {
-   printf("There are %u sections\n", nsec);
+   LOG_DEBUG(LOG_PE, "There are %u sections\n", nsec);
    for (unsigned int i=0; i < nsec; i++)
    {
-      printf("Index: %i\n", i+1);
-      printf("Section Name: %s\n", secs[i].name);
-      printf("Size in mem: %u\n", secs[i].size_in_mem);
-      printf("Address: 0x%x\n", secs[i].address);
-      printf("Data ptr: %u\n", secs[i].data_offset); 
-      printf("Flags: 0x%x\n", secs[i].flags);
+      LOG_DEBUG(LOG_PE, "Index: %i\n", i+1);
+      LOG_DEBUG(LOG_PE, "Section Name: %s\n", secs[i].name);
+      LOG_DEBUG(LOG_PE, "Size in mem: %u\n", secs[i].size_in_mem);
+      LOG_DEBUG(LOG_PE, "Address: 0x%x\n", secs[i].address);
+      LOG_DEBUG(LOG_PE, "Data ptr: %u\n", secs[i].data_offset); 
+      LOG_DEBUG(LOG_PE, "Flags: 0x%x\n", secs[i].flags);
       for (int f=0; f < 19; f++)
          if (secs[i].flags & (1<<f))
-            printf("   - %s\n", section_flags_lookup[f]);
+            LOG_DEBUG(LOG_PE, "   - %s\n", section_flags_lookup[f]);
       for (int f=24; f < 31; f++)
          if (secs[i].flags & (1<<f))
-            printf("   - %s\n", section_flags_lookup[f]);
-      printf("Alignment: %i\n\n", (secs[i].flags >> SCN_SHIFT_ALIGN) & SCN_ALIGN);
+            LOG_DEBUG(LOG_PE, "   - %s\n", section_flags_lookup[f]);
+      LOG_DEBUG(LOG_PE, "Alignment: %i\n\n", (secs[i].flags >> SCN_SHIFT_ALIGN) & SCN_ALIGN);
    }
 }
 
@@ -592,7 +629,7 @@ static backend_object* pe_read_file(const char* filename)
    FILE* f = fopen(filename, "rb");
    if (!f)
    {
-      printf("can't open file\n");
+      LOG_DEBUG(LOG_PE, "can't open file\n");
       free(buff);
       return 0;
    }
@@ -624,7 +661,7 @@ static backend_object* pe_read_file(const char* filename)
       return 0;
    }
    
-   printf("found PE magic number\n");
+   LOG_DEBUG(LOG_PE, "found PE magic number\n");
    
    backend_object* obj = backend_create();
    if (!obj)
@@ -638,16 +675,16 @@ static backend_object* pe_read_file(const char* filename)
    int fpos = ftell(f);
    //printf("COFF header @ 0x%x\n", fpos);
    if (fread(&ch, sizeof(coff_header), 1, f) != 1)
-		printf("Error reading COFF header\n");
+		LOG_ERROR(LOG_PE, "Error reading COFF header\n");
    //dump_coff(&ch);
 
    unsigned short state; // STATE_ID_
    if (fread(&state, sizeof(state), 1, f) != 1)
-		printf("Error reading state\n");
+		LOG_ERROR(LOG_PE, "Error reading state\n");
 
 	unsigned int entry_offset;
-	unsigned int base_address;
-   backend_arch be_arch;
+	unsigned long base_address = 0;
+   backend_arch be_arch = OBJECT_ARCH_UNKNOWN;
 
    switch(ch.machine)
    {
@@ -660,6 +697,7 @@ static backend_object* pe_read_file(const char* filename)
       break;
 
    case IMAGE_FILE_MACHINE_I386:
+   case IMAGE_FILE_MACHINE_AMD64:
       be_arch = OBJECT_ARCH_X86;
       break;
    }
@@ -667,6 +705,7 @@ static backend_object* pe_read_file(const char* filename)
 
    // read the optional header
    free(buff);
+   buff = NULL;
    switch(state)
    {
    case STATE_ID_NORMAL:
@@ -674,7 +713,7 @@ static backend_object* pe_read_file(const char* filename)
       // read the optional header
       buff = (char*)malloc(sizeof(optional_header));
 		if (fread(buff, sizeof(optional_header), 1, f) != 1)
-			printf("Error reading optional header\n");
+			LOG_ERROR(LOG_PE, "Error reading optional header\n");
       //dump_optional((optional_header*)buff, state);
 		entry_offset = ((optional_header*)buff)->entry;
 
@@ -682,7 +721,7 @@ static backend_object* pe_read_file(const char* filename)
       free(buff);
       buff = (char*)malloc(sizeof(pe32_windows_header));
       if (fread(buff, sizeof(pe32_windows_header), 1, f) != 1)
-			printf("Error reading windows header\n");
+			LOG_ERROR(LOG_PE, "Error reading windows header\n");
       //dump_pe32_windows((pe32_windows_header*)buff);
 
 		// add generic object information
@@ -696,21 +735,26 @@ static backend_object* pe_read_file(const char* filename)
 
    case STATE_ID_PE32PLUS:
       backend_set_type(obj, OBJECT_TYPE_PE32PLUS);
-      free(buff);
-      //buff = (char*)malloc(sizeof(pe32_windows_header));
-      //fread(buff, sizeof(pe32_windows_header), 1, f);
-      //dump_pe32plus_windows((pe32_windows_header*)buff);
+      buff = (char*)malloc(sizeof(pe32plus_header));
+      fseek(f, -(long)sizeof(state), SEEK_CUR);
+		if (fread(buff, sizeof(pe32plus_header), 1, f) != 1)
+			LOG_ERROR(LOG_PE, "Error reading PE32+ header\n");
+
+		// add generic object information
+		entry_offset = ((pe32plus_header*)buff)->entry;
+		base_address = ((pe32plus_header*)buff)->base;
+		backend_set_entry_point(obj, base_address + entry_offset);
       break;
 
    default:
-      printf("Unknown\n");
+      LOG_WARN(LOG_PE, "Unknown\n");
    }
-
+   backend_set_base_address(obj, base_address);
 
    // read the data directories
    data_dirs* dd = (data_dirs*)malloc(sizeof(data_dirs));
 	if (fread(dd, sizeof(data_dirs), 1, f) != 1)
-		printf("Error reading data directories\n");
+		LOG_ERROR(LOG_PE, "Error reading data directories\n");
    //dump_data_dirs(dd);
 
    // read the sections - they are immediately after the optional header
@@ -720,17 +764,17 @@ static backend_object* pe_read_file(const char* filename)
    int sectabsize = sizeof(section_header) * ch.num_sections;
    section_header* secs = (section_header*)malloc(sectabsize);
 	if (fread(secs, sectabsize, 1 ,f) != 1)
-		printf("Error reading section table\n");
+		LOG_ERROR(LOG_PE, "Error reading section table\n");
    //dump_sections(secs, ch.num_sections);
 
    for (unsigned int i=0; i < ch.num_sections; i++)
    {
-      unsigned char* data = (unsigned char*)malloc(secs[i].size_on_disk);
+      unsigned char* data = (unsigned char*)mem_alloc(MEM_SECTION_DATA, secs[i].size_on_disk);
 
       // load the data
       fseek(f, secs[i].data_offset, SEEK_SET);
 		if (fread(data, secs[i].size_on_disk, 1, f) != 1)
-			printf("Error reading section %i\n", i);
+			LOG_ERROR(LOG_PE, "Error reading section %i\n", i);
 
       // convert the flags
       unsigned int flags=0;
@@ -761,6 +805,7 @@ static backend_object* pe_read_file(const char* filename)
 		// add the backend section
       backend_section* sec = backend_add_section(obj, tmp_name, secs[i].size_in_mem, base_address + secs[i].address, data, 0, (secs[i].flags >> SCN_SHIFT_ALIGN) & SCN_ALIGN, flags);
    }
+   free(secs);
 
    // read the symbol table
    symbol* symtab = NULL;
@@ -773,19 +818,19 @@ static backend_object* pe_read_file(const char* filename)
       fpos = ftell(f);
       //printf("symtab @ 0x%x\n", fpos);
       if (fread(symtab, symtabsize, 1, f) != 1)
-			printf("Error reading symbol table\n");
+			LOG_ERROR(LOG_PE, "Error reading symbol table\n");
    }
    // can't dump the symbol table until the string table is read
 
    // read the string table
    int strtabsize=0;
 	if (fread(&strtabsize, 4, 1, f) != 1)
-		printf("Error reading size of string table\n");
+		LOG_ERROR(LOG_PE, "Error reading size of string table\n");
 
    //printf("string table is %i bytes long\n", strtabsize);
    char* strtab = (char*)malloc(strtabsize + sizeof(strtabsize));
 	if (fread(strtab+sizeof(strtabsize), strtabsize, 1, f) != 1)
-		printf("Error reading string table size\n");
+		LOG_ERROR(LOG_PE, "Error reading string table size\n");
    //dump_symtab(symtab, ch.num_symbols, strtab);
 
    // fill the generic symbol table
@@ -799,13 +844,13 @@ static backend_object* pe_read_file(const char* filename)
       {
          if (s->symclass == SYM_CLASS_EXTERNAL && s->section <= 0)
          {
-            printf("Warning: external symbol %s does not have a valid section number\n", name);
+            LOG_WARN(LOG_PE, "Warning: external symbol %s does not have a valid section number\n", name);
             break;
          }
          if (s->auxsymbols == 1)
             i++; // the aux doesn't seem to be in use by MSFT, so I'm not going to bother reading it now
-			// this strndup is leaking memory - fix it. It is duplicated again inside the call. also a few more down below in calls to add_symbol.
-         backend_add_symbol(obj, strndup(name, 8), s->val, SYMBOL_TYPE_FUNCTION, 0, 0, backend_get_section_by_index(obj, s->section));
+			snprintf(tmp_name, sizeof(tmp_name), "%.8s", name);
+         backend_add_symbol(obj, tmp_name, s->val, SYMBOL_TYPE_FUNCTION, 0, 0, backend_get_section_by_index(obj, s->section));
       }
       else
       {
@@ -813,8 +858,9 @@ static backend_object* pe_read_file(const char* filename)
          {
          case SYM_CLASS_FILE:
             if (strcmp(name, ".file"))
-               printf("Warning: 'file' symbol is not named '.file'!\n");
-            backend_add_symbol(obj, strndup((char*)&symtab[++i], 18), s->val, SYMBOL_TYPE_FILE, 0, 0, NULL);
+               LOG_WARN(LOG_PE, "Warning: 'file' symbol is not named '.file'!\n");
+            snprintf(tmp_name, sizeof(tmp_name), "%.18s", (char*)&symtab[++i]);
+            backend_add_symbol(obj, tmp_name, s->val, SYMBOL_TYPE_FILE, 0, 0, NULL);
             break;
 
          case SYM_CLASS_SECTION:
@@ -827,7 +873,8 @@ static backend_object* pe_read_file(const char* filename)
                //symbol_aux_sec* a = &(symtab[++i]);
                i++; // remove this when uncommenting previous line
             }
-            backend_add_symbol(obj, strndup(name, 8), s->val, SYMBOL_TYPE_SECTION, 0, 0, NULL);
+            snprintf(tmp_name, sizeof(tmp_name), "%.8s", name);
+            backend_add_symbol(obj, tmp_name, s->val, SYMBOL_TYPE_SECTION, 0, 0, NULL);
             // here we probably need to update the section object as well
             break;
 
@@ -845,16 +892,16 @@ static backend_object* pe_read_file(const char* filename)
 	backend_import* mod;
 	backend_section *imports_sec=NULL;
 	backend_section* sec_text = backend_get_section_by_name(obj, ".text");
-	unsigned int imports_start = base_address + dd->imports.offset;
+	unsigned long imports_start = base_address + dd->imports.offset;
+	unsigned int thunk_size = (state == STATE_ID_PE32PLUS) ? 8 : 4; // size of an entry in the lookup table
 
 	if (!sec_text)
 	{
-		printf("Can't find code section!\n");
+		LOG_WARN(LOG_PE, "Can't find code section!\n");
 		goto done;
 	}
 
-   if (config.verbose)
-      printf("Imports are at address 0x%x size=0x%x\n", imports_start, dd->imports.size);
+   LOG_INFO(LOG_PE, "Imports are at address 0x%lx size=0x%x\n", imports_start, dd->imports.size);
 
    // find out which section contains the import names (if we have imports)
    if (imports_start)
@@ -882,49 +929,52 @@ static backend_object* pe_read_file(const char* filename)
          //dump_import_dirent(d);
 
          if (d->name < offset)
-            printf("WARNING: going negative d->name=0x%x offset=0x%x\n", d->name, offset);
+            LOG_WARN(LOG_PE, "WARNING: going negative d->name=0x%x offset=0x%x\n", d->name, offset);
 
          // calculate the pointer to the module name
          char* mod_name = (char*)imports_sec->data + (d->name - offset);
 
          if (d->lu_table < offset)
-            printf("WARNING: going negative d->lu_table=0x%x offset=0x%x\n", d->lu_table, offset);
+            LOG_WARN(LOG_PE, "WARNING: going negative d->lu_table=0x%x offset=0x%x\n", d->lu_table, offset);
 
-         // calculate the pointer to the table in memory - each entry is 4 bytes
-         unsigned int *lu_entry = (unsigned int*)(imports_sec->data + (d->lu_table - offset));
-         unsigned int val = imports_sec->address + (d->lu_table - offset);
+         // calculate the pointer to the table in memory - each entry is 4 bytes (8 bytes in PE32+)
+         unsigned char *lu_entry = imports_sec->data + (d->lu_table - offset);
+         unsigned long val = imports_sec->address + (d->lu_table - offset);
 
-         if (config.verbose)
-            printf("Module: %s Table @ 0x%x\n", mod_name, d->lu_table - offset);
+         LOG_INFO(LOG_PE, "Module: %s Table @ 0x%x\n", mod_name, d->lu_table - offset);
 
          // add the module to the backend
          mod = backend_add_import_module(obj, mod_name);
 
          // iterate over all functions belonging to this module
-         while (*lu_entry)
+         while (1)
          {
+            unsigned long thunk = (thunk_size == 8) ? *(unsigned long*)lu_entry : *(unsigned int*)lu_entry;
+            int by_ordinal = (thunk_size == 8) ? !!(thunk & IMPORT_BY_ORDINAL_64) : !!(thunk & IMPORT_BY_ORDINAL);
+            if (!thunk)
+               break;
 
-            if (*lu_entry < offset)
-               printf("Warning: lu_entry=0x%x offset=0x%x\n", *lu_entry, offset);
+            if (!by_ordinal && thunk < offset)
+               LOG_WARN(LOG_PE, "Warning: lu_entry=0x%lx offset=0x%x\n", thunk, offset);
 
             // if the MSB is set, import by ordinal. Otherwise, import by name
-            if (*lu_entry & IMPORT_BY_ORDINAL)
+            if (by_ordinal)
             {
-               sprintf(tmp_name, "0x%x", *lu_entry & IMPORT_HINT_ENTRY_MASK);
+               sprintf(tmp_name, "0x%x", (unsigned int)thunk & IMPORT_HINT_ENTRY_MASK);
                //printf("import by ordinal: %s\n", tmp_name);
                import_name = tmp_name;
             }
             else
             {
                unsigned int lu;
-               lu = *lu_entry - offset;
+               lu = (unsigned int)thunk - offset;
                import_name = (char*)imports_sec->data + lu + 2;
                //printf("Name: %s\n", import_name);
                backend_add_symbol(obj, import_name, 0, SYMBOL_TYPE_NONE, 0, SYMBOL_FLAG_GLOBAL | SYMBOL_FLAG_EXTERNAL, sec_text);
             }
             backend_add_import_function(mod, import_name, val);
-            lu_entry++;
-            val += sizeof(unsigned int);
+            lu_entry += thunk_size;
+            val += thunk_size;
          }
 
          d++;
@@ -932,26 +982,26 @@ static backend_object* pe_read_file(const char* filename)
    }
    else
    {
-      fprintf(stderr, "Can't find imports section\n");
+      LOG_WARN(LOG_PE, "Can't find imports section\n");
    }
 
    // read the debug info
-   printf("checking for debug info\n");
+   LOG_DEBUG(LOG_PE, "checking for debug info\n");
    if (dd->debug.size && dd->debug.offset)
    {
       debug_dir_header ddh;
-      printf("Has debug info\n");
+      LOG_DEBUG(LOG_PE, "Has debug info\n");
       if (dd->debug.size != sizeof(debug_dir_header))
       {
-         printf("Unusual size %i (expected %lu)\n", dd->debug.size, sizeof(debug_dir_header));
+         LOG_WARN(LOG_PE, "Unusual size %i (expected %lu)\n", dd->debug.size, sizeof(debug_dir_header));
       }
 
       fseek(f, dd->debug.offset, SEEK_SET);
 		if (fread(&ddh, sizeof(ddh), 1, f) != 1)
-			printf("Error reading debug info header\n");
-      printf("debug type: %i\n", ddh.type);
-      printf("debug size: %i\n", ddh.size);
-      printf("debug offset: 0x%x\n", ddh.offset);
+			LOG_ERROR(LOG_PE, "Error reading debug info header\n");
+      LOG_DEBUG(LOG_PE, "debug type: %i\n", ddh.type);
+      LOG_DEBUG(LOG_PE, "debug size: %i\n", ddh.size);
+      LOG_DEBUG(LOG_PE, "debug offset: 0x%x\n", ddh.offset);
 
       fseek(f, ddh.offset, SEEK_SET);
       
@@ -961,10 +1011,11 @@ done:
    // clean up
    free(strtab);
    free(symtab);
+   free(dd);
    free(buff);
 
-	printf("PE32 loading done (%i symbols, %i relocs)\n", backend_symbol_count(obj), backend_relocation_count(obj));
-	printf("-----------------------------------------\n");
+	LOG_DEBUG(LOG_PE, "PE32 loading done (%i symbols, %i relocs)\n", backend_symbol_count(obj), backend_relocation_count(obj));
+	LOG_DEBUG(LOG_PE, "-----------------------------------------\n");
    return obj;
 }
 
@@ -997,36 +1048,29 @@ static unsigned int coff_symbol_count(backend_object* obj)
    return count;
 }
 
-static int coff_write_file(backend_object* obj, const char* filename)
+static int coff_write_file(backend_object* obj, FILE* f)
 {
-   FILE* f = fopen(filename, "wb");
-   if (!f)
-   {
-      printf("can't open file\n");
-      return -1;
-   }
-
    // fill and write the coff header
-   printf("writing COFF header\n");
+   LOG_DEBUG(LOG_PE, "writing COFF header\n");
    coff_header ch;
    ch.machine = IMAGE_FILE_MACHINE_I386;
    ch.num_sections = backend_section_count(obj);
    ch.time_created = time(NULL);
    ch.offset_symtab = sizeof(coff_header) + sizeof(section_header)*backend_section_count(obj);
-   printf("counting symbols\n");
+   LOG_DEBUG(LOG_PE, "counting symbols\n");
    ch.num_symbols = coff_symbol_count(obj);
-	printf("setting count to %i symbols\n", ch.num_symbols);
+	LOG_DEBUG(LOG_PE, "setting count to %i symbols\n", ch.num_symbols);
    ch.size_optional_hdr = 0;
    ch.flags = (1<<COFF_FLAG_32BIT_MACHINE) | (1<<COFF_FLAG_DEBUG_STRIPPED);
    fwrite(&ch, sizeof(coff_header), 1, f);
 
    // section table immediately follows the COFF header
-   printf("writing %u sections\n", backend_section_count(obj));
+   LOG_DEBUG(LOG_PE, "writing %u sections\n", backend_section_count(obj));
    backend_section* sec = backend_get_first_section(obj);
    while (sec)
    {
       section_header sh;
-      printf("Writing section %s\n", sec->name);
+      LOG_DEBUG(LOG_PE, "Writing section %s\n", sec->name);
       strncpy(sh.name, sec->name, 9); // yes, we want the null to go one past the end of buffer
       sh.size_in_mem = sec->size;
       sh.address = sec->address;
@@ -1051,7 +1095,7 @@ static int coff_write_file(backend_object* obj, const char* filename)
       if (sec->flags & SECTION_FLAG_DISCARDABLE)
          sh.flags |= SCN_LNK_REMOVE;
 
-      printf("writing section header\n");
+      LOG_DEBUG(LOG_PE, "writing section header\n");
       fwrite(&sh, sizeof(section_header), 1, f);
       sec = backend_get_next_section(obj);
    }
@@ -1087,7 +1131,6 @@ static int coff_write_file(backend_object* obj, const char* filename)
 
    // string table immediately follows the symbol table
 
-   fclose(f);
    return 0;
 }
 
@@ -1103,15 +1146,8 @@ static const unsigned char pe_header[] =
  0x6d, 0x6f, 0x64, 0x65, 0x2e, 0x0d, 0x0d, 0x0a, 0x24, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
 };
 
-static int pe32_write_file(backend_object* obj, const char* filename)
+static int pe32_write_file(backend_object* obj, FILE* f)
 {
-   FILE* f = fopen(filename, "wb");
-   if (!f)
-   {
-      printf("can't open file\n");
-      return -1;
-   }
-
    // write file header
    char buff[4];
    fwrite(&pe_header, sizeof(pe_header), 1, f);
@@ -1119,15 +1155,15 @@ static int pe32_write_file(backend_object* obj, const char* filename)
    fwrite(buff, MAGIC_SIZE, 1, f);
 
    // fill and write the coff header
-   printf("writing PE file\n");
+   LOG_DEBUG(LOG_PE, "writing PE file\n");
    coff_header ch;
    ch.machine = IMAGE_FILE_MACHINE_I386;
    ch.num_sections = backend_section_count(obj);
    ch.time_created = time(NULL);
    ch.offset_symtab = sizeof(coff_header) + sizeof(optional_header) + +sizeof(pe32_windows_header) + sizeof(data_dirs) + sizeof(section_header)*backend_section_count(obj);
-   printf("counting symbols\n");
+   LOG_DEBUG(LOG_PE, "counting symbols\n");
    ch.num_symbols = coff_symbol_count(obj);
-	printf("setting count to %i symbols\n", ch.num_symbols);
+	LOG_DEBUG(LOG_PE, "setting count to %i symbols\n", ch.num_symbols);
    ch.size_optional_hdr = sizeof(optional_header);
    ch.flags = (1<<COFF_FLAG_32BIT_MACHINE) | (1<<COFF_FLAG_DEBUG_STRIPPED) | (1<<COFF_FLAG_EXECUTABLE_IMAGE);
    fwrite(&ch, sizeof(coff_header), 1, f);
@@ -1162,12 +1198,12 @@ static int pe32_write_file(backend_object* obj, const char* filename)
    fwrite(&dd, sizeof(data_dirs), 1, f);
 
    // section table immediately follows the COFF header
-   printf("writing %u sections\n", backend_section_count(obj));
+   LOG_DEBUG(LOG_PE, "writing %u sections\n", backend_section_count(obj));
    backend_section* sec = backend_get_first_section(obj);
    while (sec)
    {
       section_header sh;
-      printf("Writing section %s\n", sec->name);
+      LOG_DEBUG(LOG_PE, "Writing section %s\n", sec->name);
       strncpy(sh.name, sec->name, 8);
       sh.size_in_mem = sec->size;
       sh.address = sec->address;
@@ -1192,13 +1228,13 @@ static int pe32_write_file(backend_object* obj, const char* filename)
       if (sec->flags & SECTION_FLAG_DISCARDABLE)
          sh.flags |= SCN_LNK_REMOVE;
 
-      printf("writing section header\n");
+      LOG_DEBUG(LOG_PE, "writing section header\n");
       fwrite(&sh, sizeof(section_header), 1, f);
       sec = backend_get_next_section(obj);
    }
 
    // symbol table
-	printf("writing symbol table\n");
+	LOG_DEBUG(LOG_PE, "writing symbol table\n");
    backend_symbol* sym = backend_get_first_symbol(obj);
    while (sym)
    {
@@ -1210,7 +1246,7 @@ static int pe32_write_file(backend_object* obj, const char* filename)
       switch (sym->type)
       {
       case SYMBOL_TYPE_FILE:
-			printf("writing file symbol %s\n", sym->name);
+			LOG_DEBUG(LOG_PE, "writing file symbol %s\n", sym->name);
          s.type = 0x20;
          s.symclass = SYM_CLASS_FILE;
          s.section = -2;
@@ -1240,7 +1276,6 @@ static int pe32_write_file(backend_object* obj, const char* filename)
 
    // string table immediately follows the symbol table
 
-   fclose(f);
    return 0;
 }
 backend_ops pe32_backend =
@@ -0,0 +1,492 @@
+/* Function detection by matching compiler prologues.
+Compilers start most functions with one of a small number of instruction sequences (push ebp;
+mov ebp,esp and friends). A database of these sequences (with wildcards for the bytes that vary,
+like the size of the stack frame) is compiled into an Aho-Corasick automaton, which finds all
+occurrences of all patterns in a single pass over each executable section.
+
+The automaton can't handle wildcards directly, so each pattern is represented in the automaton by
+its longest run of literal bytes (its 'atom'). When an atom is found, the whole pattern is checked
+at the corresponding position.
+
+The database is a text file with one pattern per line:
+<bits> <name> <bytes...>
+where <bits> is 16, 32 or 64, and each byte is a hex value or '??' for a wildcard. Everything after
+a '#' is ignored. A built-in database is always loaded - a file given with --prologues adds to it.
+The database belongs to the context of the run, and is loaded the first time it is needed. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "backend.h"
+#include "context.h"
+#include "log.h"
+#include "detect.h"
+
+#define MAX_PATTERN_LENGTH 16
+#define MAX_PATTERN_NAME 32
+#define AC_ALPHABET 256
+
+typedef struct prologue_pattern
+{
+	char name[MAX_PATTERN_NAME];
+	unsigned int bits;
+	unsigned char bytes[MAX_PATTERN_LENGTH];
+	unsigned char mask[MAX_PATTERN_LENGTH];	// 0 for wildcards
+	unsigned int length;
+	unsigned int atom_offset;						// where the longest literal run starts
+	unsigned int atom_length;
+} prologue_pattern;
+
+typedef struct ac_state
+{
+	int next[AC_ALPHABET];	// full transition table, so the scan never follows failure links
+	int fail;
+	int *out;					// patterns whose atom ends in this state
+	unsigned int out_count;
+} ac_state;
+
+typedef struct ac_automaton
+{
+	ac_state *states;
+	unsigned int count;
+	unsigned int capacity;
+} ac_automaton;
+
+static const char builtin_prologues[] =
+	"# gcc/clang with frame pointers\n"
+	"32 push-ebp             55 89 e5\n"
+	"32 push-ebp-msvc        55 8b ec\n"
+	"32 hotpatch             8b ff 55 8b ec\n"
+	"32 endbr32              f3 0f 1e fb\n"
+	"32 push-ebx-edi-esi     55 57 56 53\n"
+	"64 endbr64              f3 0f 1e fa\n"
+	"64 push-rbp             55 48 89 e5\n"
+	"64 push-rbp-r15         55 41 57\n"
+	"64 push-r15-r14         41 57 41 56\n"
+	"64 msvc-home-rcx        48 89 4c 24 08\n"
+	"64 msvc-home-rbx        48 89 5c 24 ??\n"
+	"16 push-bp              55 8b ec\n"
+	"16 enter                c8 ?? ?? 00\n";
+
+typedef struct prologue_db
+{
+	prologue_pattern *patterns;
+	unsigned int count;
+	unsigned int capacity;
+} prologue_db;
+
+// Parse one line of the database. Returns 1 if a pattern was added, 0 for empty lines and -1 for errors.
+static int parse_pattern(prologue_db *db, const char *line)
+{
+	prologue_pattern p;
+	const char *c = line;
+	unsigned int best = 0;
+	int n;
+
+	memset(&p, 0, sizeof(p));
+	if (sscanf(c, "%u %31s%n", &p.bits, p.name, &n) != 2)
+		return 0;
+	c += n;
+
+	if (p.bits != 16 && p.bits != 32 && p.bits != 64)
+		return -1;
+
+	while (*c)
+	{
+		unsigned int b;
+
+		while (isspace((unsigned char)*c))
+			c++;
+		if (!*c)
+			break;
+		if (p.length == MAX_PATTERN_LENGTH)
+			return -1;
+
+		if (c[0] == '?' && c[1] == '?')
+		{
+			c += 2;
+			p.length++;
+			continue;
+		}
+		if (sscanf(c, "%2x%n", &b, &n) != 1)
+			return -1;
+		c += n;
+		p.bytes[p.length] = b;
+		p.mask[p.length] = 0xFF;
+		p.length++;
+	}
+
+	// find the longest run of literal bytes
+	for (unsigned int i=0; i < p.length; )
+	{
+		unsigned int j = i;
+		while (j < p.length && p.mask[j])
+			j++;
+		if (j - i > best)
+		{
+			best = j - i;
+			p.atom_offset = i;
+			p.atom_length = best;
+		}
+		i = j + 1;
+	}
+	if (!best)
+		return -1;
+
+	if (db->count == db->capacity)
+	{
+		unsigned int c = db->capacity ? db->capacity * 2 : 32;
+		prologue_pattern *np = realloc(db->patterns, c * sizeof(prologue_pattern));
+		if (!np)
+			return -1;
+		db->patterns = np;
+		db->capacity = c;
+	}
+	db->patterns[db->count++] = p;
+	return 1;
+}
+
+static int parse_database(prologue_db *db, const char *text, const char *source)
+{
+	char line[256];
+	unsigned int lineno = 0;
+	int count = 0;
+
+	while (*text)
+	{
+		const char *eol = strchr(text, '\n');
+		size_t len = eol ? (size_t)(eol - text) : strlen(text);
+		char *comment;
+
+		lineno++;
+		if (len >= sizeof(line))
+			len = sizeof(line) - 1;
+		memcpy(line, text, len);
+		line[len] = 0;
+		text = eol ? eol + 1 : text + strlen(text);
+
+		comment = strchr(line, '#');
+		if (comment)
+			*comment = 0;
+
+		int ret = parse_pattern(db, line);
+		if (ret < 0)
+			LOG_WARN(LOG_RECONSTRUCT, "%s:%u: bad prologue pattern\n", source, lineno);
+		else
+			count += ret;
+	}
+
+	return count;
+}
+
+static int load_database(struct delinker_ctx *ctx)
+{
+	const char *filename = ctx->config.prologue_file;
+	prologue_db *db;
+
+	if (ctx->prologues)
+		return 0;
+	db = calloc(1, sizeof(prologue_db));
+	if (!db)
+		return -1;
+	ctx->prologues = db;
+
+	parse_database(db, builtin_prologues, "built-in");
+
+	if (filename)
+	{
+		FILE *f = fopen(filename, "r");
+		char *text;
+		long size;
+
+		if (!f)
+		{
+			LOG_ERROR(LOG_RECONSTRUCT, "Can't open prologue database %s\n", filename);
+			return -1;
+		}
+		fseek(f, 0, SEEK_END);
+		size = ftell(f);
+		fseek(f, 0, SEEK_SET);
+		text = malloc(size + 1);
+		if (!text || fread(text, 1, size, f) != size)
+		{
+			free(text);
+			fclose(f);
+			return -1;
+		}
+		text[size] = 0;
+		fclose(f);
+
+		int count = parse_database(db, text, filename);
+		LOG_INFO(LOG_RECONSTRUCT, "Loaded %i prologue patterns from %s\n", count, filename);
+		free(text);
+	}
+
+	return 0;
+}
+
+void prologue_free(struct delinker_ctx *ctx)
+{
+	if (!ctx->prologues)
+		return;
+	free(ctx->prologues->patterns);
+	free(ctx->prologues);
+	ctx->prologues = NULL;
+}
+
+static int ac_add_state(ac_automaton *ac)
+{
+	if (ac->count == ac->capacity)
+	{
+		unsigned int c = ac->capacity ? ac->capacity * 2 : 64;
+		ac_state *ns = realloc(ac->states, c * sizeof(ac_state));
+		if (!ns)
+			return -1;
+		ac->states = ns;
+		ac->capacity = c;
+	}
+	ac_state *s = &ac->states[ac->count];
+	memset(s->next, 0xFF, sizeof(s->next));
+	s->fail = 0;
+	s->out = NULL;
+	s->out_count = 0;
+	return ac->count++;
+}
+
+static int ac_add_output(ac_state *s, int pattern)
+{
+	int *o = realloc(s->out, (s->out_count + 1) * sizeof(int));
+	if (!o)
+		return -1;
+	s->out = o;
+	s->out[s->out_count++] = pattern;
+	return 0;
+}
+
+static void ac_destroy(ac_automaton *ac)
+{
+	for (unsigned int i=0; i < ac->count; i++)
+		free(ac->states[i].out);
+	free(ac->states);
+	ac->states = NULL;
+	ac->count = ac->capacity = 0;
+}
+
+// Build the automaton for all the patterns of the given word size
+static int ac_build(ac_automaton *ac, const prologue_db *db, unsigned int bits)
+{
+	int *queue;
+	unsigned int head = 0, tail = 0;
+
+	memset(ac, 0, sizeof(ac_automaton));
+	if (ac_add_state(ac) < 0)
+		return -1;
+
+	// the trie of all atoms
+	for (unsigned int i=0; i < db->count; i++)
+	{
+		const prologue_pattern *p = &db->patterns[i];
+		int state = 0;
+
+		if (p->bits != bits)
+			continue;
+
+		for (unsigned int j=0; j < p->atom_length; j++)
+		{
+			unsigned char b = p->bytes[p->atom_offset + j];
+			if (ac->states[state].next[b] < 0)
+			{
+				int ns = ac_add_state(ac);
+				if (ns < 0)
+					return -1;
+				ac->states[state].next[b] = ns;
+			}
+			state = ac->states[state].next[b];
+		}
+		if (ac_add_output(&ac->states[state], i))
+			return -1;
+	}
+
+	// Breadth-first, compute the failure links and fill in the missing transitions with the
+	// transitions of the failure state. That turns the trie into a DFA.
+	queue = malloc(ac->count * sizeof(int));
+	if (!queue)
+		return -1;
+	for (int b=0; b < AC_ALPHABET; b++)
+	{
+		int ns = ac->states[0].next[b];
+		if (ns < 0)
+			ac->states[0].next[b] = 0;
+		else
+		{
+			ac->states[ns].fail = 0;
+			queue[tail++] = ns;
+		}
+	}
+	while (head < tail)
+	{
+		int s = queue[head++];
+		int fail = ac->states[s].fail;
+
+		// a state also matches everything its failure state matches
+		for (unsigned int i=0; i < ac->states[fail].out_count; i++)
+			ac_add_output(&ac->states[s], ac->states[fail].out[i]);
+
+		for (int b=0; b < AC_ALPHABET; b++)
+		{
+			int ns = ac->states[s].next[b];
+			if (ns < 0)
+				ac->states[s].next[b] = ac->states[fail].next[b];
+			else
+			{
+				ac->states[ns].fail = ac->states[fail].next[b];
+				queue[tail++] = ns;
+			}
+		}
+	}
+	free(queue);
+
+	return 0;
+}
+
+static int pattern_matches(const prologue_pattern *p, const unsigned char *data, unsigned long size, unsigned long offset)
+{
+	if (offset + p->length > size)
+		return 0;
+	for (unsigned int i=0; i < p->length; i++)
+		if ((data[offset + i] & p->mask[i]) != p->bytes[i])
+			return 0;
+	return 1;
+}
+
+static inline int is_padding(unsigned char b)
+{
+	return (b == 0xCC || b == 0x90);
+}
+
+// A prologue in the middle of a function is more likely to be a coincidence. Only accept it at
+// the start of the section, after a 'ret', or after padding. A single padding byte may just as well
+// be the last byte of an operand, so it only counts when it pads up to a 16-byte boundary.
+static int at_boundary(const backend_section *sec, unsigned long offset)
+{
+	unsigned char prev;
+
+	if (offset == 0)
+		return 1;
+	prev = sec->data[offset - 1];
+	if (prev == 0xC3 || prev == 0xCB)
+		return 1;
+	if (!is_padding(prev))
+		return 0;
+	return (((sec->address + offset) & 0xF) == 0 || (offset >= 2 && is_padding(sec->data[offset - 2])));
+}
+
+static int offset_cmp(const void *a, const void *b)
+{
+	unsigned long oa = *(const unsigned long*)a;
+	unsigned long ob = *(const unsigned long*)b;
+	if (oa < ob)
+		return -1;
+	return (oa > ob);
+}
+
+static unsigned int scan_section(const ac_automaton *ac, const prologue_db *db, backend_object *obj, backend_section *sec, const char *src_name)
+{
+	unsigned long *starts = NULL;
+	unsigned int count = 0;
+	unsigned int capacity = 0;
+	unsigned int added = 0;
+	unsigned long entry = backend_get_entry_point(obj);
+	int state = 0;
+
+	// the start of the section and the entry point are always function starts
+	starts = malloc(64 * sizeof(unsigned long));
+	if (!starts)
+		return 0;
+	capacity = 64;
+	starts[count++] = 0;
+	if (entry > sec->address && entry < sec->address + sec->size)
+		starts[count++] = entry - sec->address;
+
+	for (unsigned long i=0; i < sec->size; i++)
+	{
+		const ac_state *s;
+
+		state = ac->states[state].next[sec->data[i]];
+		s = &ac->states[state];
+		for (unsigned int o=0; o < s->out_count; o++)
+		{
+			const prologue_pattern *p = &db->patterns[s->out[o]];
+			unsigned long atom_end = i + 1;
+			if (atom_end < p->atom_offset + p->atom_length)
+				continue;
+			unsigned long start = atom_end - p->atom_length - p->atom_offset;
+			if (!pattern_matches(p, sec->data, sec->size, start) || !at_boundary(sec, start))
+				continue;
+			if (count && starts[count-1] == start)
+				continue;
+
+			LOG_TRACE(LOG_RECONSTRUCT, "prologue '%s' @ 0x%lx\n", p->name, sec->address + start);
+			if (count == capacity)
+			{
+				unsigned long *ns = realloc(starts, capacity * 2 * sizeof(unsigned long));
+				if (!ns)
+					break;
+				starts = ns;
+				capacity *= 2;
+			}
+			starts[count++] = start;
+		}
+	}
+
+	// several patterns can match at the same place, and the entry point is out of order
+	qsort(starts, count, sizeof(unsigned long), offset_cmp);
+
+	for (unsigned int i=0; i < count; i++)
+	{
+		unsigned long end = (i + 1 < count) ? starts[i+1] : sec->size;
+
+		if (i && starts[i] == starts[i-1])
+			continue;
+
+		add_function_symbol(obj, sec, sec->address + starts[i], sec->address + end, src_name);
+		added++;
+	}
+
+	free(starts);
+	return added;
+}
+
+// Create a function symbol at every match of a prologue pattern in each executable section.
+// Returns the number of functions found, or -1 on error.
+int prologue_reconstruct_symbols(struct delinker_ctx *ctx, backend_object *obj, unsigned int bits, const char *src_name)
+{
+	ac_automaton ac;
+	int found = 0;
+
+	if (load_database(ctx))
+		return -1;
+	if (ac_build(&ac, ctx->prologues, bits))
+	{
+		ac_destroy(&ac);
+		return -1;
+	}
+	LOG_TRACE(LOG_RECONSTRUCT, "Prologue automaton has %u states\n", ac.count);
+
+	for (backend_section *sec = backend_get_first_section_by_type(obj, SECTION_TYPE_PROG); sec;
+		sec = backend_get_next_section_by_type(obj, SECTION_TYPE_PROG))
+	{
+		// same rules as for building relocations: executable, and not a table (like the PLT)
+		if (!(sec->flags & SECTION_FLAG_EXECUTE) || sec->entry_size > 0 || !sec->data || !sec->size)
+			continue;
+		if (strncmp(sec->name, ".plt", 4) == 0)
+			continue;
+
+		found += scan_section(&ac, ctx->prologues, obj, sec, src_name);
+	}
+
+	ac_destroy(&ac);
+	LOG_INFO(LOG_RECONSTRUCT, "%i functions found by matching prologues\n", found);
+	return found;
+}
@@ -0,0 +1,288 @@
+/* Dead function elimination.
+The relocations form a graph between the functions and data objects: each relocation is an edge
+from the symbol that contains it to the symbol it points at. Everything that can be reached from
+the roots (the entry point, and any symbols the user asked to keep) is marked, and everything else
+is removed from the object, along with its relocations, so it never makes it to the output.
+Function pointers stored in data (vtables, callback tables, .init_array) are not relocated, so any
+word in a data section that holds the address of a symbol is also treated as a root. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "backend.h"
+#include "context.h"
+#include "log.h"
+
+typedef struct reach_state
+{
+	backend_symbol **syms;		// functions and data objects, sorted by address
+	unsigned char *marked;
+	unsigned int count;
+	backend_reloc **relocs;		// sorted by offset
+	unsigned int reloc_count;
+	unsigned int *stack;			// symbols that are marked, but whose relocations haven't been followed
+	unsigned int depth;
+	backend_symbol **dead;		// unreachable symbols, sorted by pointer
+	unsigned int dead_count;
+} reach_state;
+
+static int is_node(const backend_symbol *sym)
+{
+	if (sym->type != SYMBOL_TYPE_FUNCTION && sym->type != SYMBOL_TYPE_OBJECT)
+		return 0;
+	return (sym->section && !(sym->flags & SYMBOL_FLAG_EXTERNAL));
+}
+
+static int symbol_addr_cmp(const void *a, const void *b)
+{
+	const backend_symbol *sa = *(const backend_symbol**)a;
+	const backend_symbol *sb = *(const backend_symbol**)b;
+	if (sa->val != sb->val)
+		return (sa->val > sb->val) - (sa->val < sb->val);
+	return (sa->size < sb->size) - (sa->size > sb->size);
+}
+
+static int symbol_ptr_cmp(const void *a, const void *b)
+{
+	const backend_symbol *sa = *(const backend_symbol**)a;
+	const backend_symbol *sb = *(const backend_symbol**)b;
+	return (sa > sb) - (sa < sb);
+}
+
+static int reloc_offset_cmp(const void *a, const void *b)
+{
+	const backend_reloc *ra = *(const backend_reloc**)a;
+	const backend_reloc *rb = *(const backend_reloc**)b;
+	return (ra->offset > rb->offset) - (ra->offset < rb->offset);
+}
+
+// index of the last symbol that starts at or before 'addr', or -1
+static int last_at_or_before(const reach_state *rs, unsigned long addr)
+{
+	int lo = 0, hi = rs->count;
+	while (lo < hi)
+	{
+		int mid = lo + (hi - lo) / 2;
+		if (rs->syms[mid]->val <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo - 1;
+}
+
+// index of the symbol that contains 'addr', or -1
+static int find_containing(const reach_state *rs, unsigned long addr)
+{
+	int i = last_at_or_before(rs, addr);
+	if (i < 0)
+		return -1;
+
+	const backend_symbol *sym = rs->syms[i];
+	if (addr < sym->val + sym->size || addr == sym->val)
+		return i;
+	return -1;
+}
+
+// index of a particular symbol, or -1
+static int find_symbol(const reach_state *rs, const backend_symbol *sym)
+{
+	for (int i = last_at_or_before(rs, sym->val); i >= 0 && rs->syms[i]->val == sym->val; i--)
+		if (rs->syms[i] == sym)
+			return i;
+	return -1;
+}
+
+static unsigned int lower_bound(backend_reloc **relocs, unsigned int count, unsigned long addr)
+{
+	unsigned int lo = 0, hi = count;
+	while (lo < hi)
+	{
+		unsigned int mid = lo + (hi - lo) / 2;
+		if (relocs[mid]->offset < addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+// the symbol that a relocation points to, or -1 if it is external (or anonymous data)
+static int reloc_target(const reach_state *rs, const backend_reloc *r)
+{
+	const backend_symbol *sym = r->symbol;
+	int i;
+
+	if (!sym)
+		return -1;
+
+	// relocations to data are relative to the section
+	if (sym->type == SYMBOL_TYPE_SECTION)
+		return sym->section ? find_containing(rs, sym->section->address + r->addend) : -1;
+
+	if (!is_node(sym))
+		return -1;
+
+	// folded functions (see icf.c) are no longer in the symbol table
+	i = find_symbol(rs, sym);
+	return (i >= 0) ? i : find_containing(rs, sym->val);
+}
+
+static void mark(reach_state *rs, int i)
+{
+	if (i < 0 || rs->marked[i])
+		return;
+	rs->marked[i] = 1;
+	rs->stack[rs->depth++] = i;
+}
+
+static void mark_by_name(reach_state *rs, backend_object *obj, const char *name)
+{
+	backend_symbol *sym = backend_find_symbol_by_name(obj, name);
+	if (!sym || !is_node(sym))
+	{
+		LOG_WARN(LOG_OPT, "Warning: can't find symbol %s to keep\n", name);
+		return;
+	}
+	mark(rs, find_symbol(rs, sym));
+}
+
+// Any word in a data section that holds the address of a symbol may be a pointer to it
+static void mark_data_pointers(reach_state *rs, backend_object *obj)
+{
+	unsigned int word;
+
+	switch (backend_get_type(obj))
+	{
+	case OBJECT_TYPE_ELF64:
+	case OBJECT_TYPE_PE32PLUS:
+		word = 8;
+		break;
+	case OBJECT_TYPE_MZ:
+		word = 2;
+		break;
+	default:
+		word = 4;
+	}
+
+	for (backend_section *sec = backend_get_first_section(obj); sec; sec = backend_get_next_section(obj))
+	{
+		if (!(sec->flags & SECTION_FLAG_INIT_DATA) || (sec->flags & SECTION_FLAG_EXECUTE) || !sec->data)
+			continue;
+
+		// tables that hold addresses, but are not part of the program's data
+		if (sec->type != SECTION_TYPE_PROG && sec->type != SECTION_TYPE_NULL)
+			continue;
+
+		for (unsigned long pos = 0; pos + word <= sec->size; pos += word)
+		{
+			unsigned long val = 0;
+			memcpy(&val, sec->data + pos, word);
+			if (val)
+				mark(rs, find_containing(rs, val));
+		}
+	}
+}
+
+static int unreachable_reloc(backend_reloc *r, void *ctx)
+{
+	const reach_state *rs = (const reach_state*)ctx;
+	int from = find_containing(rs, r->offset);
+	int to = reloc_target(rs, r);
+
+	return (from >= 0 && !rs->marked[from]) || (to >= 0 && !rs->marked[to]);
+}
+
+// The symbols are freed as they are removed, so the address-sorted array can't be searched any more
+static int unreachable_symbol(backend_symbol *sym, void *ctx)
+{
+	const reach_state *rs = (const reach_state*)ctx;
+	return bsearch(&sym, rs->dead, rs->dead_count, sizeof(backend_symbol*), symbol_ptr_cmp) != NULL;
+}
+
+// Returns the number of symbols that were removed, or a negative error code
+int remove_unreachable_symbols(struct delinker_ctx *ctx, backend_object *obj)
+{
+	reach_state rs;
+	backend_symbol *sym;
+	backend_reloc *r;
+	unsigned int removed = 0;
+	unsigned int relocs_removed = 0;
+	unsigned int roots;
+	int ret = -1;
+
+	memset(&rs, 0, sizeof(rs));
+	rs.syms = (backend_symbol**)malloc(backend_symbol_count(obj) * sizeof(backend_symbol*) + 1);
+	rs.relocs = (backend_reloc**)malloc(backend_relocation_count(obj) * sizeof(backend_reloc*) + 1);
+	if (!rs.syms || !rs.relocs)
+		goto done;
+
+	for (sym = backend_get_first_symbol(obj); sym; sym = backend_get_next_symbol(obj))
+		if (is_node(sym))
+			rs.syms[rs.count++] = sym;
+	qsort(rs.syms, rs.count, sizeof(backend_symbol*), symbol_addr_cmp);
+
+	for (r = backend_get_first_reloc(obj); r; r = backend_get_next_reloc(obj))
+		rs.relocs[rs.reloc_count++] = r;
+	qsort(rs.relocs, rs.reloc_count, sizeof(backend_reloc*), reloc_offset_cmp);
+
+	rs.marked = (unsigned char*)calloc(rs.count + 1, 1);
+	rs.stack = (unsigned int*)malloc((rs.count + 1) * sizeof(unsigned int));
+	if (!rs.marked || !rs.stack)
+		goto done;
+	ret = 0;
+
+	// the roots
+	if (ctx->config.entry_name && backend_find_symbol_by_name(obj, ctx->config.entry_name))
+		mark_by_name(&rs, obj, ctx->config.entry_name);
+	if (backend_get_entry_point(obj))
+		mark(&rs, find_containing(&rs, backend_get_entry_point(obj)));
+	for (const list_node* iter=ll_iter_start(ctx->config.keep_list); iter != NULL; iter=iter->next)
+		mark_by_name(&rs, obj, (const char*)iter->val);
+	roots = rs.depth;
+	mark_data_pointers(&rs, obj);
+
+	// without an entry point, everything would be removed
+	if (!roots)
+	{
+		LOG_WARN(LOG_OPT, "Warning: no entry point or kept symbols - not removing unreachable symbols\n");
+		goto done;
+	}
+
+	// follow the relocations of each marked symbol
+	while (rs.depth)
+	{
+		unsigned int i = rs.stack[--rs.depth];
+		const backend_symbol *from = rs.syms[i];
+		unsigned long end = from->val + from->size;
+
+		for (unsigned int k = lower_bound(rs.relocs, rs.reloc_count, from->val); k < rs.reloc_count && rs.relocs[k]->offset < end; k++)
+			mark(&rs, reloc_target(&rs, rs.relocs[k]));
+	}
+
+	// the relocations must go first, since they are matched to the symbols by address
+	relocs_removed = backend_remove_relocations_if(obj, unreachable_reloc, &rs);
+
+	rs.dead = (backend_symbol**)malloc(rs.count * sizeof(backend_symbol*) + 1);
+	if (!rs.dead)
+	{
+		ret = -1;
+		goto done;
+	}
+	for (unsigned int i=0; i < rs.count; i++)
+		if (!rs.marked[i])
+			rs.dead[rs.dead_count++] = rs.syms[i];
+	qsort(rs.dead, rs.dead_count, sizeof(backend_symbol*), symbol_ptr_cmp);
+	removed = backend_remove_symbols_if(obj, unreachable_symbol, &rs);
+
+	LOG_INFO(LOG_OPT, "Removed %u unreachable symbols and %u relocations\n", removed, relocs_removed);
+	ret = removed;
+
+done:
+	free(rs.syms);
+	free(rs.relocs);
+	free(rs.marked);
+	free(rs.stack);
+	free(rs.dead);
+	return ret;
+}
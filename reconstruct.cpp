@@ -1,4 +1,8 @@
 #include <list>
+#include <vector>
+#include <algorithm>
+#include <mutex>
+#include <stdio.h>
 #include <loader.h>
 #include <disasm.h>
 #include <cfg.h>
@@ -6,14 +10,19 @@
 
 extern "C" {
 #include "backend.h"
+#include "log.h"
 }
 
 struct options options;
 
-/* convert our backend format to their backend format */
+// Nucleus keeps its options (and more) in globals, so only one run can use it at a time
+static std::mutex nucleus_lock;
+
+/* convert our backend format to their backend format. The section contents are not copied -
+the Binary points straight at the backend buffers, so it must never be passed to unload_binary() */
 static int backend_object_to_Binary(Binary& bin, backend_object *obj)
 {
-	bin.filename = std::string("Unknown");
+	bin.filename = std::string(obj->name ? obj->name : "Unknown");
 	bin.entry    = backend_get_entry_point(obj);
 	bin.type_str = std::string("Unknown");
 
@@ -53,7 +62,18 @@ static int backend_object_to_Binary(Binary& bin, backend_object *obj)
 
 	case OBJECT_ARCH_X86:
 		bin.arch = Binary::ARCH_X86;
-		bin.bits = 64;
+		switch(backend_get_type(obj))
+		{
+		case OBJECT_TYPE_MZ:
+			bin.bits = 16;
+			break;
+		case OBJECT_TYPE_PE32PLUS:
+		case OBJECT_TYPE_ELF64:
+			bin.bits = 64;
+			break;
+		default:
+			bin.bits = 32;
+		}
 		break;
 
    case OBJECT_ARCH_MIPS:
@@ -67,15 +87,85 @@ static int backend_object_to_Binary(Binary& bin, backend_object *obj)
 		break;
 	}
 
+	// only sections that are loaded into memory are interesting for function detection
+	for (backend_section *sec = backend_get_first_section(obj); sec; sec = backend_get_next_section(obj))
+	{
+		if (sec->type != SECTION_TYPE_PROG || !sec->data || !sec->size)
+			continue;
+
+		bin.sections.push_back(Section());
+		Section& s = bin.sections.back();
+		s.binary = &bin;
+		s.name   = std::string(sec->name);
+		s.type   = (sec->flags & SECTION_FLAG_EXECUTE) ? Section::SEC_TYPE_CODE : Section::SEC_TYPE_DATA;
+		s.vma    = sec->address;
+		s.size   = sec->size;
+		s.bytes  = sec->data;
+	}
+
+	return 0;
+}
+
+struct nucleus_function
+{
+	uint64_t start;
+	uint64_t end;
+	bool operator<(const nucleus_function& other) const { return start < other.start; }
+};
+
+/* add a function symbol for each function in the CFG that doesn't already have one */
+static int CFG_to_backend_symbols(CFG& cfg, backend_object *obj, const char *src_name)
+{
+	std::vector<nucleus_function> funcs;
+	unsigned int added = 0;
+	char name[24];
+
+	for (auto& f : cfg.functions)
+	{
+		nucleus_function nf;
+
+		// the entry block is the real start of the function - the lowest block may be before it
+		nf.start = f.entry.empty() ? f.start : f.entry.front()->start;
+		nf.end = f.end;
+		if (nf.end > nf.start)
+			funcs.push_back(nf);
+	}
+	std::sort(funcs.begin(), funcs.end());
+
+	for (size_t i=0; i < funcs.size(); i++)
+	{
+		nucleus_function& f = funcs[i];
+
+		// functions may share blocks, but symbols must not overlap
+		if (i + 1 < funcs.size() && f.end > funcs[i+1].start)
+			f.end = funcs[i+1].start;
+		if (f.end <= f.start)
+			continue;
+
+		if (backend_find_symbol_by_val_type(obj, f.start, SYMBOL_TYPE_FUNCTION))
+			continue;
+
+		backend_section *sec = backend_find_section_by_val(obj, f.start);
+		if (!sec)
+			continue;
+
+		sprintf(name, "fn%06lX", (unsigned long)f.start);
+		backend_symbol *s = backend_add_symbol(obj, name, f.start, SYMBOL_TYPE_FUNCTION, f.end - f.start, SYMBOL_FLAG_GLOBAL, sec);
+		backend_set_source_file(s, src_name);
+		added++;
+	}
+
+	LOG_INFO(LOG_RECONSTRUCT, "Nucleus found %lu functions (%u new)\n", funcs.size(), added);
 	return 0;
 }
 
 /* reconstruct the symbol table by using the Nucleus algorithm */
-extern "C" int nucleus_reconstruct_symbols(backend_object *obj)
+extern "C" int nucleus_reconstruct_symbols(backend_object *obj, const char *src_name)
 {
 	Binary bin;
 	std::list<DisasmSection> disasm;
 	CFG cfg;
+	std::lock_guard<std::mutex> hold(nucleus_lock);
 
 	options.verbosity           = 0;
 	options.warnings            = 1;
@@ -97,8 +187,6 @@ extern "C" int nucleus_reconstruct_symbols(backend_object *obj)
 	if (cfg.make_cfg(&bin, &disasm) < 0)
 		return 1;
 
-	cfg.print_functions(stdout);
-
-	return 0;
+	return CFG_to_backend_symbols(cfg, obj, src_name);
 }
 
@@ -0,0 +1,517 @@
+/* Daemon mode (--daemon) and its client (--connect)
+Tools that delink the same binaries over and over, changing only the ignore list or the output
+options, pay for reading, reconstructing and relocating the input every time - and that is nearly
+all of the run time. The daemon listens on a Unix socket, and keeps the analysed objects (after the
+relocations have been built and the extraneous symbols trimmed) in memory, keyed by a hash of the
+file contents and the options that change the analysis. A request for an input that is already
+in the cache only runs the output stage.
+
+The client sends its working directory and its arguments, and the daemon handles the requests one
+at a time. The analysis runs in the daemon itself, so that it can be kept, and the output stage in
+a child process that is forked for the request. The child gets its own (copy-on-write) view of the
+cached object, which the output stage is free to change, and its own copy of the configuration
+and statistics - and if the output stage crashes, the daemon survives. Everything the request
+prints goes back to the client, followed by a NUL byte and the exit code. A client that doesn't
+send its whole request within a few seconds is dropped, so it can't hold up the ones behind it.
+A request runs with the daemon's rights, in the directory the client names, so only the user that
+started the daemon may connect: the socket is only accessible to its owner, and the daemon checks
+who is on the other end of each connection as well. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "backend.h"
+#include "config.h"
+#include "server.h"
+#include "log.h"
+
+// the most a request can be - a working directory and a command line
+#define SERVER_MAX_REQUEST (1024 * 1024)
+
+// how long a client has to send its whole request, in milliseconds
+#define SERVER_REQUEST_TIMEOUT 5000
+
+typedef struct cache_entry
+{
+	uint64_t hash;				// of the file contents
+	char *key;					// the options that change the analysis
+	backend_object *obj;
+	unsigned long used;		// when it was last used, for dropping the oldest
+} cache_entry;
+
+static cache_entry cache[SERVER_CACHE_SIZE];
+static unsigned long cache_clock;
+static int listen_fd = -1;
+static char *socket_path;
+static volatile sig_atomic_t stopping;
+
+static void stop(int sig)
+{
+	stopping = 1;
+}
+
+static int write_all(int fd, const void *buff, size_t len)
+{
+	const char *p = (const char*)buff;
+
+	while (len)
+	{
+		ssize_t n = write(fd, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+// Start listening on 'path'. A socket left behind by a daemon that is no longer running is
+// replaced, but not one that is still in use.
+int server_open(const char *path)
+{
+	struct sockaddr_un addr;
+	struct sigaction sa;
+	char cwd[4096];
+	mode_t mask;
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+	{
+		LOG_ERROR(LOG_MAIN, "The socket name %s is too long\n", path);
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0)
+	{
+		LOG_ERROR(LOG_MAIN, "There is already a daemon listening on %s\n", path);
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	unlink(path);
+
+	// the socket is created without any access for others, so there is no moment before the
+	// chmod in which someone else could connect
+	mask = umask(S_IRWXG | S_IRWXO);
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+		chmod(path, S_IRUSR | S_IWUSR) != 0 || listen(fd, 16) != 0)
+	{
+		umask(mask);
+		LOG_ERROR(LOG_MAIN, "Can't listen on %s: %s\n", path, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	umask(mask);
+	listen_fd = fd;
+
+	// the daemon changes to the directory of each client, so remember where the socket is
+	if (path[0] != '/' && getcwd(cwd, sizeof(cwd)))
+	{
+		socket_path = (char*)malloc(strlen(cwd) + strlen(path) + 2);
+		if (socket_path)
+			sprintf(socket_path, "%s/%s", cwd, path);
+	}
+	else
+		socket_path = strdup(path);
+
+	// stop between requests, and don't die when a client goes away before its answer is sent
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = stop;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	LOG_INFO(LOG_MAIN, "Listening on %s\n", path);
+	return 0;
+}
+
+void server_close(void)
+{
+	if (listen_fd >= 0)
+		close(listen_fd);
+	listen_fd = -1;
+	if (socket_path)
+		unlink(socket_path);
+	free(socket_path);
+	socket_path = NULL;
+	server_cache_clear();
+}
+
+// milliseconds left until 'deadline'
+static int time_left(const struct timespec *deadline)
+{
+	struct timespec now;
+	long ms;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ms = (deadline->tv_sec - now.tv_sec) * 1000 + (deadline->tv_nsec - now.tv_nsec) / 1000000;
+	return ms > 0 ? (int)ms : 0;
+}
+
+// The request is the working directory followed by the arguments, each one ending with a NUL.
+// Returns -1 for a bad request, and -2 when the client took too long to send it.
+static int read_request(server_request *req)
+{
+	size_t size = 0, capacity = 4096;
+	struct timespec deadline;
+	struct pollfd pfd;
+	ssize_t n;
+	int count = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += SERVER_REQUEST_TIMEOUT / 1000;
+	pfd.fd = req->fd;
+	pfd.events = POLLIN;
+
+	req->buffer = (char*)malloc(capacity);
+	while (req->buffer)
+	{
+		if (size == capacity)
+		{
+			if (capacity == SERVER_MAX_REQUEST)
+				return -1;
+			capacity *= 2;
+			char *buff = (char*)realloc(req->buffer, capacity);
+			if (!buff)
+				return -1;
+			req->buffer = buff;
+		}
+		n = poll(&pfd, 1, time_left(&deadline));
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -1;
+		if (n == 0)
+			return -2;
+		n = read(req->fd, req->buffer + size, capacity - size);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -1;
+		if (n == 0)
+			break;
+		size += n;
+	}
+	if (!req->buffer || !size || req->buffer[size-1] != 0)
+		return -1;
+
+	for (size_t i=0; i < size; i++)
+		if (!req->buffer[i])
+			count++;
+	if (count < 2)
+		return -1;
+
+	req->cwd = req->buffer;
+	req->argc = count - 1;
+	req->argv = (char**)malloc((req->argc + 1) * sizeof(char*));
+	if (!req->argv)
+		return -1;
+	char *s = req->buffer + strlen(req->buffer) + 1;
+	for (int i=0; i < req->argc; i++)
+	{
+		req->argv[i] = s;
+		s += strlen(s) + 1;
+	}
+	req->argv[req->argc] = NULL;
+	return 0;
+}
+
+static void free_request(server_request *req)
+{
+	close(req->fd);
+	free(req->argv);
+	free(req->buffer);
+	req->argv = NULL;
+	req->buffer = NULL;
+}
+
+// Only the user that runs the daemon can send it requests
+static int trusted_peer(int fd)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0)
+		return 0;
+	return (cred.uid == geteuid());
+}
+
+// Wait for the next request, and send stdout & stderr to its client until it is answered with
+// server_reply. Returns -1 when the daemon has been told to stop.
+int server_accept(server_request *req)
+{
+	while (!stopping)
+	{
+		memset(req, 0, sizeof(server_request));
+		req->fd = accept(listen_fd, NULL, NULL);
+		if (req->fd < 0)
+		{
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			LOG_ERROR(LOG_MAIN, "Can't accept a connection: %s\n", strerror(errno));
+			return -1;
+		}
+		if (!trusted_peer(req->fd))
+		{
+			LOG_WARN(LOG_MAIN, "Warning: refusing a connection from another user\n");
+			free_request(req);
+			continue;
+		}
+		int ret = read_request(req);
+		if (ret != 0)
+		{
+			if (ret == -2)
+				LOG_WARN(LOG_MAIN, "Warning: dropping a request that wasn't sent within %i ms\n", SERVER_REQUEST_TIMEOUT);
+			else
+				LOG_WARN(LOG_MAIN, "Warning: dropping a bad request\n");
+			free_request(req);
+			continue;
+		}
+
+		fflush(stdout);
+		fflush(stderr);
+		req->saved_stdout = dup(STDOUT_FILENO);
+		req->saved_stderr = dup(STDERR_FILENO);
+		dup2(req->fd, STDOUT_FILENO);
+		dup2(req->fd, STDERR_FILENO);
+		return 0;
+	}
+	return -1;
+}
+
+// Run 'fn' in a child process, and return the exit code for the client
+int server_run(server_fn fn, void *ctx)
+{
+	int status;
+	pid_t pid;
+
+	fflush(stdout);
+	fflush(stderr);
+	pid = fork();
+	if (pid < 0)
+	{
+		LOG_ERROR(LOG_MAIN, "Can't start the output stage: %s\n", strerror(errno));
+		return 1;
+	}
+	if (pid == 0)
+	{
+		close(listen_fd);
+		int ret = fn(ctx);
+		fflush(stdout);
+		fflush(stderr);
+		_exit(ret < 0 ? -ret : ret);
+	}
+
+	while (waitpid(pid, &status, 0) < 0)
+	{
+		if (errno != EINTR)
+			return 1;
+	}
+	if (WIFSIGNALED(status))
+	{
+		fprintf(stderr, "The output stage crashed (%s)\n", strsignal(WTERMSIG(status)));
+		return 128 + WTERMSIG(status);
+	}
+	return WEXITSTATUS(status);
+}
+
+// Give stdout & stderr back to the daemon, and send the exit code to the client
+void server_reply(server_request *req, int status)
+{
+	char buff[32];
+	int len;
+
+	fflush(stdout);
+	fflush(stderr);
+	dup2(req->saved_stdout, STDOUT_FILENO);
+	dup2(req->saved_stderr, STDERR_FILENO);
+	close(req->saved_stdout);
+	close(req->saved_stderr);
+
+	len = snprintf(buff, sizeof(buff), "%c%i\n", 0, status);
+	write_all(req->fd, buff, len);
+	free_request(req);
+}
+
+// Send the arguments to the daemon listening on 'path', copy whatever the request prints to
+// stdout, and return its exit code.
+int server_connect(const char *path, int argc, char *argv[])
+{
+	struct sockaddr_un addr;
+	char buff[65536];
+	char status[32];
+	unsigned int status_len = 0;
+	int done = 0;
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+	{
+		LOG_ERROR(LOG_MAIN, "The socket name %s is too long\n", path);
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+	{
+		LOG_ERROR(LOG_MAIN, "Can't connect to the daemon on %s: %s\n", path, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+
+	if (!getcwd(buff, sizeof(buff)) || write_all(fd, buff, strlen(buff) + 1) != 0)
+	{
+		close(fd);
+		return -1;
+	}
+	for (int i=0; i < argc; i++)
+	{
+		if (write_all(fd, argv[i], strlen(argv[i]) + 1) != 0)
+		{
+			LOG_ERROR(LOG_MAIN, "Can't send the request to the daemon\n");
+			close(fd);
+			return -1;
+		}
+	}
+	shutdown(fd, SHUT_WR);
+
+	while (1)
+	{
+		ssize_t n = read(fd, buff, sizeof(buff));
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+
+		// the output of the request, then a NUL, then the exit code
+		ssize_t out = n;
+		if (!done)
+		{
+			char *end = (char*)memchr(buff, 0, n);
+			if (end)
+			{
+				out = end - buff;
+				done = 1;
+			}
+			fwrite(buff, 1, out, stdout);
+			out++;
+		}
+		else
+			out = 0;
+		for (; done && out < n && status_len < sizeof(status) - 1; out++)
+			status[status_len++] = buff[out];
+	}
+	fflush(stdout);
+	close(fd);
+
+	if (!done)
+	{
+		LOG_ERROR(LOG_MAIN, "The daemon closed the connection without an answer\n");
+		return -1;
+	}
+	status[status_len] = 0;
+	return atoi(status);
+}
+
+// FNV-1a, over the whole file
+int server_hash_file(const char *filename, uint64_t *hash)
+{
+	unsigned char buff[65536];
+	uint64_t h = 0xcbf29ce484222325ULL;
+	size_t n;
+	FILE *f;
+
+	f = fopen(filename, "rb");
+	if (!f)
+		return -1;
+	while ((n = fread(buff, 1, sizeof(buff), f)) > 0)
+	{
+		for (size_t i=0; i < n; i++)
+		{
+			h ^= buff[i];
+			h *= 0x100000001b3ULL;
+		}
+	}
+	fclose(f);
+
+	*hash = h;
+	return 0;
+}
+
+backend_object* server_cache_find(uint64_t hash, const char *key)
+{
+	for (int i=0; i < SERVER_CACHE_SIZE; i++)
+	{
+		if (cache[i].obj && cache[i].hash == hash && strcmp(cache[i].key, key) == 0)
+		{
+			cache[i].used = ++cache_clock;
+			return cache[i].obj;
+		}
+	}
+	return NULL;
+}
+
+// Keep an analysed object. It belongs to the cache from now on.
+void server_cache_add(uint64_t hash, const char *key, backend_object *obj)
+{
+	cache_entry *e = &cache[0];
+
+	for (int i=0; i < SERVER_CACHE_SIZE; i++)
+	{
+		if (!cache[i].obj)
+		{
+			e = &cache[i];
+			break;
+		}
+		if (cache[i].used < e->used)
+			e = &cache[i];
+	}
+
+	if (e->obj)
+	{
+		LOG_INFO(LOG_MAIN, "Dropping %s from the cache\n", e->obj->name);
+		backend_destructor(e->obj);
+		free(e->key);
+	}
+	e->hash = hash;
+	e->key = strdup(key);
+	e->obj = e->key ? obj : NULL;
+	e->used = ++cache_clock;
+	if (!e->key)
+		backend_destructor(obj);
+}
+
+void server_cache_clear(void)
+{
+	for (int i=0; i < SERVER_CACHE_SIZE; i++)
+	{
+		if (!cache[i].obj)
+			continue;
+		backend_destructor(cache[i].obj);
+		free(cache[i].key);
+		cache[i].obj = NULL;
+	}
+}
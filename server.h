@@ -0,0 +1,37 @@
+#ifndef _SERVER__H
+#define _SERVER__H
+
+#include <stdint.h>
+
+// how many analysed inputs the daemon keeps - the least recently used is dropped first
+#define SERVER_CACHE_SIZE 8
+
+// One delink request, as sent by a client (delinker --connect)
+typedef struct server_request
+{
+	int fd;					// the connection - the client's output goes here
+	char *cwd;				// the working directory of the client
+	int argc;
+	char **argv;			// the arguments of the client, starting with its name
+	char *buffer;			// holds the strings
+	int saved_stdout;		// of the daemon, while stdout & stderr go to the client
+	int saved_stderr;
+} server_request;
+
+// Runs the output stage of a request. It is called in a process of its own, and returns 0 or a
+// negative error code, which is sent back to the client as its exit code.
+typedef int (*server_fn)(void *ctx);
+
+int server_open(const char *path);
+void server_close(void);
+int server_accept(server_request *req);
+int server_run(server_fn fn, void *ctx);
+void server_reply(server_request *req, int status);
+int server_connect(const char *path, int argc, char *argv[]);
+
+int server_hash_file(const char *filename, uint64_t *hash);
+backend_object* server_cache_find(uint64_t hash, const char *key);
+void server_cache_add(uint64_t hash, const char *key, backend_object *obj);
+void server_cache_clear(void);
+
+#endif // _SERVER__H
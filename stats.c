@@ -0,0 +1,335 @@
+/* Run time statistics (--stats).
+Each phase of unlink_file is timed (wall clock and CPU), and the interesting events (instructions
+decoded, relocations created, bytes copied...) are counted against the phase that is running when
+they happen. Phases can be nested - the output files are written while the symbols are copied - so
+the phases form a stack, and starting a phase pauses the one below it. That way the times add up
+to the total run time. The heap usage of each category (see mem.h) is taken at the end of every
+phase, along with the most that was in use while the phase ran. The report is either a table for
+people, or JSON for scripts that track the numbers from one release to the next.
+Like the memory counters, the statistics are kept per thread: a run records them on the thread it
+runs on, and the detectors' worker threads hand their counts back to it. */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+#include "ll.h"
+#include "stats.h"
+#include "log.h"
+#include "mem.h"
+#include "trace.h"
+
+#define STATS_MAX_DEPTH 8
+
+typedef struct stats_phase_data
+{
+	unsigned int runs;
+	double wall;					// seconds
+	double cpu;
+	long peak_rss;					// kB, at the end of the phase
+	size_t mem_current[MEM_CATEGORY_COUNT];	// bytes, at the end of the phase
+	size_t mem_peak[MEM_CATEGORY_COUNT];		// bytes, the most while the phase ran
+	unsigned long counters[STATS_COUNTER_COUNT];
+	unsigned long rejected[STATS_MAX_RELOC_ERROR+1];	// by create_reloc return code
+} stats_phase_data;
+
+static const char *phase_names[STATS_PHASE_COUNT] =
+{
+	"read",
+	"reconstruct",
+	"relocations",
+	"trim",
+	"gc",
+	"icf",
+	"copy",
+	"write",
+};
+
+static const char *counter_names[STATS_COUNTER_COUNT] =
+{
+	"instructions",
+	"relocs_created",
+	"relocs_rejected",
+	"symbols_split",
+	"symbols_merged",
+	"bytes_copied",
+	"files_written",
+};
+
+static __thread int enabled;			// --stats (see stats_reset)
+static __thread stats_phase_data phases[STATS_PHASE_COUNT];
+static __thread enum stats_phase stack[STATS_MAX_DEPTH];
+static __thread size_t saved_peak[STATS_MAX_DEPTH][MEM_CATEGORY_COUNT];	// of the phases below on the stack
+static __thread unsigned int depth;
+static __thread unsigned int untimed;		// phases that didn't fit on the stack
+static __thread double started_wall;
+static __thread double started_cpu;
+
+static double get_time(clockid_t clock)
+{
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long get_peak_rss(void)
+{
+	struct rusage ru;
+	if (getrusage(RUSAGE_SELF, &ru) != 0)
+		return 0;
+	return ru.ru_maxrss;
+}
+
+// charge the time since the last change to the phase on top of the stack
+static void charge_time(void)
+{
+	double wall = get_time(CLOCK_MONOTONIC);
+	double cpu = get_time(CLOCK_PROCESS_CPUTIME_ID);
+
+	if (depth)
+	{
+		stats_phase_data *p = &phases[stack[depth-1]];
+		p->wall += wall - started_wall;
+		p->cpu += cpu - started_cpu;
+	}
+	started_wall = wall;
+	started_cpu = cpu;
+}
+
+void stats_phase_begin(enum stats_phase phase)
+{
+	// the phases are traced (--trace) whether or not the statistics are on
+	trace_begin("phase", phase_names[phase]);
+	if (!enabled)
+		return;
+
+	charge_time();
+	if (depth == STATS_MAX_DEPTH)
+	{
+		LOG_WARN(LOG_MAIN, "Warning: phases nested too deeply - %s is not timed\n", phase_names[phase]);
+		untimed++;
+		return;
+	}
+	memcpy(saved_peak[depth], mem_peak, sizeof(mem_peak));
+	stack[depth++] = phase;
+	phases[phase].runs++;
+	mem_mark();
+}
+
+void stats_phase_end(void)
+{
+	trace_end();
+	if (!enabled || !depth)
+		return;
+	if (untimed)
+	{
+		untimed--;
+		return;
+	}
+
+	charge_time();
+	stats_phase_data *p = &phases[stack[--depth]];
+	long rss = get_peak_rss();
+	if (rss > p->peak_rss)
+		p->peak_rss = rss;
+
+	for (int c=0; c < MEM_CATEGORY_COUNT; c++)
+	{
+		p->mem_current[c] = mem_current[c];
+		if (mem_peak[c] > p->mem_peak[c])
+			p->mem_peak[c] = mem_peak[c];
+		// the phase below was running too, so its peak includes this one
+		if (saved_peak[depth][c] > mem_peak[c])
+			mem_peak[c] = saved_peak[depth][c];
+	}
+
+	// printed as we go, because a run that is killed for using too much memory never gets to the report
+	LOG_INFO(LOG_MAIN, "Memory after %s: %zu kB in use (section data %zu kB, tables %zu kB, lists %zu kB, output %zu kB, string tables %zu kB), peak %zu kB\n",
+		phase_names[stack[depth]], p->mem_current[MEM_TOTAL] / 1024, p->mem_current[MEM_SECTION_DATA] / 1024,
+		p->mem_current[MEM_TABLES] / 1024, p->mem_current[MEM_LIST] / 1024, p->mem_current[MEM_OUTPUT] / 1024,
+		p->mem_current[MEM_STRTAB] / 1024, p->mem_peak[MEM_TOTAL] / 1024);
+}
+
+void stats_count(enum stats_counter counter, unsigned long n)
+{
+	if (!enabled || !depth)
+		return;
+
+	phases[stack[depth-1]].counters[counter] += n;
+}
+
+// Forget everything that has been recorded, and start recording if 'on' (--stats). The daemon does
+// this for each of its requests (see server.c).
+void stats_reset(int on)
+{
+	enabled = on;
+	memset(phases, 0, sizeof(phases));
+	depth = 0;
+	untimed = 0;
+}
+
+// 'ret' is the return code of create_reloc
+void stats_reloc_result(int ret)
+{
+	if (!enabled || !depth)
+		return;
+
+	stats_phase_data *p = &phases[stack[depth-1]];
+	if (ret == 0)
+	{
+		p->counters[STATS_RELOCS_CREATED]++;
+		return;
+	}
+
+	p->counters[STATS_RELOCS_REJECTED]++;
+	if (ret < 0)
+		ret = -ret;
+	if (ret > STATS_MAX_RELOC_ERROR)
+		ret = STATS_MAX_RELOC_ERROR;
+	p->rejected[ret]++;
+}
+
+static void add_phase(stats_phase_data *total, const stats_phase_data *p)
+{
+	total->runs += p->runs;
+	total->wall += p->wall;
+	total->cpu += p->cpu;
+	if (p->peak_rss > total->peak_rss)
+		total->peak_rss = p->peak_rss;
+	for (int c=0; c < MEM_CATEGORY_COUNT; c++)
+		if (p->mem_peak[c] > total->mem_peak[c])
+			total->mem_peak[c] = p->mem_peak[c];
+	for (int c=0; c < STATS_COUNTER_COUNT; c++)
+		total->counters[c] += p->counters[c];
+	for (int r=0; r <= STATS_MAX_RELOC_ERROR; r++)
+		total->rejected[r] += p->rejected[r];
+}
+
+static void print_table_row(FILE *f, const char *name, const stats_phase_data *p)
+{
+	fprintf(f, "%-12s %10.3f %10.3f", name, p->wall * 1000, p->cpu * 1000);
+	for (int c=0; c < STATS_COUNTER_COUNT; c++)
+		fprintf(f, " %10lu", p->counters[c]);
+	fprintf(f, " %10ld\n", p->peak_rss);
+}
+
+static void print_memory_row(FILE *f, const char *name, const stats_phase_data *p)
+{
+	char cell[48];
+
+	fprintf(f, "%-12s", name);
+	for (int c=0; c < MEM_CATEGORY_COUNT; c++)
+	{
+		sprintf(cell, "%zu/%zu", p->mem_current[c] / 1024, p->mem_peak[c] / 1024);
+		fprintf(f, " %15s", cell);
+	}
+	fprintf(f, "\n");
+}
+
+static void print_table(FILE *f, const stats_phase_data *total)
+{
+	fprintf(f, "\n%-12s %10s %10s %10s %10s %10s %10s %10s %10s %10s %10s\n", "phase", "wall ms", "cpu ms",
+		"insns", "relocs", "rejected", "split", "merged", "bytes", "files", "rss kB");
+	for (int i=0; i < STATS_PHASE_COUNT; i++)
+		if (phases[i].runs)
+			print_table_row(f, phase_names[i], &phases[i]);
+	print_table_row(f, "total", total);
+
+	if (total->counters[STATS_RELOCS_REJECTED])
+	{
+		fprintf(f, "\nRejected relocations by create_reloc return code:\n");
+		for (int r=0; r <= STATS_MAX_RELOC_ERROR; r++)
+			if (total->rejected[r])
+				fprintf(f, "%s%-4i %10lu\n", (r == STATS_MAX_RELOC_ERROR) ? "<=" : "  ", -r, total->rejected[r]);
+	}
+
+	fprintf(f, "\nMemory in use at the end of each phase / the most during the phase (kB):\n%-12s", "phase");
+	for (int c=0; c < MEM_CATEGORY_COUNT; c++)
+		fprintf(f, " %15s", mem_category_name(c));
+	fprintf(f, "\n");
+	for (int i=0; i < STATS_PHASE_COUNT; i++)
+		if (phases[i].runs)
+			print_memory_row(f, phase_names[i], &phases[i]);
+	print_memory_row(f, "total", total);
+}
+
+static void print_json_phase(FILE *f, const char *name, const stats_phase_data *p)
+{
+	int first = 1;
+
+	fprintf(f, "{\"name\": \"%s\", \"runs\": %u, \"wall_ms\": %.3f, \"cpu_ms\": %.3f, \"peak_rss_kb\": %ld",
+		name, p->runs, p->wall * 1000, p->cpu * 1000, p->peak_rss);
+	for (int c=0; c < STATS_COUNTER_COUNT; c++)
+		fprintf(f, ", \"%s\": %lu", counter_names[c], p->counters[c]);
+
+	fprintf(f, ", \"rejected_by_code\": {");
+	for (int r=0; r <= STATS_MAX_RELOC_ERROR; r++)
+	{
+		if (!p->rejected[r])
+			continue;
+		fprintf(f, "%s\"%i\": %lu", first ? "" : ", ", -r, p->rejected[r]);
+		first = 0;
+	}
+	fprintf(f, "}, \"memory\": {");
+	for (int c=0; c < MEM_CATEGORY_COUNT; c++)
+		fprintf(f, "%s\"%s\": {\"current\": %zu, \"peak\": %zu}", c ? ", " : "", mem_category_name(c),
+			p->mem_current[c], p->mem_peak[c]);
+	fprintf(f, "}}");
+}
+
+static void print_json(FILE *f, const stats_phase_data *total)
+{
+	int first = 1;
+
+	fprintf(f, "{\n  \"phases\": [");
+	for (int i=0; i < STATS_PHASE_COUNT; i++)
+	{
+		if (!phases[i].runs)
+			continue;
+		fprintf(f, "%s\n    ", first ? "" : ",");
+		print_json_phase(f, phase_names[i], &phases[i]);
+		first = 0;
+	}
+	fprintf(f, "\n  ],\n  \"total\": ");
+	print_json_phase(f, "total", total);
+	fprintf(f, "\n}\n");
+}
+
+// Print the table to stdout, or if there is a file name, write JSON to it ("-" is stdout)
+int stats_report(const char *filename)
+{
+	stats_phase_data total;
+	FILE *f = stdout;
+
+	if (!enabled)
+		return 0;
+
+	// an error may have left some phases open
+	while (depth)
+		stats_phase_end();
+
+	memset(&total, 0, sizeof(total));
+	for (int i=0; i < STATS_PHASE_COUNT; i++)
+		add_phase(&total, &phases[i]);
+	memcpy(total.mem_current, mem_current, sizeof(total.mem_current));
+
+	if (!filename)
+	{
+		print_table(stdout, &total);
+		return 0;
+	}
+
+	if (strcmp(filename, "-") != 0)
+	{
+		f = fopen(filename, "w");
+		if (!f)
+		{
+			LOG_ERROR(LOG_MAIN, "Can't open %s to write the statistics\n", filename);
+			return -1;
+		}
+	}
+	print_json(f, &total);
+	if (f != stdout)
+		fclose(f);
+	return 0;
+}
@@ -0,0 +1,41 @@
+#ifndef _STATS__H
+#define _STATS__H
+
+// The phases of unlink_file, in the order they run. Phases can be nested (the files are written
+// while the symbols are being copied), in which case the time is charged to the innermost one.
+enum stats_phase
+{
+	STATS_PHASE_READ,				// backend_read
+	STATS_PHASE_RECONSTRUCT,	// reconstruct_symbols
+	STATS_PHASE_RELOCATIONS,	// build_relocations
+	STATS_PHASE_TRIM,				// removing the extraneous symbols
+	STATS_PHASE_GC,				// remove_unreachable_symbols (see reach.c)
+	STATS_PHASE_ICF,				// fold_identical_functions (see icf.c)
+	STATS_PHASE_COPY,				// write_symbol, copy_relocations & copy_data
+	STATS_PHASE_WRITE,			// backend_write
+	STATS_PHASE_COUNT
+};
+
+enum stats_counter
+{
+	STATS_INSTRUCTIONS,			// instructions decoded
+	STATS_RELOCS_CREATED,		// create_reloc succeeded
+	STATS_RELOCS_REJECTED,		// create_reloc failed (see stats_reloc_result)
+	STATS_SYMBOLS_SPLIT,
+	STATS_SYMBOLS_MERGED,
+	STATS_BYTES_COPIED,			// symbol & section data copied to the output objects
+	STATS_FILES_WRITTEN,
+	STATS_COUNTER_COUNT
+};
+
+// create_reloc return codes beyond this are counted together
+#define STATS_MAX_RELOC_ERROR 15
+
+void stats_phase_begin(enum stats_phase phase);
+void stats_phase_end(void);
+void stats_count(enum stats_counter counter, unsigned long n);
+void stats_reloc_result(int ret);
+int stats_report(const char *filename);
+void stats_reset(int on);
+
+#endif // _STATS__H
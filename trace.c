@@ -0,0 +1,121 @@
+/* Trace events (--trace)
+The events are written as they happen, as a JSON object with a "traceEvents" array. A begin event
+('B') opens a slice on the current thread and the next end event ('E') on that thread closes it,
+so slices nest like function calls. Timestamps are in microseconds since the file was opened. If
+an error path skips some end events, they are added when the file is closed so that the slices
+still finish. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include "trace.h"
+#include "log.h"
+
+static FILE *trace_file;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static double started;
+static int pid;
+static __thread int open_events;		// begun but not ended, on this thread
+
+static double get_time_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+// names come from the input file, so they must be escaped
+static void write_string(const char *s)
+{
+	fputc('"', trace_file);
+	for (; *s; s++)
+	{
+		unsigned char c = *s;
+		if (c == '"' || c == '\\')
+			fprintf(trace_file, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(trace_file, "\\u%04x", c);
+		else
+			fputc(c, trace_file);
+	}
+	fputc('"', trace_file);
+}
+
+static void write_event(char ph, const char *cat, const char *name)
+{
+	double ts = get_time_us() - started;
+	long tid = syscall(SYS_gettid);
+
+	pthread_mutex_lock(&trace_lock);
+	fprintf(trace_file, ",\n{\"ph\": \"%c\", \"ts\": %.3f, \"pid\": %i, \"tid\": %li", ph, ts, pid, tid);
+	if (cat)
+	{
+		fprintf(trace_file, ", \"cat\": ");
+		write_string(cat);
+		fprintf(trace_file, ", \"name\": ");
+		write_string(name);
+	}
+	fprintf(trace_file, "}");
+	pthread_mutex_unlock(&trace_lock);
+}
+
+int trace_open(const char *filename)
+{
+	trace_file = fopen(filename, "w");
+	if (!trace_file)
+	{
+		LOG_ERROR(LOG_MAIN, "Can't open %s to write the trace\n", filename);
+		return -1;
+	}
+
+	started = get_time_us();
+	pid = getpid();
+	// the metadata event names the process, and saves worrying about the commas between events
+	fprintf(trace_file, "{\"traceEvents\": [\n{\"ph\": \"M\", \"name\": \"process_name\", \"pid\": %i, \"tid\": %i, \"args\": {\"name\": \"delinker\"}}",
+		pid, pid);
+	return 0;
+}
+
+// Write out what is buffered. A process that is forked while the file is open must flush it
+// before the fork, and the child before it exits, so that their events don't get mixed up.
+void trace_flush(void)
+{
+	if (trace_file)
+		fflush(trace_file);
+}
+
+// must be called after any worker threads have finished
+void trace_close(void)
+{
+	if (!trace_file)
+		return;
+
+	while (open_events)
+		trace_end();
+	fprintf(trace_file, "\n],\n\"displayTimeUnit\": \"ms\"}\n");
+	fclose(trace_file);
+	trace_file = NULL;
+}
+
+// 'name' is what the work is for (a phase, section or output file), and 'cat' the kind of work
+void trace_begin(const char *cat, const char *name)
+{
+	if (!trace_file)
+		return;
+
+	write_event('B', cat, name);
+	open_events++;
+}
+
+void trace_end(void)
+{
+	if (!trace_file || !open_events)
+		return;
+
+	write_event('E', NULL, NULL);
+	open_events--;
+}
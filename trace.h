@@ -0,0 +1,14 @@
+#ifndef _TRACE__H
+#define _TRACE__H
+
+// Begin/end events in the Chrome trace format (--trace), to be loaded in Perfetto or
+// chrome://tracing. Each event belongs to the thread that records it, so begin and end must be
+// called from the same thread. When no trace file is open, these return straight away.
+
+int trace_open(const char *filename);
+void trace_flush(void);
+void trace_close(void);
+void trace_begin(const char *cat, const char *name);
+void trace_end(void);
+
+#endif // _TRACE__H
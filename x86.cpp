@@ -0,0 +1,293 @@
+#include <stdio.h>
+#include <string.h>
+#include "capstone/capstone.h"
+
+extern "C" {
+#include "backend.h"
+#include "reloc.h"
+#include "stats.h"
+#include "log.h"
+}
+
+// The relocation scanners for the different x86 modes share the same structure: walk the
+// instructions of a code section, recognize the ones that reference an absolute or relative
+// address, create a relocation for that operand and clear it. What changes between the modes
+// is the width of the operands, whether RIP-relative addressing exists, and whether addresses
+// are built from segment:offset pairs. Those properties are described by the mode structs
+// below, and the scanner is instantiated once for each of them so the mode checks are
+// resolved by the compiler rather than at run time.
+
+struct x86_mode_16
+{
+	typedef unsigned short uoperand;
+	typedef short soperand;
+	static const int bits = 16;
+	static const bool rip_relative = false;	// no RIP-relative addressing
+	static const bool segmented = true;			// addresses are segment:offset
+	static const backend_reloc_type rel_type = RELOC_TYPE_OFFSET;
+};
+
+struct x86_mode_32
+{
+	typedef unsigned int uoperand;
+	typedef int soperand;
+	static const int bits = 32;
+	static const bool rip_relative = false;
+	static const bool segmented = false;
+	static const backend_reloc_type rel_type = RELOC_TYPE_PC_RELATIVE;
+};
+
+struct x86_mode_64
+{
+	typedef unsigned int uoperand;	// displacements and immediates are still 32 bits
+	typedef int soperand;
+	static const int bits = 64;
+	static const bool rip_relative = true;
+	static const bool segmented = false;
+	static const backend_reloc_type rel_type = RELOC_TYPE_PC_RELATIVE;
+};
+
+// ModRM byte with mod=00 and r/m=101 means [RIP + disp32] in 64-bit mode
+static inline bool is_rip_modrm(unsigned char modrm)
+{
+	return (modrm & 0xC7) == 0x05;
+}
+
+// read an unsigned (absolute) operand of the mode's width
+template <class M>
+static inline unsigned long read_abs(const unsigned char *p)
+{
+	return *(const typename M::uoperand*)p;
+}
+
+// read a signed (relative) operand of the mode's width
+template <class M>
+static inline long read_rel(const unsigned char *p)
+{
+	return *(const typename M::soperand*)p;
+}
+
+// Create a relocation for the operand at 'pos' bytes into the instruction, and clear the
+// operand in the section data if the relocation was accepted
+template <class M>
+static int reloc_operand(backend_object *obj, const cs_insn *cs_ins, unsigned char *ins, unsigned int pos,
+	backend_reloc_type t, unsigned long val, unsigned int hint, unsigned int size=sizeof(typename M::uoperand))
+{
+	int ret = create_reloc(obj, t, val, cs_ins->address + pos, hint);
+	stats_reloc_result(ret);
+	if (ret == 0)
+		memset(ins + pos, 0, size);
+	else
+		LOG_TRACE(LOG_RELOC, "Error creating relocation @ 0x%lx: val=%lx\n", cs_ins->address, val);
+	return ret;
+}
+
+// a relative branch (e8/e9) with an operand of the mode's width directly after the opcode
+template <class M>
+static int reloc_branch(backend_object *obj, const cs_insn *cs_ins, unsigned char *ins, unsigned int hint)
+{
+	unsigned long val = cs_ins->address + cs_ins->size + read_rel<M>(ins + 1);
+	return reloc_operand<M>(obj, cs_ins, ins, 1, M::rel_type, val, hint);
+}
+
+// a memory operand addressed relative to the next instruction
+template <class M>
+static int reloc_rip(backend_object *obj, const cs_insn *cs_ins, unsigned char *ins, unsigned int pos)
+{
+	unsigned long val = cs_ins->address + cs_ins->size + read_rel<M>(ins + pos);
+	return reloc_operand<M>(obj, cs_ins, ins, pos, RELOC_TYPE_PC_RELATIVE, val, RELOC_HINT_NONE);
+}
+
+template <class M>
+static void reloc_call(backend_object* obj, const cs_insn *cs_ins, unsigned char *ins)
+{
+	// e8 82 00             	call   264 <fn000264>
+	//	e8 d6 fe ff ff       	callq  1030 <printf@plt>
+	// Even though e8 is a relative call, it is replaced by a reloc so the functions are independent
+	// in terms of size and location (can be reordered during link). It may also call into the PLT
+	// which needs to be replaced since the PLT may not survive.
+	if (cs_ins->size == 1 + sizeof(typename M::uoperand) && ins[0] == 0xe8)
+	{
+		reloc_branch<M>(obj, cs_ins, ins, RELOC_HINT_CALL);
+		return;
+	}
+
+	if (M::segmented)
+	{
+		// ff 16 d0 53          	call   *0x53d0
+		if (cs_ins->size == 4 && ins[0] == 0xff && ins[1] == 0x16)
+			reloc_operand<M>(obj, cs_ins, ins, 2, RELOC_TYPE_OFFSET, read_abs<M>(ins + 2), RELOC_HINT_CALL);
+		else if (cs_ins->size == 5 && ins[0] == 0x9a)
+			reloc_operand<M>(obj, cs_ins, ins, 1, RELOC_TYPE_OFFSET, read_abs<M>(ins + 1), RELOC_HINT_CALL);
+	}
+	//	ff 15 66 2f 00 00    	callq  *0x2f66(%rip)        # 3fe0 <__libc_start_main@GLIBC_2.2.5>
+	// is not handled yet
+}
+
+template <class M>
+static void reloc_lcall(backend_object* obj, const cs_insn *cs_ins, unsigned char *ins)
+{
+	// 9a 1b 03 00 00       	lcall  $0x0,$0x31b
+	if (M::segmented && cs_ins->size == 5 && ins[0] == 0x9a)
+	{
+		// the far pointer is offset:segment - convert it to a linear address
+		unsigned long val = (read_abs<M>(ins + 3) << 4) + read_abs<M>(ins + 1);
+		reloc_operand<M>(obj, cs_ins, ins, 1, RELOC_TYPE_OFFSET, val, RELOC_HINT_CALL, 4);
+	}
+}
+
+template <class M>
+static void reloc_jmp(backend_object* obj, const cs_insn *cs_ins, unsigned char *ins)
+{
+	// e9 ae cc ff ff          jmp    8048660 <malloc@plt>
+	// This is a relative jump, which only needs a reloc if it leaves the current function
+	if (cs_ins->size == 1 + sizeof(typename M::uoperand) && ins[0] == 0xe9)
+	{
+		unsigned long val = cs_ins->address + cs_ins->size + read_rel<M>(ins + 1);
+		backend_symbol *bs = backend_find_symbol_by_val_type(obj, cs_ins->address, SYMBOL_TYPE_FUNCTION);
+		if (bs && val >= bs->val && val < bs->val + bs->size)
+			return;
+
+		if (bs)
+			LOG_TRACE(LOG_RELOC, "[0x%lx]:You are in function %s, jumping to 0x%lx\n", cs_ins->address, bs->name, val);
+		reloc_branch<M>(obj, cs_ins, ins, RELOC_HINT_JUMP);
+		return;
+	}
+
+	// ff 25 98 62 45 00       jmp    *0x456298
+	// (in 64-bit mode the same encoding is RIP-relative, and is not handled yet)
+	if (!M::rip_relative && !M::segmented && cs_ins->size == 6 && ins[0] == 0xff && ins[1] == 0x25)
+		reloc_operand<M>(obj, cs_ins, ins, 2, RELOC_TYPE_OFFSET, read_abs<M>(ins + 2), RELOC_HINT_JUMP);
+}
+
+template <class M>
+static void reloc_mov(backend_object* obj, const cs_insn *cs_ins, unsigned char *ins)
+{
+	if (M::segmented)
+	{
+		// a1 1c 73             	mov    0x731c,%ax
+		// a2 c6 64             	mov    %al,0x64c6
+		// a3 24 71             	mov    %ax,0x7124
+		// c6 06 c1 64 01       	movb   $0x1,0x64c1
+		// c7 06 c0 69 0f 52    	movw   $0x520f,0x69c0
+		unsigned int pos = 0;
+		if (cs_ins->size == 3 && (ins[0] == 0xa1 || ins[0] == 0xa2 || ins[0] == 0xa3))
+			pos = 1;
+		else if (cs_ins->size == 5 && ins[0] == 0xc6 && ins[1] == 0x06)
+			pos = 2;
+		else if (cs_ins->size == 6 && ins[0] == 0xc7 && ins[1] == 0x06)
+			pos = 2;
+		if (pos)
+		{
+			unsigned long val = read_abs<M>(ins + pos) + cs_ins->address + cs_ins->size;
+			reloc_operand<M>(obj, cs_ins, ins, pos, RELOC_TYPE_OFFSET, val, RELOC_HINT_NONE);
+		}
+	}
+	else if (M::rip_relative)
+	{
+		// 48 8b 05 9b 99 5f 00		mov    0x5f999b(%rip),%rax
+		// 48 89 05 87 39 10 00 	mov    %rax,0x103987(%rip)
+		if (cs_ins->size == 7 && ins[0] == 0x48 && (ins[1] == 0x8b || ins[1] == 0x89) && is_rip_modrm(ins[2]))
+			reloc_rip<M>(obj, cs_ins, ins, 3);
+
+		// bf 43 08 40 00       	mov    $0x400843,%edi
+		else if (cs_ins->size == 5 && ins[0] == 0xbf)
+			reloc_operand<M>(obj, cs_ins, ins, 1, RELOC_TYPE_OFFSET, read_abs<M>(ins + 1), RELOC_HINT_NONE);
+	}
+	else
+	{
+		// 89 35 ac af 40 00    	mov    %esi,0x40afac
+		// 8a 88 40 80 40 00    	mov    0x408040(%eax),%cl
+		// 8b 15 34 80 40 00    	mov    0x408034,%edx
+		// a1 dc ac 40 00       	mov    0x40acdc,%eax
+		// a3 9c af 40 00       	mov    %eax,0x40af9c
+		// b8 98 81 40 00       	mov    $0x408198,%eax
+		// be 98 82 40 00       	mov    $0x408298,%esi
+		// bf a0 af 40 00       	mov    $0x40afa0,%edi
+		// c7 05 ac af 40 00 01 00 00 00	movl   $0x1,0x40afac
+		unsigned int pos = 0;
+		if (cs_ins->size == 6 && (ins[0] == 0x89 || ins[0] == 0x8a || ins[0] == 0x8b))
+			pos = 2;
+		else if (cs_ins->size == 5 && (ins[0] == 0xa1 || ins[0] == 0xa3 ||
+			ins[0] == 0xb8 || ins[0] == 0xbe || ins[0] == 0xbf))
+			pos = 1;
+		else if (cs_ins->size == 10 && ins[0] == 0xc7 && ins[1] == 0x05)
+			pos = 2;
+		if (pos)
+			reloc_operand<M>(obj, cs_ins, ins, pos, RELOC_TYPE_OFFSET, read_abs<M>(ins + pos), RELOC_HINT_NONE);
+	}
+}
+
+template <class M>
+static void reloc_x86(backend_object* obj, backend_section* sec, csh cs_dis, cs_insn *cs_ins)
+{
+	const uint8_t *pc = sec->data;
+	uint64_t pc_addr = sec->address;
+	size_t n = sec->size;
+
+	LOG_TRACE(LOG_RELOC, "x86_%i: Disassembling from 0x%lx to 0x%lx\n", M::bits, sec->address, sec->address + sec->size);
+	while(cs_disasm_iter(cs_dis, &pc, &n, &pc_addr, cs_ins))
+	{
+		stats_count(STATS_INSTRUCTIONS, 1);
+
+		// cs_ins->bytes is only a copy - point at the instruction in the section so the
+		// operands can be cleared in place
+		unsigned char *ins = (unsigned char*)pc - cs_ins->size;
+
+		switch (cs_ins->id)
+		{
+		case X86_INS_CALL:
+			reloc_call<M>(obj, cs_ins, ins);
+			break;
+
+		case X86_INS_LCALL:
+			reloc_lcall<M>(obj, cs_ins, ins);
+			break;
+
+		case X86_INS_JMP:
+			reloc_jmp<M>(obj, cs_ins, ins);
+			break;
+
+		case X86_INS_MOV:
+			reloc_mov<M>(obj, cs_ins, ins);
+			break;
+
+		case X86_INS_LEA:
+			// 48 8d 3d 89 0f 00 00 	lea    0xf89(%rip),%rdi
+			if (M::rip_relative && cs_ins->size == 7 && ins[0] == 0x48 && ins[1] == 0x8d && is_rip_modrm(ins[2]))
+				reloc_rip<M>(obj, cs_ins, ins, 3);
+			break;
+
+		case X86_INS_MOVQ:
+			//48 c7 05 c9 f7 10 00 01 00 00 00 	movq   $0x1,0x10f7c9(%rip)
+			if (M::rip_relative && cs_ins->size == 11 && ins[0] == 0x48 && ins[1] == 0xc7 && ins[2] == 0x05)
+				reloc_rip<M>(obj, cs_ins, ins, 3);
+			break;
+
+		case X86_INS_VMOVAPD:
+			// c5 fd 28 1d f7 3d 00 00		vmovapd 0x3df7(%rip),%ymm3
+		case X86_INS_VMOVSD:
+			// c5 fb 10 05 71 3d 00 00		vmovsd 0x3d71(%rip),%xmm0
+		case X86_INS_VMULSD:
+			// c5 eb 59 3d 7d 2f 00 00 	vmulsd 0x2f7d(%rip),%xmm2,%xmm7
+			if (M::rip_relative && cs_ins->size == 8 && ins[0] == 0xc5 && is_rip_modrm(ins[3]))
+				reloc_rip<M>(obj, cs_ins, ins, 4);
+			break;
+		}
+	}
+}
+
+extern "C" void reloc_x86_16(backend_object* obj, backend_section* sec, csh cs_dis, cs_insn *cs_ins)
+{
+	reloc_x86<x86_mode_16>(obj, sec, cs_dis, cs_ins);
+}
+
+extern "C" void reloc_x86_32(backend_object* obj, backend_section* sec, csh cs_dis, cs_insn *cs_ins)
+{
+	reloc_x86<x86_mode_32>(obj, sec, cs_dis, cs_ins);
+}
+
+extern "C" void reloc_x86_64(backend_object* obj, backend_section* sec, csh cs_dis, cs_insn *cs_ins)
+{
+	reloc_x86<x86_mode_64>(obj, sec, cs_dis, cs_ins);
+}